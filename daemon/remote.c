@@ -1528,6 +1528,66 @@ cleanup:
     return rv;
 }
 
+static int
+remoteDispatchDomainBlockStatsAll(virNetServerPtr server ATTRIBUTE_UNUSED,
+                                  virNetServerClientPtr client ATTRIBUTE_UNUSED,
+                                  virNetMessageHeaderPtr hdr ATTRIBUTE_UNUSED,
+                                  virNetMessageErrorPtr rerr,
+                                  remote_domain_block_stats_all_args *args,
+                                  remote_domain_block_stats_all_ret *ret)
+{
+    virDomainPtr dom = NULL;
+    virTypedParameterPtr params = NULL;
+    int nparams = args->nparams;
+    int rv = -1;
+    struct daemonClientPrivate *priv =
+        virNetServerClientGetPrivateData(client);
+
+    if (!priv->conn) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s", _("connection not open"));
+        goto cleanup;
+    }
+
+    if (nparams > REMOTE_DOMAIN_BLOCK_STATS_ALL_PARAMETERS_MAX) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s", _("nparams too large"));
+        goto cleanup;
+    }
+    if (VIR_ALLOC_N(params, nparams) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (!(dom = get_nonnull_domain(priv->conn, args->dom)))
+        goto cleanup;
+
+    if (virDomainBlockStatsAll(dom, params, &nparams, args->flags) < 0)
+        goto cleanup;
+
+    /* In this case, we need to send back the number of parameters
+     * needed
+     */
+    if (args->nparams == 0) {
+        ret->nparams = nparams;
+        goto success;
+    }
+
+    if (remoteSerializeTypedParameters(params, nparams,
+                                       &ret->params.params_val,
+                                       &ret->params.params_len) < 0)
+        goto cleanup;
+
+success:
+    rv = 0;
+
+cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+    VIR_FREE(params);
+    if (dom)
+        virDomainFree(dom);
+    return rv;
+}
+
 static int
 remoteDispatchNodeGetCPUStats(virNetServerPtr server ATTRIBUTE_UNUSED,
                               virNetServerClientPtr client ATTRIBUTE_UNUSED,
@@ -1725,6 +1785,44 @@ cleanup:
     return rv;
 }
 
+static int
+remoteDispatchGetRPCStats(virNetServerPtr server,
+                          virNetServerClientPtr client,
+                          virNetMessageHeaderPtr hdr ATTRIBUTE_UNUSED,
+                          virNetMessageErrorPtr rerr,
+                          remote_get_rpc_stats_args *args,
+                          remote_get_rpc_stats_ret *ret)
+{
+    char *stats;
+    int rv = -1;
+
+    if (args->flags & ~VIR_CONNECT_GET_RPC_STATS_RESET) {
+        virNetError(VIR_ERR_INVALID_ARG,
+                    _("unsupported flags (0x%x)"),
+                    args->flags & ~VIR_CONNECT_GET_RPC_STATS_RESET);
+        goto cleanup;
+    }
+
+    /* The report names clients and includes call arguments */
+    if (virNetServerClientGetReadonly(client)) {
+        virNetError(VIR_ERR_OPERATION_DENIED, "%s",
+                    _("RPC statistics are not available to read only clients"));
+        goto cleanup;
+    }
+
+    if (!(stats = virNetServerGetStats(server, args->nslowest,
+                                       !!(args->flags & VIR_CONNECT_GET_RPC_STATS_RESET))))
+        goto cleanup;
+
+    ret->stats = stats;
+    rv = 0;
+
+cleanup:
+    if (rv < 0)
+        virNetMessageSaveError(rerr);
+    return rv;
+}
+
 
 /*-------------------------------------------------------------*/
 
@@ -369,6 +369,7 @@ skip_impl = (
     'virDomainGetAutostart',
     'virNetworkGetAutostart',
     'virDomainBlockStats',
+    'virDomainBlockStatsAll',
     'virDomainInterfaceStats',
     'virDomainMemoryStats',
     'virNodeGetCellsFreeMemory',
@@ -11667,6 +11667,12 @@ virDomainSnapshotObjPtr virDomainSnapshotAssignDef(virDomainSnapshotObjListPtr s
         return NULL;
     }
 
+    /* Children added before their parent are picked up by
+     * virDomainSnapshotUpdateRelations */
+    if (def->parent && STRNEQ(def->parent, def->name))
+        virDomainSnapshotSetParent(snap,
+                                   virHashLookup(snapshots->objs, def->parent));
+
     return snap;
 }
 
@@ -11780,159 +11786,237 @@ virDomainSnapshotFindByName(const virDomainSnapshotObjListPtr snapshots,
 void virDomainSnapshotObjListRemove(virDomainSnapshotObjListPtr snapshots,
                                     virDomainSnapshotObjPtr snapshot)
 {
+    virDomainSnapshotObjPtr child = snapshot->first_child;
+    virDomainSnapshotObjPtr next;
+
+    virDomainSnapshotSetParent(snapshot, NULL);
+
+    /* Callers reparent or remove children first, anything left
+     * becomes a root until relations are updated */
+    while (child) {
+        next = child->sibling;
+        child->parent = NULL;
+        child->sibling = NULL;
+        child = next;
+    }
+    snapshot->first_child = NULL;
+    snapshot->nchildren = 0;
+
     virHashRemoveEntry(snapshots->objs, snapshot->def->name);
 }
 
-struct snapshot_act_on_child {
-    char *parent;
-    int number;
-    virHashIterator iter;
-    void *data;
-};
-
-static void
-virDomainSnapshotActOnChild(void *payload,
-                            const void *name,
-                            void *data)
+/* Move snapshot below parent in the tree, or make it a root if parent
+ * is NULL.  Only the tree is changed, callers keep def->parent in
+ * sync.  */
+void
+virDomainSnapshotSetParent(virDomainSnapshotObjPtr snapshot,
+                           virDomainSnapshotObjPtr parent)
 {
-    virDomainSnapshotObjPtr obj = payload;
-    struct snapshot_act_on_child *curr = data;
+    virDomainSnapshotObjPtr prev;
+
+    if (snapshot->parent) {
+        prev = snapshot->parent->first_child;
+        if (prev == snapshot) {
+            snapshot->parent->first_child = snapshot->sibling;
+        } else {
+            while (prev->sibling != snapshot)
+                prev = prev->sibling;
+            prev->sibling = snapshot->sibling;
+        }
+        snapshot->parent->nchildren--;
+    }
 
-    if (obj->def->parent && STREQ(curr->parent, obj->def->parent)) {
-        curr->number++;
-        if (curr->iter)
-            (curr->iter)(payload, name, curr->data);
+    snapshot->parent = parent;
+    snapshot->sibling = NULL;
+    if (parent) {
+        snapshot->sibling = parent->first_child;
+        parent->first_child = snapshot;
+        parent->nchildren++;
     }
 }
 
-/* Run iter(data) on all direct children of snapshot, while ignoring all
- * other entries in snapshots.  Return the number of children
+/* Run iter(data) on all direct children of snapshot.  iter may remove
+ * or reparent the child it is given.  Return the number of children
  * visited.  No particular ordering is guaranteed.  */
 int
-virDomainSnapshotForEachChild(virDomainSnapshotObjListPtr snapshots,
-                              virDomainSnapshotObjPtr snapshot,
+virDomainSnapshotForEachChild(virDomainSnapshotObjPtr snapshot,
                               virHashIterator iter,
                               void *data)
 {
-    struct snapshot_act_on_child act;
+    virDomainSnapshotObjPtr child = snapshot->first_child;
+    virDomainSnapshotObjPtr next;
+    int number = 0;
 
-    act.parent = snapshot->def->name;
-    act.number = 0;
-    act.iter = iter;
-    act.data = data;
-    virHashForEach(snapshots->objs, virDomainSnapshotActOnChild, &act);
+    while (child) {
+        next = child->sibling;
+        (iter)(child, child->def->name, data);
+        number++;
+        child = next;
+    }
+
+    return number;
+}
 
-    return act.number;
+int virDomainSnapshotHasChildren(virDomainSnapshotObjPtr snap)
+{
+    return snap->nchildren;
 }
 
-int virDomainSnapshotHasChildren(virDomainSnapshotObjPtr snap,
-                                 virDomainSnapshotObjListPtr snapshots)
+/* Return the first snapshot at or below snapshot that has no
+ * children.  */
+static virDomainSnapshotObjPtr
+virDomainSnapshotFirstLeaf(virDomainSnapshotObjPtr snapshot)
 {
-    return virDomainSnapshotForEachChild(snapshots, snap, NULL, NULL);
+    while (snapshot->first_child)
+        snapshot = snapshot->first_child;
+    return snapshot;
 }
 
-typedef enum {
-    MARK_NONE,       /* No relation determined yet */
-    MARK_DESCENDANT, /* Descendant of target */
-    MARK_OTHER,      /* Not a descendant of target */
-} snapshot_mark;
+/* Run iter(data) on all descendants of snapshot, while ignoring all
+ * other entries in snapshots.  Children are visited before their
+ * parent, so iter may remove the descendant it is given.  Return the
+ * number of descendants visited.  No particular ordering is
+ * guaranteed otherwise.  */
+int
+virDomainSnapshotForEachDescendant(virDomainSnapshotObjPtr snapshot,
+                                   virHashIterator iter,
+                                   void *data)
+{
+    virDomainSnapshotObjPtr obj;
+    virDomainSnapshotObjPtr next;
+    int number = 0;
+
+    if (!snapshot->first_child)
+        return 0;
 
-struct snapshot_mark_descendant {
-    const char *name; /* Parent's name on round 1, NULL on other rounds.  */
-    virDomainSnapshotObjListPtr snapshots;
-    bool marked; /* True if descendants were found in this round */
-};
+    obj = virDomainSnapshotFirstLeaf(snapshot->first_child);
+    while (obj != snapshot) {
+        /* Walking on must not depend on obj surviving iter */
+        if (obj->sibling)
+            next = virDomainSnapshotFirstLeaf(obj->sibling);
+        else
+            next = obj->parent;
+
+        (iter)(obj, obj->def->name, data);
+        number++;
+        obj = next;
+    }
+
+    return number;
+}
 
-/* To be called in a loop until no more descendants are found.
- * Additionally marking known unrelated snapshots reduces the number
- * of total hash searches needed.  */
 static void
-virDomainSnapshotMarkDescendant(void *payload,
+virDomainSnapshotClearRelations(void *payload,
                                 const void *name ATTRIBUTE_UNUSED,
-                                void *data)
+                                void *data ATTRIBUTE_UNUSED)
 {
     virDomainSnapshotObjPtr obj = payload;
-    struct snapshot_mark_descendant *curr = data;
-    virDomainSnapshotObjPtr parent = NULL;
 
-    /* Learned on a previous pass.  */
-    if (obj->mark)
+    obj->parent = NULL;
+    obj->sibling = NULL;
+    obj->nchildren = 0;
+    obj->first_child = NULL;
+    obj->mark = 0;
+}
+
+static void
+virDomainSnapshotLinkParent(void *payload,
+                            const void *name ATTRIBUTE_UNUSED,
+                            void *data)
+{
+    virDomainSnapshotObjPtr obj = payload;
+    virDomainSnapshotObjListPtr snapshots = data;
+    virDomainSnapshotObjPtr parent;
+
+    if (!obj->def->parent)
         return;
 
-    if (curr->name) {
-        /* First round can only find root nodes and direct children.  */
-        if (!obj->def->parent) {
-            obj->mark = MARK_OTHER;
-        } else if (STREQ(obj->def->parent, curr->name)) {
-            obj->mark = MARK_DESCENDANT;
-            curr->marked = true;
-        }
-    } else {
-        /* All remaining rounds propagate marks from parents to children.  */
-        parent = virDomainSnapshotFindByName(curr->snapshots, obj->def->parent);
-        if (!parent) {
-            VIR_WARN("snapshot hash table is inconsistent!");
-            obj->mark = MARK_OTHER;
-            return;
-        }
-        if (parent->mark) {
-            obj->mark = parent->mark;
-            if (obj->mark == MARK_DESCENDANT)
-                curr->marked = true;
+    parent = virDomainSnapshotFindByName(snapshots, obj->def->parent);
+    if (!parent) {
+        VIR_WARN("missing parent snapshot '%s' for snapshot '%s'",
+                 obj->def->parent, obj->def->name);
+        return;
+    }
+    virDomainSnapshotSetParent(obj, parent);
+}
+
+/* Set mark on snapshot and everything below it.  */
+static void
+virDomainSnapshotMarkTree(virDomainSnapshotObjPtr snapshot)
+{
+    virDomainSnapshotObjPtr obj = snapshot;
+
+    for (;;) {
+        obj->mark = 1;
+        if (obj->first_child) {
+            obj = obj->first_child;
+            continue;
         }
+        while (obj != snapshot && !obj->sibling)
+            obj = obj->parent;
+        if (obj == snapshot)
+            break;
+        obj = obj->sibling;
     }
 }
 
-struct snapshot_act_on_descendant {
-    int number;
-    virHashIterator iter;
-    void *data;
-};
+static void
+virDomainSnapshotMarkRoot(void *payload,
+                          const void *name ATTRIBUTE_UNUSED,
+                          void *data ATTRIBUTE_UNUSED)
+{
+    virDomainSnapshotObjPtr obj = payload;
 
+    if (!obj->parent)
+        virDomainSnapshotMarkTree(obj);
+}
+
+/* Anything not reachable from a root is part of a cycle, or below
+ * one.  Break it up by turning the first such snapshot seen into a
+ * root.  */
 static void
-virDomainSnapshotActOnDescendant(void *payload,
-                                 const void *name,
-                                 void *data)
+virDomainSnapshotBreakCycle(void *payload,
+                            const void *name ATTRIBUTE_UNUSED,
+                            void *data)
 {
     virDomainSnapshotObjPtr obj = payload;
-    struct snapshot_act_on_descendant *curr = data;
+    int *err = data;
 
-    if (obj->mark == MARK_DESCENDANT) {
-        curr->number++;
-        (curr->iter)(payload, name, curr->data);
-    }
-    obj->mark = MARK_NONE;
+    if (obj->mark)
+        return;
+
+    VIR_WARN("snapshot '%s' is part of a cycle of parents", obj->def->name);
+    virDomainSnapshotSetParent(obj, NULL);
+    virDomainSnapshotMarkTree(obj);
+    *err = -1;
 }
 
-/* Run iter(data) on all descendants of snapshot, while ignoring all
- * other entries in snapshots.  Return the number of descendants
- * visited.  No particular ordering is guaranteed.  */
+static void
+virDomainSnapshotClearMark(void *payload,
+                           const void *name ATTRIBUTE_UNUSED,
+                           void *data ATTRIBUTE_UNUSED)
+{
+    virDomainSnapshotObjPtr obj = payload;
+
+    obj->mark = 0;
+}
+
+/* Rebuild the tree of snapshots from the parent names in their
+ * definitions, after a batch of them was added.  Snapshots whose
+ * parent is missing, or which form a cycle, are made roots.  Return 0
+ * if the names were consistent, -1 otherwise.  */
 int
-virDomainSnapshotForEachDescendant(virDomainSnapshotObjListPtr snapshots,
-                                   virDomainSnapshotObjPtr snapshot,
-                                   virHashIterator iter,
-                                   void *data)
+virDomainSnapshotUpdateRelations(virDomainSnapshotObjListPtr snapshots)
 {
-    struct snapshot_mark_descendant mark;
-    struct snapshot_act_on_descendant act;
-
-    /* virHashForEach does not support nested traversal, so we must
-     * instead iterate until no more snapshots get marked.  We
-     * guarantee that on exit, all marks have been cleared again.  */
-    mark.name = snapshot->def->name;
-    mark.snapshots = snapshots;
-    mark.marked = true;
-    while (mark.marked) {
-        mark.marked = false;
-        virHashForEach(snapshots->objs, virDomainSnapshotMarkDescendant, &mark);
-        mark.name = NULL;
-    }
-    act.number = 0;
-    act.iter = iter;
-    act.data = data;
-    virHashForEach(snapshots->objs, virDomainSnapshotActOnDescendant, &act);
-
-    return act.number;
+    int err = 0;
+
+    virHashForEach(snapshots->objs, virDomainSnapshotClearRelations, NULL);
+    virHashForEach(snapshots->objs, virDomainSnapshotLinkParent, snapshots);
+    virHashForEach(snapshots->objs, virDomainSnapshotMarkRoot, NULL);
+    virHashForEach(snapshots->objs, virDomainSnapshotBreakCycle, &err);
+    virHashForEach(snapshots->objs, virDomainSnapshotClearMark, NULL);
+
+    return err;
 }
 
 int virDomainChrDefForeach(virDomainDefPtr def,
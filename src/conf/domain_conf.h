@@ -1370,8 +1370,20 @@ typedef virDomainSnapshotObj *virDomainSnapshotObjPtr;
 struct _virDomainSnapshotObj {
     virDomainSnapshotDefPtr def;
 
+    /* Tree of snapshots, matching def->parent */
+    virDomainSnapshotObjPtr parent; /* NULL if a root */
+    virDomainSnapshotObjPtr sibling; /* NULL if last child of parent */
+    size_t nchildren;
+    virDomainSnapshotObjPtr first_child; /* NULL if no children */
+
+    /* Set if def only holds name, parent, state, creationTime and
+     * current, the rest is still on disk */
+    bool partial;
+    bool dirty; /* def differs from what is on disk */
+    unsigned long long lastUsed; /* For dropping full definitions again */
+
     /* Internal use only */
-    int mark; /* Used in identifying descendents. */
+    int mark; /* Used in checking the tree for cycles. */
 };
 
 typedef struct _virDomainSnapshotObjList virDomainSnapshotObjList;
@@ -1418,16 +1430,16 @@ virDomainSnapshotObjPtr virDomainSnapshotFindByName(const virDomainSnapshotObjLi
                                                     const char *name);
 void virDomainSnapshotObjListRemove(virDomainSnapshotObjListPtr snapshots,
                                     virDomainSnapshotObjPtr snapshot);
-int virDomainSnapshotHasChildren(virDomainSnapshotObjPtr snap,
-                                virDomainSnapshotObjListPtr snapshots);
-int virDomainSnapshotForEachChild(virDomainSnapshotObjListPtr snapshots,
-                                  virDomainSnapshotObjPtr snapshot,
+int virDomainSnapshotHasChildren(virDomainSnapshotObjPtr snap);
+int virDomainSnapshotForEachChild(virDomainSnapshotObjPtr snapshot,
                                   virHashIterator iter,
                                   void *data);
-int virDomainSnapshotForEachDescendant(virDomainSnapshotObjListPtr snapshots,
-                                       virDomainSnapshotObjPtr snapshot,
+int virDomainSnapshotForEachDescendant(virDomainSnapshotObjPtr snapshot,
                                        virHashIterator iter,
                                        void *data);
+void virDomainSnapshotSetParent(virDomainSnapshotObjPtr snapshot,
+                                virDomainSnapshotObjPtr parent);
+int virDomainSnapshotUpdateRelations(virDomainSnapshotObjListPtr snapshots);
 
 /* Guest VM runtime state */
 typedef struct _virDomainStateReason virDomainStateReason;
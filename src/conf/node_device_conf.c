@@ -97,34 +97,28 @@ virNodeDeviceObjPtr
 virNodeDeviceFindBySysfsPath(const virNodeDeviceObjListPtr devs,
                              const char *sysfs_path)
 {
-    unsigned int i;
+    virNodeDeviceObjPtr dev;
 
-    for (i = 0; i < devs->count; i++) {
-        virNodeDeviceObjLock(devs->objs[i]);
-        if ((devs->objs[i]->def->sysfs_path != NULL) &&
-            (STREQ(devs->objs[i]->def->sysfs_path, sysfs_path))) {
-            return devs->objs[i];
-        }
-        virNodeDeviceObjUnlock(devs->objs[i]);
-    }
+    if (!devs->sysfsPaths ||
+        !(dev = virHashLookup(devs->sysfsPaths, sysfs_path)))
+        return NULL;
 
-    return NULL;
+    virNodeDeviceObjLock(dev);
+    return dev;
 }
 
 
 virNodeDeviceObjPtr virNodeDeviceFindByName(const virNodeDeviceObjListPtr devs,
                                             const char *name)
 {
-    unsigned int i;
+    virNodeDeviceObjPtr dev;
 
-    for (i = 0; i < devs->count; i++) {
-        virNodeDeviceObjLock(devs->objs[i]);
-        if (STREQ(devs->objs[i]->def->name, name))
-            return devs->objs[i];
-        virNodeDeviceObjUnlock(devs->objs[i]);
-    }
+    if (!devs->names ||
+        !(dev = virHashLookup(devs->names, name)))
+        return NULL;
 
-    return NULL;
+    virNodeDeviceObjLock(dev);
+    return dev;
 }
 
 
@@ -172,6 +166,32 @@ void virNodeDeviceObjListFree(virNodeDeviceObjListPtr devs)
         virNodeDeviceObjFree(devs->objs[i]);
     VIR_FREE(devs->objs);
     devs->count = 0;
+    virHashFree(devs->names);
+    devs->names = NULL;
+    virHashFree(devs->sysfsPaths);
+    devs->sysfsPaths = NULL;
+}
+
+/* Several devices may claim the same sysfs path; the index points to
+ * the one added first, as a scan of the list would find it first. */
+static int
+virNodeDeviceObjListIndexSysfsPath(virNodeDeviceObjListPtr devs,
+                                   virNodeDeviceObjPtr dev,
+                                   const char *sysfs_path)
+{
+    if (!sysfs_path || virHashLookup(devs->sysfsPaths, sysfs_path))
+        return 0;
+
+    return virHashAddEntry(devs->sysfsPaths, sysfs_path, dev);
+}
+
+static void
+virNodeDeviceObjListUnindexSysfsPath(virNodeDeviceObjListPtr devs,
+                                     virNodeDeviceObjPtr dev,
+                                     const char *sysfs_path)
+{
+    if (sysfs_path && virHashLookup(devs->sysfsPaths, sysfs_path) == dev)
+        virHashRemoveEntry(devs->sysfsPaths, sysfs_path);
 }
 
 virNodeDeviceObjPtr virNodeDeviceAssignDef(virNodeDeviceObjListPtr devs,
@@ -179,7 +199,28 @@ virNodeDeviceObjPtr virNodeDeviceAssignDef(virNodeDeviceObjListPtr devs,
 {
     virNodeDeviceObjPtr device;
 
+    if (!devs->names &&
+        !(devs->names = virHashCreate(0, NULL)))
+        return NULL;
+    if (!devs->sysfsPaths &&
+        !(devs->sysfsPaths = virHashCreate(0, NULL)))
+        return NULL;
+
     if ((device = virNodeDeviceFindByName(devs, def->name))) {
+        const char *old_path = device->def->sysfs_path;
+
+        if (!(old_path && def->sysfs_path &&
+              STREQ(old_path, def->sysfs_path))) {
+            if (def->sysfs_path &&
+                !virHashLookup(devs->sysfsPaths, def->sysfs_path) &&
+                virHashAddEntry(devs->sysfsPaths,
+                                def->sysfs_path, device) < 0) {
+                virNodeDeviceObjUnlock(device);
+                return NULL;
+            }
+            virNodeDeviceObjListUnindexSysfsPath(devs, device, old_path);
+        }
+
         virNodeDeviceDefFree(device->def);
         device->def = def;
         return device;
@@ -200,16 +241,28 @@ virNodeDeviceObjPtr virNodeDeviceAssignDef(virNodeDeviceObjListPtr devs,
     device->def = def;
 
     if (VIR_REALLOC_N(devs->objs, devs->count+1) < 0) {
-        device->def = NULL;
-        virNodeDeviceObjUnlock(device);
-        virNodeDeviceObjFree(device);
         virReportOOMError();
-        return NULL;
+        goto error;
     }
+
+    if (virHashAddEntry(devs->names, def->name, device) < 0)
+        goto error;
+
+    if (virNodeDeviceObjListIndexSysfsPath(devs, device,
+                                           def->sysfs_path) < 0) {
+        virHashRemoveEntry(devs->names, def->name);
+        goto error;
+    }
+
     devs->objs[devs->count++] = device;
 
     return device;
 
+error:
+    device->def = NULL;
+    virNodeDeviceObjUnlock(device);
+    virNodeDeviceObjFree(device);
+    return NULL;
 }
 
 void virNodeDeviceObjRemove(virNodeDeviceObjListPtr devs,
@@ -220,9 +273,10 @@ void virNodeDeviceObjRemove(virNodeDeviceObjListPtr devs,
     virNodeDeviceObjUnlock(dev);
 
     for (i = 0; i < devs->count; i++) {
-        virNodeDeviceObjLock(dev);
         if (devs->objs[i] == dev) {
-            virNodeDeviceObjUnlock(dev);
+            virHashRemoveEntry(devs->names, dev->def->name);
+            virNodeDeviceObjListUnindexSysfsPath(devs, dev,
+                                                 dev->def->sysfs_path);
             virNodeDeviceObjFree(devs->objs[i]);
 
             if (i < (devs->count - 1))
@@ -236,7 +290,6 @@ void virNodeDeviceObjRemove(virNodeDeviceObjListPtr devs,
 
             break;
         }
-        virNodeDeviceObjUnlock(dev);
     }
 }
 
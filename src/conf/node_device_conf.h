@@ -28,6 +28,7 @@
 # include "internal.h"
 # include "util.h"
 # include "threads.h"
+# include "hash.h"
 
 # include <libxml/tree.h>
 
@@ -200,6 +201,8 @@ typedef virNodeDeviceObjList *virNodeDeviceObjListPtr;
 struct _virNodeDeviceObjList {
     unsigned int count;
     virNodeDeviceObjPtr *objs;
+    virHashTablePtr names;              /* objs indexed by name */
+    virHashTablePtr sysfsPaths;         /* objs indexed by sysfs path */
 };
 
 typedef struct _virDeviceMonitorState virDeviceMonitorState;
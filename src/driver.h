@@ -86,6 +86,10 @@ typedef char *
 typedef char *
     (*virDrvGetSysinfo)     (virConnectPtr conn,
                              unsigned int flags);
+typedef char *
+    (*virDrvGetRPCStats)    (virConnectPtr conn,
+                             unsigned int nslowest,
+                             unsigned int flags);
 typedef int
         (*virDrvGetMaxVcpus)		(virConnectPtr conn,
                                          const char *type);
@@ -346,6 +350,12 @@ typedef int
                     (virDomainPtr domain,
                      const char *path,
                      struct _virDomainBlockStats *stats);
+typedef int
+    (*virDrvDomainBlockStatsAll)
+                    (virDomainPtr domain,
+                     virTypedParameterPtr params,
+                     int *nparams,
+                     unsigned int flags);
 typedef int
     (*virDrvDomainInterfaceStats)
                     (virDomainPtr domain,
@@ -857,6 +867,8 @@ struct _virDriver {
     virDrvDomainGetBlockJobInfo domainGetBlockJobInfo;
     virDrvDomainBlockJobSetSpeed domainBlockJobSetSpeed;
     virDrvDomainBlockPull domainBlockPull;
+    virDrvGetRPCStats getRPCStats;
+    virDrvDomainBlockStatsAll domainBlockStatsAll;
 };
 
 typedef int
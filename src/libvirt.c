@@ -1642,6 +1642,63 @@ error:
     return NULL;
 }
 
+/**
+ * virConnectGetRPCStats:
+ * @conn: pointer to a hypervisor connection
+ * @nslowest: maximum number of slowest calls to report
+ * @flags: bitwise-OR of virConnectGetRPCStatsFlags
+ *
+ * This returns an XML document describing the RPC calls handled by
+ * the daemon @conn is connected to.  For each procedure it gives the
+ * number of calls and failures, and log2 histograms of the time in
+ * microseconds spent waiting for a worker thread, being dispatched
+ * and writing the reply.  For each connected client it gives a
+ * histogram of the total call latency.  Up to @nslowest of the
+ * slowest calls seen are listed along with the leading bytes of
+ * their arguments.
+ *
+ * If @flags contains VIR_CONNECT_GET_RPC_STATS_RESET, all statistics
+ * are zeroed once reported.
+ *
+ * This is only available on read-write connections to a daemon.
+ *
+ * Returns the XML string which must be freed by the caller, or
+ * NULL if there was an error.
+ */
+char *
+virConnectGetRPCStats(virConnectPtr conn,
+                      unsigned int nslowest,
+                      unsigned int flags)
+{
+    VIR_DEBUG("conn=%p, nslowest=%u, flags=%x", conn, nslowest, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECT(conn)) {
+        virLibConnError(VIR_ERR_INVALID_CONN, __FUNCTION__);
+        virDispatchError(NULL);
+        return NULL;
+    }
+
+    if (conn->flags & VIR_CONNECT_RO) {
+        virLibConnError(VIR_ERR_OPERATION_DENIED, __FUNCTION__);
+        goto error;
+    }
+
+    if (conn->driver->getRPCStats) {
+        char *ret = conn->driver->getRPCStats(conn, nslowest, flags);
+        if (!ret)
+            goto error;
+        return ret;
+    }
+
+    virLibConnError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(conn);
+    return NULL;
+}
+
 /**
  * virConnectGetMaxVcpus:
  * @conn: pointer to the hypervisor connection
@@ -6426,6 +6483,72 @@ error:
     return -1;
 }
 
+/**
+ * virDomainBlockStatsAll:
+ * @dom: pointer to the domain object
+ * @params: pointer to block stats parameter objects
+ *          (return value, allocated by the caller)
+ * @nparams: pointer to number of parameters
+ * @flags: currently unused, pass 0
+ *
+ * This function returns the stats of all block devices (disks) of
+ * the domain at once, which is cheaper than calling
+ * virDomainBlockStats for each of them.
+ *
+ * Each statistic is returned as a separate parameter named after the
+ * target device of the disk and the statistic, separated by a dot,
+ * e.g. "vda.rd_req". See VIR_DOMAIN_BLOCK_STATS_FIELD_RD_REQ and
+ * friends for the statistics. As with virDomainBlockStats, a value
+ * of -1 means the hypervisor does not support that statistic.
+ *
+ * Call this with *@nparams set to 0 and @params NULL to learn the
+ * number of parameters needed for all disks; *@nparams is then set
+ * to that number. Otherwise @params is filled with the stats of as
+ * many disks as fit and *@nparams is set to the number of parameters
+ * filled in.
+ *
+ * Returns: 0 in case of success or -1 in case of failure.
+ */
+int
+virDomainBlockStatsAll(virDomainPtr dom,
+                       virTypedParameterPtr params,
+                       int *nparams,
+                       unsigned int flags)
+{
+    virConnectPtr conn;
+
+    VIR_DOMAIN_DEBUG(dom, "params=%p, nparams=%d, flags=%x",
+                     params, (nparams) ? *nparams : -1, flags);
+
+    virResetLastError();
+
+    if (!VIR_IS_CONNECTED_DOMAIN (dom)) {
+        virLibDomainError(VIR_ERR_INVALID_DOMAIN, __FUNCTION__);
+        virDispatchError(NULL);
+        return -1;
+    }
+    if ((nparams == NULL) || (*nparams < 0) ||
+        (params == NULL && *nparams != 0)) {
+        virLibDomainError(VIR_ERR_INVALID_ARG, __FUNCTION__);
+        goto error;
+    }
+    conn = dom->conn;
+
+    if (conn->driver->domainBlockStatsAll) {
+        int ret;
+        ret = conn->driver->domainBlockStatsAll(dom, params, nparams, flags);
+        if (ret < 0)
+            goto error;
+        return ret;
+    }
+
+    virLibDomainError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
+
+error:
+    virDispatchError(dom->conn);
+    return -1;
+}
+
 /**
  * virDomainInterfaceStats:
  * @dom: pointer to the domain object
@@ -35,7 +35,10 @@ typedef virLockManagerParam *virLockManagerParamPtr;
 
 typedef enum {
     /* State passing is used to re-acquire existing leases */
-    VIR_LOCK_MANAGER_USES_STATE = (1 << 0)
+    VIR_LOCK_MANAGER_USES_STATE = (1 << 0),
+    /* Leases are held by the calling process itself, so they are
+     * lost when it restarts and must be acquired again */
+    VIR_LOCK_MANAGER_HELD_BY_CALLER = (1 << 1),
 } virLockManagerFlags;
 
 typedef enum {
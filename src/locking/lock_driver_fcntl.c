@@ -0,0 +1,903 @@
+/*
+ * lock_driver_fcntl.c: A lock driver using fcntl() byte range locks
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ */
+
+/*
+ * Each disk is protected by a single byte lock at offset 0 of a
+ * lockspace file named after the MD5 checksum of the disk path, in
+ * a directory which can be shared between hosts over NFS.  Explicit
+ * <lease> elements lock the byte at 'offset' of the file at 'path'.
+ *
+ * The locks are held by the libvirtd process on behalf of all its
+ * guests.  fcntl() locks are per process, so conflicts between two
+ * guests on this host are detected by the driver itself, while the
+ * kernel (or the NFS lock manager) detects conflicts with other
+ * hosts.  For the same reason a lockspace file must never be opened
+ * twice: closing any descriptor drops every lock the process holds
+ * on the file.  Every lockspace file is therefore opened once, and
+ * kept open for as long as some guest, running or paused, uses one
+ * of its leases, which makes pause and resume a single fcntl() each.
+ *
+ * Guests which stop without releasing their leases are noticed the
+ * next time a lock operation finds their process has gone away.
+ * Conversely the locks go away with libvirtd, so after a restart the
+ * leases of running guests have to be acquired again.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "lock_driver.h"
+#include "logging.h"
+#include "virterror_internal.h"
+#include "memory.h"
+#include "util.h"
+#include "virfile.h"
+#include "threads.h"
+#include "hash.h"
+#include "uuid.h"
+#include "md5.h"
+#include "conf.h"
+#include "ignore-value.h"
+
+#include "configmake.h"
+
+#define VIR_FROM_THIS VIR_FROM_LOCKING
+
+#define virLockError(code, ...)                                     \
+    virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,             \
+                         __FUNCTION__, __LINE__, __VA_ARGS__)
+
+
+typedef struct _virLockManagerFcntlHolder virLockManagerFcntlHolder;
+typedef virLockManagerFcntlHolder *virLockManagerFcntlHolderPtr;
+
+typedef struct _virLockManagerFcntlLease virLockManagerFcntlLease;
+typedef virLockManagerFcntlLease *virLockManagerFcntlLeasePtr;
+
+typedef struct _virLockManagerFcntlFile virLockManagerFcntlFile;
+typedef virLockManagerFcntlFile *virLockManagerFcntlFilePtr;
+
+typedef struct _virLockManagerFcntlDriver virLockManagerFcntlDriver;
+typedef virLockManagerFcntlDriver *virLockManagerFcntlDriverPtr;
+
+typedef struct _virLockManagerFcntlResource virLockManagerFcntlResource;
+typedef virLockManagerFcntlResource *virLockManagerFcntlResourcePtr;
+
+typedef struct _virLockManagerFcntlPrivate virLockManagerFcntlPrivate;
+typedef virLockManagerFcntlPrivate *virLockManagerFcntlPrivatePtr;
+
+/* A guest using a lease */
+struct _virLockManagerFcntlHolder {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    pid_t pid;
+    bool shared;
+    bool active;        /* false while the guest is paused */
+};
+
+/* One byte of a lockspace file */
+struct _virLockManagerFcntlLease {
+    off_t offset;
+    short type;         /* F_UNLCK, F_RDLCK or F_WRLCK, as held */
+    size_t nholders;
+    virLockManagerFcntlHolderPtr holders;
+};
+
+/* An open lockspace file, shared by all the leases within it */
+struct _virLockManagerFcntlFile {
+    char *path;
+    int fd;
+    size_t nleases;
+    virLockManagerFcntlLeasePtr *leases;
+};
+
+struct _virLockManagerFcntlDriver {
+    bool autoDiskLease;
+    char *autoDiskLeasePath;
+
+    virMutex lock;
+    virHashTablePtr files;      /* path -> virLockManagerFcntlFile */
+};
+
+static virLockManagerFcntlDriver *driver = NULL;
+
+struct _virLockManagerFcntlResource {
+    char *path;
+    off_t offset;
+    bool shared;
+};
+
+struct _virLockManagerFcntlPrivate {
+    unsigned char vm_uuid[VIR_UUID_BUFLEN];
+    char *vm_name;
+    pid_t vm_pid;
+    size_t nresources;
+    virLockManagerFcntlResourcePtr resources;
+};
+
+
+/*
+ * fcntl plugin for the libvirt virLockManager API
+ */
+static int virLockManagerFcntlLoadConfig(const char *configFile)
+{
+    virConfPtr conf;
+    virConfValuePtr p;
+
+    if (access(configFile, R_OK) == -1) {
+        if (errno != ENOENT) {
+            virReportSystemError(errno,
+                                 _("Unable to access config file %s"),
+                                 configFile);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (!(conf = virConfReadFile(configFile, 0)))
+        return -1;
+
+#define CHECK_TYPE(name,typ) if (p && p->type != (typ)) {               \
+        virLockError(VIR_ERR_INTERNAL_ERROR,                            \
+                     "%s: %s: expected type " #typ,                     \
+                     configFile, (name));                               \
+        virConfFree(conf);                                              \
+        return -1;                                                      \
+    }
+
+    p = virConfGetValue(conf, "auto_disk_leases");
+    CHECK_TYPE("auto_disk_leases", VIR_CONF_LONG);
+    if (p) driver->autoDiskLease = p->l;
+
+    p = virConfGetValue(conf, "disk_lease_dir");
+    CHECK_TYPE("disk_lease_dir", VIR_CONF_STRING);
+    if (p && p->str) {
+        VIR_FREE(driver->autoDiskLeasePath);
+        if (!(driver->autoDiskLeasePath = strdup(p->str))) {
+            virReportOOMError();
+            virConfFree(conf);
+            return -1;
+        }
+    }
+
+    virConfFree(conf);
+    return 0;
+}
+
+
+static void virLockManagerFcntlFileFree(void *payload,
+                                        const void *name ATTRIBUTE_UNUSED)
+{
+    virLockManagerFcntlFilePtr file = payload;
+    size_t i;
+
+    if (!file)
+        return;
+
+    for (i = 0 ; i < file->nleases ; i++) {
+        VIR_FREE(file->leases[i]->holders);
+        VIR_FREE(file->leases[i]);
+    }
+    VIR_FREE(file->leases);
+    /* Drops any lock still held within the file */
+    VIR_FORCE_CLOSE(file->fd);
+    VIR_FREE(file->path);
+    VIR_FREE(file);
+}
+
+
+static int virLockManagerFcntlDeinit(void);
+static int virLockManagerFcntlInit(unsigned int version,
+                                   const char *configFile,
+                                   unsigned int flags)
+{
+    VIR_DEBUG("version=%u configFile=%s flags=%x",
+              version, NULLSTR(configFile), flags);
+    virCheckFlags(0, -1);
+
+    if (driver)
+        return 0;
+
+    if (VIR_ALLOC(driver) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    if (virMutexInit(&driver->lock) < 0) {
+        virLockError(VIR_ERR_INTERNAL_ERROR, "%s",
+                     _("Unable to initialize mutex"));
+        VIR_FREE(driver);
+        return -1;
+    }
+
+    driver->autoDiskLease = true;
+    if (!(driver->autoDiskLeasePath = strdup(LOCALSTATEDIR "/lib/libvirt/fcntl"))) {
+        virReportOOMError();
+        goto error;
+    }
+
+    if (!(driver->files = virHashCreate(32, virLockManagerFcntlFileFree)))
+        goto error;
+
+    if (configFile &&
+        virLockManagerFcntlLoadConfig(configFile) < 0)
+        goto error;
+
+    if (driver->autoDiskLease &&
+        virFileMakePath(driver->autoDiskLeasePath) < 0) {
+        virReportSystemError(errno,
+                             _("Unable to create lease directory %s"),
+                             driver->autoDiskLeasePath);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    virLockManagerFcntlDeinit();
+    return -1;
+}
+
+static int virLockManagerFcntlDeinit(void)
+{
+    if (!driver)
+        return 0;
+
+    virHashFree(driver->files);
+    virMutexDestroy(&driver->lock);
+    VIR_FREE(driver->autoDiskLeasePath);
+    VIR_FREE(driver);
+
+    return 0;
+}
+
+
+static int virLockManagerFcntlNew(virLockManagerPtr lock,
+                                  unsigned int type,
+                                  size_t nparams,
+                                  virLockManagerParamPtr params,
+                                  unsigned int flags)
+{
+    virLockManagerParamPtr param;
+    virLockManagerFcntlPrivatePtr priv;
+    size_t i;
+
+    virCheckFlags(0, -1);
+
+    if (!driver) {
+        virLockError(VIR_ERR_INTERNAL_ERROR, "%s",
+                     _("fcntl plugin is not initialized"));
+        return -1;
+    }
+
+    if (type != VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN) {
+        virLockError(VIR_ERR_INTERNAL_ERROR,
+                     _("Unsupported object type %d"), type);
+        return -1;
+    }
+
+    if (VIR_ALLOC(priv) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    for (i = 0; i < nparams; i++) {
+        param = &params[i];
+
+        if (STREQ(param->key, "uuid")) {
+            memcpy(priv->vm_uuid, param->value.uuid, VIR_UUID_BUFLEN);
+        } else if (STREQ(param->key, "name")) {
+            VIR_FREE(priv->vm_name);
+            if (!(priv->vm_name = strdup(param->value.str))) {
+                virReportOOMError();
+                goto error;
+            }
+        } else if (STREQ(param->key, "pid")) {
+            priv->vm_pid = param->value.ui;
+        }
+    }
+
+    lock->privateData = priv;
+    return 0;
+
+error:
+    VIR_FREE(priv->vm_name);
+    VIR_FREE(priv);
+    return -1;
+}
+
+static void virLockManagerFcntlFree(virLockManagerPtr lock)
+{
+    virLockManagerFcntlPrivatePtr priv = lock->privateData;
+    size_t i;
+
+    if (!priv)
+        return;
+
+    for (i = 0; i < priv->nresources; i++)
+        VIR_FREE(priv->resources[i].path);
+    VIR_FREE(priv->resources);
+    VIR_FREE(priv->vm_name);
+    VIR_FREE(priv);
+    lock->privateData = NULL;
+}
+
+
+static const char hex[] = { '0', '1', '2', '3', '4', '5', '6', '7',
+                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+
+static char *virLockManagerFcntlDiskLeasePath(const char *name)
+{
+    unsigned char buf[MD5_DIGEST_SIZE];
+    char str[(MD5_DIGEST_SIZE * 2) + 1];
+    char *path;
+    int i;
+
+    if (!(md5_buffer(name, strlen(name), buf))) {
+        virLockError(VIR_ERR_INTERNAL_ERROR, "%s",
+                     _("Unable to compute md5 checksum"));
+        return NULL;
+    }
+
+    for (i = 0 ; i < MD5_DIGEST_SIZE ; i++) {
+        str[i*2] = hex[(buf[i] >> 4) & 0xf];
+        str[(i*2)+1] = hex[buf[i] & 0xf];
+    }
+    str[MD5_DIGEST_SIZE*2] = '\0';
+
+    if (virAsprintf(&path, "%s/%s", driver->autoDiskLeasePath, str) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    return path;
+}
+
+
+static int virLockManagerFcntlAddResource(virLockManagerPtr lock,
+                                          unsigned int type,
+                                          const char *name,
+                                          size_t nparams,
+                                          virLockManagerParamPtr params,
+                                          unsigned int flags)
+{
+    virLockManagerFcntlPrivatePtr priv = lock->privateData;
+    char *path = NULL;
+    unsigned long long offset = 0;
+    size_t i;
+
+    virCheckFlags(VIR_LOCK_MANAGER_RESOURCE_READONLY |
+                  VIR_LOCK_MANAGER_RESOURCE_SHARED, -1);
+
+    switch (type) {
+    case VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK:
+        if (!driver->autoDiskLease)
+            return 0;
+
+        if (nparams) {
+            virLockError(VIR_ERR_INTERNAL_ERROR, "%s",
+                         _("Unexpected lock parameters for disk resource"));
+            return -1;
+        }
+
+        if (!(path = virLockManagerFcntlDiskLeasePath(name)))
+            return -1;
+        break;
+
+    case VIR_LOCK_MANAGER_RESOURCE_TYPE_LEASE:
+        for (i = 0; i < nparams; i++) {
+            if (STREQ(params[i].key, "path")) {
+                VIR_FREE(path);
+                if (!(path = strdup(params[i].value.str))) {
+                    virReportOOMError();
+                    return -1;
+                }
+            } else if (STREQ(params[i].key, "offset")) {
+                offset = params[i].value.ul;
+            }
+        }
+
+        if (!path) {
+            virLockError(VIR_ERR_CONFIG_UNSUPPORTED,
+                         _("Lease '%s' has no lockspace path"), name);
+            return -1;
+        }
+        break;
+
+    default:
+        /* Ignore other resources, without error */
+        return 0;
+    }
+
+    if (VIR_EXPAND_N(priv->resources, priv->nresources, 1) < 0) {
+        virReportOOMError();
+        VIR_FREE(path);
+        return -1;
+    }
+
+    priv->resources[priv->nresources - 1].path = path;
+    priv->resources[priv->nresources - 1].offset = offset;
+    priv->resources[priv->nresources - 1].shared =
+        !!(flags & (VIR_LOCK_MANAGER_RESOURCE_READONLY |
+                    VIR_LOCK_MANAGER_RESOURCE_SHARED));
+
+    return 0;
+}
+
+
+static int virLockManagerFcntlSetLock(int fd, off_t offset, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = 1;
+
+    return fcntl(fd, F_SETLK, &fl);
+}
+
+
+static virLockManagerFcntlFilePtr
+virLockManagerFcntlFileGet(const char *path)
+{
+    virLockManagerFcntlFilePtr file;
+
+    if ((file = virHashLookup(driver->files, path)))
+        return file;
+
+    if (VIR_ALLOC(file) < 0 ||
+        !(file->path = strdup(path))) {
+        virReportOOMError();
+        VIR_FREE(file);
+        return NULL;
+    }
+
+    if ((file->fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0) {
+        virReportSystemError(errno,
+                             _("Unable to open lockspace %s"), path);
+        VIR_FREE(file->path);
+        VIR_FREE(file);
+        return NULL;
+    }
+
+    if (virHashAddEntry(driver->files, path, file) < 0) {
+        virLockManagerFcntlFileFree(file, NULL);
+        return NULL;
+    }
+
+    VIR_DEBUG("Opened lockspace %s fd=%d", path, file->fd);
+    return file;
+}
+
+
+static virLockManagerFcntlLeasePtr
+virLockManagerFcntlLeaseGet(virLockManagerFcntlFilePtr file,
+                            off_t offset)
+{
+    virLockManagerFcntlLeasePtr lease;
+    size_t i;
+
+    for (i = 0 ; i < file->nleases ; i++) {
+        if (file->leases[i]->offset == offset)
+            return file->leases[i];
+    }
+
+    if (VIR_ALLOC(lease) < 0 ||
+        VIR_EXPAND_N(file->leases, file->nleases, 1) < 0) {
+        virReportOOMError();
+        VIR_FREE(lease);
+        return NULL;
+    }
+
+    lease->offset = offset;
+    lease->type = F_UNLCK;
+    file->leases[file->nleases - 1] = lease;
+
+    return lease;
+}
+
+
+static virLockManagerFcntlHolderPtr
+virLockManagerFcntlHolderFind(virLockManagerFcntlLeasePtr lease,
+                              const unsigned char *uuid)
+{
+    size_t i;
+
+    for (i = 0 ; i < lease->nholders ; i++) {
+        if (memcmp(lease->holders[i].uuid, uuid, VIR_UUID_BUFLEN) == 0)
+            return &lease->holders[i];
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Bring the lock held on @lease in line with what its active
+ * holders need. Weakening a lock cannot fail, so a failure always
+ * leaves the previous lock in place.
+ */
+static int virLockManagerFcntlLeaseSync(virLockManagerFcntlFilePtr file,
+                                        virLockManagerFcntlLeasePtr lease)
+{
+    short type = F_UNLCK;
+    size_t i;
+
+    for (i = 0 ; i < lease->nholders ; i++) {
+        if (!lease->holders[i].active)
+            continue;
+        if (!lease->holders[i].shared) {
+            type = F_WRLCK;
+            break;
+        }
+        type = F_RDLCK;
+    }
+
+    if (type == lease->type)
+        return 0;
+
+    if (virLockManagerFcntlSetLock(file->fd, lease->offset, type) < 0)
+        return -1;
+
+    lease->type = type;
+    return 0;
+}
+
+
+/*
+ * Forget @lease, and close its file if nothing else uses it
+ */
+static void virLockManagerFcntlLeasePrune(virLockManagerFcntlFilePtr file,
+                                          virLockManagerFcntlLeasePtr lease)
+{
+    size_t i;
+
+    if (lease->nholders)
+        return;
+
+    for (i = 0 ; i < file->nleases ; i++) {
+        if (file->leases[i] == lease)
+            break;
+    }
+    if (i == file->nleases)
+        return;
+
+    ignore_value(virLockManagerFcntlSetLock(file->fd, lease->offset, F_UNLCK));
+    VIR_FREE(lease->holders);
+    VIR_FREE(lease);
+    memmove(file->leases + i, file->leases + i + 1,
+            sizeof(*file->leases) * (file->nleases - i - 1));
+    VIR_SHRINK_N(file->leases, file->nleases, 1);
+
+    if (file->nleases == 0) {
+        VIR_DEBUG("Closing unused lockspace %s", file->path);
+        virHashRemoveEntry(driver->files, file->path);
+    }
+}
+
+
+static void virLockManagerFcntlHolderDelete(virLockManagerFcntlLeasePtr lease,
+                                            size_t i)
+{
+    memmove(lease->holders + i, lease->holders + i + 1,
+            sizeof(*lease->holders) * (lease->nholders - i - 1));
+    VIR_SHRINK_N(lease->holders, lease->nholders, 1);
+}
+
+
+static void virLockManagerFcntlHolderRemove(virLockManagerFcntlFilePtr file,
+                                            virLockManagerFcntlLeasePtr lease,
+                                            virLockManagerFcntlHolderPtr holder)
+{
+    virLockManagerFcntlHolderDelete(lease, holder - lease->holders);
+    ignore_value(virLockManagerFcntlLeaseSync(file, lease));
+    virLockManagerFcntlLeasePrune(file, lease);
+}
+
+
+/*
+ * Drop every holder whose process no longer exists. Guests are not
+ * required to release their leases when they shut down.
+ */
+static void virLockManagerFcntlReapFile(void *payload,
+                                        const void *name ATTRIBUTE_UNUSED,
+                                        void *opaque)
+{
+    virLockManagerFcntlFilePtr file = payload;
+    size_t *nreaped = opaque;
+    size_t i, j;
+
+    for (i = 0 ; i < file->nleases ; i++) {
+        virLockManagerFcntlLeasePtr lease = file->leases[i];
+
+        for (j = 0 ; j < lease->nholders ; ) {
+            if (lease->holders[j].pid > 0 &&
+                kill(lease->holders[j].pid, 0) < 0 && errno == ESRCH) {
+                virLockManagerFcntlHolderDelete(lease, j);
+                (*nreaped)++;
+            } else {
+                j++;
+            }
+        }
+        ignore_value(virLockManagerFcntlLeaseSync(file, lease));
+    }
+}
+
+static int virLockManagerFcntlFileUnused(const void *payload,
+                                          const void *name ATTRIBUTE_UNUSED,
+                                          const void *opaque ATTRIBUTE_UNUSED)
+{
+    virLockManagerFcntlFilePtr file = (virLockManagerFcntlFilePtr) payload;
+    size_t i;
+
+    for (i = 0 ; i < file->nleases ; i++) {
+        if (file->leases[i]->nholders)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void virLockManagerFcntlReap(void)
+{
+    size_t nreaped = 0;
+
+    virHashForEach(driver->files, virLockManagerFcntlReapFile, &nreaped);
+    if (nreaped) {
+        VIR_DEBUG("Dropped %zu leases of stopped guests", nreaped);
+        virHashRemoveSet(driver->files, virLockManagerFcntlFileUnused, NULL);
+    }
+}
+
+
+static int virLockManagerFcntlAcquire(virLockManagerPtr lock,
+                                      const char *state ATTRIBUTE_UNUSED,
+                                      unsigned int flags,
+                                      int *fd ATTRIBUTE_UNUSED)
+{
+    virLockManagerFcntlPrivatePtr priv = lock->privateData;
+    virLockManagerFcntlFilePtr file;
+    virLockManagerFcntlLeasePtr lease;
+    virLockManagerFcntlHolderPtr holder;
+    virLockManagerFcntlHolderPtr *taken = NULL;
+    bool *added = NULL;
+    unsigned long long start = 0, end = 0;
+    size_t i, j;
+    int ret = -1;
+
+    virCheckFlags(VIR_LOCK_MANAGER_ACQUIRE_RESTRICT |
+                  VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY, -1);
+
+    if (flags & VIR_LOCK_MANAGER_ACQUIRE_REGISTER_ONLY)
+        return 0;
+
+    if (priv->nresources == 0)
+        return 0;
+
+    if (VIR_ALLOC_N(taken, priv->nresources) < 0 ||
+        VIR_ALLOC_N(added, priv->nresources) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    ignore_value(virTimeMs(&start));
+
+    virMutexLock(&driver->lock);
+
+    virLockManagerFcntlReap();
+
+    /* All leases of the guest are taken in one go, so any failure
+     * gives back those taken so far */
+    for (i = 0 ; i < priv->nresources ; i++) {
+        virLockManagerFcntlResourcePtr res = &priv->resources[i];
+
+        if (!(file = virLockManagerFcntlFileGet(res->path)) ||
+            !(lease = virLockManagerFcntlLeaseGet(file, res->offset)))
+            goto rollback;
+
+        for (j = 0 ; j < lease->nholders ; j++) {
+            virLockManagerFcntlHolderPtr other = &lease->holders[j];
+
+            if (!other->active ||
+                memcmp(other->uuid, priv->vm_uuid, VIR_UUID_BUFLEN) == 0)
+                continue;
+
+            if (!other->shared || !res->shared) {
+                char uuidstr[VIR_UUID_STRING_BUFLEN];
+
+                virUUIDFormat(other->uuid, uuidstr);
+                virLockError(VIR_ERR_OPERATION_FAILED,
+                             _("Lease %s:%llu is already held by domain %s"),
+                             res->path, (unsigned long long)res->offset,
+                             uuidstr);
+                virLockManagerFcntlLeasePrune(file, lease);
+                goto rollback;
+            }
+        }
+
+        if (!(holder = virLockManagerFcntlHolderFind(lease, priv->vm_uuid))) {
+            if (VIR_EXPAND_N(lease->holders, lease->nholders, 1) < 0) {
+                virReportOOMError();
+                virLockManagerFcntlLeasePrune(file, lease);
+                goto rollback;
+            }
+            holder = &lease->holders[lease->nholders - 1];
+            memcpy(holder->uuid, priv->vm_uuid, VIR_UUID_BUFLEN);
+            added[i] = true;
+        } else if (holder->active) {
+            /* Already held, e.g. a disk listed twice */
+            continue;
+        }
+
+        holder->pid = priv->vm_pid;
+        holder->shared = res->shared;
+        holder->active = true;
+
+        if (virLockManagerFcntlLeaseSync(file, lease) < 0) {
+            int err = errno;
+
+            holder->active = false;
+            if (added[i])
+                virLockManagerFcntlHolderRemove(file, lease, holder);
+
+            if (err == EAGAIN || err == EACCES)
+                virLockError(VIR_ERR_OPERATION_FAILED,
+                             _("Lease %s:%llu is held by another host"),
+                             res->path, (unsigned long long)res->offset);
+            else
+                virReportSystemError(err,
+                                     _("Failed to acquire lease %s:%llu"),
+                                     res->path,
+                                     (unsigned long long)res->offset);
+            goto rollback;
+        }
+
+        taken[i] = holder;
+    }
+
+    virMutexUnlock(&driver->lock);
+
+    ignore_value(virTimeMs(&end));
+    VIR_DEBUG("Acquired %zu leases for '%s' in %llu ms",
+              priv->nresources, NULLSTR(priv->vm_name), end - start);
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(taken);
+    VIR_FREE(added);
+    return ret;
+
+rollback:
+    while (i-- > 0) {
+        virLockManagerFcntlResourcePtr res = &priv->resources[i];
+
+        if (!taken[i] ||
+            !(file = virHashLookup(driver->files, res->path)) ||
+            !(lease = virLockManagerFcntlLeaseGet(file, res->offset)) ||
+            !(holder = virLockManagerFcntlHolderFind(lease, priv->vm_uuid)))
+            continue;
+
+        holder->active = false;
+        if (added[i])
+            virLockManagerFcntlHolderRemove(file, lease, holder);
+        else
+            ignore_value(virLockManagerFcntlLeaseSync(file, lease));
+    }
+    virMutexUnlock(&driver->lock);
+    goto cleanup;
+}
+
+
+static int virLockManagerFcntlRelease(virLockManagerPtr lock,
+                                      char **state,
+                                      unsigned int flags)
+{
+    virLockManagerFcntlPrivatePtr priv = lock->privateData;
+    virLockManagerFcntlFilePtr file;
+    virLockManagerFcntlLeasePtr lease;
+    virLockManagerFcntlHolderPtr holder;
+    size_t i, j;
+
+    virCheckFlags(0, -1);
+
+    /* No state is needed to get the leases back */
+    if (state)
+        *state = NULL;
+
+    virMutexLock(&driver->lock);
+
+    virLockManagerFcntlReap();
+
+    for (i = 0 ; i < priv->nresources ; i++) {
+        virLockManagerFcntlResourcePtr res = &priv->resources[i];
+
+        if (!(file = virHashLookup(driver->files, res->path)))
+            continue;
+
+        lease = NULL;
+        for (j = 0 ; j < file->nleases ; j++) {
+            if (file->leases[j]->offset == res->offset)
+                lease = file->leases[j];
+        }
+
+        if (!lease ||
+            !(holder = virLockManagerFcntlHolderFind(lease, priv->vm_uuid)))
+            continue;
+
+        if (state) {
+            /* Pausing: keep the lockspace open so that resuming is
+             * cheap, but let other guests and hosts have the lease */
+            holder->active = false;
+            ignore_value(virLockManagerFcntlLeaseSync(file, lease));
+        } else {
+            virLockManagerFcntlHolderRemove(file, lease, holder);
+        }
+    }
+
+    virMutexUnlock(&driver->lock);
+
+    return 0;
+}
+
+
+static int virLockManagerFcntlInquire(virLockManagerPtr lock ATTRIBUTE_UNUSED,
+                                      char **state,
+                                      unsigned int flags)
+{
+    virCheckFlags(0, -1);
+
+    if (!state) {
+        virLockError(VIR_ERR_INVALID_ARG, "state");
+        return -1;
+    }
+
+    *state = NULL;
+
+    return 0;
+}
+
+virLockDriver virLockDriverImpl =
+{
+    .version = VIR_LOCK_MANAGER_VERSION,
+    .flags = VIR_LOCK_MANAGER_HELD_BY_CALLER,
+
+    .drvInit = virLockManagerFcntlInit,
+    .drvDeinit = virLockManagerFcntlDeinit,
+
+    .drvNew = virLockManagerFcntlNew,
+    .drvFree = virLockManagerFcntlFree,
+
+    .drvAddResource = virLockManagerFcntlAddResource,
+
+    .drvAcquire = virLockManagerFcntlAcquire,
+    .drvRelease = virLockManagerFcntlRelease,
+    .drvInquire = virLockManagerFcntlInquire,
+};
@@ -269,6 +269,14 @@ bool virLockManagerPluginUsesState(virLockManagerPluginPtr plugin)
 }
 
 
+bool virLockManagerPluginHeldByCaller(virLockManagerPluginPtr plugin)
+{
+    VIR_DEBUG("plugin=%p", plugin);
+
+    return plugin->driver->flags & VIR_LOCK_MANAGER_HELD_BY_CALLER;
+}
+
+
 /**
  * virLockManagerNew:
  * @plugin: the plugin implementation to use
@@ -36,6 +36,7 @@ void virLockManagerPluginUnref(virLockManagerPluginPtr plugin);
 
 const char *virLockManagerPluginGetName(virLockManagerPluginPtr plugin);
 bool virLockManagerPluginUsesState(virLockManagerPluginPtr plugin);
+bool virLockManagerPluginHeldByCaller(virLockManagerPluginPtr plugin);
 
 
 virLockManagerPtr virLockManagerNew(virLockManagerPluginPtr plugin,
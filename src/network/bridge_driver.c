@@ -119,6 +119,7 @@ static int networkShutdownNetworkExternal(struct network_driver *driver,
                                         virNetworkObjPtr network);
 
 static void networkReloadIptablesRules(struct network_driver *driver);
+static void networkRefreshDaemons(struct network_driver *driver);
 
 static struct network_driver *driverState = NULL;
 
@@ -330,6 +331,7 @@ networkStartup(int privileged) {
 
     networkFindActiveConfigs(driverState);
     networkReloadIptablesRules(driverState);
+    networkRefreshDaemons(driverState);
     networkAutostartConfigs(driverState);
 
     networkDriverUnlock(driverState);
@@ -364,6 +366,7 @@ networkReload(void) {
                              driverState->networkConfigDir,
                              driverState->networkAutostartDir);
     networkReloadIptablesRules(driverState);
+    networkRefreshDaemons(driverState);
     networkAutostartConfigs(driverState);
     networkDriverUnlock(driverState);
     return 0;
@@ -608,12 +611,12 @@ networkBuildDnsmasqArgv(virNetworkObjPtr network,
         if (networkBuildDnsmasqHostsfile(dctx, ipdef, network->def->dns) < 0)
             goto cleanup;
 
-        if (dctx->hostsfile->nhosts)
-            virCommandAddArgPair(cmd, "--dhcp-hostsfile",
-                                 dctx->hostsfile->path);
-        if (dctx->addnhostsfile->nhosts)
-            virCommandAddArgPair(cmd, "--addn-hosts",
-                                 dctx->addnhostsfile->path);
+        /* Given even when empty, so that hosts added while dnsmasq
+         * runs are picked up on SIGHUP */
+        virCommandAddArgPair(cmd, "--dhcp-hostsfile",
+                             dctx->hostsfile->path);
+        virCommandAddArgPair(cmd, "--addn-hosts",
+                             dctx->addnhostsfile->path);
 
         if (ipdef->tftproot) {
             virCommandAddArgList(cmd, "--enable-tftp",
@@ -641,27 +644,36 @@ cleanup:
     return ret;
 }
 
-int
-networkBuildDhcpDaemonCommandLine(virNetworkObjPtr network, virCommandPtr *cmdout,
-                                  char *pidfile, dnsmasqContext *dctx)
+/* Pick the IPv4 address whose dhcp settings dnsmasq serves */
+static virNetworkIpDefPtr
+networkGetDhcpIpDef(virNetworkDefPtr def)
 {
-    virCommandPtr cmd = NULL;
-    int ret = -1, ii;
     virNetworkIpDefPtr ipdef;
-
-    network->dnsmasqPid = -1;
+    int ii;
 
     /* Look for first IPv4 address that has dhcp defined. */
     /* We support dhcp config on 1 IPv4 interface only. */
     for (ii = 0;
-         (ipdef = virNetworkDefGetIpByIndex(network->def, AF_INET, ii));
+         (ipdef = virNetworkDefGetIpByIndex(def, AF_INET, ii));
          ii++) {
         if (ipdef->nranges || ipdef->nhosts)
-            break;
+            return ipdef;
     }
     /* If no IPv4 addresses had dhcp info, pick the first (if there were any). */
-    if (!ipdef)
-        ipdef = virNetworkDefGetIpByIndex(network->def, AF_INET, 0);
+    return virNetworkDefGetIpByIndex(def, AF_INET, 0);
+}
+
+int
+networkBuildDhcpDaemonCommandLine(virNetworkObjPtr network, virCommandPtr *cmdout,
+                                  char *pidfile, dnsmasqContext *dctx)
+{
+    virCommandPtr cmd = NULL;
+    int ret = -1;
+    virNetworkIpDefPtr ipdef;
+
+    network->dnsmasqPid = -1;
+
+    ipdef = networkGetDhcpIpDef(network->def);
 
     /* If there are no IP addresses at all (v4 or v6), return now, since
      * there won't be any address for dnsmasq to listen on anyway.
@@ -756,6 +768,69 @@ cleanup:
     return ret;
 }
 
+/*
+ * networkRefreshDhcpDaemon:
+ *
+ * Bring the host files of an already running dnsmasq in line with
+ * the network definition and, if anything changed, make it re-read
+ * them with SIGHUP instead of restarting it, so DHCP service is not
+ * interrupted.
+ */
+static int
+networkRefreshDhcpDaemon(virNetworkObjPtr network)
+{
+    int ret = -1;
+    int changed;
+    virNetworkIpDefPtr ipdef;
+    dnsmasqContext *dctx = NULL;
+
+    if (network->dnsmasqPid <= 0)
+        return 0;
+
+    /* Without an IPv4 address, dnsmasq was not given any host files */
+    if (!(ipdef = networkGetDhcpIpDef(network->def)))
+        return 0;
+
+    dctx = dnsmasqContextNew(network->def->name, DNSMASQ_STATE_DIR);
+    if (dctx == NULL)
+        goto cleanup;
+
+    if (networkBuildDnsmasqHostsfile(dctx, ipdef, network->def->dns) < 0)
+        goto cleanup;
+
+    if ((changed = dnsmasqSave(dctx)) < 0)
+        goto cleanup;
+
+    if (changed) {
+        VIR_INFO("Reloading dnsmasq host files for network '%s'",
+                 network->def->name);
+        if (dnsmasqReload(network->dnsmasqPid) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+cleanup:
+    dnsmasqContextFree(dctx);
+    return ret;
+}
+
+static void
+networkRefreshDaemons(struct network_driver *driver)
+{
+    unsigned int i;
+
+    for (i = 0 ; i < driver->networks.count ; i++) {
+        virNetworkObjPtr network = driver->networks.objs[i];
+
+        virNetworkObjLock(network);
+        if (virNetworkObjIsActive(network) &&
+            networkRefreshDhcpDaemon(network) < 0) {
+            /* failed to refresh but already logged */
+        }
+        virNetworkObjUnlock(network);
+    }
+}
+
 static int
 networkStartRadvd(virNetworkObjPtr network)
 {
@@ -1421,7 +1496,8 @@ networkRemoveIpSpecificIptablesRules(struct network_driver *driver,
     }
 }
 
-/* Add all rules for all ip addresses (and general rules) on a network */
+/* Add all rules for all ip addresses (and general rules) on a network
+ * to the open iptables transaction */
 static int
 networkAddIptablesRules(struct network_driver *driver,
                         virNetworkObjPtr network)
@@ -1461,15 +1537,41 @@ static void
 networkRemoveIptablesRules(struct network_driver *driver,
                            virNetworkObjPtr network)
 {
-    int ii;
-    virNetworkIpDefPtr ipdef;
+    /* A network without rules queued loses all it had installed */
+    if (iptablesContextBegin(driver->iptables, 0) < 0)
+        return;
 
-    for (ii = 0;
-         (ipdef = virNetworkDefGetIpByIndex(network->def, AF_UNSPEC, ii));
-         ii++) {
-        networkRemoveIpSpecificIptablesRules(driver, network, ipdef);
+    if (iptablesContextSetOwner(driver->iptables, network->def->bridge) < 0) {
+        iptablesContextAbort(driver->iptables);
+        return;
     }
-    networkRemoveGeneralIptablesRules(driver, network);
+
+    if (iptablesContextCommit(driver->iptables) < 0) {
+        /* failed to remove but already logged */
+    }
+}
+
+/* Install the rules of a network, replacing any it already has */
+static int
+networkInstallIptablesRules(struct network_driver *driver,
+                            virNetworkObjPtr network)
+{
+    if (iptablesContextBegin(driver->iptables, 0) < 0)
+        return -1;
+
+    if (iptablesContextSetOwner(driver->iptables, network->def->bridge) < 0 ||
+        networkAddIptablesRules(driver, network) < 0) {
+        iptablesContextAbort(driver->iptables);
+        return -1;
+    }
+
+    if (iptablesContextCommit(driver->iptables) < 0) {
+        /* Don't leave the tables that were updated behind */
+        networkRemoveIptablesRules(driver, network);
+        return -1;
+    }
+
+    return 0;
 }
 
 static void
@@ -1479,16 +1581,31 @@ networkReloadIptablesRules(struct network_driver *driver)
 
     VIR_INFO("Reloading iptables rules");
 
+    /* The rules of all active networks are refreshed in one
+     * transaction, which leaves those that are intact alone */
+    if (iptablesContextBegin(driver->iptables,
+                             IPTABLES_TRANSACTION_LEGACY) < 0)
+        return;
+
     for (i = 0 ; i < driver->networks.count ; i++) {
         virNetworkObjLock(driver->networks.objs[i]);
         if (virNetworkObjIsActive(driver->networks.objs[i])) {
-            networkRemoveIptablesRules(driver, driver->networks.objs[i]);
-            if (networkAddIptablesRules(driver, driver->networks.objs[i]) < 0) {
+            if (iptablesContextSetOwner(driver->iptables,
+                                        driver->networks.objs[i]->def->bridge) < 0) {
                 /* failed to add but already logged */
+            } else if (networkAddIptablesRules(driver,
+                                               driver->networks.objs[i]) < 0) {
+                /* failed to add but already logged, so at least
+                 * keep the rules the network has now */
+                iptablesContextDropOwner(driver->iptables);
             }
         }
         virNetworkObjUnlock(driver->networks.objs[i]);
     }
+
+    if (iptablesContextCommit(driver->iptables) < 0) {
+        /* failed to apply but already logged */
+    }
 }
 
 /* Enable IP Forwarding. Return 0 for success, -1 for failure. */
@@ -1768,7 +1885,7 @@ networkStartNetworkVirtual(struct network_driver *driver,
         goto err1;
 
     /* Add "once per network" rules */
-    if (networkAddIptablesRules(driver, network) < 0)
+    if (networkInstallIptablesRules(driver, network) < 0)
         goto err1;
 
     for (ii = 0;
@@ -2374,7 +2491,9 @@ static virNetworkPtr networkDefine(virConnectPtr conn, const char *xml) {
             }
         }
     }
-    if (ipv4def) {
+    /* The host files of an active network belong to its running
+     * dnsmasq; they are brought up to date when it is next started */
+    if (ipv4def && !virNetworkObjIsActive(network)) {
         dctx = dnsmasqContextNew(def->name, DNSMASQ_STATE_DIR);
         if (dctx == NULL ||
             networkBuildDnsmasqHostsfile(dctx, ipv4def, def->dns) < 0 ||
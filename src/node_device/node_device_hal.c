@@ -442,7 +442,6 @@ static void dev_create(const char *udi)
     const char *name = hal_name(udi);
     int rv;
     char *privData = strdup(udi);
-    char *devicePath = NULL;
 
     if (!privData)
         return;
@@ -469,20 +468,18 @@ static void dev_create(const char *udi)
     if (def->caps == NULL)
         goto cleanup;
 
-    /* Some devices don't have a path in sysfs, so ignore failure */
-    (void)get_str_prop(ctx, udi, "linux.sysfs_path", &devicePath);
+    /* Some devices don't have a path in sysfs, so ignore failure.
+     * Set it before adding the device so it gets indexed. */
+    (void)get_str_prop(ctx, udi, "linux.sysfs_path", &def->sysfs_path);
 
     dev = virNodeDeviceAssignDef(&driverState->devs,
                                  def);
 
-    if (!dev) {
-        VIR_FREE(devicePath);
+    if (!dev)
         goto failure;
-    }
 
     dev->privateData = privData;
     dev->privateFree = free_udi;
-    dev->def->sysfs_path = devicePath;
 
     virNodeDeviceObjUnlock(dev);
 
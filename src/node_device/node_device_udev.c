@@ -38,6 +38,9 @@
 #include "util.h"
 #include "buf.h"
 #include "pci.h"
+#include "hash.h"
+#include "threads.h"
+#include "ignore-value.h"
 
 #define VIR_FROM_THIS VIR_FROM_NODEDEV
 
@@ -362,14 +365,46 @@ static void udevLogFunction(struct udev *udev ATTRIBUTE_UNUSED,
 }
 
 
-static int udevTranslatePCIIds(unsigned int vendor,
-                               unsigned int product,
-                               char **vendor_string,
-                               char **product_string)
+/* Names libpciaccess knows for a vendor/product pair.  Either may be
+ * NULL if the ID database has no entry for it. */
+typedef struct _udevPCIIdNames udevPCIIdNames;
+struct _udevPCIIdNames {
+    char *vendor_name;
+    char *product_name;
+};
+
+/* Memo of udevPCIIdNames keyed by "vendor:product".  Lookups in the
+ * libpciaccess ID database are slow and not thread safe, and hosts
+ * usually have many devices sharing a handful of IDs, so each pair is
+ * looked up once and every call into libpciaccess happens under the
+ * lock. */
+static virMutex pciIdsLock;
+static virHashTablePtr pciIds = NULL;
+
+
+static void udevPCIIdNamesFree(void *payload,
+                               const void *name ATTRIBUTE_UNUSED)
 {
-    int ret = -1;
+    udevPCIIdNames *names = payload;
+
+    VIR_FREE(names->vendor_name);
+    VIR_FREE(names->product_name);
+    VIR_FREE(names);
+}
+
+
+static udevPCIIdNames *udevLookupPCIIds(unsigned int vendor,
+                                        unsigned int product)
+{
+    udevPCIIdNames *names = NULL;
     struct pci_id_match m;
     const char *vendor_name = NULL, *device_name = NULL;
+    char key[32];
+
+    snprintf(key, sizeof(key), "%04x:%04x", vendor, product);
+
+    if ((names = virHashLookup(pciIds, key)) != NULL)
+        return names;
 
     m.vendor_id = vendor;
     m.device_id = product;
@@ -386,16 +421,53 @@ static int udevTranslatePCIIds(unsigned int vendor,
                     NULL,
                     NULL);
 
-    if (vendor_name != NULL) {
-        *vendor_string = strdup(vendor_name);
+    if (VIR_ALLOC(names) < 0)
+        goto no_memory;
+
+    if ((vendor_name != NULL &&
+         (names->vendor_name = strdup(vendor_name)) == NULL) ||
+        (device_name != NULL &&
+         (names->product_name = strdup(device_name)) == NULL))
+        goto no_memory;
+
+    if (virHashAddEntry(pciIds, key, names) < 0) {
+        udevPCIIdNamesFree(names, NULL);
+        return NULL;
+    }
+
+    return names;
+
+no_memory:
+    virReportOOMError();
+    if (names)
+        udevPCIIdNamesFree(names, NULL);
+    return NULL;
+}
+
+
+static int udevTranslatePCIIds(unsigned int vendor,
+                               unsigned int product,
+                               char **vendor_string,
+                               char **product_string)
+{
+    int ret = -1;
+    udevPCIIdNames *names;
+
+    virMutexLock(&pciIdsLock);
+
+    if ((names = udevLookupPCIIds(vendor, product)) == NULL)
+        goto out;
+
+    if (names->vendor_name != NULL) {
+        *vendor_string = strdup(names->vendor_name);
         if (*vendor_string == NULL) {
             virReportOOMError();
             goto out;
         }
     }
 
-    if (device_name != NULL) {
-        *product_string = strdup(device_name);
+    if (names->product_name != NULL) {
+        *product_string = strdup(names->product_name);
         if (*product_string == NULL) {
             virReportOOMError();
             goto out;
@@ -405,6 +477,7 @@ static int udevTranslatePCIIds(unsigned int vendor,
     ret = 0;
 
 out:
+    virMutexUnlock(&pciIdsLock);
     return ret;
 }
 
@@ -1284,39 +1357,57 @@ out:
 }
 
 
-static int udevAddOneDevice(struct udev_device *device)
+/* Builds the definition of @device from what udev and sysfs tell
+ * about it.  Looks at nothing but @device, so it may run for several
+ * devices concurrently as long as each of them belongs to a udev
+ * context used by one thread only. */
+static virNodeDeviceDefPtr udevNewDeviceDef(struct udev_device *device)
 {
     virNodeDeviceDefPtr def = NULL;
-    virNodeDeviceObjPtr dev = NULL;
-    int ret = -1;
 
     if (VIR_ALLOC(def) != 0) {
         virReportOOMError();
-        goto out;
+        goto error;
     }
 
     def->sysfs_path = strdup(udev_device_get_syspath(device));
     if (udevGetStringProperty(device,
                               "DRIVER",
                               &def->driver) == PROPERTY_ERROR) {
-        goto out;
+        goto error;
     }
 
     if (VIR_ALLOC(def->caps) != 0) {
         virReportOOMError();
-        goto out;
+        goto error;
     }
 
     if (udevGetDeviceType(device, &def->caps->type) != 0) {
-        goto out;
+        goto error;
     }
 
     if (udevGetDeviceDetails(device, def) != 0) {
-        goto out;
+        goto error;
     }
 
+    return def;
+
+error:
+    virNodeDeviceDefFree(def);
+    return NULL;
+}
+
+
+/* Links @def to its parent and adds it to the device list, which takes
+ * ownership of @def on success.  Parents are looked up in the list, so
+ * devices must be added in the order udev lists them. */
+static int udevAssignDeviceDef(struct udev_device *device,
+                               virNodeDeviceDefPtr def)
+{
+    virNodeDeviceObjPtr dev = NULL;
+
     if (udevSetParent(device, def) != 0) {
-        goto out;
+        return -1;
     }
 
     /* If this is a device change, the old definition will be freed
@@ -1325,53 +1416,95 @@ static int udevAddOneDevice(struct udev_device *device)
 
     if (dev == NULL) {
         VIR_ERROR(_("Failed to create device for '%s'"), def->name);
-        goto out;
+        return -1;
     }
 
     virNodeDeviceObjUnlock(dev);
 
-    ret = 0;
+    return 0;
+}
 
-out:
-    if (ret != 0) {
+
+static int udevAddOneDevice(struct udev_device *device)
+{
+    virNodeDeviceDefPtr def = NULL;
+
+    if ((def = udevNewDeviceDef(device)) == NULL)
+        return -1;
+
+    if (udevAssignDeviceDef(device, def) != 0) {
         virNodeDeviceDefFree(def);
+        return -1;
     }
 
-    return ret;
+    return 0;
 }
 
 
-static int udevProcessDeviceListEntry(struct udev *udev,
-                                      struct udev_list_entry *list_entry)
-{
+/* A device found by enumeration, together with its definition once a
+ * worker has built it. */
+typedef struct _udevEnumEntry udevEnumEntry;
+struct _udevEnumEntry {
+    const char *syspath;
     struct udev_device *device;
-    const char *name = NULL;
-    int ret = -1;
+    virNodeDeviceDefPtr def;
+};
 
-    name = udev_list_entry_get_name(list_entry);
+typedef struct _udevEnumWorker udevEnumWorker;
+struct _udevEnumWorker {
+    virThread thread;
+    bool running;
+    struct udev *udev;
+    udevEnumEntry *entries;
+    size_t nentries;
+};
 
-    device = udev_device_new_from_syspath(udev, name);
 
-    if (device != NULL) {
-        if (udevAddOneDevice(device) != 0) {
+static void udevEnumWorkerRun(void *opaque)
+{
+    udevEnumWorker *worker = opaque;
+    size_t i;
+
+    for (i = 0; i < worker->nentries; i++) {
+        udevEnumEntry *entry = &worker->entries[i];
+
+        entry->device = udev_device_new_from_syspath(worker->udev,
+                                                     entry->syspath);
+        if (entry->device == NULL)
+            continue;
+
+        if ((entry->def = udevNewDeviceDef(entry->device)) == NULL) {
             VIR_DEBUG("Failed to create node device for udev device '%s'",
-                      name);
+                      entry->syspath);
         }
-        ret = 0;
     }
-
-    udev_device_unref(device);
-
-    return ret;
 }
 
 
+/*
+ * Enumerates all devices known to udev and adds them to the device
+ * list.  Building the definitions means reading lots of sysfs files
+ * and is spread over up to UDEV_ENUM_WORKERS threads, each working on
+ * a contiguous part of the list with a udev context of its own, since
+ * a single context must not be used from several threads.  Adding the
+ * results to the list happens afterwards, in enumeration order, so
+ * that parents are known before their children.
+ */
 static int udevEnumerateDevices(struct udev *udev)
 {
     struct udev_enumerate *udev_enumerate = NULL;
     struct udev_list_entry *list_entry = NULL;
+    udevEnumEntry *entries = NULL;
+    size_t nentries = 0;
+    udevEnumWorker *workers = NULL;
+    size_t nworkers = 0;
+    size_t nadded = 0;
+    size_t i, per_worker;
+    unsigned long long start = 0, end = 0;
     int ret = 0;
 
+    ignore_value(virTimeMs(&start));
+
     udev_enumerate = udev_enumerate_new(udev);
 
     ret = udev_enumerate_scan_devices(udev_enumerate);
@@ -1382,11 +1515,87 @@ static int udevEnumerateDevices(struct udev *udev)
 
     udev_list_entry_foreach(list_entry,
                             udev_enumerate_get_list_entry(udev_enumerate)) {
+        if (VIR_EXPAND_N(entries, nentries, 1) < 0) {
+            virReportOOMError();
+            ret = -1;
+            goto out;
+        }
+        entries[nentries - 1].syspath = udev_list_entry_get_name(list_entry);
+    }
+
+    if (nentries == 0)
+        goto out;
+
+    nworkers = MIN(UDEV_ENUM_WORKERS,
+                   (nentries + UDEV_ENUM_MIN_DEVICES - 1) /
+                   UDEV_ENUM_MIN_DEVICES);
+    if (VIR_ALLOC_N(workers, nworkers) < 0) {
+        virReportOOMError();
+        ret = -1;
+        goto out;
+    }
+
+    per_worker = (nentries + nworkers - 1) / nworkers;
+    for (i = 0; i < nworkers; i++) {
+        workers[i].entries = entries + i * per_worker;
+        workers[i].nentries = MIN(per_worker, nentries - i * per_worker);
+    }
+
+    /* The first part is ours, using the context we were given */
+    workers[0].udev = udev;
+    for (i = 1; i < nworkers; i++) {
+        if ((workers[i].udev = udev_new()) == NULL)
+            continue;
+        udev_set_log_fn(workers[i].udev, udevLogFunction);
+        if (virThreadCreate(&workers[i].thread, true,
+                            udevEnumWorkerRun, &workers[i]) == 0)
+            workers[i].running = true;
+    }
 
-        udevProcessDeviceListEntry(udev, list_entry);
+    udevEnumWorkerRun(&workers[0]);
+
+    for (i = 1; i < nworkers; i++) {
+        if (workers[i].running) {
+            virThreadJoin(&workers[i].thread);
+        } else {
+            /* No thread or no context of its own, so do its part here */
+            if (workers[i].udev == NULL)
+                workers[i].udev = udev_ref(udev);
+            udevEnumWorkerRun(&workers[i]);
+        }
     }
 
+    for (i = 0; i < nentries; i++) {
+        if (entries[i].def == NULL)
+            continue;
+
+        if (udevAssignDeviceDef(entries[i].device, entries[i].def) != 0) {
+            VIR_DEBUG("Failed to create node device for udev device '%s'",
+                      entries[i].syspath);
+            virNodeDeviceDefFree(entries[i].def);
+        } else {
+            nadded++;
+        }
+        entries[i].def = NULL;
+    }
+
+    ignore_value(virTimeMs(&end));
+
+    VIR_INFO("Enumerated %zu of %zu udev devices in %llu ms (%zu threads)",
+             nadded, nentries, end - start, nworkers);
+
 out:
+    for (i = 0; i < nentries; i++) {
+        virNodeDeviceDefFree(entries[i].def);
+        if (entries[i].device != NULL)
+            udev_device_unref(entries[i].device);
+    }
+    for (i = 1; i < nworkers; i++) {
+        if (workers[i].udev != NULL)
+            udev_unref(workers[i].udev);
+    }
+    VIR_FREE(workers);
+    VIR_FREE(entries);
     udev_enumerate_unref(udev_enumerate);
     return ret;
 }
@@ -1435,6 +1644,12 @@ static int udevDeviceMonitorShutdown(void)
     pci_system_cleanup();
 #endif
 
+    if (pciIds != NULL) {
+        virHashFree(pciIds);
+        pciIds = NULL;
+        virMutexDestroy(&pciIdsLock);
+    }
+
     return ret;
 }
 
@@ -1630,6 +1845,18 @@ static int udevDeviceMonitorStartup(int privileged)
     }
 #endif
 
+    if (virMutexInit(&pciIdsLock) < 0) {
+        VIR_ERROR(_("Failed to initialize mutex for PCI ID names"));
+        ret = -1;
+        goto out;
+    }
+
+    if ((pciIds = virHashCreate(64, udevPCIIdNamesFree)) == NULL) {
+        virMutexDestroy(&pciIdsLock);
+        ret = -1;
+        goto out;
+    }
+
     if (VIR_ALLOC(priv) < 0) {
         virReportOOMError();
         ret = -1;
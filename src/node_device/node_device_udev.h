@@ -32,3 +32,8 @@ typedef struct _udevPrivate udevPrivate;
 #define PROPERTY_FOUND 0
 #define PROPERTY_MISSING 1
 #define PROPERTY_ERROR -1
+
+/* Threads building device definitions during enumeration, and the
+ * fewest devices worth handing to one of them */
+#define UDEV_ENUM_WORKERS 4
+#define UDEV_ENUM_MIN_DEVICES 64
@@ -34,6 +34,7 @@
 #include "domain_conf.h"
 #include "qemu_conf.h"
 #include "command.h"
+#include "threads.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -1246,9 +1247,59 @@ qemuCapsParseDeviceStr(const char *str, virBitmapPtr flags)
     return 0;
 }
 
-int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
-                               unsigned int *retversion,
-                               virBitmapPtr *retflags)
+/* Probing a binary means running it at least twice, which adds up when
+ * many guests are started at once, so the results are kept for as long
+ * as the binary does not change.
+ */
+typedef struct _qemuCapsCacheEntry qemuCapsCacheEntry;
+struct _qemuCapsCacheEntry {
+    char *binary;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+
+    unsigned int version;
+    virBitmapPtr flags;
+};
+
+static virOnceControl qemuCapsCacheOnce = VIR_ONCE_CONTROL_INITIALIZER;
+static virMutex qemuCapsCacheLock;
+static bool qemuCapsCacheReady;
+static qemuCapsCacheEntry *qemuCapsCache;
+static size_t qemuCapsCacheCount;
+
+static void
+qemuCapsCacheOnceInit(void)
+{
+    if (virMutexInit(&qemuCapsCacheLock) == 0)
+        qemuCapsCacheReady = true;
+}
+
+static virBitmapPtr
+qemuCapsCopy(virBitmapPtr caps)
+{
+    virBitmapPtr copy;
+    int i;
+
+    if (!(copy = qemuCapsNew()))
+        return NULL;
+
+    for (i = 0; i < QEMU_CAPS_LAST; i++) {
+        if (qemuCapsGet(caps, i))
+            qemuCapsSet(copy, i);
+    }
+
+    return copy;
+}
+
+/* Runs @qemu to find out its version and the features it supports,
+ * independent of the guest architecture */
+static int
+qemuCapsProbe(const char *qemu,
+              unsigned int *retversion,
+              virBitmapPtr *retflags)
 {
     int ret = -1;
     unsigned int version, is_kvm, kvm_version;
@@ -1256,20 +1307,6 @@ int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
     char *help = NULL;
     virCommandPtr cmd;
 
-    if (retflags)
-        *retflags = NULL;
-    if (retversion)
-        *retversion = 0;
-
-    /* Make sure the binary we are about to try exec'ing exists.
-     * Technically we could catch the exec() failure, but that's
-     * in a sub-process so it's hard to feed back a useful error.
-     */
-    if (!virFileIsExecutable(qemu)) {
-        virReportSystemError(errno, _("Cannot find QEMU binary %s"), qemu);
-        return -1;
-    }
-
     cmd = virCommandNewArgList(qemu, "-help", NULL);
     virCommandAddEnvPassCommon(cmd);
     virCommandSetOutputBuffer(cmd, &help);
@@ -1283,12 +1320,6 @@ int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
                              &version, &is_kvm, &kvm_version) == -1)
         goto cleanup;
 
-    /* Currently only x86_64 and i686 support PCI-multibus. */
-    if (STREQLEN(arch, "x86_64", 6) ||
-        STREQLEN(arch, "i686", 4)) {
-        qemuCapsSet(flags, QEMU_CAPS_PCI_MULTIBUS);
-    }
-
     /*
      * RHEL-6 specific hack to enable some features that were backported
      * Only RHEL-6 puts KVM in /usr/libexec, so we hook off that since
@@ -1307,13 +1338,9 @@ int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
         qemuCapsExtractDeviceStr(qemu, flags) < 0)
         goto cleanup;
 
-    if (retversion)
-        *retversion = version;
-    if (retflags) {
-        *retflags = flags;
-        flags = NULL;
-    }
-
+    *retversion = version;
+    *retflags = flags;
+    flags = NULL;
     ret = 0;
 
 cleanup:
@@ -1324,6 +1351,128 @@ cleanup:
     return ret;
 }
 
+/* Looks up the probe results for @qemu, probing it if there are none
+ * or the binary changed since. Returns a copy of the flags in @retflags.
+ */
+static int
+qemuCapsCacheLookup(const char *qemu,
+                    unsigned int *retversion,
+                    virBitmapPtr *retflags)
+{
+    qemuCapsCacheEntry *entry = NULL;
+    struct stat sb;
+    unsigned int version;
+    virBitmapPtr flags = NULL;
+    size_t i;
+    int ret = -1;
+
+    if (virOnce(&qemuCapsCacheOnce, qemuCapsCacheOnceInit) < 0 ||
+        !qemuCapsCacheReady) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("unable to initialize QEMU capabilities cache"));
+        return -1;
+    }
+
+    if (stat(qemu, &sb) < 0) {
+        virReportSystemError(errno, _("Cannot find QEMU binary %s"), qemu);
+        return -1;
+    }
+
+    virMutexLock(&qemuCapsCacheLock);
+
+    for (i = 0; i < qemuCapsCacheCount; i++) {
+        if (STREQ(qemuCapsCache[i].binary, qemu)) {
+            entry = &qemuCapsCache[i];
+            break;
+        }
+    }
+
+    if (entry &&
+        entry->dev == sb.st_dev &&
+        entry->ino == sb.st_ino &&
+        entry->size == sb.st_size &&
+        entry->mtime == sb.st_mtime &&
+        entry->ctime == sb.st_ctime) {
+        VIR_DEBUG("Reusing capabilities of %s", qemu);
+    } else {
+        VIR_DEBUG("Probing capabilities of %s", qemu);
+        if (qemuCapsProbe(qemu, &version, &flags) < 0)
+            goto cleanup;
+
+        if (!entry) {
+            if (VIR_EXPAND_N(qemuCapsCache, qemuCapsCacheCount, 1) < 0) {
+                virReportOOMError();
+                goto cleanup;
+            }
+            entry = &qemuCapsCache[qemuCapsCacheCount - 1];
+            if (!(entry->binary = strdup(qemu))) {
+                virReportOOMError();
+                VIR_SHRINK_N(qemuCapsCache, qemuCapsCacheCount, 1);
+                goto cleanup;
+            }
+        }
+
+        qemuCapsFree(entry->flags);
+        entry->flags = flags;
+        flags = NULL;
+        entry->version = version;
+        entry->dev = sb.st_dev;
+        entry->ino = sb.st_ino;
+        entry->size = sb.st_size;
+        entry->mtime = sb.st_mtime;
+        entry->ctime = sb.st_ctime;
+    }
+
+    if (retflags && !(*retflags = qemuCapsCopy(entry->flags)))
+        goto cleanup;
+    if (retversion)
+        *retversion = entry->version;
+
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&qemuCapsCacheLock);
+    qemuCapsFree(flags);
+    return ret;
+}
+
+int qemuCapsExtractVersionInfo(const char *qemu, const char *arch,
+                               unsigned int *retversion,
+                               virBitmapPtr *retflags)
+{
+    virBitmapPtr flags = NULL;
+
+    if (retflags)
+        *retflags = NULL;
+    if (retversion)
+        *retversion = 0;
+
+    /* Make sure the binary we are about to try exec'ing exists.
+     * Technically we could catch the exec() failure, but that's
+     * in a sub-process so it's hard to feed back a useful error.
+     */
+    if (!virFileIsExecutable(qemu)) {
+        virReportSystemError(errno, _("Cannot find QEMU binary %s"), qemu);
+        return -1;
+    }
+
+    if (qemuCapsCacheLookup(qemu, retversion,
+                            retflags ? &flags : NULL) < 0)
+        return -1;
+
+    if (!retflags)
+        return 0;
+
+    /* Currently only x86_64 and i686 support PCI-multibus. */
+    if (STREQLEN(arch, "x86_64", 6) ||
+        STREQLEN(arch, "i686", 4)) {
+        qemuCapsSet(flags, QEMU_CAPS_PCI_MULTIBUS);
+    }
+
+    *retflags = flags;
+    return 0;
+}
+
 static void
 uname_normalize (struct utsname *ut)
 {
@@ -43,6 +43,7 @@
 #include <sys/utsname.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <strings.h>
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
@@ -126,16 +127,10 @@ qemuPhysIfaceConnect(virDomainDefPtr def,
     if (qemuCapsGet(qemuCaps, QEMU_CAPS_VNET_HDR) &&
         net->model && STREQ(net->model, "virtio"))
         vnet_hdr = 1;
-    
-    err = ifaceAddRemoveSfcPeerDevice(virDomainNetGetActualDirectDev(net),
-                                      net->mac,
-                                      true);
-  
+
     rc = openMacvtapTap(net->ifname, net->mac,
                         virDomainNetGetActualDirectDev(net),
                         virDomainNetGetActualDirectMode(net),
-                        virDomainNetGetActualVfPCIAddr(net),
-                        virDomainNetGetActualVlan(net),
                         vnet_hdr, def->uuid,
                         virDomainNetGetActualDirectVirtPortProfile(net),
                         &res_ifname,
@@ -162,8 +157,6 @@ qemuPhysIfaceConnect(virDomainDefPtr def,
                 VIR_FORCE_CLOSE(rc);
                 delMacvtap(net->ifname, net->mac,
                            virDomainNetGetActualDirectDev(net),
-                           virDomainNetGetActualVfPCIAddr(net),
-                           virDomainNetGetActualVlan(net),
                            virDomainNetGetActualDirectMode(net),
                            virDomainNetGetActualDirectVirtPortProfile(net),
                            driver->stateDir); 
@@ -189,19 +182,116 @@ void
 qemuPhysIfaceDisconnect(struct qemud_driver *driver,
                         virDomainNetDefPtr net)
 {
-    int err;
 #if WITH_MACVTAP
-    
     delMacvtap(net->ifname, net->mac,
                virDomainNetGetActualDirectDev(net),
-               virDomainNetGetActualVfPCIAddr(net),
-               virDomainNetGetActualVlan(net),
                virDomainNetGetActualDirectMode(net),
                virDomainNetGetActualDirectVirtPortProfile(net),
                driver->stateDir);
-    err = ifaceAddRemoveSfcPeerDevice(virDomainNetGetActualDirectDev(net),
-                                      net->mac,
-                                      false);
+#else
+    (void)driver;
+    (void)net;
+#endif
+}
+
+
+#if WITH_MACVTAP
+/* Queue the local_addrs entries and VF settings of the direct
+ * interfaces among @nets */
+static ifaceVfBatchPtr
+qemuPhysIfaceVfBatch(virDomainNetDefPtr *nets,
+                     size_t nnets)
+{
+    ifaceVfBatchPtr batch;
+    size_t i;
+
+    if (!(batch = ifaceVfBatchNew()))
+        return NULL;
+
+    for (i = 0 ; i < nnets ; i++) {
+        virDomainNetDefPtr net = nets[i];
+        const char *vf_pci_addr = NULL;
+
+        if (virDomainNetGetActualType(net) != VIR_DOMAIN_NET_TYPE_DIRECT)
+            continue;
+
+        if (virDomainNetGetActualDirectMode(net) ==
+            VIR_MACVTAP_MODE_PCI_PASSTHRU_HYBRID)
+            vf_pci_addr = virDomainNetGetActualVfPCIAddr(net);
+
+        if (ifaceVfBatchAdd(batch, virDomainNetGetActualDirectDev(net),
+                            net->mac, vf_pci_addr,
+                            virDomainNetGetActualVlan(net)) < 0) {
+            ifaceVfBatchFree(batch);
+            return NULL;
+        }
+    }
+
+    return batch;
+}
+#endif
+
+
+/**
+ * qemuPhysIfaceConnectVfs:
+ * @nets: the interfaces of the domain
+ * @nnets: number of interfaces
+ *
+ * Add the MAC addresses of the direct interfaces among @nets to the
+ * local_addrs of their physical functions, and set the MAC address and
+ * VLAN of the virtual functions of the PCI_PASSTHRU_HYBRID ones. This
+ * must be done before qemuPhysIfaceConnect, and is done for all the
+ * interfaces at once so that there is one request per physical function.
+ *
+ * Returns 0 on success or -1 in case of error.
+ */
+int
+qemuPhysIfaceConnectVfs(virDomainNetDefPtr *nets,
+                        size_t nnets)
+{
+#if WITH_MACVTAP
+    ifaceVfBatchPtr batch;
+    int ret;
+
+    if (!(batch = qemuPhysIfaceVfBatch(nets, nnets)))
+        return -1;
+
+    ret = ifaceVfBatchApply(batch, true);
+
+    ifaceVfBatchFree(batch);
+    return ret;
+#else
+    (void)nets;
+    (void)nnets;
+    return 0;
+#endif
+}
+
+
+/**
+ * qemuPhysIfaceDisconnectVfs:
+ * @nets: the interfaces of the domain
+ * @nnets: number of interfaces
+ *
+ * Undo qemuPhysIfaceConnectVfs, once the direct interfaces among @nets
+ * are disconnected.
+ */
+void
+qemuPhysIfaceDisconnectVfs(virDomainNetDefPtr *nets,
+                           size_t nnets)
+{
+#if WITH_MACVTAP
+    ifaceVfBatchPtr batch;
+
+    if (!(batch = qemuPhysIfaceVfBatch(nets, nnets)))
+        return;
+
+    ifaceVfBatchApply(batch, false);
+
+    ifaceVfBatchFree(batch);
+#else
+    (void)nets;
+    (void)nnets;
 #endif
 }
 
@@ -715,33 +805,79 @@ qemuAssignDeviceAliases(virDomainDefPtr def, virBitmapPtr qemuCaps)
 
 
 #define QEMU_PCI_ADDRESS_LAST_SLOT 31
-#define QEMU_PCI_ADDRESS_LAST_FUNCTION 8
+#define QEMU_PCI_ADDRESS_LAST_FUNCTION 7
+#define QEMU_PCI_ADDRESS_BUSES 1
+
+/* Functions in use in each slot of a bus, one bit per function */
+typedef struct _qemuDomainPCIAddressBus qemuDomainPCIAddressBus;
+struct _qemuDomainPCIAddressBus {
+    uint8_t slots[QEMU_PCI_ADDRESS_LAST_SLOT + 1];
+};
+
+#define QEMU_PCI_ADDRESS_SLOT_FULL 0xff
+
 struct _qemuDomainPCIAddressSet {
-    virHashTablePtr used;
+    qemuDomainPCIAddressBus *buses;
+    size_t nbuses;
+    /* Where the search for a free slot starts */
+    unsigned int nextbus;
     int nextslot;
 };
 
 
-static char *qemuPCIAddressAsString(virDomainDeviceInfoPtr dev)
+/* Check that @addr lies within the buses known to @addrs */
+static int qemuPCIAddressValidate(qemuDomainPCIAddressSetPtr addrs,
+                                  virDomainDevicePCIAddressPtr addr)
 {
-    char *addr;
+    if (addr->domain != 0 || addr->bus >= addrs->nbuses) {
+        if (addrs->nbuses == 1)
+            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                            _("Only PCI domain 0 and bus 0 are available"));
+        else
+            qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                            _("Only PCI domain 0 and buses 0 to %zu are "
+                              "available"), addrs->nbuses - 1);
+        return -1;
+    }
 
-    if (dev->addr.pci.domain != 0 ||
-        dev->addr.pci.bus != 0) {
-        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                        _("Only PCI domain 0 and bus 0 are available"));
-        return NULL;
+    if (addr->slot > QEMU_PCI_ADDRESS_LAST_SLOT) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("PCI slot %u is out of range, must be at most %d"),
+                        addr->slot, QEMU_PCI_ADDRESS_LAST_SLOT);
+        return -1;
     }
 
-    if (virAsprintf(&addr, "%d:%d:%d.%d",
-                    dev->addr.pci.domain,
-                    dev->addr.pci.bus,
-                    dev->addr.pci.slot,
-                    dev->addr.pci.function) < 0) {
-        virReportOOMError();
-        return NULL;
+    if (addr->function > QEMU_PCI_ADDRESS_LAST_FUNCTION) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("PCI function %u is out of range, must be at most %d"),
+                        addr->function, QEMU_PCI_ADDRESS_LAST_FUNCTION);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static uint8_t *qemuPCIAddressSlot(qemuDomainPCIAddressSetPtr addrs,
+                                   virDomainDevicePCIAddressPtr addr)
+{
+    return &addrs->buses[addr->bus].slots[addr->slot];
+}
+
+
+/* Move the search for free slots past @addr, like reserving
+ * addresses always did */
+static void qemuPCIAddressAdvance(qemuDomainPCIAddressSetPtr addrs,
+                                  virDomainDevicePCIAddressPtr addr)
+{
+    if (addr->bus != addrs->nextbus)
+        return;
+
+    if (addr->slot > addrs->nextslot) {
+        addrs->nextslot = addr->slot + 1;
+        if (QEMU_PCI_ADDRESS_LAST_SLOT < addrs->nextslot)
+            addrs->nextslot = 0;
     }
-    return addr;
 }
 
 
@@ -749,65 +885,55 @@ static int qemuCollectPCIAddress(virDomainDefPtr def ATTRIBUTE_UNUSED,
                                  virDomainDeviceInfoPtr dev,
                                  void *opaque)
 {
-    int ret = -1;
-    char *addr = NULL;
     qemuDomainPCIAddressSetPtr addrs = opaque;
+    virDomainDevicePCIAddressPtr addr = &dev->addr.pci;
+    uint8_t *slot;
 
     if (dev->type != VIR_DOMAIN_DEVICE_ADDRESS_TYPE_PCI)
         return 0;
 
-    addr = qemuPCIAddressAsString(dev);
-    if (!addr)
-        goto cleanup;
+    if (qemuPCIAddressValidate(addrs, addr) < 0)
+        return -1;
 
-    if (virHashLookup(addrs->used, addr)) {
-        if (dev->addr.pci.function != 0) {
+    slot = qemuPCIAddressSlot(addrs, addr);
+
+    if (*slot & (1 << addr->function)) {
+        if (addr->function != 0) {
             qemuReportError(VIR_ERR_XML_ERROR,
-                            _("Attempted double use of PCI Address '%s' "
+                            _("Attempted double use of PCI Address '%u:%u:%u.%u' "
                               "(may need \"multifunction='on'\" for device on function 0"),
-                            addr);
+                            addr->domain, addr->bus, addr->slot, addr->function);
         } else {
             qemuReportError(VIR_ERR_XML_ERROR,
-                            _("Attempted double use of PCI Address '%s'"), addr);
+                            _("Attempted double use of PCI Address '%u:%u:%u.%u'"),
+                            addr->domain, addr->bus, addr->slot, addr->function);
         }
-        goto cleanup;
+        return -1;
     }
 
-    VIR_DEBUG("Remembering PCI addr %s", addr);
-    if (virHashAddEntry(addrs->used, addr, addr) < 0)
-        goto cleanup;
-    addr = NULL;
+    VIR_DEBUG("Remembering PCI addr %u:%u:%u.%u",
+              addr->domain, addr->bus, addr->slot, addr->function);
+    *slot |= 1 << addr->function;
 
-    if ((dev->addr.pci.function == 0) &&
-        (dev->addr.pci.multi != VIR_DOMAIN_DEVICE_ADDRESS_PCI_MULTI_ON)) {
+    if ((addr->function == 0) &&
+        (addr->multi != VIR_DOMAIN_DEVICE_ADDRESS_PCI_MULTI_ON)) {
         /* a function 0 w/o multifunction=on must reserve the entire slot */
-        int function;
-        virDomainDeviceInfo temp_dev = *dev;
-
-        for (function = 1; function < QEMU_PCI_ADDRESS_LAST_FUNCTION; function++) {
-            temp_dev.addr.pci.function = function;
-            addr = qemuPCIAddressAsString(&temp_dev);
-            if (!addr)
-                goto cleanup;
-
-            if (virHashLookup(addrs->used, addr)) {
-                qemuReportError(VIR_ERR_XML_ERROR,
-                                _("Attempted double use of PCI Address '%s'"
-                                  "(need \"multifunction='off'\" for device on function 0)"),
-                                addr);
-                goto cleanup;
-            }
+        if (*slot != 1) {
+            int function = ffs(*slot & ~1) - 1;
 
-            VIR_DEBUG("Remembering PCI addr %s (multifunction=off for function 0)", addr);
-            if (virHashAddEntry(addrs->used, addr, addr))
-                goto cleanup;
-            addr = NULL;
+            qemuReportError(VIR_ERR_XML_ERROR,
+                            _("Attempted double use of PCI Address '%u:%u:%u.%d'"
+                              "(need \"multifunction='off'\" for device on function 0)"),
+                            addr->domain, addr->bus, addr->slot, function);
+            return -1;
         }
+
+        VIR_DEBUG("Remembering PCI slot %u:%u:%u (multifunction=off for function 0)",
+                  addr->domain, addr->bus, addr->slot);
+        *slot = QEMU_PCI_ADDRESS_SLOT_FULL;
     }
-    ret = 0;
-cleanup:
-    VIR_FREE(addr);
-    return ret;
+
+    return 0;
 }
 
 
@@ -841,13 +967,6 @@ cleanup:
 }
 
 
-static void
-qemuDomainPCIAddressSetFreeEntry(void *payload,
-                                 const void *name ATTRIBUTE_UNUSED)
-{
-    VIR_FREE(payload);
-}
-
 qemuDomainPCIAddressSetPtr qemuDomainPCIAddressSetCreate(virDomainDefPtr def)
 {
     qemuDomainPCIAddressSetPtr addrs;
@@ -855,8 +974,9 @@ qemuDomainPCIAddressSetPtr qemuDomainPCIAddressSetCreate(virDomainDefPtr def)
     if (VIR_ALLOC(addrs) < 0)
         goto no_memory;
 
-    if (!(addrs->used = virHashCreate(10, qemuDomainPCIAddressSetFreeEntry)))
-        goto error;
+    if (VIR_ALLOC_N(addrs->buses, QEMU_PCI_ADDRESS_BUSES) < 0)
+        goto no_memory;
+    addrs->nbuses = QEMU_PCI_ADDRESS_BUSES;
 
     if (virDomainDeviceInfoIterate(def, qemuCollectPCIAddress, addrs) < 0)
         goto error;
@@ -870,63 +990,28 @@ error:
     return NULL;
 }
 
-/* check whether the slot is used by the other device
- * Return 0 if the slot is not used by the other device, or -1 if the slot
- * is used by the other device.
- */
-static int qemuDomainPCIAddressCheckSlot(qemuDomainPCIAddressSetPtr addrs,
-                                         virDomainDeviceInfoPtr dev)
-{
-    char *addr;
-    virDomainDeviceInfo temp_dev;
-    int function;
-
-    temp_dev = *dev;
-    for (function = 0; function < QEMU_PCI_ADDRESS_LAST_FUNCTION; function++) {
-        temp_dev.addr.pci.function = function;
-        addr = qemuPCIAddressAsString(&temp_dev);
-        if (!addr)
-            return -1;
-
-        if (virHashLookup(addrs->used, addr)) {
-            VIR_FREE(addr);
-            return -1;
-        }
-
-        VIR_FREE(addr);
-    }
-
-    return 0;
-}
-
 int qemuDomainPCIAddressReserveAddr(qemuDomainPCIAddressSetPtr addrs,
                                     virDomainDeviceInfoPtr dev)
 {
-    char *addr;
+    virDomainDevicePCIAddressPtr addr = &dev->addr.pci;
+    uint8_t *slot;
 
-    addr = qemuPCIAddressAsString(dev);
-    if (!addr)
+    if (qemuPCIAddressValidate(addrs, addr) < 0)
         return -1;
 
-    VIR_DEBUG("Reserving PCI addr %s", addr);
+    VIR_DEBUG("Reserving PCI addr %u:%u:%u.%u",
+              addr->domain, addr->bus, addr->slot, addr->function);
 
-    if (virHashLookup(addrs->used, addr)) {
+    slot = qemuPCIAddressSlot(addrs, addr);
+    if (*slot & (1 << addr->function)) {
         qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                        _("unable to reserve PCI address %s"), addr);
-        VIR_FREE(addr);
+                        _("unable to reserve PCI address %u:%u:%u.%u"),
+                        addr->domain, addr->bus, addr->slot, addr->function);
         return -1;
     }
 
-    if (virHashAddEntry(addrs->used, addr, addr)) {
-        VIR_FREE(addr);
-        return -1;
-    }
-
-    if (dev->addr.pci.slot > addrs->nextslot) {
-        addrs->nextslot = dev->addr.pci.slot + 1;
-        if (QEMU_PCI_ADDRESS_LAST_SLOT < addrs->nextslot)
-            addrs->nextslot = 0;
-    }
+    *slot |= 1 << addr->function;
+    qemuPCIAddressAdvance(addrs, addr);
 
     return 0;
 }
@@ -936,8 +1021,7 @@ int qemuDomainPCIAddressReserveFunction(qemuDomainPCIAddressSetPtr addrs,
 {
     virDomainDeviceInfo dev;
 
-    dev.addr.pci.domain = 0;
-    dev.addr.pci.bus = 0;
+    memset(&dev, 0, sizeof(dev));
     dev.addr.pci.slot = slot;
     dev.addr.pci.function = function;
 
@@ -947,20 +1031,29 @@ int qemuDomainPCIAddressReserveFunction(qemuDomainPCIAddressSetPtr addrs,
 int qemuDomainPCIAddressReserveSlot(qemuDomainPCIAddressSetPtr addrs,
                                     int slot)
 {
-    int function;
+    virDomainDevicePCIAddress addr;
+    uint8_t *used;
 
-    for (function = 0; function <= QEMU_PCI_ADDRESS_LAST_FUNCTION; function++) {
-        if (qemuDomainPCIAddressReserveFunction(addrs, slot, function) < 0)
-            goto cleanup;
-    }
+    memset(&addr, 0, sizeof(addr));
+    addr.slot = slot;
 
-    return 0;
+    if (qemuPCIAddressValidate(addrs, &addr) < 0)
+        return -1;
 
-cleanup:
-    for (function--; function >= 0; function--) {
-        qemuDomainPCIAddressReleaseFunction(addrs, slot, function);
+    VIR_DEBUG("Reserving PCI slot %u:%u:%u", addr.domain, addr.bus, addr.slot);
+
+    used = qemuPCIAddressSlot(addrs, &addr);
+    if (*used) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("unable to reserve PCI address %u:%u:%u.%d"),
+                        addr.domain, addr.bus, addr.slot, ffs(*used) - 1);
+        return -1;
     }
-    return -1;
+
+    *used = QEMU_PCI_ADDRESS_SLOT_FULL;
+    qemuPCIAddressAdvance(addrs, &addr);
+
+    return 0;
 }
 
 int qemuDomainPCIAddressEnsureAddr(qemuDomainPCIAddressSetPtr addrs,
@@ -989,18 +1082,18 @@ int qemuDomainPCIAddressEnsureAddr(qemuDomainPCIAddressSetPtr addrs,
 int qemuDomainPCIAddressReleaseAddr(qemuDomainPCIAddressSetPtr addrs,
                                     virDomainDeviceInfoPtr dev)
 {
-    char *addr;
-    int ret;
+    virDomainDevicePCIAddressPtr addr = &dev->addr.pci;
+    uint8_t *slot;
 
-    addr = qemuPCIAddressAsString(dev);
-    if (!addr)
+    if (qemuPCIAddressValidate(addrs, addr) < 0)
         return -1;
 
-    ret = virHashRemoveEntry(addrs->used, addr);
-
-    VIR_FREE(addr);
+    slot = qemuPCIAddressSlot(addrs, addr);
+    if (!(*slot & (1 << addr->function)))
+        return -1;
 
-    return ret;
+    *slot &= ~(1 << addr->function);
+    return 0;
 }
 
 int qemuDomainPCIAddressReleaseFunction(qemuDomainPCIAddressSetPtr addrs,
@@ -1008,8 +1101,7 @@ int qemuDomainPCIAddressReleaseFunction(qemuDomainPCIAddressSetPtr addrs,
 {
     virDomainDeviceInfo dev;
 
-    dev.addr.pci.domain = 0;
-    dev.addr.pci.bus = 0;
+    memset(&dev, 0, sizeof(dev));
     dev.addr.pci.slot = slot;
     dev.addr.pci.function = function;
 
@@ -1018,32 +1110,16 @@ int qemuDomainPCIAddressReleaseFunction(qemuDomainPCIAddressSetPtr addrs,
 
 int qemuDomainPCIAddressReleaseSlot(qemuDomainPCIAddressSetPtr addrs, int slot)
 {
-    virDomainDeviceInfo dev;
-    char *addr;
-    int ret = 0;
-    unsigned int *function = &dev.addr.pci.function;
-
-    dev.addr.pci.domain = 0;
-    dev.addr.pci.bus = 0;
-    dev.addr.pci.slot = slot;
-
-    for (*function = 0; *function <= QEMU_PCI_ADDRESS_LAST_FUNCTION; (*function)++) {
-        addr = qemuPCIAddressAsString(&dev);
-        if (!addr)
-            return -1;
-
-        if (!virHashLookup(addrs->used, addr)) {
-            VIR_FREE(addr);
-            continue;
-        }
+    virDomainDevicePCIAddress addr;
 
-        VIR_FREE(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.slot = slot;
 
-        if (qemuDomainPCIAddressReleaseFunction(addrs, slot, *function) < 0)
-            ret = -1;
-    }
+    if (qemuPCIAddressValidate(addrs, &addr) < 0)
+        return -1;
 
-    return ret;
+    *qemuPCIAddressSlot(addrs, &addr) = 0;
+    return 0;
 }
 
 void qemuDomainPCIAddressSetFree(qemuDomainPCIAddressSetPtr addrs)
@@ -1051,7 +1127,7 @@ void qemuDomainPCIAddressSetFree(qemuDomainPCIAddressSetPtr addrs)
     if (!addrs)
         return;
 
-    virHashFree(addrs->used);
+    VIR_FREE(addrs->buses);
     VIR_FREE(addrs);
 }
 
@@ -1059,43 +1135,41 @@ void qemuDomainPCIAddressSetFree(qemuDomainPCIAddressSetPtr addrs)
 int qemuDomainPCIAddressSetNextAddr(qemuDomainPCIAddressSetPtr addrs,
                                     virDomainDeviceInfoPtr dev)
 {
-    int i;
-    int iteration;
-
-    for (i = addrs->nextslot, iteration = 0;
-         iteration <= QEMU_PCI_ADDRESS_LAST_SLOT; i++, iteration++) {
-        virDomainDeviceInfo maybe;
-        char *addr;
-
-        if (QEMU_PCI_ADDRESS_LAST_SLOT < i)
-            i = 0;
-        memset(&maybe, 0, sizeof(maybe));
-        maybe.addr.pci.domain = 0;
-        maybe.addr.pci.bus = 0;
-        maybe.addr.pci.slot = i;
-        maybe.addr.pci.function = 0;
-
-        if (!(addr = qemuPCIAddressAsString(&maybe)))
-            return -1;
-
-        if (qemuDomainPCIAddressCheckSlot(addrs, &maybe) < 0) {
-            VIR_DEBUG("PCI addr %s already in use", addr);
-            VIR_FREE(addr);
+    unsigned int bus = addrs->nextbus;
+    int slot = addrs->nextslot;
+    size_t iteration;
+
+    /* Every slot of every bus is looked at once, starting after the
+     * last one handed out */
+    for (iteration = 0;
+         iteration < addrs->nbuses * (QEMU_PCI_ADDRESS_LAST_SLOT + 1);
+         iteration++, slot++) {
+        if (QEMU_PCI_ADDRESS_LAST_SLOT < slot) {
+            slot = 0;
+            if (++bus >= addrs->nbuses)
+                bus = 0;
+        }
+
+        if (addrs->buses[bus].slots[slot]) {
+            VIR_DEBUG("PCI addr 0:%u:%d.0 already in use", bus, slot);
             continue;
         }
 
-        VIR_DEBUG("Allocating PCI addr %s", addr);
-        VIR_FREE(addr);
-
-        if (qemuDomainPCIAddressReserveSlot(addrs, i) < 0)
-            return -1;
+        VIR_DEBUG("Allocating PCI addr 0:%u:%d.0", bus, slot);
+        addrs->buses[bus].slots[slot] = QEMU_PCI_ADDRESS_SLOT_FULL;
 
         dev->type = VIR_DOMAIN_DEVICE_ADDRESS_TYPE_PCI;
-        dev->addr.pci = maybe.addr.pci;
+        memset(&dev->addr.pci, 0, sizeof(dev->addr.pci));
+        dev->addr.pci.bus = bus;
+        dev->addr.pci.slot = slot;
 
-        addrs->nextslot = i + 1;
-        if (QEMU_PCI_ADDRESS_LAST_SLOT < addrs->nextslot)
+        addrs->nextbus = bus;
+        addrs->nextslot = slot + 1;
+        if (QEMU_PCI_ADDRESS_LAST_SLOT < addrs->nextslot) {
             addrs->nextslot = 0;
+            if (++addrs->nextbus >= addrs->nbuses)
+                addrs->nextbus = 0;
+        }
 
         return 0;
     }
@@ -3905,6 +3979,20 @@ qemuBuildCommandLine(virConnectPtr conn,
             }
         }
 
+        /* If appropriate, grab a physical device from the configured
+         * network's pool of devices, or resolve bridge device name
+         * to the one defined in the network definition. This is done
+         * for all interfaces first so that the virtual functions they
+         * use can be set up together.
+         */
+        for (i = 0 ; i < def->nnets ; i++) {
+            if (networkAllocateActualDevice(def->nets[i]) < 0)
+               goto error;
+        }
+
+        if (qemuPhysIfaceConnectVfs(def->nets, def->nnets) < 0)
+            goto error;
+
         for (i = 0 ; i < def->nnets ; i++) {
             virDomainNetDefPtr net = def->nets[i];
             char *nic, *host;
@@ -3926,13 +4014,6 @@ qemuBuildCommandLine(virConnectPtr conn,
             else
                 vlan = i;
 
-            /* If appropriate, grab a physical device from the configured
-             * network's pool of devices, or resolve bridge device name
-             * to the one defined in the network definition.
-             */
-            if (networkAllocateActualDevice(net) < 0)
-               goto error;
-
             actualType = virDomainNetGetActualType(net);
             if (actualType == VIR_DOMAIN_NET_TYPE_NETWORK ||
                 actualType == VIR_DOMAIN_NET_TYPE_BRIDGE) {
@@ -132,6 +132,12 @@ int qemuPhysIfaceConnect(virDomainDefPtr def,
                          virBitmapPtr qemuCaps,
                          enum virVMOperationType vmop);
 
+int qemuPhysIfaceConnectVfs(virDomainNetDefPtr *nets,
+                            size_t nnets);
+
+void qemuPhysIfaceDisconnectVfs(virDomainNetDefPtr *nets,
+                                size_t nnets);
+
 void qemuPhysIfaceDisconnect(struct qemud_driver *driver,
                              virDomainNetDefPtr net);
 
@@ -59,6 +59,13 @@
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
+VIR_ENUM_IMPL(qemuMigrationConvergeAction, QEMU_MIGRATION_CONVERGE_LAST,
+              "none",
+              "downtime",
+              "bandwidth",
+              "pause",
+              "abort");
+
 void qemuDriverLock(struct qemud_driver *driver)
 {
     virMutexLock(&driver->lock);
@@ -81,6 +88,14 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     driver->dynamicOwnership = 1;
     driver->clearEmulatorCapabilities = 1;
 
+    driver->hotplugTimeout = 10000;
+    driver->hotplugSettleTime = 1000;
+
+    driver->migrationConverge.maxDowntime = 2000;
+    driver->migrationConverge.stallTimeout = 30000;
+
+    driver->snapshotCacheSize = 64;
+
     if (!(driver->vncListen = strdup("127.0.0.1"))) {
         virReportOOMError();
         return -1;
@@ -462,6 +477,54 @@ int qemudLoadDriverConfig(struct qemud_driver *driver,
     CHECK_TYPE("max_queued", VIR_CONF_LONG);
     if (p) driver->max_queued = p->l;
 
+    p = virConfGetValue(conf, "hotplug_timeout");
+    CHECK_TYPE("hotplug_timeout", VIR_CONF_LONG);
+    if (p) driver->hotplugTimeout = p->l;
+
+    p = virConfGetValue(conf, "hotplug_settle_time");
+    CHECK_TYPE("hotplug_settle_time", VIR_CONF_LONG);
+    if (p) driver->hotplugSettleTime = p->l;
+
+    p = virConfGetValue(conf, "migration_auto_converge");
+    CHECK_TYPE("migration_auto_converge", VIR_CONF_LONG);
+    if (p) driver->migrationConverge.enabled = p->l;
+
+    p = virConfGetValue(conf, "migration_max_downtime");
+    CHECK_TYPE("migration_max_downtime", VIR_CONF_LONG);
+    if (p) driver->migrationConverge.maxDowntime = p->l;
+
+    p = virConfGetValue(conf, "migration_max_bandwidth");
+    CHECK_TYPE("migration_max_bandwidth", VIR_CONF_LONG);
+    if (p) driver->migrationConverge.maxBandwidth = p->l;
+
+    p = virConfGetValue(conf, "migration_stall_timeout");
+    CHECK_TYPE("migration_stall_timeout", VIR_CONF_LONG);
+    if (p) driver->migrationConverge.stallTimeout = p->l;
+
+    p = virConfGetValue(conf, "migration_stall_action");
+    CHECK_TYPE("migration_stall_action", VIR_CONF_STRING);
+    if (p && p->str) {
+        int action = qemuMigrationConvergeActionTypeFromString(p->str);
+
+        if (action != QEMU_MIGRATION_CONVERGE_NONE &&
+            action != QEMU_MIGRATION_CONVERGE_PAUSE &&
+            action != QEMU_MIGRATION_CONVERGE_ABORT) {
+            qemuReportError(VIR_ERR_CONF_SYNTAX,
+                            _("unknown migration_stall_action '%s'"), p->str);
+            virConfFree(conf);
+            return -1;
+        }
+        driver->migrationConverge.stallAction = action;
+    }
+
+    p = virConfGetValue(conf, "block_stats_max_age");
+    CHECK_TYPE("block_stats_max_age", VIR_CONF_LONG);
+    if (p) driver->blockStatsMaxAge = p->l;
+
+    p = virConfGetValue(conf, "snapshot_cache_size");
+    CHECK_TYPE("snapshot_cache_size", VIR_CONF_LONG);
+    if (p) driver->snapshotCacheSize = p->l;
+
     virConfFree (conf);
     return 0;
 }
@@ -49,6 +49,28 @@
 
 
 /* Main driver state */
+/* Adjustments done to an outgoing migration which does not converge */
+enum qemuMigrationConvergeAction {
+    QEMU_MIGRATION_CONVERGE_NONE = 0,
+    QEMU_MIGRATION_CONVERGE_DOWNTIME,   /* Allow longer downtime */
+    QEMU_MIGRATION_CONVERGE_BANDWIDTH,  /* Allow higher bandwidth */
+    QEMU_MIGRATION_CONVERGE_PAUSE,      /* Pause the guest */
+    QEMU_MIGRATION_CONVERGE_ABORT,      /* Give up on the migration */
+
+    QEMU_MIGRATION_CONVERGE_LAST
+};
+VIR_ENUM_DECL(qemuMigrationConvergeAction)
+
+typedef struct _qemuMigrationConvergePolicy qemuMigrationConvergePolicy;
+typedef qemuMigrationConvergePolicy *qemuMigrationConvergePolicyPtr;
+struct _qemuMigrationConvergePolicy {
+    bool enabled;
+    unsigned long long maxDowntime;     /* In milliseconds */
+    unsigned long maxBandwidth;         /* In MiB/s, 0 keeps job's limit */
+    unsigned int stallTimeout;          /* In milliseconds */
+    int stallAction;                    /* enum qemuMigrationConvergeAction */
+};
+
 struct qemud_driver {
     virMutex lock;
 
@@ -111,6 +133,17 @@ struct qemud_driver {
 
     int max_queued;
 
+    /* In milliseconds */
+    unsigned int hotplugTimeout;
+    unsigned int hotplugSettleTime;
+
+    qemuMigrationConvergePolicy migrationConverge;
+
+    unsigned int blockStatsMaxAge;
+
+    /* Full snapshot definitions kept per domain, 0 for all */
+    unsigned int snapshotCacheSize;
+
     virCapsPtr caps;
 
     virDomainEventStatePtr domainEventState;
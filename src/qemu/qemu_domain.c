@@ -37,7 +37,9 @@
 #include "virfile.h"
 
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 
 #include <libxml/xpathInternals.h>
 
@@ -154,7 +156,7 @@ qemuDomainObjInitJob(qemuDomainObjPrivatePtr priv)
     if (virCondInit(&priv->job.cond) < 0)
         return -1;
 
-    if (virCondInit(&priv->job.asyncCond) < 0) {
+    if (virCondInit(&priv->job.progressCond) < 0) {
         ignore_value(virCondDestroy(&priv->job.cond));
         return -1;
     }
@@ -168,6 +170,7 @@ qemuDomainObjResetJob(qemuDomainObjPrivatePtr priv)
     struct qemuDomainJobObj *job = &priv->job;
 
     job->active = QEMU_JOB_NONE;
+    job->owner = 0;
 }
 
 static void
@@ -180,6 +183,11 @@ qemuDomainObjResetAsyncJob(qemuDomainObjPrivatePtr priv)
     job->mask = DEFAULT_JOB_MASK;
     job->start = 0;
     memset(&job->info, 0, sizeof(job->info));
+    memset(&job->progress, 0, sizeof(job->progress));
+    memset(&job->converge, 0, sizeof(job->converge));
+    job->hotplugs = 0;
+    job->hotplugTime = 0;
+    job->hotplugMax = 0;
 }
 
 void
@@ -201,7 +209,8 @@ static void
 qemuDomainObjFreeJob(qemuDomainObjPrivatePtr priv)
 {
     ignore_value(virCondDestroy(&priv->job.cond));
-    ignore_value(virCondDestroy(&priv->job.asyncCond));
+    ignore_value(virCondDestroy(&priv->job.progressCond));
+    VIR_FREE(priv->job.queries);
 }
 
 
@@ -232,6 +241,7 @@ static void qemuDomainObjPrivateFree(void *data)
     VIR_FREE(priv->vcpupids);
     VIR_FREE(priv->lockState);
     VIR_FREE(priv->origname);
+    virHashFree(priv->blockStats);
 
     /* This should never be non-NULL if we get here, but just in case... */
     if (priv->mon) {
@@ -246,6 +256,8 @@ static int qemuDomainObjPrivateXMLFormat(virBufferPtr buf, void *data)
 {
     qemuDomainObjPrivatePtr priv = data;
     const char *monitorpath;
+    int job;
+    bool waited = false;
 
     /* priv->monitor_chr is set only for qemu */
     if (priv->monConfig) {
@@ -303,12 +315,96 @@ static int qemuDomainObjPrivateXMLFormat(virBufferPtr buf, void *data)
         virBufferAddLit(buf, "/>\n");
     }
 
+    for (job = 0; job < QEMU_JOB_LAST; job++) {
+        qemuDomainJobWaitStats *waits = &priv->job.waits[job];
+
+        if (!waits->count)
+            continue;
+        if (!waited) {
+            virBufferAddLit(buf, "  <jobwaits>\n");
+            waited = true;
+        }
+        virBufferAsprintf(buf, "    <wait job='%s' count='%llu' "
+                          "total='%llu' max='%llu'/>\n",
+                          qemuDomainJobTypeToString(job),
+                          waits->count, waits->total, waits->max);
+    }
+    for (job = 0; job < QEMU_ASYNC_JOB_LAST; job++) {
+        qemuDomainJobWaitStats *waits = &priv->job.asyncWaits[job];
+
+        if (!waits->count)
+            continue;
+        if (!waited) {
+            virBufferAddLit(buf, "  <jobwaits>\n");
+            waited = true;
+        }
+        virBufferAsprintf(buf, "    <wait async='%s' count='%llu' "
+                          "total='%llu' max='%llu'/>\n",
+                          qemuDomainAsyncJobTypeToString(job),
+                          waits->count, waits->total, waits->max);
+    }
+    if (waited)
+        virBufferAddLit(buf, "  </jobwaits>\n");
+
     if (priv->fakeReboot)
         virBufferAsprintf(buf, "  <fakereboot/>\n");
 
     return 0;
 }
 
+static int
+qemuDomainJobWaitStatsParse(xmlNodePtr node,
+                            qemuDomainObjPrivatePtr priv)
+{
+    qemuDomainJobWaitStats *waits;
+    char *job = NULL;
+    char *count = NULL;
+    char *total = NULL;
+    char *max = NULL;
+    int type;
+    int ret = -1;
+
+    if ((job = virXMLPropString(node, "job"))) {
+        if ((type = qemuDomainJobTypeFromString(job)) < 0) {
+            qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                            _("Unknown job type %s"), job);
+            goto cleanup;
+        }
+        waits = &priv->job.waits[type];
+    } else if ((job = virXMLPropString(node, "async"))) {
+        if ((type = qemuDomainAsyncJobTypeFromString(job)) < 0) {
+            qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                            _("Unknown async job type %s"), job);
+            goto cleanup;
+        }
+        waits = &priv->job.asyncWaits[type];
+    } else {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        "%s", _("missing job type of job wait"));
+        goto cleanup;
+    }
+
+    count = virXMLPropString(node, "count");
+    total = virXMLPropString(node, "total");
+    max = virXMLPropString(node, "max");
+    if (!count || virStrToLong_ull(count, NULL, 10, &waits->count) < 0 ||
+        !total || virStrToLong_ull(total, NULL, 10, &waits->total) < 0 ||
+        !max || virStrToLong_ull(max, NULL, 10, &waits->max) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("invalid wait statistics of job %s"), job);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(job);
+    VIR_FREE(count);
+    VIR_FREE(total);
+    VIR_FREE(max);
+    return ret;
+}
+
 static int qemuDomainObjPrivateXMLParse(xmlXPathContextPtr ctxt, void *data)
 {
     qemuDomainObjPrivatePtr priv = data;
@@ -449,6 +545,14 @@ static int qemuDomainObjPrivateXMLParse(xmlXPathContextPtr ctxt, void *data)
         }
     }
 
+    if ((n = virXPathNodeSet("./jobwaits/wait", ctxt, &nodes)) < 0)
+        goto error;
+    for (i = 0 ; i < n ; i++) {
+        if (qemuDomainJobWaitStatsParse(nodes[i], priv) < 0)
+            goto error;
+    }
+    VIR_FREE(nodes);
+
     priv->fakeReboot = virXPathBoolean("boolean(./fakereboot)", ctxt) == 1;
 
     return 0;
@@ -683,6 +787,7 @@ qemuDomainObjSetAsyncJobMask(virDomainObjPtr obj,
         return;
 
     priv->job.mask = allowedJobs | JOB_MASK(QEMU_JOB_DESTROY);
+    virCondBroadcast(&priv->job.cond);
 }
 
 void
@@ -694,6 +799,22 @@ qemuDomainObjDiscardAsyncJob(struct qemud_driver *driver, virDomainObjPtr obj)
         qemuDomainObjResetJob(priv);
     qemuDomainObjResetAsyncJob(priv);
     qemuDomainObjSaveJob(driver, obj);
+    virCondBroadcast(&priv->job.cond);
+}
+
+/*
+ * obj must be locked before calling
+ *
+ * Wakes up a thread waiting for the async job to make progress, e.g. when
+ * something happened which may have finished or aborted the job.
+ */
+void
+qemuDomainObjSignalJobProgress(virDomainObjPtr obj)
+{
+    qemuDomainObjPrivatePtr priv = obj->privateData;
+
+    if (priv->job.asyncJob != QEMU_ASYNC_JOB_NONE)
+        virCondBroadcast(&priv->job.progressCond);
 }
 
 static bool
@@ -702,10 +823,98 @@ qemuDomainNestedJobAllowed(qemuDomainObjPrivatePtr priv, enum qemuDomainJob job)
     return !priv->job.asyncJob || (priv->job.mask & JOB_MASK(job)) != 0;
 }
 
+/* Query jobs only read state, so they may run together and alongside the
+ * steps of an async job, which may change state only while the domain
+ * object is locked.  They share the monitor, where qemuMonitorSend()
+ * makes each command wait until the one in flight got its reply.
+ */
+static bool
+qemuDomainJobsCompatible(enum qemuDomainJob a, enum qemuDomainJob b)
+{
+    if (a == QEMU_JOB_QUERY)
+        return b == QEMU_JOB_QUERY || b == QEMU_JOB_ASYNC_NESTED;
+    if (b == QEMU_JOB_QUERY)
+        return a == QEMU_JOB_ASYNC_NESTED;
+    return false;
+}
+
+/* Can @job run alongside the jobs running right now? */
+static bool
+qemuDomainJobCompatible(qemuDomainObjPrivatePtr priv, enum qemuDomainJob job)
+{
+    if (priv->job.active &&
+        !qemuDomainJobsCompatible(priv->job.active, job))
+        return false;
+    if (priv->job.nqueries &&
+        !qemuDomainJobsCompatible(QEMU_JOB_QUERY, job))
+        return false;
+    return true;
+}
+
 bool
 qemuDomainJobAllowed(qemuDomainObjPrivatePtr priv, enum qemuDomainJob job)
 {
-    return !priv->job.active && qemuDomainNestedJobAllowed(priv, job);
+    return qemuDomainJobCompatible(priv, job) &&
+        qemuDomainNestedJobAllowed(priv, job);
+}
+
+static int
+qemuDomainJobPriority(enum qemuDomainJob job)
+{
+    switch (job) {
+    case QEMU_JOB_DESTROY:
+    case QEMU_JOB_ABORT:
+        return QEMU_JOB_PRIORITY_URGENT;
+    case QEMU_JOB_MIGRATION_OP:
+    case QEMU_JOB_ASYNC_NESTED:
+        return QEMU_JOB_PRIORITY_ASYNC;
+    default:
+        return QEMU_JOB_PRIORITY_NORMAL;
+    }
+}
+
+/* Is @self held back by a waiter that goes first and cannot run
+ * together with it? Waiters the current async job keeps out do not
+ * count, or they would block the jobs it allows.
+ */
+static bool
+qemuDomainJobWaiterBlocked(qemuDomainObjPrivatePtr priv,
+                           qemuDomainJobWaiterPtr self)
+{
+    qemuDomainJobWaiterPtr w;
+
+    for (w = priv->job.waiters; w; w = w->next) {
+        if (w == self ||
+            w->priority < self->priority ||
+            (w->priority == self->priority && w->ticket > self->ticket))
+            continue;
+
+        if (w->job != QEMU_JOB_ASYNC_NESTED &&
+            !qemuDomainNestedJobAllowed(priv, w->job))
+            continue;
+
+        if (!qemuDomainJobsCompatible(w->job, self->job))
+            return true;
+    }
+
+    return false;
+}
+
+static void
+qemuDomainJobWaiterRemove(qemuDomainObjPrivatePtr priv,
+                          qemuDomainJobWaiterPtr self)
+{
+    qemuDomainJobWaiterPtr *w;
+
+    for (w = &priv->job.waiters; *w; w = &(*w)->next) {
+        if (*w == self) {
+            *w = self->next;
+            break;
+        }
+    }
+
+    /* Waiters queued behind us may be able to start now */
+    virCondBroadcast(&priv->job.cond);
 }
 
 /* Give up waiting for mutex after 30 seconds */
@@ -725,7 +934,11 @@ qemuDomainObjBeginJobInternal(struct qemud_driver *driver,
     qemuDomainObjPrivatePtr priv = obj->privateData;
     unsigned long long now;
     unsigned long long then;
+    unsigned long long started;
     bool nested = job == QEMU_JOB_ASYNC_NESTED;
+    qemuDomainJobWaiter waiter;
+    qemuDomainJobWaiterPtr *tail;
+    qemuDomainJobWaitStats *waits;
 
     priv->jobs_queued++;
 
@@ -737,37 +950,62 @@ qemuDomainObjBeginJobInternal(struct qemud_driver *driver,
     if (driver_locked)
         qemuDriverUnlock(driver);
 
-retry:
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.job = job;
+    waiter.priority = qemuDomainJobPriority(job);
+    waiter.ticket = priv->job.tickets++;
+    for (tail = &priv->job.waiters; *tail; tail = &(*tail)->next)
+        ;
+    *tail = &waiter;
+
     if (driver->max_queued &&
         priv->jobs_queued > driver->max_queued) {
         goto error;
     }
 
-    while (!nested && !qemuDomainNestedJobAllowed(priv, job)) {
-        if (virCondWaitUntil(&priv->job.asyncCond, &obj->lock, then) < 0)
-            goto error;
-    }
-
-    while (priv->job.active) {
+    while ((!nested && !qemuDomainNestedJobAllowed(priv, job)) ||
+           !qemuDomainJobCompatible(priv, job) ||
+           qemuDomainJobWaiterBlocked(priv, &waiter)) {
         if (virCondWaitUntil(&priv->job.cond, &obj->lock, then) < 0)
             goto error;
     }
 
-    /* No job is active but a new async job could have been started while obj
-     * was unlocked, so we need to recheck it. */
-    if (!nested && !qemuDomainNestedJobAllowed(priv, job))
-        goto retry;
+    if (job == QEMU_JOB_QUERY &&
+        VIR_EXPAND_N(priv->job.queries, priv->job.nqueries, 1) < 0) {
+        virReportOOMError();
+        errno = ENOMEM;
+        goto error;
+    }
 
-    qemuDomainObjResetJob(priv);
+    qemuDomainJobWaiterRemove(priv, &waiter);
 
-    if (job != QEMU_JOB_ASYNC) {
+    if (job == QEMU_JOB_QUERY) {
+        priv->job.queries[priv->job.nqueries - 1] = virThreadSelfID();
+    } else if (job != QEMU_JOB_ASYNC) {
+        qemuDomainObjResetJob(priv);
         priv->job.active = job;
+        priv->job.owner = virThreadSelfID();
     } else {
         qemuDomainObjResetAsyncJob(priv);
         priv->job.asyncJob = asyncJob;
         priv->job.start = now;
     }
 
+    if (virTimeMs(&started) == 0) {
+        if (job == QEMU_JOB_ASYNC)
+            waits = &priv->job.asyncWaits[asyncJob];
+        else
+            waits = &priv->job.waits[job];
+        waits->count++;
+        waits->total += started - now;
+        if (started - now > waits->max)
+            waits->max = started - now;
+        VIR_DEBUG("Job %s waited %llums",
+                  job == QEMU_JOB_ASYNC ?
+                  qemuDomainAsyncJobTypeToString(asyncJob) :
+                  qemuDomainJobTypeToString(job), started - now);
+    }
+
     if (driver_locked) {
         virDomainObjUnlock(obj);
         qemuDriverLock(driver);
@@ -779,6 +1017,7 @@ retry:
     return 0;
 
 error:
+    qemuDomainJobWaiterRemove(priv, &waiter);
     if (errno == ETIMEDOUT)
         qemuReportError(VIR_ERR_OPERATION_TIMEOUT,
                         "%s", _("cannot acquire state change lock"));
@@ -787,7 +1026,7 @@ error:
         qemuReportError(VIR_ERR_OPERATION_FAILED,
                         "%s", _("cannot acquire state change lock "
                                 "due to max_queued limit"));
-    else
+    else if (errno != ENOMEM)
         virReportSystemError(errno,
                              "%s", _("cannot acquire job mutex"));
     priv->jobs_queued--;
@@ -870,12 +1109,26 @@ int qemuDomainObjBeginAsyncJobWithDriver(struct qemud_driver *driver,
 int qemuDomainObjEndJob(struct qemud_driver *driver, virDomainObjPtr obj)
 {
     qemuDomainObjPrivatePtr priv = obj->privateData;
+    int self = virThreadSelfID();
+    size_t i;
 
     priv->jobs_queued--;
 
-    qemuDomainObjResetJob(priv);
-    qemuDomainObjSaveJob(driver, obj);
-    virCondSignal(&priv->job.cond);
+    for (i = 0; i < priv->job.nqueries; i++) {
+        if (priv->job.queries[i] == self)
+            break;
+    }
+
+    if (i < priv->job.nqueries) {
+        if (i != priv->job.nqueries - 1)
+            memmove(&priv->job.queries[i], &priv->job.queries[i + 1],
+                    sizeof(*priv->job.queries) * (priv->job.nqueries - i - 1));
+        VIR_SHRINK_N(priv->job.queries, priv->job.nqueries, 1);
+    } else {
+        qemuDomainObjResetJob(priv);
+        qemuDomainObjSaveJob(driver, obj);
+    }
+    virCondBroadcast(&priv->job.cond);
 
     return virDomainObjUnref(obj);
 }
@@ -887,9 +1140,16 @@ qemuDomainObjEndAsyncJob(struct qemud_driver *driver, virDomainObjPtr obj)
 
     priv->jobs_queued--;
 
+    if (priv->job.hotplugs)
+        VIR_DEBUG("Async job %s hotplugged %u PCI devices in %llums, "
+                  "slowest %llums",
+                  qemuDomainAsyncJobTypeToString(priv->job.asyncJob),
+                  priv->job.hotplugs, priv->job.hotplugTime,
+                  priv->job.hotplugMax);
+
     qemuDomainObjResetAsyncJob(priv);
     qemuDomainObjSaveJob(driver, obj);
-    virCondBroadcast(&priv->job.asyncCond);
+    virCondBroadcast(&priv->job.cond);
 
     return virDomainObjUnref(obj);
 }
@@ -953,10 +1213,12 @@ qemuDomainObjExitMonitorInternal(struct qemud_driver *driver,
         priv->mon = NULL;
     }
 
-    if (priv->job.active == QEMU_JOB_ASYNC_NESTED) {
+    /* Query jobs may be using the monitor alongside a nested job */
+    if (priv->job.active == QEMU_JOB_ASYNC_NESTED &&
+        priv->job.owner == virThreadSelfID()) {
         qemuDomainObjResetJob(priv);
         qemuDomainObjSaveJob(driver, obj);
-        virCondSignal(&priv->job.cond);
+        virCondBroadcast(&priv->job.cond);
 
         /* safe to ignore since the surrounding async job increased
          * the reference counter as well */
@@ -1027,6 +1289,23 @@ qemuDomainObjEnterMonitorAsync(struct qemud_driver *driver,
     return qemuDomainObjEnterMonitorInternal(driver, true, obj, asyncJob);
 }
 
+/*
+ * obj must be locked before calling, qemud_driver must be unlocked
+ *
+ * Same as qemuDomainObjEnterMonitorAsync() for callers that run an
+ * async job without holding the driver lock.
+ *
+ * Returns 0 if job was started, in which case this must be followed with
+ * qemuDomainObjExitMonitor(); or -1 if the job could not be started.
+ */
+int
+qemuDomainObjEnterMonitorAsyncNoDriver(struct qemud_driver *driver,
+                                       virDomainObjPtr obj,
+                                       enum qemuDomainAsyncJob asyncJob)
+{
+    return qemuDomainObjEnterMonitorInternal(driver, false, obj, asyncJob);
+}
+
 /* obj must NOT be locked before calling, qemud_driver must be unlocked,
  * and will be locked after returning
  *
@@ -1325,10 +1604,471 @@ qemuFindQemuImgBinary(struct qemud_driver *driver)
     return driver->qemuImgBinary;
 }
 
+/* Drops the index of snapshots of @vm, whether or not it is known to
+ * exist */
+static void
+qemuDomainSnapshotRemoveIndex(struct qemud_driver *driver,
+                              virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    char *path = NULL;
+
+    priv->snapshotIndexValid = false;
+
+    if (virAsprintf(&path, "%s/%s/%s", driver->snapshotDir, vm->def->name,
+                    QEMU_SNAPSHOT_INDEX) < 0) {
+        virReportOOMError();
+        return;
+    }
+
+    if (unlink(path) < 0 && errno != ENOENT)
+        VIR_WARN("Failed to remove snapshot index %s", path);
+    VIR_FREE(path);
+}
+
+/* To be called before any snapshot metadata file of @vm is changed.
+ * Should we not get to write a new index, the next start parses all
+ * metadata files instead of trusting an outdated one.  */
+static void
+qemuDomainSnapshotInvalidateIndex(struct qemud_driver *driver,
+                                  virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+
+    if (priv->snapshotIndexValid)
+        qemuDomainSnapshotRemoveIndex(driver, vm);
+}
+
+static void
+qemuDomainSnapshotFormatIndexEntry(void *payload,
+                                   const void *name ATTRIBUTE_UNUSED,
+                                   void *data)
+{
+    virDomainSnapshotObjPtr snap = payload;
+    virBufferPtr buf = data;
+
+    virBufferEscapeString(buf, "  <snapshot name='%s'", snap->def->name);
+    if (snap->def->parent)
+        virBufferEscapeString(buf, " parent='%s'", snap->def->parent);
+    virBufferAsprintf(buf, " state='%s' creationTime='%lld'",
+                      virDomainSnapshotStateTypeToString(snap->def->state),
+                      snap->def->creationTime);
+    if (snap->def->current)
+        virBufferAddLit(buf, " current='yes'");
+    virBufferAddLit(buf, "/>\n");
+}
+
+/*
+ * Writes the index of snapshots of @vm, holding what is needed to
+ * list them and walk their tree, unless the one on disk is up to date
+ * already.  The metadata files themselves are only parsed once a
+ * snapshot is looked at in detail.
+ */
 int
-qemuDomainSnapshotWriteMetadata(virDomainObjPtr vm,
-                                virDomainSnapshotObjPtr snapshot,
-                                char *snapshotDir)
+qemuDomainSnapshotWriteIndex(struct qemud_driver *driver,
+                             virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *path = NULL;
+    char *tmp = NULL;
+    char *xml = NULL;
+    int fd = -1;
+    int ret = -1;
+
+    if (priv->snapshotIndexValid)
+        return 0;
+
+    if (virDomainSnapshotObjListNum(&vm->snapshots, 0) == 0) {
+        qemuDomainSnapshotRemoveIndex(driver, vm);
+        return 0;
+    }
+
+    virBufferAddLit(&buf, "<snapshots>\n");
+    virHashForEach(vm->snapshots.objs, qemuDomainSnapshotFormatIndexEntry,
+                   &buf);
+    virBufferAddLit(&buf, "</snapshots>\n");
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        goto cleanup;
+    }
+    xml = virBufferContentAndReset(&buf);
+
+    if (virAsprintf(&path, "%s/%s/%s", driver->snapshotDir, vm->def->name,
+                    QEMU_SNAPSHOT_INDEX) < 0 ||
+        virAsprintf(&tmp, "%s.new", path) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    /* Replace the index at once, it is trusted whenever it exists */
+    fd = open(tmp, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR);
+    if (fd < 0) {
+        virReportSystemError(errno, _("failed to create snapshot index '%s'"),
+                             tmp);
+        goto cleanup;
+    }
+    if (safewrite(fd, xml, strlen(xml)) != strlen(xml)) {
+        virReportSystemError(errno, _("failed to write snapshot index '%s'"),
+                             tmp);
+        goto cleanup;
+    }
+    if (VIR_CLOSE(fd) < 0) {
+        virReportSystemError(errno, _("failed to write snapshot index '%s'"),
+                             tmp);
+        goto cleanup;
+    }
+    if (rename(tmp, path) < 0) {
+        virReportSystemError(errno, _("failed to replace snapshot index '%s'"),
+                             path);
+        goto cleanup;
+    }
+
+    priv->snapshotIndexValid = true;
+    ret = 0;
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    if (ret < 0 && tmp)
+        unlink(tmp);
+    VIR_FREE(xml);
+    VIR_FREE(tmp);
+    VIR_FREE(path);
+    return ret;
+}
+
+static virDomainSnapshotDefPtr
+qemuDomainSnapshotParseIndexEntry(xmlNodePtr node)
+{
+    virDomainSnapshotDefPtr def = NULL;
+    char *state = NULL;
+    char *creationTime = NULL;
+    char *current = NULL;
+
+    if (VIR_ALLOC(def) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    def->name = virXMLPropString(node, "name");
+    def->parent = virXMLPropString(node, "parent");
+    state = virXMLPropString(node, "state");
+    creationTime = virXMLPropString(node, "creationTime");
+    current = virXMLPropString(node, "current");
+
+    if (!def->name || !state || !creationTime ||
+        (def->state = virDomainSnapshotStateTypeFromString(state)) < 0 ||
+        virStrToLong_ll(creationTime, NULL, 10, &def->creationTime) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("malformed snapshot index entry"));
+        virDomainSnapshotDefFree(def);
+        def = NULL;
+        goto cleanup;
+    }
+    def->current = current && STREQ(current, "yes");
+
+cleanup:
+    VIR_FREE(state);
+    VIR_FREE(creationTime);
+    VIR_FREE(current);
+    return def;
+}
+
+static int
+qemuDomainSnapshotMatchAny(const void *payload ATTRIBUTE_UNUSED,
+                           const void *name ATTRIBUTE_UNUSED,
+                           const void *data ATTRIBUTE_UNUSED)
+{
+    return 1;
+}
+
+/*
+ * Fills the snapshot list of @vm from its index, leaving all
+ * definitions partial.  The index is only used if it names exactly
+ * the metadata files present and none of them changed after it was
+ * written.
+ *
+ * Returns 0 on success, -1 if the index is missing or unusable, in
+ * which case the list is left empty and all metadata files must be
+ * parsed.  An unusable index is removed, so that it is not looked at
+ * again before a new one is written.
+ */
+int
+qemuDomainSnapshotLoadIndex(struct qemud_driver *driver,
+                            virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    char *snapDir = NULL;
+    char *path = NULL;
+    char *name = NULL;
+    xmlDocPtr xml = NULL;
+    xmlXPathContextPtr ctxt = NULL;
+    xmlNodePtr *nodes = NULL;
+    virDomainSnapshotDefPtr def = NULL;
+    virDomainSnapshotObjPtr snap;
+    DIR *dir = NULL;
+    struct dirent *entry;
+    struct stat sb;
+    time_t indexTime;
+    int nfiles = 0;
+    int n = 0;
+    int i;
+    int ret = -1;
+
+    if (virAsprintf(&snapDir, "%s/%s", driver->snapshotDir,
+                    vm->def->name) < 0 ||
+        virAsprintf(&path, "%s/%s", snapDir, QEMU_SNAPSHOT_INDEX) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (stat(path, &sb) < 0)
+        goto cleanup;
+    indexTime = sb.st_mtime;
+
+    if (!(xml = virXMLParseFileCtxt(path, &ctxt)) ||
+        (n = virXPathNodeSet("./snapshot", ctxt, &nodes)) < 0)
+        goto cleanup;
+
+    for (i = 0; i < n; i++) {
+        if (!(def = qemuDomainSnapshotParseIndexEntry(nodes[i])) ||
+            !(snap = virDomainSnapshotAssignDef(&vm->snapshots, def)))
+            goto cleanup;
+        def = NULL;
+        snap->partial = true;
+
+        if (snap->def->current) {
+            if (vm->current_snapshot) {
+                VIR_WARN("Snapshot index %s has several current snapshots",
+                         path);
+                goto cleanup;
+            }
+            vm->current_snapshot = snap;
+        }
+    }
+
+    if (!(dir = opendir(snapDir)))
+        goto cleanup;
+
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        if (!virFileHasSuffix(entry->d_name, ".xml") ||
+            !(name = strndup(entry->d_name,
+                             strlen(entry->d_name) - strlen(".xml"))) ||
+            !virDomainSnapshotFindByName(&vm->snapshots, name)) {
+            VIR_DEBUG("Snapshot index %s lacks %s", path, entry->d_name);
+            goto cleanup;
+        }
+        VIR_FREE(name);
+
+        if (virAsprintf(&name, "%s/%s", snapDir, entry->d_name) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        if (stat(name, &sb) < 0 || sb.st_mtime > indexTime) {
+            VIR_DEBUG("Snapshot index %s is older than %s", path, name);
+            goto cleanup;
+        }
+        VIR_FREE(name);
+        nfiles++;
+    }
+
+    if (nfiles != n) {
+        VIR_DEBUG("Snapshot index %s lists snapshots without metadata", path);
+        goto cleanup;
+    }
+
+    if (virDomainSnapshotUpdateRelations(&vm->snapshots) < 0)
+        VIR_WARN("Snapshots have inconsistent relations for domain %s",
+                 vm->def->name);
+
+    priv->snapshotIndexValid = true;
+    ret = 0;
+
+cleanup:
+    if (ret < 0) {
+        virHashRemoveSet(vm->snapshots.objs, qemuDomainSnapshotMatchAny, NULL);
+        vm->current_snapshot = NULL;
+        if (path && unlink(path) < 0 && errno != ENOENT)
+            VIR_WARN("Failed to remove snapshot index %s", path);
+    }
+    if (dir)
+        closedir(dir);
+    virDomainSnapshotDefFree(def);
+    VIR_FREE(nodes);
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(xml);
+    VIR_FREE(name);
+    VIR_FREE(path);
+    VIR_FREE(snapDir);
+    return ret;
+}
+
+/*
+ * Makes sure @snap has its full definition, parsing its metadata file
+ * if only what the index holds is known so far.
+ */
+int
+qemuDomainSnapshotLoadDef(struct qemud_driver *driver,
+                          virDomainObjPtr vm,
+                          virDomainSnapshotObjPtr snap)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    virDomainSnapshotDefPtr def = NULL;
+    char *path = NULL;
+    char *xmlStr = NULL;
+    int ret = -1;
+
+    snap->lastUsed = ++priv->snapshotDefsUsed;
+    if (!snap->partial)
+        return 0;
+
+    if (virAsprintf(&path, "%s/%s/%s.xml", driver->snapshotDir,
+                    vm->def->name, snap->def->name) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (virFileReadAll(path, 1024*1024*1, &xmlStr) < 0)
+        goto cleanup;
+
+    if (!(def = virDomainSnapshotDefParseString(xmlStr, driver->caps,
+                                                QEMU_EXPECTED_VIRT_TYPES,
+                                                (VIR_DOMAIN_SNAPSHOT_PARSE_REDEFINE |
+                                                 VIR_DOMAIN_SNAPSHOT_PARSE_DISKS |
+                                                 VIR_DOMAIN_SNAPSHOT_PARSE_INTERNAL))))
+        goto cleanup;
+
+    if (STRNEQ(def->name, snap->def->name)) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("snapshot file %s holds snapshot '%s'"),
+                        path, def->name);
+        goto cleanup;
+    }
+
+    /* Parent and current may have changed in memory meanwhile */
+    VIR_FREE(def->parent);
+    def->parent = snap->def->parent;
+    snap->def->parent = NULL;
+    def->current = snap->def->current;
+
+    virDomainSnapshotDefFree(snap->def);
+    snap->def = def;
+    def = NULL;
+    snap->partial = false;
+
+    ret = 0;
+
+cleanup:
+    virDomainSnapshotDefFree(def);
+    VIR_FREE(xmlStr);
+    VIR_FREE(path);
+    return ret;
+}
+
+/* Turns the definition of @snap back into what the index holds.  */
+static int
+qemuDomainSnapshotDropDef(virDomainSnapshotObjPtr snap)
+{
+    virDomainSnapshotDefPtr def;
+
+    if (VIR_ALLOC(def) < 0) {
+        virReportOOMError();
+        return -1;
+    }
+
+    def->name = snap->def->name;
+    snap->def->name = NULL;
+    def->parent = snap->def->parent;
+    snap->def->parent = NULL;
+    def->creationTime = snap->def->creationTime;
+    def->state = snap->def->state;
+    def->current = snap->def->current;
+
+    virDomainSnapshotDefFree(snap->def);
+    snap->def = def;
+    snap->partial = true;
+    return 0;
+}
+
+struct qemuDomainSnapshotTrimData {
+    virDomainObjPtr vm;
+    virDomainSnapshotObjPtr *snaps;
+    size_t nsnaps;
+};
+
+static void
+qemuDomainSnapshotCollectFull(void *payload,
+                              const void *name ATTRIBUTE_UNUSED,
+                              void *data)
+{
+    virDomainSnapshotObjPtr snap = payload;
+    struct qemuDomainSnapshotTrimData *trim = data;
+
+    /* Metadata of the current snapshot is rewritten all the time, and
+     * the definition is the only copy of what could not be saved */
+    if (!snap->partial && !snap->dirty &&
+        snap != trim->vm->current_snapshot)
+        trim->snaps[trim->nsnaps++] = snap;
+}
+
+static int
+qemuDomainSnapshotCompareUse(const void *a, const void *b)
+{
+    virDomainSnapshotObjPtr snapa = *(virDomainSnapshotObjPtr *)a;
+    virDomainSnapshotObjPtr snapb = *(virDomainSnapshotObjPtr *)b;
+
+    if (snapa->lastUsed < snapb->lastUsed)
+        return -1;
+    return snapa->lastUsed > snapb->lastUsed;
+}
+
+/*
+ * Drops the least recently used full snapshot definitions of @vm once
+ * there are more than driver->snapshotCacheSize of them.  Only to be
+ * called once an API is done with the snapshots of @vm.  Snapshots
+ * whose metadata could not be written are kept.
+ */
+void
+qemuDomainSnapshotTrimDefs(struct qemud_driver *driver,
+                           virDomainObjPtr vm)
+{
+    struct qemuDomainSnapshotTrimData trim = { vm, NULL, 0 };
+    size_t i;
+
+    if (!driver->snapshotCacheSize ||
+        virHashSize(vm->snapshots.objs) <= driver->snapshotCacheSize)
+        return;
+
+    if (VIR_ALLOC_N(trim.snaps, virHashSize(vm->snapshots.objs)) < 0) {
+        virReportOOMError();
+        return;
+    }
+
+    virHashForEach(vm->snapshots.objs, qemuDomainSnapshotCollectFull, &trim);
+
+    if (trim.nsnaps > driver->snapshotCacheSize) {
+        qsort(trim.snaps, trim.nsnaps, sizeof(*trim.snaps),
+              qemuDomainSnapshotCompareUse);
+        VIR_DEBUG("Dropping %zu snapshot definitions of domain %s",
+                  trim.nsnaps - driver->snapshotCacheSize, vm->def->name);
+        for (i = 0; i < trim.nsnaps - driver->snapshotCacheSize; i++) {
+            if (qemuDomainSnapshotDropDef(trim.snaps[i]) < 0)
+                break;
+        }
+    }
+
+    VIR_FREE(trim.snaps);
+}
+
+int
+qemuDomainSnapshotWriteMetadata(struct qemud_driver *driver,
+                                virDomainObjPtr vm,
+                                virDomainSnapshotObjPtr snapshot)
 {
     int fd = -1;
     char *newxml = NULL;
@@ -1338,6 +2078,11 @@ qemuDomainSnapshotWriteMetadata(virDomainObjPtr vm,
     char uuidstr[VIR_UUID_STRING_BUFLEN];
     char *tmp;
 
+    if (qemuDomainSnapshotLoadDef(driver, vm, snapshot) < 0)
+        return -1;
+    qemuDomainSnapshotInvalidateIndex(driver, vm);
+    snapshot->dirty = true;
+
     virUUIDFormat(vm->def->uuid, uuidstr);
     newxml = virDomainSnapshotDefFormat(uuidstr, snapshot->def,
                                         VIR_DOMAIN_XML_SECURE, 1);
@@ -1346,7 +2091,8 @@ qemuDomainSnapshotWriteMetadata(virDomainObjPtr vm,
         return -1;
     }
 
-    if (virAsprintf(&snapDir, "%s/%s", snapshotDir, vm->def->name) < 0) {
+    if (virAsprintf(&snapDir, "%s/%s", driver->snapshotDir,
+                    vm->def->name) < 0) {
         virReportOOMError();
         goto cleanup;
     }
@@ -1380,6 +2126,7 @@ qemuDomainSnapshotWriteMetadata(virDomainObjPtr vm,
         goto cleanup;
     }
 
+    snapshot->dirty = false;
     ret = 0;
 
 cleanup:
@@ -1404,6 +2151,9 @@ qemuDomainSnapshotForEachQcow2(struct qemud_driver *driver,
     bool skipped = false;
     virDomainDefPtr def;
 
+    if (qemuDomainSnapshotLoadDef(driver, vm, snap) < 0)
+        return -1;
+
     /* Prefer action on the disks in use at the time the snapshot was
      * created; but fall back to current definition if dealing with a
      * snapshot created prior to libvirt 0.9.5.  */
@@ -1497,15 +2247,14 @@ qemuDomainSnapshotDiscard(struct qemud_driver *driver,
 
     if (snap == vm->current_snapshot) {
         if (update_current && snap->def->parent) {
-            parentsnap = virDomainSnapshotFindByName(&vm->snapshots,
-                                                     snap->def->parent);
+            parentsnap = snap->parent;
             if (!parentsnap) {
                 VIR_WARN("missing parent snapshot matching name '%s'",
                          snap->def->parent);
             } else {
                 parentsnap->def->current = true;
-                if (qemuDomainSnapshotWriteMetadata(vm, parentsnap,
-                                                    driver->snapshotDir) < 0) {
+                if (qemuDomainSnapshotWriteMetadata(driver, vm,
+                                                    parentsnap) < 0) {
                     VIR_WARN("failed to set parent snapshot '%s' as current",
                              snap->def->parent);
                     parentsnap->def->current = false;
@@ -1516,6 +2265,7 @@ qemuDomainSnapshotDiscard(struct qemud_driver *driver,
         vm->current_snapshot = parentsnap;
     }
 
+    qemuDomainSnapshotInvalidateIndex(driver, vm);
     if (unlink(snapFile) < 0)
         VIR_WARN("Failed to unlink %s", snapFile);
     virDomainSnapshotObjListRemove(&vm->snapshots, snap);
@@ -1571,6 +2321,7 @@ qemuDomainRemoveInactive(struct qemud_driver *driver,
     char *snapDir;
 
     /* Remove any snapshot metadata prior to removing the domain */
+    qemuDomainSnapshotRemoveIndex(driver, vm);
     if (qemuDomainSnapshotDiscardAllMetadata(driver, vm) < 0) {
         VIR_WARN("unable to remove all snapshots for domain %s",
                  vm->def->name);
@@ -1602,3 +2353,65 @@ qemuDomainSetFakeReboot(struct qemud_driver *driver,
     if (virDomainSaveStatus(driver->caps, driver->stateDir, vm) < 0)
         VIR_WARN("Failed to save status on vm %s", vm->def->name);
 }
+
+static void
+qemuDomainBlockStatsFree(void *payload, const void *name ATTRIBUTE_UNUSED)
+{
+    VIR_FREE(payload);
+}
+
+/*
+ * Makes sure priv->blockStats holds the statistics of all disks, or at
+ * least of the disk with @alias, no older than driver->blockStatsMaxAge
+ * milliseconds. All disks are queried at once, so polling disks one by
+ * one costs a single monitor command per period.
+ *
+ * The caller must hold a job; the entries may only be used until the
+ * domain object is unlocked.
+ */
+int
+qemuDomainUpdateBlockStats(struct qemud_driver *driver,
+                           virDomainObjPtr vm,
+                           const char *alias)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    virHashTablePtr stats = NULL;
+    unsigned long long now;
+    int ret;
+
+    if (virTimeMs(&now) < 0)
+        return -1;
+
+    if (priv->blockStats && driver->blockStatsMaxAge &&
+        now - priv->blockStatsTime <= driver->blockStatsMaxAge &&
+        (!alias || virHashLookup(priv->blockStats, alias))) {
+        VIR_DEBUG("Using block stats of %s from %llums ago",
+                  vm->def->name, now - priv->blockStatsTime);
+        return 0;
+    }
+
+    if (!(stats = virHashCreate(vm->def->ndisks, qemuDomainBlockStatsFree)))
+        return -1;
+
+    qemuDomainObjEnterMonitor(driver, vm);
+    ret = qemuMonitorGetAllBlockStatsInfo(priv->mon, stats);
+    qemuDomainObjExitMonitor(driver, vm);
+
+    if (ret < 0)
+        goto error;
+
+    if (!virDomainObjIsActive(vm)) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID,
+                        "%s", _("domain is not running"));
+        goto error;
+    }
+
+    virHashFree(priv->blockStats);
+    priv->blockStats = stats;
+    priv->blockStatsTime = now;
+    return 0;
+
+error:
+    virHashFree(stats);
+    return -1;
+}
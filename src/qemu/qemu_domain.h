@@ -37,6 +37,7 @@
      (1 << VIR_DOMAIN_VIRT_XEN))
 
 # define QEMU_DOMAIN_DEFAULT_MIG_BANDWIDTH_MAX (32 << 20)
+
 # if ULONG_MAX == 4294967295
 /* Qemu has a 64-bit limit, but we are limited by our historical choice of
  * representing bandwidth in a long instead of a 64-bit int.  */
@@ -45,13 +46,17 @@
 #  define QEMU_DOMAIN_FILE_MIG_BANDWIDTH_MAX    (INT64_MAX / (1024 * 1024))
 # endif
 
+/* Name of the index next to the snapshot metadata files of a domain */
+# define QEMU_SNAPSHOT_INDEX ".index"
+
 # define JOB_MASK(job)                  (1 << (job - 1))
 # define DEFAULT_JOB_MASK               \
     (JOB_MASK(QEMU_JOB_QUERY) |         \
      JOB_MASK(QEMU_JOB_DESTROY) |       \
      JOB_MASK(QEMU_JOB_ABORT))
 
-/* Only 1 job is allowed at any time
+/* Only 1 job is allowed at any time, except that any number of query
+ * jobs may run together, and alongside the steps of an async job.
  * A job includes *all* monitor commands, even those just querying
  * information, not merely actions */
 enum qemuDomainJob {
@@ -84,21 +89,96 @@ enum qemuDomainAsyncJob {
     QEMU_ASYNC_JOB_LAST
 };
 
+/* Samples of an outgoing migration's memory transfer */
+typedef struct _qemuDomainJobProgress qemuDomainJobProgress;
+typedef qemuDomainJobProgress *qemuDomainJobProgressPtr;
+struct _qemuDomainJobProgress {
+    unsigned long long sampled;         /* When last sampled, in ms */
+    unsigned long long samples;         /* Number of samples taken */
+    unsigned long long processed;       /* Bytes transferred so far */
+    unsigned long long remaining;       /* Bytes still to transfer */
+    unsigned long long transferRate;    /* Bytes/s sent to the destination */
+    unsigned long long dirtyRate;       /* Bytes/s dirtied by the guest */
+};
+
+/* State of the migration convergence controller */
+typedef struct _qemuDomainJobConverge qemuDomainJobConverge;
+typedef qemuDomainJobConverge *qemuDomainJobConvergePtr;
+struct _qemuDomainJobConverge {
+    unsigned long long downtime;        /* Allowed downtime, in ms */
+    unsigned long bandwidth;            /* Bandwidth limit, in MiB/s */
+    unsigned long long decided;         /* When last looked at, in ms */
+    unsigned long long bestRemaining;   /* Least memory left to send so far */
+    unsigned long long bestTime;        /* When bestRemaining was seen */
+    unsigned int downtimeSteps;         /* Times downtime was raised */
+    unsigned int bandwidthSteps;        /* Times bandwidth was raised */
+    int lastAction;                     /* enum qemuMigrationConvergeAction */
+    unsigned long long lastActionTime;  /* When lastAction was taken */
+    bool stalled;                       /* Stall action was taken */
+};
+
+/* Order in which waiting jobs get to run, unless they can run together */
+enum qemuDomainJobPriority {
+    QEMU_JOB_PRIORITY_NORMAL = 0,
+    QEMU_JOB_PRIORITY_ASYNC,            /* Steps of the current async job */
+    QEMU_JOB_PRIORITY_URGENT,           /* Destroying or aborting */
+};
+
+/* A thread waiting to start a job; jobs of the same priority start in
+ * the order they were asked for */
+typedef struct _qemuDomainJobWaiter qemuDomainJobWaiter;
+typedef qemuDomainJobWaiter *qemuDomainJobWaiterPtr;
+struct _qemuDomainJobWaiter {
+    enum qemuDomainJob job;
+    int priority;                       /* enum qemuDomainJobPriority */
+    unsigned long long ticket;
+    qemuDomainJobWaiterPtr next;
+};
+
+/* How long jobs of one type had to wait before starting, in ms */
+typedef struct _qemuDomainJobWaitStats qemuDomainJobWaitStats;
+struct _qemuDomainJobWaitStats {
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long max;
+};
+
 struct qemuDomainJobObj {
     virCond cond;                       /* Use to coordinate jobs */
     enum qemuDomainJob active;          /* Currently running job */
+    int owner;                          /* Thread running the active job */
+    int *queries;                       /* Threads running query jobs */
+    size_t nqueries;
+    qemuDomainJobWaiterPtr waiters;     /* Threads waiting for a job */
+    unsigned long long tickets;         /* Tickets handed out to waiters */
+    qemuDomainJobWaitStats waits[QEMU_JOB_LAST];
+    qemuDomainJobWaitStats asyncWaits[QEMU_ASYNC_JOB_LAST];
 
-    virCond asyncCond;                  /* Use to coordinate with async jobs */
     enum qemuDomainAsyncJob asyncJob;   /* Currently active async job */
     int phase;                          /* Job phase (mainly for migrations) */
     unsigned long long mask;            /* Jobs allowed during async job */
     unsigned long long start;           /* When the async job started */
     virDomainJobInfo info;              /* Async job progress data */
+    virCond progressCond;               /* Signalled when info may change */
+    qemuDomainJobProgress progress;     /* Migration transfer statistics */
+    qemuDomainJobConverge converge;     /* Migration convergence decisions */
+    unsigned int hotplugs;              /* PCI hotplugs done by the async job */
+    unsigned long long hotplugTime;     /* Total time they took, in ms */
+    unsigned long long hotplugMax;      /* Time the slowest of them took */
 };
 
 typedef struct _qemuDomainPCIAddressSet qemuDomainPCIAddressSet;
 typedef qemuDomainPCIAddressSet *qemuDomainPCIAddressSetPtr;
 
+/* Time spent in each phase of starting the domain, in ms */
+typedef struct _qemuDomainStartTimes qemuDomainStartTimes;
+struct _qemuDomainStartTimes {
+    unsigned long long prepare;         /* Up to running the emulator */
+    unsigned long long launch;          /* Until the emulator is running */
+    unsigned long long monitor;         /* Until the monitor is connected */
+    unsigned long long setup;           /* Until the domain is up */
+};
+
 typedef struct _qemuDomainObjPrivate qemuDomainObjPrivate;
 typedef qemuDomainObjPrivate *qemuDomainObjPrivatePtr;
 struct _qemuDomainObjPrivate {
@@ -109,6 +189,7 @@ struct _qemuDomainObjPrivate {
     int monJSON;
     bool monError;
     unsigned long long monStart;
+    qemuDomainStartTimes startTimes;
     bool gotShutdown;
     char *pidfile;
 
@@ -117,6 +198,7 @@ struct _qemuDomainObjPrivate {
 
     qemuDomainPCIAddressSetPtr pciaddrs;
     int persistentAddrs;
+    unsigned long long pciHotplugSettle; /* No PCI hotplug before this time */
 
     virBitmapPtr qemuCaps;
     char *lockState;
@@ -127,6 +209,12 @@ struct _qemuDomainObjPrivate {
 
     unsigned long migMaxBandwidth;
     char *origname;
+
+    virHashTablePtr blockStats;     /* qemuBlockStats by disk alias */
+    unsigned long long blockStatsTime;
+
+    bool snapshotIndexValid;        /* Index on disk matches snapshots */
+    unsigned long long snapshotDefsUsed; /* Counts snapshot definition uses */
 };
 
 struct qemuDomainWatchdogEvent
@@ -181,6 +269,7 @@ void qemuDomainObjRestoreJob(virDomainObjPtr obj,
                              struct qemuDomainJobObj *job);
 void qemuDomainObjDiscardAsyncJob(struct qemud_driver *driver,
                                   virDomainObjPtr obj);
+void qemuDomainObjSignalJobProgress(virDomainObjPtr obj);
 
 void qemuDomainObjEnterMonitor(struct qemud_driver *driver,
                                virDomainObjPtr obj)
@@ -195,6 +284,10 @@ int qemuDomainObjEnterMonitorAsync(struct qemud_driver *driver,
                                    virDomainObjPtr obj,
                                    enum qemuDomainAsyncJob asyncJob)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+int qemuDomainObjEnterMonitorAsyncNoDriver(struct qemud_driver *driver,
+                                           virDomainObjPtr obj,
+                                           enum qemuDomainAsyncJob asyncJob)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
 void qemuDomainObjExitMonitorWithDriver(struct qemud_driver *driver,
                                         virDomainObjPtr obj)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2);
@@ -240,9 +333,19 @@ int qemuDomainAppendLog(struct qemud_driver *driver,
 
 const char *qemuFindQemuImgBinary(struct qemud_driver *driver);
 
-int qemuDomainSnapshotWriteMetadata(virDomainObjPtr vm,
-                                    virDomainSnapshotObjPtr snapshot,
-                                    char *snapshotDir);
+int qemuDomainSnapshotWriteMetadata(struct qemud_driver *driver,
+                                    virDomainObjPtr vm,
+                                    virDomainSnapshotObjPtr snapshot);
+
+int qemuDomainSnapshotWriteIndex(struct qemud_driver *driver,
+                                 virDomainObjPtr vm);
+int qemuDomainSnapshotLoadIndex(struct qemud_driver *driver,
+                                virDomainObjPtr vm);
+int qemuDomainSnapshotLoadDef(struct qemud_driver *driver,
+                              virDomainObjPtr vm,
+                              virDomainSnapshotObjPtr snap);
+void qemuDomainSnapshotTrimDefs(struct qemud_driver *driver,
+                                virDomainObjPtr vm);
 
 int qemuDomainSnapshotForEachQcow2(struct qemud_driver *driver,
                                    virDomainObjPtr vm,
@@ -280,4 +383,8 @@ void qemuDomainSetFakeReboot(struct qemud_driver *driver,
 
 bool qemuDomainJobAllowed(qemuDomainObjPrivatePtr priv,
                           enum qemuDomainJob job);
+
+int qemuDomainUpdateBlockStats(struct qemud_driver *driver,
+                               virDomainObjPtr vm,
+                               const char *alias);
 #endif /* __QEMU_DOMAIN_H__ */
@@ -115,6 +115,8 @@
 
 #define QEMU_NB_BLKIO_PARAM  1
 
+#define QEMU_NB_BLOCK_STATS_PARAM  5
+
 static void processWatchdogEvent(void *data, void *opaque);
 
 static int qemudShutdown(void);
@@ -286,12 +288,31 @@ err_exit:
     return NULL;
 }
 
+/* Once done with the snapshots of @vm, brings their index up to date
+ * and drops definitions that are not needed any more.  */
+static void
+qemuDomainSnapshotFinish(struct qemud_driver *driver,
+                         virDomainObjPtr vm)
+{
+    virErrorPtr orig_err = virSaveLastError();
+
+    if (qemuDomainSnapshotWriteIndex(driver, vm) < 0)
+        VIR_WARN("Failed to write snapshot index for domain %s",
+                 vm->def->name);
+    qemuDomainSnapshotTrimDefs(driver, vm);
+
+    if (orig_err) {
+        virSetError(orig_err);
+        virFreeError(orig_err);
+    }
+}
+
 static void qemuDomainSnapshotLoad(void *payload,
                                    const void *name ATTRIBUTE_UNUSED,
                                    void *data)
 {
     virDomainObjPtr vm = (virDomainObjPtr)payload;
-    char *baseDir = (char *)data;
+    struct qemud_driver *driver = data;
     char *snapDir = NULL;
     DIR *dir = NULL;
     struct dirent *entry;
@@ -307,7 +328,16 @@ static void qemuDomainSnapshotLoad(void *payload,
                           VIR_DOMAIN_SNAPSHOT_PARSE_INTERNAL);
 
     virDomainObjLock(vm);
-    if (virAsprintf(&snapDir, "%s/%s", baseDir, vm->def->name) < 0) {
+
+    if (qemuDomainSnapshotLoadIndex(driver, vm) == 0) {
+        VIR_INFO("Loaded index of %d snapshots for domain %s",
+                 virDomainSnapshotObjListNum(&vm->snapshots, 0),
+                 vm->def->name);
+        goto cleanup;
+    }
+
+    if (virAsprintf(&snapDir, "%s/%s", driver->snapshotDir,
+                    vm->def->name) < 0) {
         VIR_ERROR(_("Failed to allocate memory for snapshot directory for domain %s"),
                    vm->def->name);
         goto cleanup;
@@ -346,7 +376,7 @@ static void qemuDomainSnapshotLoad(void *payload,
             continue;
         }
 
-        def = virDomainSnapshotDefParseString(xmlStr, qemu_driver->caps,
+        def = virDomainSnapshotDefParseString(xmlStr, driver->caps,
                                               QEMU_EXPECTED_VIRT_TYPES,
                                               flags);
         if (def == NULL) {
@@ -377,6 +407,13 @@ static void qemuDomainSnapshotLoad(void *payload,
         vm->current_snapshot = NULL;
     }
 
+    if (virDomainSnapshotUpdateRelations(&vm->snapshots) < 0)
+        VIR_ERROR(_("Snapshots have inconsistent relations for domain %s"),
+                  vm->def->name);
+
+    /* Spare the next start parsing all of them again */
+    qemuDomainSnapshotFinish(driver, vm);
+
     /* FIXME: qemu keeps internal track of snapshots.  We can get access
      * to this info via the "info snapshots" monitor command for running
      * domains, or via "qemu-img snapshot -l" for shutoff domains.  It would
@@ -665,7 +702,7 @@ qemudStartup(int privileged) {
 
 
     virHashForEach(qemu_driver->domains.objs, qemuDomainSnapshotLoad,
-                   qemu_driver->snapshotDir);
+                   qemu_driver);
 
     qemu_driver->workerPool = virThreadPoolNew(0, 1, 0, processWatchdogEvent, qemu_driver);
     if (!qemu_driver->workerPool)
@@ -2135,7 +2172,7 @@ qemuDomainGetControlInfo(virDomainPtr dom,
 
     if (priv->monError) {
         info->state = VIR_DOMAIN_CONTROL_ERROR;
-    } else if (priv->job.active) {
+    } else if (priv->job.active || priv->job.nqueries) {
         if (!priv->monStart) {
             info->state = VIR_DOMAIN_CONTROL_JOB;
             if (virTimeMs(&info->stateTime) < 0)
@@ -7060,6 +7097,7 @@ qemudDomainBlockStats (virDomainPtr dom,
     virDomainObjPtr vm;
     virDomainDiskDefPtr disk = NULL;
     qemuDomainObjPrivatePtr priv;
+    qemuBlockStatsPtr bstats;
 
     qemuDriverLock(driver);
     vm = virDomainFindByUUID(&driver->domains, dom->uuid);
@@ -7107,15 +7145,129 @@ qemudDomainBlockStats (virDomainPtr dom,
         goto endjob;
     }
 
-    qemuDomainObjEnterMonitor(driver, vm);
-    ret = qemuMonitorGetBlockStatsInfo(priv->mon,
-                                       disk->info.alias,
-                                       &stats->rd_req,
-                                       &stats->rd_bytes,
-                                       &stats->wr_req,
-                                       &stats->wr_bytes,
-                                       &stats->errs);
-    qemuDomainObjExitMonitor(driver, vm);
+    if (qemuDomainUpdateBlockStats(driver, vm, disk->info.alias) < 0)
+        goto endjob;
+
+    if (!(bstats = virHashLookup(priv->blockStats, disk->info.alias))) {
+        qemuReportError(VIR_ERR_INVALID_ARG,
+                        _("no stats found for device %s"), disk->info.alias);
+        goto endjob;
+    }
+
+    stats->rd_req = bstats->rd_req;
+    stats->rd_bytes = bstats->rd_bytes;
+    stats->wr_req = bstats->wr_req;
+    stats->wr_bytes = bstats->wr_bytes;
+    stats->errs = bstats->errs;
+    ret = 0;
+
+endjob:
+    if (qemuDomainObjEndJob(driver, vm) == 0)
+        vm = NULL;
+
+cleanup:
+    if (vm)
+        virDomainObjUnlock(vm);
+    return ret;
+}
+
+static int
+qemuDomainBlockStatsAll(virDomainPtr dom,
+                        virTypedParameterPtr params,
+                        int *nparams,
+                        unsigned int flags)
+{
+    struct qemud_driver *driver = dom->conn->privateData;
+    static const char *const fields[QEMU_NB_BLOCK_STATS_PARAM] = {
+        VIR_DOMAIN_BLOCK_STATS_FIELD_RD_REQ,
+        VIR_DOMAIN_BLOCK_STATS_FIELD_RD_BYTES,
+        VIR_DOMAIN_BLOCK_STATS_FIELD_WR_REQ,
+        VIR_DOMAIN_BLOCK_STATS_FIELD_WR_BYTES,
+        VIR_DOMAIN_BLOCK_STATS_FIELD_ERRS,
+    };
+    virDomainObjPtr vm;
+    qemuDomainObjPrivatePtr priv;
+    int i, j, n = 0;
+    int ret = -1;
+
+    virCheckFlags(0, -1);
+
+    qemuDriverLock(driver);
+    vm = virDomainFindByUUID(&driver->domains, dom->uuid);
+    qemuDriverUnlock(driver);
+    if (!vm) {
+        char uuidstr[VIR_UUID_STRING_BUFLEN];
+        virUUIDFormat(dom->uuid, uuidstr);
+        qemuReportError(VIR_ERR_NO_DOMAIN,
+                        _("no domain with matching uuid '%s'"), uuidstr);
+        goto cleanup;
+    }
+
+    if (!virDomainObjIsActive(vm)) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID,
+                        "%s", _("domain is not running"));
+        goto cleanup;
+    }
+
+    if (*nparams == 0) {
+        for (i = 0 ; i < vm->def->ndisks ; i++) {
+            if (vm->def->disks[i]->info.alias)
+                n += QEMU_NB_BLOCK_STATS_PARAM;
+        }
+        *nparams = n;
+        ret = 0;
+        goto cleanup;
+    }
+
+    priv = vm->privateData;
+    if (qemuDomainObjBeginJob(driver, vm, QEMU_JOB_QUERY) < 0)
+        goto cleanup;
+
+    if (!virDomainObjIsActive(vm)) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID,
+                        "%s", _("domain is not running"));
+        goto endjob;
+    }
+
+    if (qemuDomainUpdateBlockStats(driver, vm, NULL) < 0)
+        goto endjob;
+
+    for (i = 0 ; i < vm->def->ndisks ; i++) {
+        virDomainDiskDefPtr disk = vm->def->disks[i];
+        qemuBlockStatsPtr bstats;
+        long long values[QEMU_NB_BLOCK_STATS_PARAM];
+
+        /* Disks without a medium have no block device in QEMU */
+        if (!disk->info.alias ||
+            !(bstats = virHashLookup(priv->blockStats, disk->info.alias)))
+            continue;
+
+        if (n + QEMU_NB_BLOCK_STATS_PARAM > *nparams)
+            break;
+
+        values[0] = bstats->rd_req;
+        values[1] = bstats->rd_bytes;
+        values[2] = bstats->wr_req;
+        values[3] = bstats->wr_bytes;
+        values[4] = bstats->errs;
+
+        for (j = 0 ; j < QEMU_NB_BLOCK_STATS_PARAM ; j++) {
+            virTypedParameterPtr param = &params[n++];
+
+            if (snprintf(param->field, VIR_TYPED_PARAM_FIELD_LENGTH, "%s.%s",
+                         disk->dst, fields[j]) >= VIR_TYPED_PARAM_FIELD_LENGTH) {
+                qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                                _("Field %s.%s too long for destination"),
+                                disk->dst, fields[j]);
+                goto endjob;
+            }
+            param->type = VIR_TYPED_PARAM_LLONG;
+            param->value.l = values[j];
+        }
+    }
+
+    *nparams = n;
+    ret = 0;
 
 endjob:
     if (qemuDomainObjEndJob(driver, vm) == 0)
@@ -7537,11 +7689,24 @@ static int qemuDomainGetBlockInfo(virDomainPtr dom,
             goto cleanup;
 
         if (virDomainObjIsActive(vm)) {
-            qemuDomainObjEnterMonitor(driver, vm);
-            ret = qemuMonitorGetBlockExtent(priv->mon,
-                                            disk->info.alias,
-                                            &info->allocation);
-            qemuDomainObjExitMonitor(driver, vm);
+            qemuBlockStatsPtr bstats;
+
+            if (qemuDomainUpdateBlockStats(driver, vm, disk->info.alias) < 0) {
+                ret = -1;
+            } else if (!(bstats = virHashLookup(priv->blockStats,
+                                                disk->info.alias))) {
+                qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                                _("cannot find statistics for device '%s'"),
+                                disk->info.alias);
+                ret = -1;
+            } else if (!bstats->has_extent) {
+                qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                                _("unable to query block extent with this QEMU"));
+                ret = -1;
+            } else {
+                info->allocation = bstats->extent;
+                ret = 0;
+            }
         } else {
             ret = 0;
         }
@@ -8422,6 +8587,8 @@ static int qemuDomainAbortJob(virDomainPtr dom) {
     qemuDomainObjEnterMonitor(driver, vm);
     ret = qemuMonitorMigrateCancel(priv->mon);
     qemuDomainObjExitMonitor(driver, vm);
+    if (ret == 0)
+        qemuDomainObjSignalJobProgress(vm);
 
 endjob:
     if (qemuDomainObjEndJob(driver, vm) == 0)
@@ -8480,6 +8647,9 @@ qemuDomainMigrateSetMaxDowntime(virDomainPtr dom,
     ret = qemuMonitorSetMigrationDowntime(priv->mon, downtime);
     qemuDomainObjExitMonitor(driver, vm);
 
+    if (ret == 0)
+        priv->job.converge.downtime = downtime;
+
 endjob:
     if (qemuDomainObjEndJob(driver, vm) == 0)
         vm = NULL;
@@ -8530,8 +8700,10 @@ qemuDomainMigrateSetMaxSpeed(virDomainPtr dom,
         ret = qemuMonitorSetMigrationSpeed(priv->mon, bandwidth);
         qemuDomainObjExitMonitor(driver, vm);
 
-        if (ret == 0)
+        if (ret == 0) {
             priv->migMaxBandwidth = bandwidth;
+            priv->job.converge.bandwidth = bandwidth;
+        }
 
 endjob:
         if (qemuDomainObjEndJob(driver, vm) == 0)
@@ -8987,6 +9159,7 @@ qemuDomainSnapshotCreateXML(virDomainPtr domain,
     char uuidstr[VIR_UUID_STRING_BUFLEN];
     virDomainSnapshotDefPtr def = NULL;
     bool update_current = true;
+    bool replaced = false;
     unsigned int parse_flags = 0;
 
     virCheckFlags(VIR_DOMAIN_SNAPSHOT_CREATE_REDEFINE |
@@ -9047,20 +9220,14 @@ qemuDomainSnapshotCreateXML(virDomainPtr domain,
                                 def->parent, def->name);
                 goto cleanup;
             }
-            while (other->def->parent) {
-                if (STREQ(other->def->parent, def->name)) {
+            while (other->parent) {
+                if (STREQ(other->parent->def->name, def->name)) {
                     qemuReportError(VIR_ERR_INVALID_ARG,
                                     _("parent %s would create cycle to %s"),
                                     other->def->name, def->name);
                     goto cleanup;
                 }
-                other = virDomainSnapshotFindByName(&vm->snapshots,
-                                                    other->def->parent);
-                if (!other) {
-                    VIR_WARN("snapshots are inconsistent for %s",
-                             vm->def->name);
-                    break;
-                }
+                other = other->parent;
             }
         }
 
@@ -9074,6 +9241,8 @@ qemuDomainSnapshotCreateXML(virDomainPtr domain,
         }
         other = virDomainSnapshotFindByName(&vm->snapshots, def->name);
         if (other) {
+            if (qemuDomainSnapshotLoadDef(driver, vm, other) < 0)
+                goto cleanup;
             if ((other->def->state == VIR_DOMAIN_RUNNING ||
                  other->def->state == VIR_DOMAIN_PAUSED) !=
                 (def->state == VIR_DOMAIN_RUNNING ||
@@ -9108,6 +9277,7 @@ qemuDomainSnapshotCreateXML(virDomainPtr domain,
                 vm->current_snapshot = NULL;
             }
             virDomainSnapshotObjListRemove(&vm->snapshots, other);
+            replaced = true;
         }
         if (def->state == VIR_DOMAIN_DISK_SNAPSHOT && def->dom) {
             if (virDomainSnapshotAlignDisks(def,
@@ -9153,6 +9323,10 @@ qemuDomainSnapshotCreateXML(virDomainPtr domain,
         goto cleanup;
     def = NULL;
 
+    /* Children of a replaced definition were left without a parent */
+    if (replaced)
+        ignore_value(virDomainSnapshotUpdateRelations(&vm->snapshots));
+
     if (update_current)
         snap->def->current = true;
     if (vm->current_snapshot) {
@@ -9162,11 +9336,12 @@ qemuDomainSnapshotCreateXML(virDomainPtr domain,
                 virReportOOMError();
                 goto cleanup;
             }
+            virDomainSnapshotSetParent(snap, vm->current_snapshot);
         }
         if (update_current) {
             vm->current_snapshot->def->current = false;
-            if (qemuDomainSnapshotWriteMetadata(vm, vm->current_snapshot,
-                                                driver->snapshotDir) < 0)
+            if (qemuDomainSnapshotWriteMetadata(driver, vm,
+                                                vm->current_snapshot) < 0)
                 goto cleanup;
             vm->current_snapshot = NULL;
         }
@@ -9205,8 +9380,7 @@ qemuDomainSnapshotCreateXML(virDomainPtr domain,
 cleanup:
     if (vm) {
         if (snapshot && !(flags & VIR_DOMAIN_SNAPSHOT_CREATE_NO_METADATA)) {
-            if (qemuDomainSnapshotWriteMetadata(vm, snap,
-                                                driver->snapshotDir) < 0)
+            if (qemuDomainSnapshotWriteMetadata(driver, vm, snap) < 0)
                 VIR_WARN("unable to save metadata for snapshot %s",
                          snap->def->name);
             else if (update_current)
@@ -9214,6 +9388,7 @@ cleanup:
         } else if (snap) {
             virDomainSnapshotObjListRemove(&vm->snapshots, snap);
         }
+        qemuDomainSnapshotFinish(driver, vm);
         virDomainObjUnlock(vm);
     }
     virDomainSnapshotDefFree(def);
@@ -9413,11 +9588,16 @@ static char *qemuDomainSnapshotGetXMLDesc(virDomainSnapshotPtr snapshot,
         goto cleanup;
     }
 
+    if (qemuDomainSnapshotLoadDef(driver, vm, snap) < 0)
+        goto cleanup;
+
     xml = virDomainSnapshotDefFormat(uuidstr, snap->def, flags, 0);
 
 cleanup:
-    if (vm)
+    if (vm) {
+        qemuDomainSnapshotTrimDefs(driver, vm);
         virDomainObjUnlock(vm);
+    }
     qemuDriverUnlock(driver);
     return xml;
 }
@@ -9483,6 +9663,9 @@ static int qemuDomainRevertToSnapshot(virDomainSnapshotPtr snapshot,
         goto cleanup;
     }
 
+    if (qemuDomainSnapshotLoadDef(driver, vm, snap) < 0)
+        goto cleanup;
+
     if (!vm->persistent &&
         snap->def->state != VIR_DOMAIN_RUNNING &&
         snap->def->state != VIR_DOMAIN_PAUSED &&
@@ -9520,8 +9703,8 @@ static int qemuDomainRevertToSnapshot(virDomainSnapshotPtr snapshot,
 
     if (vm->current_snapshot) {
         vm->current_snapshot->def->current = false;
-        if (qemuDomainSnapshotWriteMetadata(vm, vm->current_snapshot,
-                                            driver->snapshotDir) < 0)
+        if (qemuDomainSnapshotWriteMetadata(driver, vm,
+                                            vm->current_snapshot) < 0)
             goto cleanup;
         vm->current_snapshot = NULL;
         /* XXX Should we restore vm->current_snapshot after this point
@@ -9750,8 +9933,7 @@ endjob:
 
 cleanup:
     if (vm && ret == 0) {
-        if (qemuDomainSnapshotWriteMetadata(vm, snap,
-                                            driver->snapshotDir) < 0)
+        if (qemuDomainSnapshotWriteMetadata(driver, vm, snap) < 0)
             ret = -1;
         else
             vm->current_snapshot = snap;
@@ -9763,8 +9945,10 @@ cleanup:
         if (event2)
             qemuDomainEventQueue(driver, event2);
     }
-    if (vm)
+    if (vm) {
+        qemuDomainSnapshotFinish(driver, vm);
         virDomainObjUnlock(vm);
+    }
     qemuDriverUnlock(driver);
 
     return ret;
@@ -9772,7 +9956,7 @@ cleanup:
 
 struct snap_reparent {
     struct qemud_driver *driver;
-    const char *parent;
+    virDomainSnapshotObjPtr parent;
     virDomainObjPtr vm;
     int err;
 };
@@ -9792,7 +9976,7 @@ qemuDomainSnapshotReparentChildren(void *payload,
     VIR_FREE(snap->def->parent);
 
     if (rep->parent != NULL) {
-        snap->def->parent = strdup(rep->parent);
+        snap->def->parent = strdup(rep->parent->def->name);
 
         if (snap->def->parent == NULL) {
             virReportOOMError();
@@ -9800,9 +9984,9 @@ qemuDomainSnapshotReparentChildren(void *payload,
             return;
         }
     }
+    virDomainSnapshotSetParent(snap, rep->parent);
 
-    rep->err = qemuDomainSnapshotWriteMetadata(rep->vm, snap,
-                                               rep->driver->snapshotDir);
+    rep->err = qemuDomainSnapshotWriteMetadata(rep->driver, rep->vm, snap);
 }
 
 static int qemuDomainSnapshotDelete(virDomainSnapshotPtr snapshot,
@@ -9844,7 +10028,7 @@ static int qemuDomainSnapshotDelete(virDomainSnapshotPtr snapshot,
             snap->def->state == VIR_DOMAIN_DISK_SNAPSHOT)
             external++;
         if (flags & VIR_DOMAIN_SNAPSHOT_DELETE_CHILDREN)
-            virDomainSnapshotForEachDescendant(&vm->snapshots, snap,
+            virDomainSnapshotForEachDescendant(snap,
                                                qemuDomainSnapshotCountExternal,
                                                &external);
         if (external) {
@@ -9865,8 +10049,7 @@ static int qemuDomainSnapshotDelete(virDomainSnapshotPtr snapshot,
         rem.metadata_only = metadata_only;
         rem.err = 0;
         rem.current = false;
-        virDomainSnapshotForEachDescendant(&vm->snapshots,
-                                           snap,
+        virDomainSnapshotForEachDescendant(snap,
                                            qemuDomainSnapshotDiscardAll,
                                            &rem);
         if (rem.err < 0)
@@ -9874,8 +10057,7 @@ static int qemuDomainSnapshotDelete(virDomainSnapshotPtr snapshot,
         if (rem.current) {
             if (flags & VIR_DOMAIN_SNAPSHOT_DELETE_CHILDREN_ONLY) {
                 snap->def->current = true;
-                if (qemuDomainSnapshotWriteMetadata(vm, snap,
-                                                    driver->snapshotDir) < 0) {
+                if (qemuDomainSnapshotWriteMetadata(driver, vm, snap) < 0) {
                     qemuReportError(VIR_ERR_INTERNAL_ERROR,
                                     _("failed to set snapshot '%s' as current"),
                                     snap->def->name);
@@ -9887,10 +10069,10 @@ static int qemuDomainSnapshotDelete(virDomainSnapshotPtr snapshot,
         }
     } else {
         rep.driver = driver;
-        rep.parent = snap->def->parent;
+        rep.parent = snap->parent;
         rep.vm = vm;
         rep.err = 0;
-        virDomainSnapshotForEachChild(&vm->snapshots, snap,
+        virDomainSnapshotForEachChild(snap,
                                       qemuDomainSnapshotReparentChildren,
                                       &rep);
         if (rep.err < 0)
@@ -9907,8 +10089,10 @@ endjob:
         vm = NULL;
 
 cleanup:
-    if (vm)
+    if (vm) {
+        qemuDomainSnapshotFinish(driver, vm);
         virDomainObjUnlock(vm);
+    }
     qemuDriverUnlock(driver);
     return ret;
 }
@@ -10391,6 +10575,7 @@ static virDriver qemuDriver = {
     .domainGetBlockJobInfo = qemuDomainGetBlockJobInfo, /* 0.9.4 */
     .domainBlockJobSetSpeed = qemuDomainBlockJobSetSpeed, /* 0.9.4 */
     .domainBlockPull = qemuDomainBlockPull, /* 0.9.4 */
+    .domainBlockStatsAll = qemuDomainBlockStatsAll, /* 0.9.5 */
 };
 
 
@@ -24,11 +24,15 @@
 #include <config.h>
 
 #include "qemu_hostdev.h"
+#include "qemu_domain.h"
 #include "logging.h"
 #include "virterror_internal.h"
 #include "memory.h"
 #include "pci.h"
 #include "hostusb.h"
+#include "virfile.h"
+
+#define VIR_FROM_THIS VIR_FROM_QEMU
 
 static pciDeviceList *
 qemuGetPciHostDeviceList(virDomainHostdevDefPtr *hostdevs, int nhostdevs)
@@ -143,43 +147,131 @@ cleanup:
 
 
 
+/* Shared by the actors handling PCI devices on each bus */
+struct qemuHostdevData {
+    struct qemud_driver *driver;
+    /* Devices assigned to domains, or NULL when working
+     * without the driver lock */
+    pciDeviceList *activedevs;
+    /* Devices being assigned or released together */
+    pciDeviceList *pcidevs;
+    /* Which of @pcidevs got detached from their host driver, by
+     * position in the list, or NULL when releasing */
+    bool *detached;
+};
+
+static int
+qemuHostdevDataIndex(struct qemuHostdevData *data, pciDevice *dev)
+{
+    int i;
+
+    for (i = 0; i < pciDeviceListCount(data->pcidevs); i++) {
+        if (pciDeviceListGet(data->pcidevs, i) == dev)
+            return i;
+    }
+    return -1;
+}
+
+static int
+qemuCheckPciDevice(pciDevice *dev, void *opaque)
+{
+    struct qemuHostdevData *data = opaque;
+
+    /* Validate that non-managed device isn't in use, eg by checking
+     * that device is either un-bound, or bound to pci-stub.ko
+     */
+    if (!pciDeviceIsAssignable(dev, !data->driver->relaxedACS)) {
+        qemuReportError(VIR_ERR_OPERATION_INVALID,
+                        _("PCI device %s is not assignable"),
+                        pciDeviceGetName(dev));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+qemuDetachPciDevice(pciDevice *dev, void *opaque)
+{
+    struct qemuHostdevData *data = opaque;
+
+    if (!pciDeviceGetManaged(dev))
+        return 0;
+    if (pciDettachDevice(dev, data->activedevs) < 0)
+        return -1;
+
+    /* Each device is only ever seen by the worker of its bus */
+    data->detached[qemuHostdevDataIndex(data, dev)] = true;
+    return 0;
+}
+
+static int
+qemuResetPciDevice(pciDevice *dev, void *opaque)
+{
+    struct qemuHostdevData *data = opaque;
+
+    if (pciResetDevice(dev, data->activedevs, data->pcidevs) < 0)
+        return -1;
+
+    VIR_DEBUG("Reset of PCI device %s took %llums",
+              pciDeviceGetName(dev), pciDeviceGetResetTime(dev));
+    return 0;
+}
+
+static int
+qemuUndoPciDevice(pciDevice *dev, void *opaque)
+{
+    struct qemuHostdevData *data = opaque;
+
+    /* Devices left bound to their host driver, or that were not
+     * managed, stay as they are */
+    if (!data->detached[qemuHostdevDataIndex(data, dev)])
+        return 0;
+
+    ignore_value(pciReAttachDevice(dev, data->activedevs));
+    return 0;
+}
+
 int qemuPrepareHostdevPCIDevices(struct qemud_driver *driver,
-                                 const char *name,
+                                 virDomainObjPtr vm,
                                  virDomainHostdevDefPtr *hostdevs,
                                  int nhostdevs)
 {
+    /* *All* devices on a bus must be detached before we reset any of
+     * them, because in some cases you have to reset the whole bus,
+     * which impacts all devices on it. Also, all devices must be reset
+     * before being handed over to the guest.
+     */
+    static const pciDeviceListActor prepare[] = {
+        qemuCheckPciDevice,
+        qemuDetachPciDevice,
+        qemuResetPciDevice,
+    };
+    static const pciDeviceListActor undo[] = {
+        qemuUndoPciDevice,
+    };
     pciDeviceList *pcidevs;
+    struct qemuHostdevData data;
     int i;
+    int rc;
     int ret = -1;
 
+    memset(&data, 0, sizeof(data));
+
     if (!(pcidevs = qemuGetPciHostDeviceList(hostdevs, nhostdevs)))
         return -1;
 
-    /* We have to use 6 loops here. *All* devices must
-     * be detached before we reset any of them, because
-     * in some cases you have to reset the whole PCI,
-     * which impacts all devices on it. Also, all devices
-     * must be reset before being marked as active.
-     */
+    if (pciDeviceListCount(pcidevs) == 0) {
+        ret = 0;
+        goto cleanup;
+    }
 
-    /* Loop 1: validate that non-managed device isn't in use, eg
-     * by checking that device is either un-bound, or bound
-     * to pci-stub.ko
+    /* Step 1: validate that none of the devices is in use by another
+     * domain, i.e. in the list driver->activePciHostdevs.
      */
-
     for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
         pciDevice *dev = pciDeviceListGet(pcidevs, i);
         pciDevice *other;
 
-        if (!pciDeviceIsAssignable(dev, !driver->relaxedACS)) {
-            qemuReportError(VIR_ERR_OPERATION_INVALID,
-                            _("PCI device %s is not assignable"),
-                            pciDeviceGetName(dev));
-            goto cleanup;
-        }
-        /* The device is in use by other active domain if
-         * the dev is in list driver->activePciHostdevs.
-         */
         if ((other = pciDeviceListFind(driver->activePciHostdevs, dev))) {
             const char *other_name = pciDeviceGetUsedBy(other);
 
@@ -195,44 +287,50 @@ int qemuPrepareHostdevPCIDevices(struct qemud_driver *driver,
         }
     }
 
-    /* Loop 2: detach managed devices */
-    for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
-        pciDevice *dev = pciDeviceListGet(pcidevs, i);
-        if (pciDeviceGetManaged(dev) &&
-            pciDettachDevice(dev, driver->activePciHostdevs) < 0)
-            goto reattachdevs;
-    }
-
-    /* Loop 3: Now that all the PCI hostdevs have been detached, we
-     * can safely reset them */
+    /* Step 2: mark all the devices as active and used by this domain
+     * right away. This reserves them while we work on them without the
+     * driver lock; other domains and node device APIs keep off them.
+     */
     for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
         pciDevice *dev = pciDeviceListGet(pcidevs, i);
-        if (pciResetDevice(dev, driver->activePciHostdevs, pcidevs) < 0)
-            goto reattachdevs;
-    }
 
-    /* Loop 4: Now mark all the devices as active */
-    for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
-        pciDevice *dev = pciDeviceListGet(pcidevs, i);
-        if (pciDeviceListAdd(driver->activePciHostdevs, dev) < 0) {
-            pciFreeDevice(dev);
+        if (pciDeviceListAdd(driver->activePciHostdevs, dev) < 0)
             goto inactivedevs;
-        }
+        pciDeviceSetUsedBy(dev, vm->def->name);
     }
 
-    /* Loop 5: Now set the used_by_domain of the device in
-     * driver->activePciHostdevs as domain name.
+    /* Step 3: check, detach and reset the devices. This is all sysfs
+     * and config space work, which may take seconds with bus resets, so
+     * it runs unlocked and in parallel for devices on different buses.
+     * Since the devices are reserved, there is no active list to check
+     * them against.
      */
-    for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
-        pciDevice *dev, *activeDev;
-
-        dev = pciDeviceListGet(pcidevs, i);
-        activeDev = pciDeviceListFind(driver->activePciHostdevs, dev);
+    data.driver = driver;
+    data.pcidevs = pcidevs;
+    if (VIR_ALLOC_N(data.detached, pciDeviceListCount(pcidevs)) < 0) {
+        virReportOOMError();
+        goto inactivedevs;
+    }
 
-        pciDeviceSetUsedBy(activeDev, name);
+    qemuDomainObjEnterRemoteWithDriver(driver, vm);
+    rc = pciDeviceListForEachBus(pcidevs, prepare,
+                                 ARRAY_CARDINALITY(prepare), &data);
+    if (rc < 0) {
+        virErrorPtr err = virSaveLastError();
+        ignore_value(pciDeviceListForEachBus(pcidevs, undo,
+                                             ARRAY_CARDINALITY(undo),
+                                             &data));
+        if (err) {
+            virSetError(err);
+            virFreeError(err);
+        }
     }
+    qemuDomainObjExitRemoteWithDriver(driver, vm);
 
-    /* Loop 6: Now steal all the devices from pcidevs */
+    if (rc < 0)
+        goto inactivedevs;
+
+    /* Step 4: the devices now belong to driver->activePciHostdevs */
     while (pciDeviceListCount(pcidevs) > 0) {
         pciDevice *dev = pciDeviceListGet(pcidevs, 0);
         pciDeviceListSteal(pcidevs, dev);
@@ -245,27 +343,23 @@ inactivedevs:
     /* Only steal all the devices from driver->activePciHostdevs. We will
      * free them in pciDeviceListFree().
      */
-    while (pciDeviceListCount(pcidevs) > 0) {
-        pciDevice *dev = pciDeviceListGet(pcidevs, 0);
-        pciDeviceListSteal(driver->activePciHostdevs, dev);
-    }
-
-reattachdevs:
     for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
         pciDevice *dev = pciDeviceListGet(pcidevs, i);
-        pciReAttachDevice(dev, driver->activePciHostdevs);
+        pciDeviceListSteal(driver->activePciHostdevs, dev);
     }
 
 cleanup:
+    VIR_FREE(data.detached);
     pciDeviceListFree(pcidevs);
     return ret;
 }
 
 static int
 qemuPrepareHostPCIDevices(struct qemud_driver *driver,
-                          virDomainDefPtr def)
+                          virDomainObjPtr vm)
 {
-    return qemuPrepareHostdevPCIDevices(driver, def->name, def->hostdevs, def->nhostdevs);
+    return qemuPrepareHostdevPCIDevices(driver, vm, vm->def->hostdevs,
+                                        vm->def->nhostdevs);
 }
 
 
@@ -303,29 +397,42 @@ qemuPrepareHostUSBDevices(struct qemud_driver *driver ATTRIBUTE_UNUSED,
 
 
 int qemuPrepareHostDevices(struct qemud_driver *driver,
-                           virDomainDefPtr def)
+                           virDomainObjPtr vm)
 {
-    if (!def->nhostdevs)
+    if (!vm->def->nhostdevs)
         return 0;
 
-    if (qemuPrepareHostPCIDevices(driver, def) < 0)
+    if (qemuPrepareHostPCIDevices(driver, vm) < 0)
         return -1;
 
-    if (qemuPrepareHostUSBDevices(driver, def) < 0)
+    if (qemuPrepareHostUSBDevices(driver, vm->def) < 0)
         return -1;
 
     return 0;
 }
 
 
+/* Bounds for polling until KVM lets go of a device, in ms */
+#define QEMU_PCI_CLEANUP_POLL_MIN 10
+#define QEMU_PCI_CLEANUP_POLL_MAX 100
+#define QEMU_PCI_CLEANUP_TIMEOUT 10000
+
 void qemuReattachPciDevice(pciDevice *dev, struct qemud_driver *driver)
 {
-    int retries = 100;
-
-    while (pciWaitForDeviceCleanup(dev, "kvm_assigned_device")
-           && retries) {
-        usleep(100*1000);
-        retries--;
+    unsigned long long start;
+    unsigned long long now;
+    unsigned int interval = QEMU_PCI_CLEANUP_POLL_MIN;
+
+    if (virTimeMs(&start) < 0)
+        start = 0;
+    now = start;
+
+    while (pciWaitForDeviceCleanup(dev, "kvm_assigned_device") &&
+           now - start < QEMU_PCI_CLEANUP_TIMEOUT) {
+        usleep(interval * 1000);
+        interval = MIN(interval * 2, QEMU_PCI_CLEANUP_POLL_MAX);
+        if (virTimeMs(&now) < 0)
+            break;
     }
 
     if (pciDeviceGetManaged(dev)) {
@@ -339,12 +446,39 @@ void qemuReattachPciDevice(pciDevice *dev, struct qemud_driver *driver)
 }
 
 
+static int
+qemuResetInactivePciDevice(pciDevice *dev, void *opaque)
+{
+    if (qemuResetPciDevice(dev, opaque) < 0) {
+        virErrorPtr err = virGetLastError();
+        VIR_ERROR(_("Failed to reset PCI device: %s"),
+                  err ? err->message : _("unknown error"));
+        virResetError(err);
+    }
+    return 0;
+}
+
+static int
+qemuReattachInactivePciDevice(pciDevice *dev, void *opaque)
+{
+    struct qemuHostdevData *data = opaque;
+
+    qemuReattachPciDevice(dev, data->driver);
+    return 0;
+}
+
+
 void qemuDomainReAttachHostdevDevices(struct qemud_driver *driver,
                                       const char *name,
                                       virDomainHostdevDefPtr *hostdevs,
                                       int nhostdevs)
 {
+    static const pciDeviceListActor release[] = {
+        qemuResetInactivePciDevice,
+        qemuReattachInactivePciDevice,
+    };
     pciDeviceList *pcidevs;
+    struct qemuHostdevData data;
     int i;
 
     if (!(pcidevs = qemuGetActivePciHostDeviceList(driver,
@@ -375,20 +509,14 @@ void qemuDomainReAttachHostdevDevices(struct qemud_driver *driver,
         pciDeviceListSteal(driver->activePciHostdevs, dev);
     }
 
-    for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
-        pciDevice *dev = pciDeviceListGet(pcidevs, i);
-        if (pciResetDevice(dev, driver->activePciHostdevs, pcidevs) < 0) {
-            virErrorPtr err = virGetLastError();
-            VIR_ERROR(_("Failed to reset PCI device: %s"),
-                      err ? err->message : _("unknown error"));
-            virResetError(err);
-        }
-    }
-
-    for (i = 0; i < pciDeviceListCount(pcidevs); i++) {
-        pciDevice *dev = pciDeviceListGet(pcidevs, i);
-        qemuReattachPciDevice(dev, driver);
-    }
+    /* Reset all the devices on a bus before re-attaching any of them;
+     * devices on different buses are handled in parallel */
+    data.driver = driver;
+    data.activedevs = driver->activePciHostdevs;
+    data.pcidevs = pcidevs;
+    data.detached = NULL;
+    ignore_value(pciDeviceListForEachBus(pcidevs, release,
+                                         ARRAY_CARDINALITY(release), &data));
 
     pciDeviceListFree(pcidevs);
 }
@@ -401,7 +529,4 @@ void qemuDomainReAttachHostDevices(struct qemud_driver *driver,
         return;
 
     qemuDomainReAttachHostdevDevices(driver, def->name, def->hostdevs, def->nhostdevs);
-
-    /* workaround for RHEL bug 696877 */
-    sleep(6);
 }
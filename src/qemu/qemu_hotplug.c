@@ -43,6 +43,11 @@
 
 #define VIR_FROM_THIS VIR_FROM_QEMU
 
+/* Bounds of the interval between two looks at the guest PCI devices
+ * while waiting for a hotplug to complete, in milliseconds */
+#define QEMU_HOTPLUG_POLL_MIN 10
+#define QEMU_HOTPLUG_POLL_MAX 250
+
 int qemuDomainChangeEjectableMedia(struct qemud_driver *driver,
                                    virDomainObjPtr vm,
                                    virDomainDiskDefPtr disk,
@@ -640,6 +645,7 @@ int qemuDomainAttachNetDevice(virConnectPtr conn,
     int vlan;
     bool releaseaddr = false;
     bool iface_connected = false;
+    bool vfs_connected = false;
     int actualType;
 
     if (!qemuCapsGet(priv->qemuCaps, QEMU_CAPS_HOST_NET_ADD)) {
@@ -665,6 +671,9 @@ int qemuDomainAttachNetDevice(virConnectPtr conn,
         if (qemuOpenVhostNet(vm->def, net, priv->qemuCaps, &vhostfd) < 0)
             goto cleanup;
     } else if (actualType == VIR_DOMAIN_NET_TYPE_DIRECT) {
+        if (qemuPhysIfaceConnectVfs(&net, 1) < 0)
+            goto cleanup;
+        vfs_connected = true;
         if ((tapfd = qemuPhysIfaceConnect(vm->def, conn, driver, net,
                                           priv->qemuCaps,
                                           VIR_VM_OP_CREATE)) < 0)
@@ -796,6 +805,9 @@ cleanup:
         if (iface_connected)
             virDomainConfNWFilterTeardown(net);
 
+        if (vfs_connected)
+            qemuPhysIfaceDisconnectVfs(&net, 1);
+
         networkReleaseActualDevice(net);
     }
 
@@ -846,6 +858,155 @@ no_memory:
 }
 
 
+/* Sleep for @ms milliseconds without holding the driver and domain
+ * locks. Returns -1 if the guest went away meanwhile */
+static int
+qemuDomainHotplugSleep(struct qemud_driver *driver,
+                       virDomainObjPtr vm,
+                       unsigned long long ms)
+{
+    qemuDomainObjEnterRemoteWithDriver(driver, vm);
+    usleep(ms * 1000);
+    qemuDomainObjExitRemoteWithDriver(driver, vm);
+
+    if (!virDomainObjIsActive(vm)) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("guest unexpectedly quit during hotplug"));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Hold a PCI hotplug back until the guest had time to handle the
+ * previous one */
+static int
+qemuDomainPCIHotplugSettle(struct qemud_driver *driver,
+                           virDomainObjPtr vm)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned long long now;
+
+    if (!priv->pciHotplugSettle ||
+        virTimeMs(&now) < 0 ||
+        now >= priv->pciHotplugSettle)
+        return 0;
+
+    VIR_DEBUG("Waiting %llums for the previous PCI hotplug to settle",
+              priv->pciHotplugSettle - now);
+
+    return qemuDomainHotplugSleep(driver, vm, priv->pciHotplugSettle - now);
+}
+
+
+/*
+ * Look at the PCI devices of the guest until the one at @addr shows up
+ * or, when unplugging it, is gone, which happens once the guest ejected
+ * it. Give up after the hotplug timeout.
+ *
+ * Returns 0 if the device got there, -1 otherwise
+ */
+static int
+qemuDomainWaitPCIHotplug(struct qemud_driver *driver,
+                         virDomainObjPtr vm,
+                         virDomainDevicePCIAddressPtr addr,
+                         bool present)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuMonitorPCIAddress *addrs = NULL;
+    unsigned long long now;
+    unsigned long long deadline;
+    unsigned long long delay = QEMU_HOTPLUG_POLL_MIN;
+    int naddrs;
+    int i;
+
+    if (virTimeMs(&now) < 0)
+        return -1;
+    deadline = now + driver->hotplugTimeout;
+
+    for (;;) {
+        qemuDomainObjEnterMonitorWithDriver(driver, vm);
+        naddrs = qemuMonitorGetAllPCIAddresses(priv->mon, &addrs);
+        qemuDomainObjExitMonitorWithDriver(driver, vm);
+
+        if (naddrs < 0) {
+            virErrorPtr err = virGetLastError();
+            VIR_WARN("Unable to list the PCI devices of %s: %s",
+                     vm->def->name, err ? err->message : _("unknown error"));
+            virResetError(err);
+            return -1;
+        }
+
+        for (i = 0 ; i < naddrs ; i++) {
+            if (addrs[i].addr.domain == addr->domain &&
+                addrs[i].addr.bus == addr->bus &&
+                addrs[i].addr.slot == addr->slot &&
+                addrs[i].addr.function == addr->function)
+                break;
+        }
+        VIR_FREE(addrs);
+
+        if ((i < naddrs) == present)
+            return 0;
+
+        if (virTimeMs(&now) < 0)
+            return -1;
+
+        if (now >= deadline) {
+            VIR_WARN("Guest PCI device %.4x:%.2x:%.2x.%.1x of %s is still %s "
+                     "after %ums",
+                     addr->domain, addr->bus, addr->slot, addr->function,
+                     vm->def->name, present ? "missing" : "present",
+                     driver->hotplugTimeout);
+            return -1;
+        }
+
+        if (delay > deadline - now)
+            delay = deadline - now;
+        if (qemuDomainHotplugSleep(driver, vm, delay) < 0)
+            return -1;
+        delay = MIN(delay * 2, QEMU_HOTPLUG_POLL_MAX);
+    }
+}
+
+
+/* Account for a PCI hotplug which started at @start and completed */
+static void
+qemuDomainPCIHotplugDone(struct qemud_driver *driver,
+                         virDomainObjPtr vm,
+                         virDomainHostdevDefPtr hostdev,
+                         bool attach,
+                         unsigned long long start)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    unsigned long long now;
+    unsigned long long elapsed;
+
+    if (virTimeMs(&now) < 0)
+        return;
+    elapsed = now - start;
+
+    if (attach && driver->hotplugSettleTime)
+        priv->pciHotplugSettle = now + driver->hotplugSettleTime;
+
+    if (priv->job.asyncJob != QEMU_ASYNC_JOB_NONE) {
+        priv->job.hotplugs++;
+        priv->job.hotplugTime += elapsed;
+        if (elapsed > priv->job.hotplugMax)
+            priv->job.hotplugMax = elapsed;
+    }
+
+    VIR_DEBUG("%s host PCI device %.4x:%.2x:%.2x.%.1x in %llums",
+              attach ? "Attached" : "Detached",
+              hostdev->source.subsys.u.pci.domain,
+              hostdev->source.subsys.u.pci.bus,
+              hostdev->source.subsys.u.pci.slot,
+              hostdev->source.subsys.u.pci.function,
+              elapsed);
+}
+
+
 int qemuDomainAttachHostPciDevice(struct qemud_driver *driver,
                                   virDomainObjPtr vm,
                                   virDomainHostdevDefPtr hostdev)
@@ -856,15 +1017,28 @@ int qemuDomainAttachHostPciDevice(struct qemud_driver *driver,
     int configfd = -1;
     char *configfd_name = NULL;
     bool releaseaddr = false;
+    unsigned long long start = 0;
+
+    ignore_value(virTimeMs(&start));
 
     if (VIR_REALLOC_N(vm->def->hostdevs, vm->def->nhostdevs+1) < 0) {
         virReportOOMError();
         return -1;
     }
 
-    if (qemuPrepareHostdevPCIDevices(driver, vm->def->name, &hostdev, 1) < 0)
+    if (qemuPrepareHostdevPCIDevices(driver, vm, &hostdev, 1) < 0)
         return -1;
 
+    /* The guest may have gone while the device was being prepared */
+    if (!virDomainObjIsActive(vm)) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("guest unexpectedly quit during hotplug"));
+        goto error;
+    }
+
+    if (qemuDomainPCIHotplugSettle(driver, vm) < 0)
+        goto error;
+
     if (qemuCapsGet(priv->qemuCaps, QEMU_CAPS_DEVICE)) {
         if (qemuAssignDeviceHostdevAlias(vm->def, hostdev, -1) < 0)
             goto error;
@@ -918,9 +1092,11 @@ int qemuDomainAttachHostPciDevice(struct qemud_driver *driver,
     VIR_FREE(configfd_name);
     VIR_FORCE_CLOSE(configfd);
 
-    /* Add a 6 sec delay for acpi hotplug to cope */
-    /* This is a workaround for RHEL bug 696877 */
-    sleep(6);
+    /* Further PCI hotplugs are held back for a while once the guest
+     * sees the device, for the sake of RHEL bug 696877 */
+    if (qemuDomainWaitPCIHotplug(driver, vm, &hostdev->info.addr.pci,
+                                 true) == 0)
+        qemuDomainPCIHotplugDone(driver, vm, hostdev, true, start);
 
     return 0;
 
@@ -1685,6 +1861,7 @@ int qemuDomainDetachNetDevice(struct qemud_driver *driver,
 #if WITH_MACVTAP
     if (virDomainNetGetActualType(detach) == VIR_DOMAIN_NET_TYPE_DIRECT) {
         qemuPhysIfaceDisconnect(driver, detach);
+        qemuPhysIfaceDisconnectVfs(&detach, 1);
         VIR_FREE(detach->ifname);
     }
 #endif
@@ -1730,6 +1907,7 @@ int qemuDomainDetachHostPciDevice(struct qemud_driver *driver,
     qemuDomainObjPrivatePtr priv = vm->privateData;
     int i, ret;
     pciDevice *pci;
+    unsigned long long start = 0;
 
     for (i = 0 ; i < vm->def->nhostdevs ; i++) {
         if (vm->def->hostdevs[i]->mode != VIR_DOMAIN_HOSTDEV_MODE_SUBSYS ||
@@ -1774,6 +1952,11 @@ int qemuDomainDetachHostPciDevice(struct qemud_driver *driver,
         return -1;
     }
 
+    ignore_value(virTimeMs(&start));
+
+    if (qemuDomainPCIHotplugSettle(driver, vm) < 0)
+        return -1;
+
     qemuDomainObjEnterMonitorWithDriver(driver, vm);
     if (qemuCapsGet(priv->qemuCaps, QEMU_CAPS_DEVICE)) {
         ret = qemuMonitorDelDevice(priv->mon, detach->info.alias);
@@ -1785,6 +1968,22 @@ int qemuDomainDetachHostPciDevice(struct qemud_driver *driver,
     if (ret < 0)
         return -1;
 
+    /* Give the device back to the host only once the guest let go
+     * of it; until then it stays assigned to the domain */
+    if (qemuDomainWaitPCIHotplug(driver, vm, &detach->info.addr.pci,
+                                 false) < 0) {
+        if (virDomainObjIsActive(vm))
+            qemuReportError(VIR_ERR_OPERATION_TIMEOUT,
+                            _("guest did not release host pci device "
+                              "%.4x:%.2x:%.2x.%.1x"),
+                            detach->source.subsys.u.pci.domain,
+                            detach->source.subsys.u.pci.bus,
+                            detach->source.subsys.u.pci.slot,
+                            detach->source.subsys.u.pci.function);
+        return -1;
+    }
+    qemuDomainPCIHotplugDone(driver, vm, detach, false, start);
+
     pci = pciGetDevice(detach->source.subsys.u.pci.domain,
                        detach->source.subsys.u.pci.bus,
                        detach->source.subsys.u.pci.slot,
@@ -1821,10 +2020,6 @@ int qemuDomainDetachHostPciDevice(struct qemud_driver *driver,
     }
     virDomainHostdevDefFree(detach);
 
-    /* Add a 6 sec delay for acpi hotplug to cope */
-    /* This is a workaround for RHEL bug 696877 */
-    sleep(6); 
-    
     return ret;
 }
 
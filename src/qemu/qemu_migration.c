@@ -839,8 +839,242 @@ qemuMigrationSetOffline(struct qemud_driver *driver,
 }
 
 
+/* Bounds for the interval between migration progress checks, in ms */
+#define QEMU_MIGRATION_POLL_MIN 50
+#define QEMU_MIGRATION_POLL_MAX 1000
+
+/* Downtime QEMU allows unless told otherwise, in ms */
+#define QEMU_MIGRATION_DEFAULT_DOWNTIME 30
+
+/* Give each convergence adjustment this long to show its effect, in ms */
+#define QEMU_MIGRATION_CONVERGE_INTERVAL 2000
+
+/*
+ * Updates transfer and dirty page rates from a new sample of migration
+ * progress.  Since remaining = old_remaining - sent + dirtied, the amount
+ * of memory the guest dirtied in between can be derived from the change
+ * in remaining and processed bytes.
+ */
+void
+qemuMigrationUpdateProgress(qemuDomainJobProgressPtr progress,
+                            unsigned long long now,
+                            unsigned long long processed,
+                            unsigned long long remaining)
+{
+    unsigned long long elapsed = now - progress->sampled;
+    unsigned long long sent;
+    unsigned long long dirtied;
+
+    if (progress->samples++ && elapsed && processed >= progress->processed) {
+        sent = processed - progress->processed;
+        if (remaining + sent > progress->remaining)
+            dirtied = remaining + sent - progress->remaining;
+        else
+            dirtied = 0;
+
+        progress->transferRate = sent * 1000 / elapsed;
+        progress->dirtyRate = dirtied * 1000 / elapsed;
+    }
+
+    progress->sampled = now;
+    progress->processed = processed;
+    progress->remaining = remaining;
+
+    VIR_DEBUG("remaining=%llu transferRate=%llu dirtyRate=%llu",
+              remaining, progress->transferRate, progress->dirtyRate);
+}
+
+/*
+ * Decides what to do about a migration based on its latest progress
+ * sample.  Nothing is done while the guest dirties memory clearly slower
+ * than it is sent or while the rest fits into the allowed downtime.
+ * Otherwise bandwidth is raised first, as long as the transfer is really
+ * limited by it, then downtime.  Once both are at their ceiling and the
+ * amount of memory left to send has not dropped for stallTimeout ms, the
+ * policy's stall action is taken, only once.
+ *
+ * Returns the action which the caller is supposed to apply; state then
+ * contains the new downtime and bandwidth.
+ */
+int
+qemuMigrationConverge(const qemuMigrationConvergePolicy *policy,
+                      qemuDomainJobConvergePtr state,
+                      const qemuDomainJobProgress *progress)
+{
+    unsigned long long now = progress->sampled;
+    unsigned long long rate = progress->transferRate;
+    unsigned long long limit;
+    int action = QEMU_MIGRATION_CONVERGE_NONE;
+
+    if (state->stalled || progress->samples < 2 || !rate)
+        return QEMU_MIGRATION_CONVERGE_NONE;
+
+    if (!state->bestTime || progress->remaining < state->bestRemaining) {
+        state->bestRemaining = progress->remaining;
+        state->bestTime = now;
+    }
+
+    if (!state->decided) {
+        state->decided = now;
+        return QEMU_MIGRATION_CONVERGE_NONE;
+    }
+    if (now - state->decided < QEMU_MIGRATION_CONVERGE_INTERVAL)
+        return QEMU_MIGRATION_CONVERGE_NONE;
+    state->decided = now;
+
+    if (progress->dirtyRate < rate - rate / 10 ||
+        progress->remaining * 1000 / rate <= state->downtime)
+        return QEMU_MIGRATION_CONVERGE_NONE;
+
+    limit = (unsigned long long) state->bandwidth * 1024 * 1024;
+    if (state->bandwidth && state->bandwidth < policy->maxBandwidth &&
+        rate >= limit - limit / 10) {
+        if (state->bandwidth > policy->maxBandwidth / 2)
+            state->bandwidth = policy->maxBandwidth;
+        else
+            state->bandwidth *= 2;
+        state->bandwidthSteps++;
+        action = QEMU_MIGRATION_CONVERGE_BANDWIDTH;
+    } else if (state->downtime < policy->maxDowntime) {
+        if (state->downtime > policy->maxDowntime / 2)
+            state->downtime = policy->maxDowntime;
+        else if (state->downtime)
+            state->downtime *= 2;
+        else
+            state->downtime = QEMU_MIGRATION_DEFAULT_DOWNTIME;
+        state->downtimeSteps++;
+        action = QEMU_MIGRATION_CONVERGE_DOWNTIME;
+    } else if (policy->stallAction != QEMU_MIGRATION_CONVERGE_NONE &&
+               now - state->bestTime >= policy->stallTimeout) {
+        state->stalled = true;
+        action = policy->stallAction;
+    }
+
+    if (action != QEMU_MIGRATION_CONVERGE_NONE) {
+        state->lastAction = action;
+        state->lastActionTime = now;
+    }
+    return action;
+}
+
+/*
+ * vm must be locked, qemud_driver must be unlocked
+ *
+ * Lets the convergence controller look at the latest progress sample and
+ * applies whatever it decides.  Returns -1 when the migration was aborted.
+ */
+static int
+qemuMigrationApplyConverge(struct qemud_driver *driver,
+                           virDomainObjPtr vm,
+                           enum qemuDomainAsyncJob asyncJob)
+{
+    qemuDomainObjPrivatePtr priv = vm->privateData;
+    qemuDomainJobConvergePtr state = &priv->job.converge;
+    qemuDomainJobProgressPtr progress = &priv->job.progress;
+    int action;
+    int rc = 0;
+
+    action = qemuMigrationConverge(&driver->migrationConverge,
+                                   state, progress);
+    if (action == QEMU_MIGRATION_CONVERGE_NONE)
+        return 0;
+
+    VIR_INFO("Migration of '%s' does not converge (remaining=%llu "
+             "transferRate=%llu dirtyRate=%llu): %s, downtime=%llums "
+             "bandwidth=%luMiB/s",
+             vm->def->name, progress->remaining, progress->transferRate,
+             progress->dirtyRate,
+             qemuMigrationConvergeActionTypeToString(action),
+             state->downtime, state->bandwidth);
+
+    if (action == QEMU_MIGRATION_CONVERGE_PAUSE) {
+        virDomainObjUnlock(vm);
+        qemuDriverLock(driver);
+        virDomainObjLock(vm);
+        if (virDomainObjGetState(vm, NULL) == VIR_DOMAIN_RUNNING)
+            rc = qemuMigrationSetOffline(driver, vm);
+        virDomainObjUnlock(vm);
+        qemuDriverUnlock(driver);
+        virDomainObjLock(vm);
+
+        if (rc < 0)
+            VIR_WARN("Unable to pause '%s' to finish migration",
+                     vm->def->name);
+        return 0;
+    }
+
+    if (qemuDomainObjEnterMonitorAsyncNoDriver(driver, vm, asyncJob) < 0)
+        return -1;
+
+    switch (action) {
+    case QEMU_MIGRATION_CONVERGE_DOWNTIME:
+        rc = qemuMonitorSetMigrationDowntime(priv->mon, state->downtime);
+        break;
+    case QEMU_MIGRATION_CONVERGE_BANDWIDTH:
+        rc = qemuMonitorSetMigrationSpeed(priv->mon, state->bandwidth);
+        break;
+    case QEMU_MIGRATION_CONVERGE_ABORT:
+        rc = qemuMonitorMigrateCancel(priv->mon);
+        break;
+    }
+    qemuDomainObjExitMonitor(driver, vm);
+
+    if (action == QEMU_MIGRATION_CONVERGE_ABORT) {
+        if (rc == 0) {
+            priv->job.info.type = VIR_DOMAIN_JOB_FAILED;
+            qemuReportError(VIR_ERR_OPERATION_FAILED, "%s",
+                            _("migration job: aborted because migration "
+                              "does not converge"));
+        }
+        return -1;
+    }
+
+    if (rc < 0)
+        VIR_WARN("Unable to adjust migration of '%s'", vm->def->name);
+    return 0;
+}
+
+/*
+ * Returns how long to wait before checking progress again.  While the
+ * transfer keeps its pace the interval doubles up to the maximum; it is
+ * reset as soon as the rate changes noticeably.  The wait never exceeds
+ * half of the expected time to send the remaining memory so that the end
+ * of migration is not noticed late.
+ */
+static unsigned long long
+qemuMigrationPollInterval(qemuDomainJobProgressPtr progress,
+                          unsigned long long lastRate,
+                          unsigned long long interval)
+{
+    unsigned long long rate = progress->transferRate;
+    unsigned long long eta;
+
+    if (!rate ||
+        rate > lastRate + lastRate / 4 ||
+        rate < lastRate - lastRate / 4)
+        return QEMU_MIGRATION_POLL_MIN;
+
+    interval *= 2;
+    if (interval > QEMU_MIGRATION_POLL_MAX)
+        interval = QEMU_MIGRATION_POLL_MAX;
+
+    if (progress->dirtyRate < rate) {
+        eta = progress->remaining * 1000 / rate;
+        if (interval > eta / 2)
+            interval = eta / 2;
+    }
+
+    if (interval < QEMU_MIGRATION_POLL_MIN)
+        interval = QEMU_MIGRATION_POLL_MIN;
+    return interval;
+}
+
+/*
+ * vm must be locked; driver_locked says whether qemud_driver is locked too
+ */
 static int
 qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
+                             bool driver_locked,
                              virDomainObjPtr vm,
                              const char *job,
                              enum qemuDomainAsyncJob asyncJob)
@@ -848,11 +1082,15 @@ qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
     qemuDomainObjPrivatePtr priv = vm->privateData;
     int ret = -1;
     int status;
+    unsigned long long now;
     unsigned long long memProcessed;
     unsigned long long memRemaining;
     unsigned long long memTotal;
 
-    ret = qemuDomainObjEnterMonitorAsync(driver, vm, asyncJob);
+    if (driver_locked)
+        ret = qemuDomainObjEnterMonitorAsync(driver, vm, asyncJob);
+    else
+        ret = qemuDomainObjEnterMonitorAsyncNoDriver(driver, vm, asyncJob);
     if (ret < 0) {
         /* Guest already exited; nothing further to update.  */
         return -1;
@@ -862,13 +1100,16 @@ qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
                                         &memProcessed,
                                         &memRemaining,
                                         &memTotal);
-    qemuDomainObjExitMonitorWithDriver(driver, vm);
+    if (driver_locked)
+        qemuDomainObjExitMonitorWithDriver(driver, vm);
+    else
+        qemuDomainObjExitMonitor(driver, vm);
 
-    if (ret < 0 || virTimeMs(&priv->job.info.timeElapsed) < 0) {
+    if (ret < 0 || virTimeMs(&now) < 0) {
         priv->job.info.type = VIR_DOMAIN_JOB_FAILED;
         return -1;
     }
-    priv->job.info.timeElapsed -= priv->job.start;
+    priv->job.info.timeElapsed = now - priv->job.start;
 
     switch (status) {
     case QEMU_MONITOR_MIGRATION_STATUS_INACTIVE:
@@ -886,6 +1127,8 @@ qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
         priv->job.info.memRemaining = memRemaining;
         priv->job.info.memProcessed = memProcessed;
 
+        qemuMigrationUpdateProgress(&priv->job.progress, now,
+                                    memProcessed, memRemaining);
         ret = 0;
         break;
 
@@ -911,12 +1154,19 @@ qemuMigrationUpdateJobStatus(struct qemud_driver *driver,
 }
 
 
+/*
+ * vm and qemud_driver must be locked before calling.  The driver lock is
+ * dropped while waiting, the async job keeps vm referenced meanwhile.
+ */
 static int
 qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm,
                                enum qemuDomainAsyncJob asyncJob)
 {
     qemuDomainObjPrivatePtr priv = vm->privateData;
     const char *job;
+    unsigned long long interval = QEMU_MIGRATION_POLL_MIN;
+    unsigned long long lastRate = 0;
+    unsigned long long now;
 
     switch (priv->job.asyncJob) {
     case QEMU_ASYNC_JOB_MIGRATION_OUT:
@@ -934,23 +1184,46 @@ qemuMigrationWaitForCompletion(struct qemud_driver *driver, virDomainObjPtr vm,
 
     priv->job.info.type = VIR_DOMAIN_JOB_UNBOUNDED;
 
-    while (priv->job.info.type == VIR_DOMAIN_JOB_UNBOUNDED) {
-        /* Poll every 50ms for progress & to allow cancellation */
-        struct timespec ts = { .tv_sec = 0, .tv_nsec = 50 * 1000 * 1000ull };
+    virDomainObjUnlock(vm);
+    qemuDriverUnlock(driver);
+    virDomainObjLock(vm);
 
-        if (qemuMigrationUpdateJobStatus(driver, vm, job, asyncJob) < 0)
-            goto cleanup;
+    while (priv->job.info.type == VIR_DOMAIN_JOB_UNBOUNDED) {
+        /* QEMU does not emit events about migration progress so we need to
+         * poll for it; anything which may end the job, such as STOP or EOF
+         * from the monitor or a cancel request, wakes us up right away */
+        if (qemuMigrationUpdateJobStatus(driver, false, vm, job, asyncJob) < 0)
+            break;
+        if (priv->job.info.type != VIR_DOMAIN_JOB_UNBOUNDED)
+            break;
 
-        virDomainObjUnlock(vm);
-        qemuDriverUnlock(driver);
+        if (asyncJob == QEMU_ASYNC_JOB_MIGRATION_OUT &&
+            driver->migrationConverge.enabled &&
+            qemuMigrationApplyConverge(driver, vm, asyncJob) < 0)
+            break;
 
-        nanosleep(&ts, NULL);
+        interval = qemuMigrationPollInterval(&priv->job.progress,
+                                             lastRate, interval);
+        lastRate = priv->job.progress.transferRate;
 
-        qemuDriverLock(driver);
-        virDomainObjLock(vm);
+        if (virTimeMs(&now) < 0) {
+            priv->job.info.type = VIR_DOMAIN_JOB_FAILED;
+            break;
+        }
+        if (virCondWaitUntil(&priv->job.progressCond, &vm->lock,
+                             now + interval) < 0 &&
+            errno != ETIMEDOUT) {
+            virReportSystemError(errno, _("%s: %s"), job,
+                                 _("failed to wait for progress"));
+            priv->job.info.type = VIR_DOMAIN_JOB_FAILED;
+            break;
+        }
     }
 
-cleanup:
+    virDomainObjUnlock(vm);
+    qemuDriverLock(driver);
+    virDomainObjLock(vm);
+
     if (priv->job.info.type == VIR_DOMAIN_JOB_COMPLETED)
         return 0;
     else
@@ -1672,6 +1945,9 @@ qemuMigrationRun(struct qemud_driver *driver,
         qemuDomainObjExitMonitorWithDriver(driver, vm);
         goto cleanup;
     }
+    priv->job.converge.bandwidth = migrate_speed;
+    if (!priv->job.converge.downtime)
+        priv->job.converge.downtime = QEMU_MIGRATION_DEFAULT_DOWNTIME;
 
     if (flags & VIR_MIGRATE_NON_SHARED_DISK)
         migrate_flags |= QEMU_MONITOR_MIGRATE_NON_SHARED_DISK;
@@ -1725,7 +2001,7 @@ qemuMigrationRun(struct qemud_driver *driver,
          * rather failed later on.  Check its status before waiting for a
          * connection from qemu which may never be initiated.
          */
-        if (qemuMigrationUpdateJobStatus(driver, vm, _("migration job"),
+        if (qemuMigrationUpdateJobStatus(driver, true, vm, _("migration job"),
                                          QEMU_ASYNC_JOB_MIGRATION_OUT) < 0)
             goto cancel;
 
@@ -145,5 +145,15 @@ int qemuMigrationToFile(struct qemud_driver *driver, virDomainObjPtr vm,
                         enum qemuDomainAsyncJob asyncJob)
     ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(5)
     ATTRIBUTE_RETURN_CHECK;
+void qemuMigrationUpdateProgress(qemuDomainJobProgressPtr progress,
+                                 unsigned long long now,
+                                 unsigned long long processed,
+                                 unsigned long long remaining)
+    ATTRIBUTE_NONNULL(1);
+
+int qemuMigrationConverge(const qemuMigrationConvergePolicy *policy,
+                          qemuDomainJobConvergePtr state,
+                          const qemuDomainJobProgress *progress)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
 
 #endif /* __QEMU_MIGRATION_H__ */
@@ -42,9 +42,14 @@
 #define DEBUG_IO 0
 #define DEBUG_RAW_IO 0
 
+/* How long to wait before retrying a monitor socket refusing
+ * connections, in milliseconds */
+#define QEMU_MONITOR_REFUSED_RETRY 20
+
 struct _qemuMonitor {
     virMutex lock; /* also used to protect fd */
     virCond notify;
+    virCond busy; /* signalled when msg becomes NULL */
 
     int refs;
 
@@ -217,6 +222,8 @@ static void qemuMonitorFree(qemuMonitorPtr mon)
         (mon->cb->destroy)(mon, mon->vm);
     if (virCondDestroy(&mon->notify) < 0)
     {}
+    if (virCondDestroy(&mon->busy) < 0)
+    {}
     virMutexDestroy(&mon->lock);
     VIR_FREE(mon->buffer);
     VIR_FREE(mon);
@@ -256,8 +263,11 @@ qemuMonitorOpenUnix(const char *monitor, pid_t cpid)
 {
     struct sockaddr_un addr;
     int monfd;
-    int timeout = 3; /* In seconds */
-    int ret, i = 0;
+    unsigned long long timeout = 3000; /* In milliseconds */
+    unsigned long long now;
+    unsigned long long then;
+    virFileWatchPtr watch = NULL;
+    int ret;
 
     if ((monfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
         virReportSystemError(errno,
@@ -273,7 +283,15 @@ qemuMonitorOpenUnix(const char *monitor, pid_t cpid)
         goto error;
     }
 
-    do {
+    /* Watch before the first attempt so that the socket cannot show up
+     * unnoticed in between */
+    if (!(watch = virFileWatchNew(cpid)) ||
+        virFileWatchAddPath(watch, monitor, true) < 0 ||
+        virTimeMs(&now) < 0)
+        goto error;
+    then = now + timeout;
+
+    while (true) {
         ret = connect(monfd, (struct sockaddr *) &addr, sizeof(addr));
 
         if (ret == 0)
@@ -282,15 +300,28 @@ qemuMonitorOpenUnix(const char *monitor, pid_t cpid)
         if ((errno == ENOENT || errno == ECONNREFUSED) &&
             virKillProcess(cpid, 0) == 0) {
             /* ENOENT       : Socket may not have shown up yet
-             * ECONNREFUSED : Leftover socket hasn't been removed yet */
+             * ECONNREFUSED : Leftover socket hasn't been removed yet,
+             *                or QEMU has bound it but not listened
+             *                yet, which no further event announces */
+            bool refused = errno == ECONNREFUSED;
+            unsigned long long delay;
+
+            if (virTimeMs(&now) < 0)
+                goto error;
+            if (now >= then)
+                break;
+            delay = then - now;
+            if (refused && delay > QEMU_MONITOR_REFUSED_RETRY)
+                delay = QEMU_MONITOR_REFUSED_RETRY;
+            if (virFileWatchWait(watch, delay) < 0)
+                goto error;
             continue;
         }
 
         virReportSystemError(errno, "%s",
                              _("failed to connect to monitor socket"));
         goto error;
-
-    } while ((++i <= timeout*5) && (usleep(.2 * 1000000) <= 0));
+    }
 
     if (ret != 0) {
         virReportSystemError(errno, "%s",
@@ -298,9 +329,11 @@ qemuMonitorOpenUnix(const char *monitor, pid_t cpid)
         goto error;
     }
 
+    virFileWatchFree(watch);
     return monfd;
 
 error:
+    virFileWatchFree(watch);
     VIR_FORCE_CLOSE(monfd);
     return -1;
 }
@@ -688,6 +721,14 @@ qemuMonitorOpen(virDomainObjPtr vm,
         VIR_FREE(mon);
         return NULL;
     }
+    if (virCondInit(&mon->busy) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("cannot initialize monitor condition"));
+        ignore_value(virCondDestroy(&mon->notify));
+        virMutexDestroy(&mon->lock);
+        VIR_FREE(mon);
+        return NULL;
+    }
     mon->fd = -1;
     mon->refs = 1;
     mon->vm = vm;
@@ -793,6 +834,16 @@ int qemuMonitorSend(qemuMonitorPtr mon,
 {
     int ret = -1;
 
+    /* Query jobs may send commands concurrently; the monitor lock is
+     * dropped while waiting for a reply, so take turns */
+    while (mon->msg) {
+        if (virCondWait(&mon->busy, &mon->lock) < 0) {
+            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                            _("Unable to wait on monitor condition"));
+            return -1;
+        }
+    }
+
     /* Check whether qemu quited unexpectedly */
     if (mon->lastError.code != VIR_ERR_OK) {
         VIR_DEBUG("Attempt to send command while error is set %s",
@@ -824,6 +875,7 @@ int qemuMonitorSend(qemuMonitorPtr mon,
 cleanup:
     mon->msg = NULL;
     qemuMonitorUpdateWatch(mon);
+    virCondBroadcast(&mon->busy);
 
     return ret;
 }
@@ -1224,16 +1276,13 @@ int qemuMonitorGetBlockInfo(qemuMonitorPtr mon,
     return ret;
 }
 
-int qemuMonitorGetBlockStatsInfo(qemuMonitorPtr mon,
-                                 const char *devname,
-                                 long long *rd_req,
-                                 long long *rd_bytes,
-                                 long long *wr_req,
-                                 long long *wr_bytes,
-                                 long long *errs)
+/* Fills @stats with a qemuBlockStats for each block device, keyed by
+ * the device alias */
+int qemuMonitorGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                    virHashTablePtr stats)
 {
     int ret;
-    VIR_DEBUG("mon=%p dev=%s", mon, devname);
+    VIR_DEBUG("mon=%p", mon);
 
     if (!mon) {
         qemuReportError(VIR_ERR_INVALID_ARG, "%s",
@@ -1242,31 +1291,9 @@ int qemuMonitorGetBlockStatsInfo(qemuMonitorPtr mon,
     }
 
     if (mon->json)
-        ret = qemuMonitorJSONGetBlockStatsInfo(mon, devname,
-                                               rd_req, rd_bytes,
-                                               wr_req, wr_bytes,
-                                               errs);
+        ret = qemuMonitorJSONGetAllBlockStatsInfo(mon, stats);
     else
-        ret = qemuMonitorTextGetBlockStatsInfo(mon, devname,
-                                               rd_req, rd_bytes,
-                                               wr_req, wr_bytes,
-                                               errs);
-    return ret;
-}
-
-int qemuMonitorGetBlockExtent(qemuMonitorPtr mon,
-                              const char *devname,
-                              unsigned long long *extent)
-{
-    int ret;
-    VIR_DEBUG("mon=%p, fd=%d, devname=%p",
-          mon, mon->fd, devname);
-
-    if (mon->json)
-        ret = qemuMonitorJSONGetBlockExtent(mon, devname, extent);
-    else
-        ret = qemuMonitorTextGetBlockExtent(mon, devname, extent);
-
+        ret = qemuMonitorTextGetAllBlockStatsInfo(mon, stats);
     return ret;
 }
 
@@ -235,17 +235,22 @@ int qemuMonitorGetMemoryStats(qemuMonitorPtr mon,
 int qemuMonitorGetBlockInfo(qemuMonitorPtr mon,
                             const char *devname,
                             struct qemuDomainDiskInfo *info);
-int qemuMonitorGetBlockStatsInfo(qemuMonitorPtr mon,
-                                 const char *devname,
-                                 long long *rd_req,
-                                 long long *rd_bytes,
-                                 long long *wr_req,
-                                 long long *wr_bytes,
-                                 long long *errs);
-
-int qemuMonitorGetBlockExtent(qemuMonitorPtr mon,
-                              const char *devname,
-                              unsigned long long *extent);
+
+/* Statistics of one block device, -1 where QEMU does not report them */
+typedef struct _qemuBlockStats qemuBlockStats;
+typedef qemuBlockStats *qemuBlockStatsPtr;
+struct _qemuBlockStats {
+    long long rd_req;
+    long long rd_bytes;
+    long long wr_req;
+    long long wr_bytes;
+    long long errs;
+    bool has_extent;
+    unsigned long long extent;  /* Highest offset written */
+};
+
+int qemuMonitorGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                    virHashTablePtr stats);
 
 
 int qemuMonitorSetVNCPassword(qemuMonitorPtr mon,
@@ -1460,129 +1460,74 @@ cleanup:
 }
 
 
-int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
-                                     const char *devname,
-                                     long long *rd_req,
-                                     long long *rd_bytes,
-                                     long long *wr_req,
-                                     long long *wr_bytes,
-                                     long long *errs)
+static int
+qemuMonitorJSONGetBlockStatsEntry(virJSONValuePtr dev,
+                                  qemuBlockStatsPtr bstats)
 {
-    int ret;
-    int i;
-    int found = 0;
-    virJSONValuePtr cmd = qemuMonitorJSONMakeCommand("query-blockstats",
-                                                     NULL);
-    virJSONValuePtr reply = NULL;
-    virJSONValuePtr devices;
-
-    *rd_req = *rd_bytes = *wr_req = *wr_bytes = *errs = 0;
-
-    if (!cmd)
-        return -1;
+    virJSONValuePtr stats;
+    virJSONValuePtr parent;
 
-    ret = qemuMonitorJSONCommand(mon, cmd, &reply);
-
-    if (ret == 0)
-        ret = qemuMonitorJSONCheckError(cmd, reply);
-    if (ret < 0)
-        goto cleanup;
-    ret = -1;
-
-    devices = virJSONValueObjectGet(reply, "return");
-    if (!devices || devices->type != VIR_JSON_TYPE_ARRAY) {
+    if ((stats = virJSONValueObjectGet(dev, "stats")) == NULL ||
+        stats->type != VIR_JSON_TYPE_OBJECT) {
         qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                        _("blockstats reply was missing device list"));
-        goto cleanup;
+                        _("blockstats stats entry was not in expected format"));
+        return -1;
     }
 
-    for (i = 0 ; i < virJSONValueArraySize(devices) ; i++) {
-        virJSONValuePtr dev = virJSONValueArrayGet(devices, i);
-        virJSONValuePtr stats;
-        const char *thisdev;
-        if (!dev || dev->type != VIR_JSON_TYPE_OBJECT) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats device entry was not in expected format"));
-            goto cleanup;
-        }
-
-        if ((thisdev = virJSONValueObjectGetString(dev, "device")) == NULL) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats device entry was not in expected format"));
-            goto cleanup;
-        }
-
-        /* New QEMU has separate names for host & guest side of the disk
-         * and libvirt gives the host side a 'drive-' prefix. The passed
-         * in devname is the guest side though
-         */
-        if (STRPREFIX(thisdev, QEMU_DRIVE_HOST_PREFIX))
-            thisdev += strlen(QEMU_DRIVE_HOST_PREFIX);
-
-        if (STRNEQ(thisdev, devname))
-            continue;
-
-        found = 1;
-        if ((stats = virJSONValueObjectGet(dev, "stats")) == NULL ||
-            stats->type != VIR_JSON_TYPE_OBJECT) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats stats entry was not in expected format"));
-            goto cleanup;
-        }
-
-        if (virJSONValueObjectGetNumberLong(stats, "rd_bytes", rd_bytes) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "rd_bytes");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "rd_operations", rd_req) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "rd_operations");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "wr_bytes", wr_bytes) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "wr_bytes");
-            goto cleanup;
-        }
-        if (virJSONValueObjectGetNumberLong(stats, "wr_operations", wr_req) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "wr_operations");
-            goto cleanup;
-        }
+    if (virJSONValueObjectGetNumberLong(stats, "rd_bytes",
+                                        &bstats->rd_bytes) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("cannot read %s statistic"),
+                        "rd_bytes");
+        return -1;
     }
-
-    if (!found) {
+    if (virJSONValueObjectGetNumberLong(stats, "rd_operations",
+                                        &bstats->rd_req) < 0) {
         qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                        _("cannot find statistics for device '%s'"), devname);
-        goto cleanup;
+                        _("cannot read %s statistic"),
+                        "rd_operations");
+        return -1;
+    }
+    if (virJSONValueObjectGetNumberLong(stats, "wr_bytes",
+                                        &bstats->wr_bytes) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("cannot read %s statistic"),
+                        "wr_bytes");
+        return -1;
+    }
+    if (virJSONValueObjectGetNumberLong(stats, "wr_operations",
+                                        &bstats->wr_req) < 0) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                        _("cannot read %s statistic"),
+                        "wr_operations");
+        return -1;
     }
-    ret = 0;
 
-cleanup:
-    virJSONValueFree(cmd);
-    virJSONValueFree(reply);
-    return ret;
+    /* The highest offset written is only known for the image file
+     * underneath the format driver, so a device without one is not an
+     * error until someone asks for its extent */
+    if ((parent = virJSONValueObjectGet(dev, "parent")) != NULL &&
+        parent->type == VIR_JSON_TYPE_OBJECT &&
+        (stats = virJSONValueObjectGet(parent, "stats")) != NULL &&
+        stats->type == VIR_JSON_TYPE_OBJECT &&
+        virJSONValueObjectGetNumberUlong(stats, "wr_highest_offset",
+                                         &bstats->extent) == 0)
+        bstats->has_extent = true;
+
+    return 0;
 }
 
 
-int qemuMonitorJSONGetBlockExtent(qemuMonitorPtr mon,
-                                  const char *devname,
-                                  unsigned long long *extent)
+int qemuMonitorJSONGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                        virHashTablePtr stats)
 {
-    int ret = -1;
+    int ret;
     int i;
-    int found = 0;
     virJSONValuePtr cmd = qemuMonitorJSONMakeCommand("query-blockstats",
                                                      NULL);
     virJSONValuePtr reply = NULL;
     virJSONValuePtr devices;
-
-    *extent = 0;
+    qemuBlockStatsPtr bstats = NULL;
 
     if (!cmd)
         return -1;
@@ -1604,8 +1549,6 @@ int qemuMonitorJSONGetBlockExtent(qemuMonitorPtr mon,
 
     for (i = 0 ; i < virJSONValueArraySize(devices) ; i++) {
         virJSONValuePtr dev = virJSONValueArrayGet(devices, i);
-        virJSONValuePtr stats;
-        virJSONValuePtr parent;
         const char *thisdev;
         if (!dev || dev->type != VIR_JSON_TYPE_OBJECT) {
             qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
@@ -1620,46 +1563,33 @@ int qemuMonitorJSONGetBlockExtent(qemuMonitorPtr mon,
         }
 
         /* New QEMU has separate names for host & guest side of the disk
-         * and libvirt gives the host side a 'drive-' prefix. The passed
-         * in devname is the guest side though
+         * and libvirt gives the host side a 'drive-' prefix. The stats
+         * are looked up by the guest side name though
          */
         if (STRPREFIX(thisdev, QEMU_DRIVE_HOST_PREFIX))
             thisdev += strlen(QEMU_DRIVE_HOST_PREFIX);
 
-        if (STRNEQ(thisdev, devname))
-            continue;
-
-        found = 1;
-        if ((parent = virJSONValueObjectGet(dev, "parent")) == NULL ||
-            parent->type != VIR_JSON_TYPE_OBJECT) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats parent entry was not in expected format"));
+        if (VIR_ALLOC(bstats) < 0) {
+            virReportOOMError();
             goto cleanup;
         }
 
-        if ((stats = virJSONValueObjectGet(parent, "stats")) == NULL ||
-            stats->type != VIR_JSON_TYPE_OBJECT) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                            _("blockstats stats entry was not in expected format"));
+        if (qemuMonitorJSONGetBlockStatsEntry(dev, bstats) < 0)
             goto cleanup;
-        }
 
-        if (virJSONValueObjectGetNumberUlong(stats, "wr_highest_offset", extent) < 0) {
-            qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                            _("cannot read %s statistic"),
-                            "wr_highest_offset");
+        if (virHashAddEntry(stats, thisdev, bstats) < 0) {
+            qemuReportError(VIR_ERR_OPERATION_FAILED,
+                            _("failed to save statistics of device '%s'"),
+                            thisdev);
             goto cleanup;
         }
+        bstats = NULL;
     }
 
-    if (!found) {
-        qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                        _("cannot find statistics for device '%s'"), devname);
-        goto cleanup;
-    }
     ret = 0;
 
 cleanup:
+    VIR_FREE(bstats);
     virJSONValueFree(cmd);
     virJSONValueFree(reply);
     return ret;
@@ -2626,12 +2556,135 @@ int qemuMonitorJSONAttachDrive(qemuMonitorPtr mon,
 }
 
 
-int qemuMonitorJSONGetAllPCIAddresses(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
-                                      qemuMonitorPCIAddress **addrs ATTRIBUTE_UNUSED)
+/* Append the devices of a bus to @addrs, and those behind its bridges */
+static int
+qemuMonitorJSONExtractPCIDevices(virJSONValuePtr devices,
+                                 qemuMonitorPCIAddress **addrs,
+                                 size_t *naddrs)
 {
-    qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                    _("query-pci not suppported in JSON mode"));
-    return -1;
+    int ndevices;
+    int i;
+
+    if (devices->type != VIR_JSON_TYPE_ARRAY) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("PCI device list was not an array"));
+        return -1;
+    }
+
+    ndevices = virJSONValueArraySize(devices);
+    for (i = 0 ; i < ndevices ; i++) {
+        virJSONValuePtr entry = virJSONValueArrayGet(devices, i);
+        virJSONValuePtr id;
+        virJSONValuePtr bridge;
+        virJSONValuePtr bridgedevices;
+        qemuMonitorPCIAddress *addr;
+
+        if (!entry) {
+            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                            _("PCI device information was missing array element"));
+            return -1;
+        }
+
+        if (VIR_EXPAND_N(*addrs, *naddrs, 1) < 0) {
+            virReportOOMError();
+            return -1;
+        }
+        addr = &(*addrs)[*naddrs - 1];
+
+        if (virJSONValueObjectGetNumberUint(entry, "bus",
+                                            &addr->addr.bus) < 0 ||
+            virJSONValueObjectGetNumberUint(entry, "slot",
+                                            &addr->addr.slot) < 0 ||
+            virJSONValueObjectGetNumberUint(entry, "function",
+                                            &addr->addr.function) < 0) {
+            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                            _("PCI device information was missing its address"));
+            return -1;
+        }
+
+        if ((id = virJSONValueObjectGet(entry, "id")) &&
+            (virJSONValueObjectGetNumberUint(id, "vendor",
+                                             &addr->vendor) < 0 ||
+             virJSONValueObjectGetNumberUint(id, "device",
+                                             &addr->product) < 0)) {
+            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                            _("PCI device information had a malformed id"));
+            return -1;
+        }
+
+        VIR_DEBUG("Got dev %d:%d:%d   %x:%x",
+                  addr->addr.bus, addr->addr.slot, addr->addr.function,
+                  addr->vendor, addr->product);
+
+        if ((bridge = virJSONValueObjectGet(entry, "pci_bridge")) &&
+            (bridgedevices = virJSONValueObjectGet(bridge, "devices")) &&
+            qemuMonitorJSONExtractPCIDevices(bridgedevices,
+                                             addrs, naddrs) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+int qemuMonitorJSONGetAllPCIAddresses(qemuMonitorPtr mon,
+                                      qemuMonitorPCIAddress **addrs)
+{
+    int ret;
+    virJSONValuePtr cmd = qemuMonitorJSONMakeCommand("query-pci",
+                                                     NULL);
+    virJSONValuePtr reply = NULL;
+    virJSONValuePtr data;
+    qemuMonitorPCIAddress *found = NULL;
+    size_t nfound = 0;
+    int nbuses;
+    int i;
+
+    *addrs = NULL;
+
+    if (!cmd)
+        return -1;
+
+    ret = qemuMonitorJSONCommand(mon, cmd, &reply);
+
+    if (ret == 0)
+        ret = qemuMonitorJSONCheckError(cmd, reply);
+
+    if (ret < 0)
+        goto cleanup;
+    ret = -1;
+
+    if (!(data = virJSONValueObjectGet(reply, "return")) ||
+        data->type != VIR_JSON_TYPE_ARRAY) {
+        qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("query-pci reply was missing return data"));
+        goto cleanup;
+    }
+
+    nbuses = virJSONValueArraySize(data);
+    for (i = 0 ; i < nbuses ; i++) {
+        virJSONValuePtr bus = virJSONValueArrayGet(data, i);
+        virJSONValuePtr devices;
+
+        if (!bus || !(devices = virJSONValueObjectGet(bus, "devices"))) {
+            qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                            _("query-pci reply was missing device list"));
+            goto cleanup;
+        }
+
+        if (qemuMonitorJSONExtractPCIDevices(devices, &found, &nfound) < 0)
+            goto cleanup;
+    }
+
+    *addrs = found;
+    found = NULL;
+    ret = nfound;
+
+cleanup:
+    VIR_FREE(found);
+    virJSONValueFree(cmd);
+    virJSONValueFree(reply);
+    return ret;
 }
 
 
@@ -65,16 +65,8 @@ int qemuMonitorJSONGetMemoryStats(qemuMonitorPtr mon,
 int qemuMonitorJSONGetBlockInfo(qemuMonitorPtr mon,
                                 const char *devname,
                                 struct qemuDomainDiskInfo *info);
-int qemuMonitorJSONGetBlockStatsInfo(qemuMonitorPtr mon,
-                                     const char *devname,
-                                     long long *rd_req,
-                                     long long *rd_bytes,
-                                     long long *wr_req,
-                                     long long *wr_bytes,
-                                     long long *errs);
-int qemuMonitorJSONGetBlockExtent(qemuMonitorPtr mon,
-                                  const char *devname,
-                                  unsigned long long *extent);
+int qemuMonitorJSONGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                          virHashTablePtr stats);
 
 
 int qemuMonitorJSONSetVNCPassword(qemuMonitorPtr mon,
@@ -795,19 +795,15 @@ cleanup:
     return ret;
 }
 
-int qemuMonitorTextGetBlockStatsInfo(qemuMonitorPtr mon,
-                                     const char *devname,
-                                     long long *rd_req,
-                                     long long *rd_bytes,
-                                     long long *wr_req,
-                                     long long *wr_bytes,
-                                     long long *errs)
+int qemuMonitorTextGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                        virHashTablePtr stats)
 {
     char *info = NULL;
     int ret = -1;
     char *dummy;
-    const char *p, *eol;
-    int devnamelen = strlen(devname);
+    char *devname = NULL;
+    const char *p, *eol, *colon;
+    qemuBlockStatsPtr bstats = NULL;
 
     if (qemuMonitorHMPCommand (mon, "info blockstats", &info) < 0) {
         qemuReportError(VIR_ERR_OPERATION_FAILED,
@@ -827,12 +823,6 @@ int qemuMonitorTextGetBlockStatsInfo(qemuMonitorPtr mon,
         goto cleanup;
     }
 
-    *rd_req = -1;
-    *rd_bytes = -1;
-    *wr_req = -1;
-    *wr_bytes = -1;
-    *errs = -1;
-
     /* The output format for both qemu & KVM is:
      *   blockdevice: rd_bytes=% wr_bytes=% rd_operations=% wr_operations=%
      *   (repeated for each block device)
@@ -841,77 +831,85 @@ int qemuMonitorTextGetBlockStatsInfo(qemuMonitorPtr mon,
     p = info;
 
     while (*p) {
+        eol = strchr (p, '\n');
+        if (!eol)
+            eol = p + strlen (p);
+
         /* New QEMU has separate names for host & guest side of the disk
-         * and libvirt gives the host side a 'drive-' prefix. The passed
-         * in devname is the guest side though
+         * and libvirt gives the host side a 'drive-' prefix. The stats
+         * are looked up by the guest side name though
          */
         if (STRPREFIX(p, QEMU_DRIVE_HOST_PREFIX))
             p += strlen(QEMU_DRIVE_HOST_PREFIX);
 
-        if (STREQLEN (p, devname, devnamelen)
-            && p[devnamelen] == ':' && p[devnamelen+1] == ' ') {
+        colon = strchr (p, ':');
+        if (!colon || colon >= eol || colon[1] != ' ')
+            goto next;
 
-            eol = strchr (p, '\n');
-            if (!eol)
-                eol = p + strlen (p);
-
-            p += devnamelen+2;         /* Skip to first label. */
+        if (!(devname = strndup(p, colon - p)) ||
+            VIR_ALLOC(bstats) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        bstats->rd_req = -1;
+        bstats->rd_bytes = -1;
+        bstats->wr_req = -1;
+        bstats->wr_bytes = -1;
+        bstats->errs = -1;
+
+        p = colon + 2;         /* Skip to first label. */
+
+        while (*p) {
+            if (STRPREFIX (p, "rd_bytes=")) {
+                p += 9;
+                if (virStrToLong_ll (p, &dummy, 10, &bstats->rd_bytes) == -1)
+                    VIR_DEBUG ("error reading rd_bytes: %s", p);
+            } else if (STRPREFIX (p, "wr_bytes=")) {
+                p += 9;
+                if (virStrToLong_ll (p, &dummy, 10, &bstats->wr_bytes) == -1)
+                    VIR_DEBUG ("error reading wr_bytes: %s", p);
+            } else if (STRPREFIX (p, "rd_operations=")) {
+                p += 14;
+                if (virStrToLong_ll (p, &dummy, 10, &bstats->rd_req) == -1)
+                    VIR_DEBUG ("error reading rd_req: %s", p);
+            } else if (STRPREFIX (p, "wr_operations=")) {
+                p += 14;
+                if (virStrToLong_ll (p, &dummy, 10, &bstats->wr_req) == -1)
+                    VIR_DEBUG ("error reading wr_req: %s", p);
+            } else
+                VIR_DEBUG ("unknown block stat near %s", p);
+
+            /* Skip to next label. */
+            p = strchr (p, ' ');
+            if (!p || p >= eol) break;
+            p++;
+        }
 
-            while (*p) {
-                if (STRPREFIX (p, "rd_bytes=")) {
-                    p += 9;
-                    if (virStrToLong_ll (p, &dummy, 10, rd_bytes) == -1)
-                        VIR_DEBUG ("error reading rd_bytes: %s", p);
-                } else if (STRPREFIX (p, "wr_bytes=")) {
-                    p += 9;
-                    if (virStrToLong_ll (p, &dummy, 10, wr_bytes) == -1)
-                        VIR_DEBUG ("error reading wr_bytes: %s", p);
-                } else if (STRPREFIX (p, "rd_operations=")) {
-                    p += 14;
-                    if (virStrToLong_ll (p, &dummy, 10, rd_req) == -1)
-                        VIR_DEBUG ("error reading rd_req: %s", p);
-                } else if (STRPREFIX (p, "wr_operations=")) {
-                    p += 14;
-                    if (virStrToLong_ll (p, &dummy, 10, wr_req) == -1)
-                        VIR_DEBUG ("error reading wr_req: %s", p);
-                } else
-                    VIR_DEBUG ("unknown block stat near %s", p);
-
-                /* Skip to next label. */
-                p = strchr (p, ' ');
-                if (!p || p >= eol) break;
-                p++;
-            }
-            ret = 0;
+        if (virHashAddEntry(stats, devname, bstats) < 0) {
+            qemuReportError(VIR_ERR_OPERATION_FAILED,
+                            _("failed to save statistics of device '%s'"),
+                            devname);
             goto cleanup;
         }
+        bstats = NULL;
+        VIR_FREE(devname);
 
+    next:
         /* Skip to next line. */
-        p = strchr (p, '\n');
-        if (!p) break;
-        p++;
+        if (!*eol) break;
+        p = eol + 1;
     }
 
-    /* If we reach here then the device was not found. */
-    qemuReportError (VIR_ERR_INVALID_ARG,
-                     _("no stats found for device %s"), devname);
+    ret = 0;
 
  cleanup:
+    VIR_FREE(bstats);
+    VIR_FREE(devname);
     VIR_FREE(info);
     return ret;
 }
 
 
-int qemuMonitorTextGetBlockExtent(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
-                                  const char *devname ATTRIBUTE_UNUSED,
-                                  unsigned long long *extent ATTRIBUTE_UNUSED)
-{
-    qemuReportError(VIR_ERR_INTERNAL_ERROR, "%s",
-                    _("unable to query block extent with this QEMU"));
-    return -1;
-}
-
-
 static int
 qemuMonitorSendVNCPassphrase(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
                              qemuMonitorMessagePtr msg,
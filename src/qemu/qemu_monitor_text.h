@@ -62,16 +62,8 @@ int qemuMonitorTextGetMemoryStats(qemuMonitorPtr mon,
 int qemuMonitorTextGetBlockInfo(qemuMonitorPtr mon,
                                 const char *devname,
                                 struct qemuDomainDiskInfo *info);
-int qemuMonitorTextGetBlockStatsInfo(qemuMonitorPtr mon,
-                                     const char *devname,
-                                     long long *rd_req,
-                                     long long *rd_bytes,
-                                     long long *wr_req,
-                                     long long *wr_bytes,
-                                     long long *errs);
-int qemuMonitorTextGetBlockExtent(qemuMonitorPtr mon,
-                                  const char *devname,
-                                  unsigned long long *extent);
+int qemuMonitorTextGetAllBlockStatsInfo(qemuMonitorPtr mon,
+                                          virHashTablePtr stats);
 
 int qemuMonitorTextSetVNCPassword(qemuMonitorPtr mon,
                                   const char *password);
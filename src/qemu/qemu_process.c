@@ -135,6 +135,8 @@ qemuProcessHandleMonitorEOF(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
     }
 
     priv = vm->privateData;
+    qemuDomainObjSignalJobProgress(vm);
+
     if (priv->monJSON && !priv->gotShutdown) {
         VIR_DEBUG("Monitor connection to '%s' closed without SHUTDOWN event; "
                   "assuming the domain crashed", vm->def->name);
@@ -498,6 +500,9 @@ qemuProcessHandleStop(qemuMonitorPtr mon ATTRIBUTE_UNUSED,
                                          VIR_DOMAIN_EVENT_SUSPENDED,
                                          VIR_DOMAIN_EVENT_SUSPENDED_PAUSED);
 
+        /* QEMU stops the CPUs right before completing migration */
+        qemuDomainObjSignalJobProgress(vm);
+
         VIR_FREE(priv->lockState);
         if (virDomainLockProcessPause(driver->lockManager, vm, &priv->lockState) < 0)
             VIR_WARN("Unable to release lease on %s", vm->def->name);
@@ -903,13 +908,15 @@ typedef int qemuProcessLogHandleOutput(virDomainObjPtr vm,
 static int
 qemuProcessReadLogOutput(virDomainObjPtr vm,
                          int fd,
+                         virFileWatchPtr watch,
                          char *buf,
                          size_t buflen,
                          qemuProcessLogHandleOutput func,
                          const char *what,
                          int timeout)
 {
-    int retries = (timeout*10);
+    unsigned long long now;
+    unsigned long long then;
     int got = 0;
     char *debug = NULL;
     int ret = -1;
@@ -917,6 +924,10 @@ qemuProcessReadLogOutput(virDomainObjPtr vm,
 
     buf[0] = '\0';
 
+    if (virTimeMs(&now) < 0)
+        return -1;
+    then = now + timeout * 1000ull;
+
     /* This relies on log message format generated by virLogFormatString() and
      * might need to be modified when message format changes. */
     if (virAsprintf(&debug, ": %d: debug : ", vm->pid) < 0) {
@@ -924,7 +935,7 @@ qemuProcessReadLogOutput(virDomainObjPtr vm,
         return -1;
     }
 
-    while (retries) {
+    while (now < then) {
         ssize_t func_ret, bytes;
         int isdead = 0;
         char *eol;
@@ -978,8 +989,11 @@ qemuProcessReadLogOutput(virDomainObjPtr vm,
             goto cleanup;
         }
 
-        usleep(100*1000);
-        retries--;
+        /* QEMU writes to the log whenever there is something to look at
+         * and the log is closed when QEMU exits */
+        if (virFileWatchWait(watch, then - now) < 0 ||
+            virTimeMs(&now) < 0)
+            goto cleanup;
     }
 
     qemuReportError(VIR_ERR_INTERNAL_ERROR,
@@ -1044,13 +1058,22 @@ qemuProcessExtractTTYPath(const char *haystack,
     return 1;
 }
 
+/*
+ * Assigns the pty paths QEMU reported through the monitor, keyed by
+ * chardev alias in @paths, to @devices.
+ *
+ * Returns -1 on error, 0 on success, 1 if a pty device is left without
+ * a path.  If @report is true, the latter is an error too.
+ */
 static int
 qemuProcessLookupPTYs(virDomainChrDefPtr *devices,
                       int count,
                       virHashTablePtr paths,
-                      bool chardevfmt)
+                      bool chardevfmt,
+                      bool report)
 {
     int i;
+    int ret = 0;
     const char *prefix = chardevfmt ? "char" : "";
 
     for (i = 0 ; i < count ; i++) {
@@ -1063,21 +1086,23 @@ qemuProcessLookupPTYs(virDomainChrDefPtr *devices,
                          prefix, chr->info.alias) >= sizeof(id))
                 return -1;
 
-            path = (const char *) virHashLookup(paths, id);
+            path = paths ? (const char *) virHashLookup(paths, id) : NULL;
             if (path == NULL) {
                 if (chr->source.data.file.path == NULL) {
                     /* neither the log output nor 'info chardev' had a
-                     * pty path for this chardev, report an error
+                     * pty path for this chardev
                      */
-                    qemuReportError(VIR_ERR_INTERNAL_ERROR,
-                                    _("no assigned pty for device %s"), id);
-                    return -1;
-                } else {
-                    /* 'info chardev' had no pty path for this chardev,
-                     * but the log output had, so we're fine
-                     */
-                    continue;
+                    if (report) {
+                        qemuReportError(VIR_ERR_INTERNAL_ERROR,
+                                        _("no assigned pty for device %s"), id);
+                        return -1;
+                    }
+                    ret = 1;
                 }
+                /* otherwise 'info chardev' had no pty path for this
+                 * chardev, but the log output had, so we're fine
+                 */
+                continue;
             }
 
             VIR_FREE(chr->source.data.file.path);
@@ -1090,33 +1115,64 @@ qemuProcessLookupPTYs(virDomainChrDefPtr *devices,
         }
     }
 
-    return 0;
+    return ret;
 }
 
+/* Same return values as qemuProcessLookupPTYs, for all the domain's
+ * character devices */
 static int
 qemuProcessFindCharDevicePTYsMonitor(virDomainObjPtr vm,
                                      virBitmapPtr qemuCaps,
-                                     virHashTablePtr paths)
+                                     virHashTablePtr paths,
+                                     bool report)
 {
     bool chardevfmt = qemuCapsGet(qemuCaps, QEMU_CAPS_CHARDEV);
+    int ret = 0;
+    int rc;
 
-    if (qemuProcessLookupPTYs(vm->def->serials, vm->def->nserials,
-                              paths, chardevfmt) < 0)
+    if ((rc = qemuProcessLookupPTYs(vm->def->serials, vm->def->nserials,
+                                    paths, chardevfmt, report)) < 0)
         return -1;
+    ret |= rc;
 
-    if (qemuProcessLookupPTYs(vm->def->parallels, vm->def->nparallels,
-                              paths, chardevfmt) < 0)
+    if ((rc = qemuProcessLookupPTYs(vm->def->parallels, vm->def->nparallels,
+                                    paths, chardevfmt, report)) < 0)
         return -1;
+    ret |= rc;
 
-    if (qemuProcessLookupPTYs(vm->def->channels, vm->def->nchannels,
-                              paths, chardevfmt) < 0)
+    if ((rc = qemuProcessLookupPTYs(vm->def->channels, vm->def->nchannels,
+                                    paths, chardevfmt, report)) < 0)
         return -1;
+    ret |= rc;
 
     if (vm->def->console &&
-        qemuProcessLookupPTYs(&vm->def->console, 1, paths, chardevfmt) < 0)
+        (rc = qemuProcessLookupPTYs(&vm->def->console, 1, paths,
+                                    chardevfmt, report)) < 0)
         return -1;
+    ret |= rc;
 
-    return 0;
+    return ret;
+}
+
+static bool
+qemuProcessHasCharDevicePTYs(virDomainObjPtr vm)
+{
+    int i;
+
+    for (i = 0 ; i < vm->def->nserials ; i++) {
+        if (vm->def->serials[i]->source.type == VIR_DOMAIN_CHR_TYPE_PTY)
+            return true;
+    }
+    for (i = 0 ; i < vm->def->nparallels ; i++) {
+        if (vm->def->parallels[i]->source.type == VIR_DOMAIN_CHR_TYPE_PTY)
+            return true;
+    }
+    for (i = 0 ; i < vm->def->nchannels ; i++) {
+        if (vm->def->channels[i]->source.type == VIR_DOMAIN_CHR_TYPE_PTY)
+            return true;
+    }
+    return vm->def->console &&
+        vm->def->console->source.type == VIR_DOMAIN_CHR_TYPE_PTY;
 }
 
 static int
@@ -1206,20 +1262,33 @@ qemuProcessWaitForMonitor(struct qemud_driver* driver,
     int ret = -1;
     virHashTablePtr paths = NULL;
     qemuDomainObjPrivatePtr priv;
+    char *logfile = NULL;
+    virFileWatchPtr watch = NULL;
 
     if (pos != -1) {
-        if ((logfd = qemuDomainOpenLog(driver, vm, pos)) < 0)
+        if (virAsprintf(&logfile, "%s/%s.log",
+                        driver->logDir, vm->def->name) < 0) {
+            virReportOOMError();
             return -1;
+        }
 
-        if (VIR_ALLOC_N(buf, buf_size) < 0) {
-            virReportOOMError();
+        if (!(watch = virFileWatchNew(vm->pid)) ||
+            virFileWatchAddPath(watch, logfile, false) < 0) {
+            virFileWatchFree(watch);
+            VIR_FREE(logfile);
             return -1;
         }
+        VIR_FREE(logfile);
 
-        if (qemuProcessReadLogOutput(vm, logfd, buf, buf_size,
-                                     qemuProcessFindCharDevicePTYs,
-                                     "console", 30) < 0)
+        if ((logfd = qemuDomainOpenLog(driver, vm, pos)) < 0) {
+            virFileWatchFree(watch);
+            return -1;
+        }
+
+        if (VIR_ALLOC_N(buf, buf_size) < 0) {
+            virReportOOMError();
             goto closelog;
+        }
     }
 
     VIR_DEBUG("Connect monitor to %p '%s'", vm, vm->def->name);
@@ -1227,10 +1296,13 @@ qemuProcessWaitForMonitor(struct qemud_driver* driver,
         goto cleanup;
     }
 
-    /* Try to get the pty path mappings again via the monitor. This is much more
-     * reliable if it's available.
-     * Note that the monitor itself can be on a pty, so we still need to try the
-     * log output method. */
+    if (!qemuProcessHasCharDevicePTYs(vm)) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    /* Get all the pty path mappings at once via the monitor. QEMU has
+     * opened every chardev by the time the monitor answers. */
     paths = virHashCreate(0, qemuProcessFreePtyPath);
     if (paths == NULL)
         goto cleanup;
@@ -1241,8 +1313,31 @@ qemuProcessWaitForMonitor(struct qemud_driver* driver,
     qemuDomainObjExitMonitorWithDriver(driver, vm);
 
     VIR_DEBUG("qemuMonitorGetPtyPaths returned %i", ret);
-    if (ret == 0)
-        ret = qemuProcessFindCharDevicePTYsMonitor(vm, qemuCaps, paths);
+    if (ret == 0) {
+        ret = qemuProcessFindCharDevicePTYsMonitor(vm, qemuCaps, paths,
+                                                   pos == -1);
+    } else if (pos != -1) {
+        /* Older QEMU may not know the command; try the log instead */
+        virResetLastError();
+        virHashFree(paths);
+        paths = NULL;
+        ret = 1;
+    }
+
+    if (ret > 0) {
+        /* Only now fall back to scraping the paths from the log output,
+         * which QEMU prints in the order of the devices. Paths known
+         * from the monitor win. */
+        VIR_DEBUG("Looking for pty paths in the log output");
+        if (qemuProcessReadLogOutput(vm, logfd, watch, buf, buf_size,
+                                     qemuProcessFindCharDevicePTYs,
+                                     "console", 30) < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+
+        ret = qemuProcessFindCharDevicePTYsMonitor(vm, qemuCaps, paths, true);
+    }
 
 cleanup:
     virHashFree(paths);
@@ -1264,6 +1359,7 @@ closelog:
                  virStrerror(errno, ebuf, sizeof ebuf));
     }
 
+    virFileWatchFree(watch);
     VIR_FREE(buf);
 
     return ret;
@@ -2604,6 +2700,18 @@ qemuProcessReconnect(void *opaque)
         goto endjob;
     }
 
+    /* Leases held by libvirtd itself went away with the previous
+     * daemon, so take them again, or keep the guest off its disks */
+    if (state == VIR_DOMAIN_RUNNING &&
+        virLockManagerPluginHeldByCaller(driver->lockManager) &&
+        virDomainLockProcessResume(driver->lockManager, obj, NULL) < 0) {
+        VIR_ERROR(_("Unable to reacquire leases of domain %s, pausing it"),
+                  obj->def->name);
+        if (qemuProcessStopCPUs(driver, obj, VIR_DOMAIN_PAUSED_UNKNOWN,
+                                QEMU_ASYNC_JOB_NONE) < 0)
+            goto error;
+    }
+
     if (qemuCapsGet(priv->qemuCaps, QEMU_CAPS_DEVICE)) {
         priv->persistentAddrs = 1;
 
@@ -2774,6 +2882,20 @@ qemuProcessReconnectAll(virConnectPtr conn, struct qemud_driver *driver)
     virHashForEach(driver->domains.objs, qemuProcessReconnectHelper, &data);
 }
 
+/* Accounts the time since *last to *phase and starts the next phase */
+static void
+qemuProcessStartPhase(unsigned long long *last,
+                      unsigned long long *phase)
+{
+    unsigned long long now;
+
+    if (virTimeMs(&now) < 0)
+        return;
+    if (*last)
+        *phase = now - *last;
+    *last = now;
+}
+
 int qemuProcessStart(virConnectPtr conn,
                      struct qemud_driver *driver,
                      virDomainObjPtr vm,
@@ -2794,11 +2916,15 @@ int qemuProcessStart(virConnectPtr conn,
     virCommandPtr cmd = NULL;
     struct qemuProcessHookData hookData;
     unsigned long cur_balloon;
+    unsigned long long phaseStart = 0;
 
     hookData.conn = conn;
     hookData.vm = vm;
     hookData.driver = driver;
 
+    memset(&priv->startTimes, 0, sizeof(priv->startTimes));
+    qemuProcessStartPhase(&phaseStart, NULL);
+
     VIR_DEBUG("Beginning VM startup process");
 
     if (virDomainObjIsActive(vm)) {
@@ -2837,7 +2963,7 @@ int qemuProcessStart(virConnectPtr conn,
 
     /* Must be run before security labelling */
     VIR_DEBUG("Preparing host devices");
-    if (qemuPrepareHostDevices(driver, vm->def) < 0)
+    if (qemuPrepareHostDevices(driver, vm) < 0)
         goto cleanup;
 
     VIR_DEBUG("Preparing chr devices");
@@ -3039,6 +3165,7 @@ int qemuProcessStart(virConnectPtr conn,
     virCommandDaemonize(cmd);
     virCommandRequireHandshake(cmd);
 
+    qemuProcessStartPhase(&phaseStart, &priv->startTimes.prepare);
     ret = virCommandRun(cmd, NULL);
 
     /* wait for qemu process to show up */
@@ -3118,9 +3245,12 @@ int qemuProcessStart(virConnectPtr conn,
     if (ret == -1) /* The VM failed to start */
         goto cleanup;
 
+    qemuProcessStartPhase(&phaseStart, &priv->startTimes.launch);
+
     VIR_DEBUG("Waiting for monitor to show up");
     if (qemuProcessWaitForMonitor(driver, vm, priv->qemuCaps, pos) < 0)
         goto cleanup;
+    qemuProcessStartPhase(&phaseStart, &priv->startTimes.monitor);
 
     VIR_DEBUG("Detecting VCPU PIDs");
     if (qemuProcessDetectVcpuPIDs(driver, vm) < 0)
@@ -3193,6 +3323,12 @@ int qemuProcessStart(virConnectPtr conn,
     if (virDomainSaveStatus(driver->caps, driver->stateDir, vm) < 0)
         goto cleanup;
 
+    qemuProcessStartPhase(&phaseStart, &priv->startTimes.setup);
+    VIR_INFO("Started domain %s: prepare=%llums launch=%llums "
+             "monitor=%llums setup=%llums", vm->def->name,
+             priv->startTimes.prepare, priv->startTimes.launch,
+             priv->startTimes.monitor, priv->startTimes.setup);
+
     virCommandFree(cmd);
     VIR_FORCE_CLOSE(logfile);
 
@@ -3369,14 +3505,18 @@ void qemuProcessStop(struct qemud_driver *driver,
     qemuDomainReAttachHostDevices(driver, vm->def);
 
     def = vm->def;
+#if WITH_MACVTAP
     for (i = 0; i < def->nnets; i++) {
         virDomainNetDefPtr net = def->nets[i];
-#if WITH_MACVTAP
         if (virDomainNetGetActualType(net) == VIR_DOMAIN_NET_TYPE_DIRECT) {
             qemuPhysIfaceDisconnect(driver, net);
             VIR_FREE(net->ifname);
         }
+    }
+    qemuPhysIfaceDisconnectVfs(def->nets, def->nnets);
 #endif
+    for (i = 0; i < def->nnets; i++) {
+        virDomainNetDefPtr net = def->nets[i];
         /* release the physical device (or any other resources used by
          * this interface in the network driver
          */
@@ -3419,6 +3559,8 @@ retry:
     qemuCapsFree(priv->qemuCaps);
     priv->qemuCaps = NULL;
     VIR_FREE(priv->pidfile);
+    virHashFree(priv->blockStats);
+    priv->blockStats = NULL;
 
     /* The "release" hook cleans up additional resources */
     if (virHookPresent(VIR_HOOK_DRIVER_QEMU)) {
@@ -1456,6 +1456,54 @@ done:
     return rv;
 }
 
+static int
+remoteDomainBlockStatsAll (virDomainPtr domain,
+                           virTypedParameterPtr params, int *nparams,
+                           unsigned int flags)
+{
+    int rv = -1;
+    remote_domain_block_stats_all_args args;
+    remote_domain_block_stats_all_ret ret;
+    struct private_data *priv = domain->conn->privateData;
+
+    remoteDriverLock(priv);
+
+    make_nonnull_domain (&args.dom, domain);
+    args.nparams = *nparams;
+    args.flags = flags;
+
+    memset (&ret, 0, sizeof ret);
+    if (call (domain->conn, priv, 0, REMOTE_PROC_DOMAIN_BLOCK_STATS_ALL,
+              (xdrproc_t) xdr_remote_domain_block_stats_all_args, (char *) &args,
+              (xdrproc_t) xdr_remote_domain_block_stats_all_ret, (char *) &ret) == -1)
+        goto done;
+
+    /* Handle the case when the caller does not know the number of parameters
+     * and is asking for the number of parameters needed
+     */
+    if (*nparams == 0) {
+        *nparams = ret.nparams;
+        rv = 0;
+        goto cleanup;
+    }
+
+    if (remoteDeserializeTypedParameters(ret.params.params_val,
+                                         ret.params.params_len,
+                                         REMOTE_DOMAIN_BLOCK_STATS_ALL_PARAMETERS_MAX,
+                                         params,
+                                         nparams) < 0)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    xdr_free ((xdrproc_t) xdr_remote_domain_block_stats_all_ret,
+              (char *) &ret);
+done:
+    remoteDriverUnlock(priv);
+    return rv;
+}
+
 static int
 remoteDomainGetVcpuPinInfo (virDomainPtr domain,
                             int ncpumaps,
@@ -4365,6 +4413,8 @@ static virDriver remote_driver = {
     .domainGetBlockJobInfo = remoteDomainGetBlockJobInfo, /* 0.9.4 */
     .domainBlockJobSetSpeed = remoteDomainBlockJobSetSpeed, /* 0.9.4 */
     .domainBlockPull = remoteDomainBlockPull, /* 0.9.4 */
+    .getRPCStats = remoteGetRPCStats, /* 0.9.5 */
+    .domainBlockStatsAll = remoteDomainBlockStatsAll, /* 0.9.5 */
 };
 
 static virNetworkDriver network_driver = {
@@ -125,6 +125,9 @@ const REMOTE_DOMAIN_BLKIO_PARAMETERS_MAX = 16;
 /* Upper limit on list of memory parameters. */
 const REMOTE_DOMAIN_MEMORY_PARAMETERS_MAX = 16;
 
+/* Upper limit on list of block stats of all disks. */
+const REMOTE_DOMAIN_BLOCK_STATS_ALL_PARAMETERS_MAX = 1024;
+
 /* Upper limit on list of node cpu stats. */
 const REMOTE_NODE_CPU_STATS_MAX = 16;
 
@@ -393,6 +396,15 @@ struct remote_get_sysinfo_ret {
     remote_nonnull_string sysinfo;
 };
 
+struct remote_get_rpc_stats_args {
+    unsigned int nslowest;
+    unsigned int flags;
+};
+
+struct remote_get_rpc_stats_ret {
+    remote_nonnull_string stats;
+};
+
 struct remote_get_uri_ret {
     remote_nonnull_string uri;
 };
@@ -544,6 +556,17 @@ struct remote_domain_block_stats_ret { /* insert@2 */
     hyper errs;
 };
 
+struct remote_domain_block_stats_all_args {
+    remote_nonnull_domain dom;
+    int nparams;
+    unsigned int flags;
+};
+
+struct remote_domain_block_stats_all_ret {
+    remote_typed_param params<REMOTE_DOMAIN_BLOCK_STATS_ALL_PARAMETERS_MAX>;
+    int nparams;
+};
+
 struct remote_domain_interface_stats_args {
     remote_nonnull_domain dom;
     remote_nonnull_string path;
@@ -2481,7 +2504,9 @@ enum remote_procedure {
     REMOTE_PROC_DOMAIN_BLOCK_JOB_SET_SPEED = 239, /* autogen autogen */
     REMOTE_PROC_DOMAIN_BLOCK_PULL = 240, /* autogen autogen */
 
-    REMOTE_PROC_DOMAIN_EVENT_BLOCK_JOB = 241 /* skipgen skipgen */
+    REMOTE_PROC_DOMAIN_EVENT_BLOCK_JOB = 241, /* skipgen skipgen */
+    REMOTE_PROC_GET_RPC_STATS = 242, /* skipgen autogen priority:high */
+    REMOTE_PROC_DOMAIN_BLOCK_STATS_ALL = 243 /* skipgen skipgen */
 
     /*
      * Notice how the entries are grouped in sets of 10 ?
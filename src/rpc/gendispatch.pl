@@ -37,7 +37,7 @@ sub name_to_ProcName {
     @elems = map { $_ =~ s/Nwfilter/NWFilter/; $_ =~ s/Xml/XML/;
                    $_ =~ s/Uri/URI/; $_ =~ s/Uuid/UUID/; $_ =~ s/Id/ID/;
                    $_ =~ s/Mac/MAC/; $_ =~ s/Cpu/CPU/; $_ =~ s/Os/OS/;
-                   $_ =~ s/Nmi/NMI/; $_ } @elems;
+                   $_ =~ s/Nmi/NMI/; $_ =~ s/Rpc/RPC/; $_ } @elems;
     join "", @elems
 }
 
@@ -939,7 +939,7 @@ elsif ($opt_b) {
 
     print "virNetServerProgramProc ${structprefix}Procs[] = {\n";
     for ($id = 0 ; $id <= $#calls ; $id++) {
-	my ($comment, $name, $argtype, $arglen, $argfilter, $retlen, $retfilter, $priority);
+	my ($comment, $name, $argtype, $arglen, $argfilter, $retlen, $retfilter, $priority, $procname);
 
 	if (defined $calls[$id] && !$calls[$id]->{msg}) {
 	    $comment = "/* Method $calls[$id]->{ProcName} => $id */";
@@ -950,6 +950,7 @@ elsif ($opt_b) {
 	    $retlen = $rettype ne "void" ? "sizeof($rettype)" : "0";
 	    $argfilter = $argtype ne "void" ? "xdr_$argtype" : "xdr_void";
 	    $retfilter = $rettype ne "void" ? "xdr_$rettype" : "xdr_void";
+	    $procname = "\"$calls[$id]->{ProcName}\"";
 	} else {
 	    if ($calls[$id]->{msg}) {
 		$comment = "/* Async event $calls[$id]->{ProcName} => $id */";
@@ -960,11 +961,12 @@ elsif ($opt_b) {
 	    $arglen = $retlen = 0;
 	    $argfilter = "xdr_void";
 	    $retfilter = "xdr_void";
+	    $procname = "NULL";
 	}
 
     $priority = defined $calls[$id]->{priority} ? $calls[$id]->{priority} : 0;
 
-	print "{ $comment\n   ${name},\n   $arglen,\n   (xdrproc_t)$argfilter,\n   $retlen,\n   (xdrproc_t)$retfilter,\n   true,\n   $priority\n},\n";
+	print "{ $comment\n   ${name},\n   $arglen,\n   (xdrproc_t)$argfilter,\n   $retlen,\n   (xdrproc_t)$retfilter,\n   true,\n   $priority,\n   $procname\n},\n";
     }
     print "};\n";
     print "size_t ${structprefix}NProcs = ARRAY_CARDINALITY(${structprefix}Procs);\n";
@@ -41,9 +41,6 @@
     virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,           \
                          __FUNCTION__, __LINE__, __VA_ARGS__)
 
-typedef struct _virNetClientCall virNetClientCall;
-typedef virNetClientCall *virNetClientCallPtr;
-
 enum {
     VIR_NET_CLIENT_MODE_WAIT_TX,
     VIR_NET_CLIENT_MODE_WAIT_RX,
@@ -56,11 +53,25 @@ struct _virNetClientCall {
     virNetMessagePtr msg;
     bool expectReply;
 
+    /* Set when the call could not be completed, with the
+     * call specific error, if there is one */
+    bool failed;
+    virErrorPtr err;
+
     virCond cond;
 
+    /* Transmit queue, or reply table bucket chain */
     virNetClientCallPtr next;
 };
 
+/* Calls awaiting their reply are hashed on their serial. Serials
+ * are allocated sequentially, so this spreads them evenly */
+#define VIR_NET_CLIENT_REPLY_BUCKETS 64
+
+/* Incoming messages dispatched before the I/O thread lets
+ * go of the client lock */
+#define VIR_NET_CLIENT_DISPATCH_BATCH 16
+
 
 struct _virNetClient {
     int refs;
@@ -82,12 +93,25 @@ struct _virNetClient {
     virNetSASLSessionPtr sasl;
 #endif
 
-    /* Self-pipe to wakeup threads waiting in poll() */
+    /* Self-pipe to wakeup the I/O thread from poll() */
     int wakeupSendFD;
     int wakeupReadFD;
+    bool wakeupPending;
+
+    /* The thread owning the socket once the first call is made */
+    virThread ioThread;
+    bool ioThreadRunning;
+    bool quit;
+    bool wantClose;             /* I/O thread closes the socket on exit */
+    virErrorPtr ioError;
+
+    /* Calls waiting to be written, in submission order */
+    virNetClientCallPtr txHead;
+    virNetClientCallPtr txTail;
 
-    /* List of threads currently waiting for dispatch */
-    virNetClientCallPtr waitDispatch;
+    /* Calls written and waiting for their reply */
+    virNetClientCallPtr replies[VIR_NET_CLIENT_REPLY_BUCKETS];
+    size_t nreplies;
 
     size_t nstreams;
     virNetClientStreamPtr *streams;
@@ -106,15 +130,24 @@ static void virNetClientUnlock(virNetClientPtr client)
 }
 
 
-static void virNetClientIncomingEvent(virNetSocketPtr sock,
-                                      int events,
-                                      void *opaque);
+static void virNetClientIOFailAll(virNetClientPtr client);
 
-static void virNetClientEventFree(void *opaque)
+static void virNetClientWakeup(virNetClientPtr client)
 {
-    virNetClientPtr client = opaque;
+    char ignore = 1;
 
-    virNetClientFree(client);
+    /* The I/O thread drains the pipe each time it wakes up, so
+     * one pending byte is enough however many callers want it */
+    if (client->wakeupPending)
+        return;
+
+    if (safewrite(client->wakeupSendFD, &ignore, sizeof(ignore)) != sizeof(ignore)) {
+        char ebuf[1024];
+        VIR_WARN("Failed to wake up client I/O thread: %s",
+                 virStrerror(errno, ebuf, sizeof(ebuf)));
+    } else {
+        client->wakeupPending = true;
+    }
 }
 
 static virNetClientPtr virNetClientNew(virNetSocketPtr sock,
@@ -123,7 +156,8 @@ static virNetClientPtr virNetClientNew(virNetSocketPtr sock,
     virNetClientPtr client = NULL;
     int wakeupFD[2] = { -1, -1 };
 
-    if (pipe2(wakeupFD, O_CLOEXEC) < 0) {
+    if (pipe2(wakeupFD, O_CLOEXEC) < 0 ||
+        virSetNonBlock(wakeupFD[0]) < 0) {
         virReportSystemError(errno, "%s",
                              _("unable to make pipe"));
         goto error;
@@ -146,17 +180,6 @@ static virNetClientPtr virNetClientNew(virNetSocketPtr sock,
         !(client->hostname = strdup(hostname)))
         goto no_memory;
 
-    /* Set up a callback to listen on the socket data */
-    client->refs++;
-    if (virNetSocketAddIOCallback(client->sock,
-                                  VIR_EVENT_HANDLE_READABLE,
-                                  virNetClientIncomingEvent,
-                                  client,
-                                  virNetClientEventFree) < 0) {
-        client->refs--;
-        VIR_DEBUG("Failed to add event watch, disabling events");
-    }
-
     VIR_DEBUG("client=%p refs=%d", client, client->refs);
     return client;
 
@@ -264,6 +287,12 @@ void virNetClientFree(virNetClientPtr client)
     VIR_DEBUG("client=%p refs=%d", client, client->refs);
     client->refs--;
     if (client->refs > 0) {
+        /* The I/O thread holds the last reference, so tell it
+         * to quit, and it will release it */
+        if (client->refs == 1 && client->ioThreadRunning) {
+            client->quit = true;
+            virNetClientWakeup(client);
+        }
         virNetClientUnlock(client);
         return;
     }
@@ -276,9 +305,8 @@ void virNetClientFree(virNetClientPtr client)
     VIR_FORCE_CLOSE(client->wakeupReadFD);
 
     VIR_FREE(client->hostname);
+    virFreeError(client->ioError);
 
-    if (client->sock)
-        virNetSocketRemoveIOCallback(client->sock);
     virNetSocketFree(client->sock);
     virNetTLSSessionFree(client->tls);
 #if HAVE_SASL
@@ -291,13 +319,13 @@ void virNetClientFree(virNetClientPtr client)
 }
 
 
-void virNetClientClose(virNetClientPtr client)
+/*
+ * NB. You must have the client lock before calling this
+ */
+static void virNetClientCloseLocked(virNetClientPtr client)
 {
-    if (!client)
-        return;
+    VIR_DEBUG("client=%p sock=%p", client, client->sock);
 
-    virNetClientLock(client);
-    virNetSocketRemoveIOCallback(client->sock);
     virNetSocketFree(client->sock);
     client->sock = NULL;
     virNetTLSSessionFree(client->tls);
@@ -306,6 +334,31 @@ void virNetClientClose(virNetClientPtr client)
     virNetSASLSessionFree(client->sasl);
     client->sasl = NULL;
 #endif
+    client->wantClose = false;
+}
+
+
+void virNetClientClose(virNetClientPtr client)
+{
+    if (!client)
+        return;
+
+    virNetClientLock(client);
+
+    /* Nothing will ever answer the outstanding calls now */
+    virNetClientIOFailAll(client);
+
+    /* The I/O thread may be in poll() on the socket, where closing
+     * its FD under it could have it poll whatever reuses the FD
+     * number, so leave it to close the socket once it has stopped */
+    if (client->ioThreadRunning) {
+        client->quit = true;
+        client->wantClose = true;
+        virNetClientWakeup(client);
+    } else {
+        virNetClientCloseLocked(client);
+    }
+
     virNetClientUnlock(client);
 }
 
@@ -532,6 +585,136 @@ int virNetClientGetTLSKeySize(virNetClientPtr client)
     return ret;
 }
 
+static unsigned int
+virNetClientReplyBucket(unsigned int serial)
+{
+    return serial % VIR_NET_CLIENT_REPLY_BUCKETS;
+}
+
+
+static void
+virNetClientReplyAdd(virNetClientPtr client,
+                     virNetClientCallPtr call)
+{
+    virNetClientCallPtr *tmp;
+
+    /* Keep each chain in submission order, so stream packets are
+     * matched against calls in the same order as they were made */
+    tmp = &client->replies[virNetClientReplyBucket(call->msg->header.serial)];
+    while (*tmp)
+        tmp = &(*tmp)->next;
+
+    call->next = NULL;
+    *tmp = call;
+    client->nreplies++;
+}
+
+
+static void
+virNetClientReplyRemove(virNetClientPtr client,
+                        virNetClientCallPtr call)
+{
+    virNetClientCallPtr *tmp;
+
+    tmp = &client->replies[virNetClientReplyBucket(call->msg->header.serial)];
+    while (*tmp && *tmp != call)
+        tmp = &(*tmp)->next;
+
+    if (*tmp) {
+        *tmp = call->next;
+        call->next = NULL;
+        client->nreplies--;
+    }
+}
+
+
+static virNetClientCallPtr
+virNetClientReplyFind(virNetClientPtr client,
+                      virNetMessageHeaderPtr header)
+{
+    virNetClientCallPtr thecall;
+
+    thecall = client->replies[virNetClientReplyBucket(header->serial)];
+    while (thecall &&
+           !(thecall->msg->header.prog == header->prog &&
+             thecall->msg->header.vers == header->vers &&
+             thecall->msg->header.serial == header->serial))
+        thecall = thecall->next;
+
+    return thecall;
+}
+
+
+static void
+virNetClientCallComplete(virNetClientPtr client,
+                         virNetClientCallPtr thecall)
+{
+    if (thecall->mode == VIR_NET_CLIENT_MODE_WAIT_RX)
+        virNetClientReplyRemove(client, thecall);
+
+    thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+    virCondSignal(&thecall->cond);
+}
+
+
+static void
+virNetClientCallFail(virNetClientCallPtr thecall)
+{
+    thecall->next = NULL;
+    thecall->failed = true;
+    thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+    virCondSignal(&thecall->cond);
+}
+
+
+static void
+virNetClientIOFailAll(virNetClientPtr client)
+{
+    virNetClientCallPtr thecall;
+    size_t i;
+
+    while ((thecall = client->txHead)) {
+        client->txHead = thecall->next;
+        virNetClientCallFail(thecall);
+    }
+    client->txTail = NULL;
+
+    for (i = 0 ; i < VIR_NET_CLIENT_REPLY_BUCKETS ; i++) {
+        while ((thecall = client->replies[i])) {
+            client->replies[i] = thecall->next;
+            virNetClientCallFail(thecall);
+        }
+    }
+    client->nreplies = 0;
+}
+
+
+/*
+ * The connection is unusable, so record why, fail every outstanding
+ * call with that error and stop the I/O thread
+ */
+static void
+virNetClientMarkFailed(virNetClientPtr client)
+{
+    if (!client->ioError) {
+        if (!virGetLastError())
+            virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("client connection failed"));
+        client->ioError = virSaveLastError();
+    }
+
+    VIR_DEBUG("client=%p failing %zu calls awaiting replies",
+              client, client->nreplies);
+
+    virNetClientIOFailAll(client);
+
+    if (client->ioThreadRunning) {
+        client->quit = true;
+        virNetClientWakeup(client);
+    }
+}
+
+
 static int
 virNetClientCallDispatchReply(virNetClientPtr client)
 {
@@ -539,12 +722,7 @@ virNetClientCallDispatchReply(virNetClientPtr client)
 
     /* Ok, definitely got an RPC reply now find
        out who's been waiting for it */
-    thecall = client->waitDispatch;
-    while (thecall &&
-           !(thecall->msg->header.prog == client->msg.header.prog &&
-             thecall->msg->header.vers == client->msg.header.vers &&
-             thecall->msg->header.serial == client->msg.header.serial))
-        thecall = thecall->next;
+    thecall = virNetClientReplyFind(client, &client->msg.header);
 
     if (!thecall) {
         virNetError(VIR_ERR_RPC,
@@ -553,12 +731,13 @@ virNetClientCallDispatchReply(virNetClientPtr client)
         return -1;
     }
 
-    memcpy(thecall->msg->buffer, client->msg.buffer, sizeof(client->msg.buffer));
+    /* The buffer is huge, so only copy the part in use */
+    memcpy(thecall->msg->buffer, client->msg.buffer, client->msg.bufferLength);
     memcpy(&thecall->msg->header, &client->msg.header, sizeof(client->msg.header));
     thecall->msg->bufferLength = client->msg.bufferLength;
     thecall->msg->bufferOffset = client->msg.bufferOffset;
 
-    thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+    virNetClientCallComplete(client, thecall);
 
     return 0;
 }
@@ -609,12 +788,7 @@ static int virNetClientCallDispatchStream(virNetClientPtr client)
 
     /* Finish/Abort are synchronous, so also see if there's an
      * (optional) call waiting for this stream packet */
-    thecall = client->waitDispatch;
-    while (thecall &&
-           !(thecall->msg->header.prog == client->msg.header.prog &&
-             thecall->msg->header.vers == client->msg.header.vers &&
-             thecall->msg->header.serial == client->msg.header.serial))
-        thecall = thecall->next;
+    thecall = virNetClientReplyFind(client, &client->msg.header);
 
     VIR_DEBUG("Found call %p", thecall);
 
@@ -628,10 +802,10 @@ static int virNetClientCallDispatchStream(virNetClientPtr client)
         if (virNetClientStreamQueuePacket(st, &client->msg) < 0)
             return -1;
 
-        if (thecall && thecall->expectReply) {
+        if (thecall) {
             if (thecall->msg->header.status == VIR_NET_CONTINUE) {
                 VIR_DEBUG("Got a synchronous confirm");
-                thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+                virNetClientCallComplete(client, thecall);
             } else {
                 VIR_DEBUG("Not completing call with status %d", thecall->msg->header.status);
             }
@@ -640,9 +814,9 @@ static int virNetClientCallDispatchStream(virNetClientPtr client)
     }
 
     case VIR_NET_OK:
-        if (thecall && thecall->expectReply) {
+        if (thecall) {
             VIR_DEBUG("Got a synchronous confirm");
-            thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+            virNetClientCallComplete(client, thecall);
         } else {
             VIR_DEBUG("Got unexpected async stream finish confirmation");
             return -1;
@@ -654,12 +828,15 @@ static int virNetClientCallDispatchStream(virNetClientPtr client)
         if (virNetClientStreamSetError(st, &client->msg) < 0)
             return -1;
 
-        if (thecall && thecall->expectReply) {
+        if (thecall) {
             VIR_DEBUG("Got a synchronous error");
-            /* Raise error now, so that this call will see it immediately */
+            /* Raise error now, so that this call will see it immediately.
+             * We're in the I/O thread, so hand it over to the caller */
             if (!virNetClientStreamRaiseError(st))
                 VIR_DEBUG("unable to raise synchronous error");
-            thecall->mode = VIR_NET_CLIENT_MODE_COMPLETE;
+            thecall->err = virSaveLastError();
+            virResetLastError();
+            virNetClientCallComplete(client, thecall);
         }
         return 0;
 
@@ -731,27 +908,39 @@ virNetClientIOWriteMessage(virNetClientPtr client,
 }
 
 
-static ssize_t
-virNetClientIOHandleOutput(virNetClientPtr client)
+/*
+ * Once a call is fully written, either wait for its reply,
+ * or let the caller know it is done
+ */
+static void
+virNetClientCallSent(virNetClientPtr client,
+                     virNetClientCallPtr thecall)
 {
-    virNetClientCallPtr thecall = client->waitDispatch;
+    if (thecall->mode == VIR_NET_CLIENT_MODE_WAIT_RX)
+        virNetClientReplyAdd(client, thecall);
+    else
+        virCondSignal(&thecall->cond);
+}
 
-    while (thecall &&
-           thecall->mode != VIR_NET_CLIENT_MODE_WAIT_TX)
-        thecall = thecall->next;
 
-    if (!thecall)
-        return -1; /* Shouldn't happen, but you never know... */
+static int
+virNetClientIOHandleOutput(virNetClientPtr client)
+{
+    while (client->txHead) {
+        virNetClientCallPtr thecall = client->txHead;
 
-    while (thecall) {
-        ssize_t ret = virNetClientIOWriteMessage(client, thecall);
-        if (ret < 0)
-            return ret;
+        if (virNetClientIOWriteMessage(client, thecall) < 0)
+            return -1;
 
         if (thecall->mode == VIR_NET_CLIENT_MODE_WAIT_TX)
-            return 0; /* Blocking write, to back to event loop */
+            return 0; /* Blocking write, back to poll */
 
-        thecall = thecall->next;
+        client->txHead = thecall->next;
+        if (!client->txHead)
+            client->txTail = NULL;
+        thecall->next = NULL;
+
+        virNetClientCallSent(client, thecall);
     }
 
     return 0; /* No more calls to send, all done */
@@ -781,11 +970,13 @@ virNetClientIOReadMessage(virNetClientPtr client)
 }
 
 
-static ssize_t
+static int
 virNetClientIOHandleInput(virNetClientPtr client)
 {
+    size_t ndispatched = 0;
+
     /* Read as much data as is available, until we get
-     * EAGAIN
+     * EAGAIN, or have dispatched a batch of messages
      */
     for (;;) {
         ssize_t ret = virNetClientIOReadMessage(client);
@@ -809,28 +1000,27 @@ virNetClientIOHandleInput(virNetClientPtr client)
                  * next iteration.
                  */
             } else {
-                ret = virNetClientCallDispatch(client);
+                /* A message nobody was waiting for is not a reason
+                 * to drop the connection and every call on it */
+                if (virNetClientCallDispatch(client) < 0) {
+                    virErrorPtr err = virGetLastError();
+                    VIR_WARN("Failed to dispatch message prog=%d serial=%d: %s",
+                             client->msg.header.prog, client->msg.header.serial,
+                             err && err->message ? err->message : "unknown error");
+                    virResetLastError();
+                }
                 client->msg.bufferOffset = client->msg.bufferLength = 0;
+
                 /*
-                 * We've completed one call, but we don't want to
-                 * spin around the loop forever if there are many
-                 * incoming async events, or replies for other
-                 * thread's RPC calls. We want to get out & let
-                 * any other thread take over as soon as we've
-                 * got our reply. When SASL is active though, we
-                 * may have read more data off the wire than we
-                 * initially wanted & cached it in memory. In this
-                 * case, poll() would not detect that there is more
-                 * ready todo.
-                 *
-                 * So if SASL is active *and* some SASL data is
-                 * already cached, then we'll process that now,
-                 * before returning.
+                 * Don't hog the client lock if there is a flood of
+                 * incoming events, callers need it to submit calls.
+                 * When SASL is active, we may have read more data
+                 * off the wire than we wanted & cached it in memory,
+                 * but the I/O thread checks for that before it
+                 * sleeps in poll() again.
                  */
-                if (ret == 0 &&
-                    virNetSocketHasCachedData(client->sock))
-                    continue;
-                return ret;
+                if (++ndispatched == VIR_NET_CLIENT_DISPATCH_BATCH)
+                    return 0;
             }
         }
     }
@@ -838,25 +1028,52 @@ virNetClientIOHandleInput(virNetClientPtr client)
 
 
 /*
- * Process all calls pending dispatch/receive until we
- * get a reply to our own call. Then quit and pass the buck
- * to someone else.
+ * The I/O thread owns the socket for as long as the connection is
+ * open.  Callers put their calls on the transmit queue, or write
+ * them directly when nothing is queued, then sleep on their own
+ * condition until the I/O thread has matched the reply to them by
+ * serial.  Any number of calls may be outstanding at once, and the
+ * replies may arrive in any order.  Async events and stream packets
+ * are dispatched from here too.
  */
-static int virNetClientIOEventLoop(virNetClientPtr client,
-                                   virNetClientCallPtr thiscall)
+static void
+virNetClientIOThread(void *opaque)
 {
-    struct pollfd fds[2];
-    int ret;
+    virNetClientPtr client = opaque;
+    sigset_t blockedsigs;
 
-    fds[0].fd = virNetSocketGetFD(client->sock);
-    fds[1].fd = client->wakeupReadFD;
+    /* Keep SIGWINCH from interrupting poll in curses programs
+     * (RHBZ#567931).  Same for SIGCHLD and SIGPIPE at the
+     * suggestion of Paolo Bonzini and Daniel Berrange.
+     */
+    sigemptyset (&blockedsigs);
+#ifdef SIGWINCH
+    sigaddset (&blockedsigs, SIGWINCH);
+#endif
+#ifdef SIGCHLD
+    sigaddset (&blockedsigs, SIGCHLD);
+#endif
+    sigaddset (&blockedsigs, SIGPIPE);
+    ignore_value(pthread_sigmask(SIG_BLOCK, &blockedsigs, NULL));
 
-    for (;;) {
-        virNetClientCallPtr tmp = client->waitDispatch;
-        virNetClientCallPtr prev;
-        char ignore;
-        sigset_t oldmask, blockedsigs;
+    virNetClientLock(client);
+
+    VIR_DEBUG("client=%p I/O thread started", client);
+
+    while (!client->quit && client->sock) {
+        struct pollfd fds[2];
         int timeout = -1;
+        int ret;
+
+        fds[0].fd = virNetSocketGetFD(client->sock);
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        if (client->txHead)
+            fds[0].events |= POLLOUT;
+
+        fds[1].fd = client->wakeupReadFD;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
 
         /* If we have existing SASL decoded data we
          * don't want to sleep in the poll(), just
@@ -865,77 +1082,41 @@ static int virNetClientIOEventLoop(virNetClientPtr client,
         if (virNetSocketHasCachedData(client->sock))
             timeout = 0;
 
-        fds[0].events = fds[0].revents = 0;
-        fds[1].events = fds[1].revents = 0;
-
-        fds[1].events = POLLIN;
-        while (tmp) {
-            if (tmp->mode == VIR_NET_CLIENT_MODE_WAIT_RX)
-                fds[0].events |= POLLIN;
-            if (tmp->mode == VIR_NET_CLIENT_MODE_WAIT_TX)
-                fds[0].events |= POLLOUT;
-
-            tmp = tmp->next;
-        }
-
-        /* We have to be prepared to receive stream data
-         * regardless of whether any of the calls waiting
-         * for dispatch are for streams.
-         */
-        if (client->nstreams)
-            fds[0].events |= POLLIN;
-
         /* Release lock while poll'ing so other threads
          * can stuff themselves on the queue */
         virNetClientUnlock(client);
 
-        /* Block SIGWINCH from interrupting poll in curses programs,
-         * then restore the original signal mask again immediately
-         * after the call (RHBZ#567931).  Same for SIGCHLD and SIGPIPE
-         * at the suggestion of Paolo Bonzini and Daniel Berrange.
-         */
-        sigemptyset (&blockedsigs);
-#ifdef SIGWINCH
-        sigaddset (&blockedsigs, SIGWINCH);
-#endif
-#ifdef SIGCHLD
-        sigaddset (&blockedsigs, SIGCHLD);
-#endif
-        sigaddset (&blockedsigs, SIGPIPE);
-        ignore_value(pthread_sigmask(SIG_BLOCK, &blockedsigs, &oldmask));
-
     repoll:
         ret = poll(fds, ARRAY_CARDINALITY(fds), timeout);
-        if (ret < 0 && errno == EAGAIN)
+        if (ret < 0 && (errno == EAGAIN || errno == EINTR))
             goto repoll;
 
-        ignore_value(pthread_sigmask(SIG_SETMASK, &oldmask, NULL));
-
         virNetClientLock(client);
 
-        /* If we have existing SASL decoded data, pretend
-         * the socket became readable so we consume it
-         */
-        if (virNetSocketHasCachedData(client->sock))
-            fds[0].revents |= POLLIN;
+        /* The socket may have been closed while we were in poll() */
+        if (client->quit || !client->sock)
+            break;
 
         if (fds[1].revents) {
+            char ignore[16];
             VIR_DEBUG("Woken up from poll by other thread");
-            if (saferead(client->wakeupReadFD, &ignore, sizeof(ignore)) != sizeof(ignore)) {
-                virReportSystemError(errno, "%s",
-                                     _("read on wakeup fd failed"));
-                goto error;
-            }
+            while (read(client->wakeupReadFD, ignore, sizeof(ignore)) > 0)
+                ;
+            client->wakeupPending = false;
         }
 
         if (ret < 0) {
-            if (errno == EWOULDBLOCK)
-                continue;
             virReportSystemError(errno,
                                  "%s", _("poll on socket failed"));
             goto error;
         }
 
+        /* If we have existing SASL decoded data, pretend
+         * the socket became readable so we consume it
+         */
+        if (virNetSocketHasCachedData(client->sock))
+            fds[0].revents |= POLLIN;
+
         if (fds[0].revents & POLLOUT) {
             if (virNetClientIOHandleOutput(client) < 0)
                 goto error;
@@ -946,250 +1127,203 @@ static int virNetClientIOEventLoop(virNetClientPtr client,
                 goto error;
         }
 
-        /* Iterate through waiting threads and if
-         * any are complete then tell 'em to wakeup
-         */
-        tmp = client->waitDispatch;
-        prev = NULL;
-        while (tmp) {
-            if (tmp != thiscall &&
-                tmp->mode == VIR_NET_CLIENT_MODE_COMPLETE) {
-                /* Take them out of the list */
-                if (prev)
-                    prev->next = tmp->next;
-                else
-                    client->waitDispatch = tmp->next;
-
-                /* And wake them up....
-                 * ...they won't actually wakeup until
-                 * we release our mutex a short while
-                 * later...
-                 */
-                VIR_DEBUG("Waking up sleep %p %p", tmp, client->waitDispatch);
-                virCondSignal(&tmp->cond);
-            } else {
-                prev = tmp;
-            }
-            tmp = tmp->next;
-        }
-
-        /* Now see if *we* are done */
-        if (thiscall->mode == VIR_NET_CLIENT_MODE_COMPLETE) {
-            /* We're at head of the list already, so
-             * remove us
-             */
-            client->waitDispatch = thiscall->next;
-            VIR_DEBUG("Giving up the buck %p %p", thiscall, client->waitDispatch);
-            /* See if someone else is still waiting
-             * and if so, then pass the buck ! */
-            if (client->waitDispatch) {
-                VIR_DEBUG("Passing the buck to %p", client->waitDispatch);
-                virCondSignal(&client->waitDispatch->cond);
-            }
-            return 0;
-        }
-
-
         if (fds[0].revents & (POLLHUP | POLLERR)) {
             virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
                         _("received hangup / error event on socket"));
             goto error;
         }
+
+        continue;
+
+    error:
+        virNetClientMarkFailed(client);
+        virResetLastError();
     }
 
+    VIR_DEBUG("client=%p I/O thread exiting", client);
+    client->ioThreadRunning = false;
+    if (client->wantClose)
+        virNetClientCloseLocked(client);
+    virNetClientUnlock(client);
 
-error:
-    client->waitDispatch = thiscall->next;
-    VIR_DEBUG("Giving up the buck due to I/O error %p %p", thiscall, client->waitDispatch);
-    /* See if someone else is still waiting
-     * and if so, then pass the buck ! */
-    if (client->waitDispatch) {
-        VIR_DEBUG("Passing the buck to %p", client->waitDispatch);
-        virCondSignal(&client->waitDispatch->cond);
+    /* Drop the reference taken when the thread was started */
+    virNetClientFree(client);
+}
+
+
+static virNetClientCallPtr
+virNetClientCallNew(virNetMessagePtr msg,
+                    bool expectReply)
+{
+    virNetClientCallPtr call;
+
+    if (expectReply &&
+        (msg->bufferLength != 0) &&
+        (msg->header.status == VIR_NET_CONTINUE)) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                    _("Attempt to send an asynchronous message with a synchronous reply"));
+        return NULL;
     }
-    return -1;
+
+    if (VIR_ALLOC(call) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    if (virCondInit(&call->cond) < 0) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                    _("cannot initialize condition variable"));
+        VIR_FREE(call);
+        return NULL;
+    }
+
+    if (msg->bufferLength)
+        call->mode = VIR_NET_CLIENT_MODE_WAIT_TX;
+    else
+        call->mode = VIR_NET_CLIENT_MODE_WAIT_RX;
+    call->msg = msg;
+    call->expectReply = expectReply;
+
+    return call;
+}
+
+
+static void
+virNetClientCallFree(virNetClientCallPtr call)
+{
+    if (!call)
+        return;
+
+    virFreeError(call->err);
+    ignore_value(virCondDestroy(&call->cond));
+    VIR_FREE(call);
 }
 
 
 /*
- * This function sends a message to remote server and awaits a reply
- *
- * NB. This does not free the args structure (not desirable, since you
- * often want this allocated on the stack or else it contains strings
- * which come from the user).  It does however free any intermediate
- * results, eg. the error structure if there is one.
- *
- * NB(2). Make sure to memset (&ret, 0, sizeof ret) before calling,
- * else Bad Things will happen in the XDR code.
- *
- * NB(3) You must have the client lock before calling this
- *
- * NB(4) This is very complicated. Multiple threads are allowed to
- * use the client for RPC at the same time. Obviously only one of
- * them can. So if someone's using the socket, other threads are put
- * to sleep on condition variables. The existing thread may completely
- * send & receive their RPC call/reply while they're asleep. Or it
- * may only get around to dealing with sending the call. Or it may
- * get around to neither. So upon waking up from slumber, the other
- * thread may or may not have more work todo.
- *
- * We call this dance  'passing the buck'
- *
- *      http://en.wikipedia.org/wiki/Passing_the_buck
- *
- *   "Buck passing or passing the buck is the action of transferring
- *    responsibility or blame unto another person. It is also used as
- *    a strategy in power politics when the actions of one country/
- *    nation are blamed on another, providing an opportunity for war."
+ * Hand a call over to the I/O thread, starting it if needed.
  *
- * NB(5) Don't Panic!
+ * NB. You must have the client lock before calling this
  */
-static int virNetClientIO(virNetClientPtr client,
-                          virNetClientCallPtr thiscall)
+static int
+virNetClientCallSubmit(virNetClientPtr client,
+                       virNetClientCallPtr thecall)
 {
-    int rv = -1;
-
-    VIR_DEBUG("Outgoing message prog=%u version=%u serial=%u proc=%d type=%d length=%zu dispatch=%p",
-              thiscall->msg->header.prog,
-              thiscall->msg->header.vers,
-              thiscall->msg->header.serial,
-              thiscall->msg->header.proc,
-              thiscall->msg->header.type,
-              thiscall->msg->bufferLength,
-              client->waitDispatch);
-
-    /* Check to see if another thread is dispatching */
-    if (client->waitDispatch) {
-        /* Stick ourselves on the end of the wait queue */
-        virNetClientCallPtr tmp = client->waitDispatch;
-        char ignore = 1;
-        while (tmp && tmp->next)
-            tmp = tmp->next;
-        if (tmp)
-            tmp->next = thiscall;
+    VIR_DEBUG("Outgoing message prog=%u version=%u serial=%u proc=%d type=%d length=%zu pending=%zu",
+              thecall->msg->header.prog,
+              thecall->msg->header.vers,
+              thecall->msg->header.serial,
+              thecall->msg->header.proc,
+              thecall->msg->header.type,
+              thecall->msg->bufferLength,
+              client->nreplies);
+
+    if (!client->sock || client->quit) {
+        if (client->ioError)
+            virSetError(client->ioError);
         else
-            client->waitDispatch = thiscall;
-
-        /* Force other thread to wakeup from poll */
-        if (safewrite(client->wakeupSendFD, &ignore, sizeof(ignore)) != sizeof(ignore)) {
-            if (tmp)
-                tmp->next = NULL;
-            else
-                client->waitDispatch = NULL;
+            virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("client socket is closed"));
+        return -1;
+    }
+
+    if (!client->ioThreadRunning) {
+        client->refs++;
+        if (virThreadCreate(&client->ioThread, false,
+                            virNetClientIOThread, client) < 0) {
+            client->refs--;
             virReportSystemError(errno, "%s",
-                                 _("failed to wake up polling thread"));
+                                 _("unable to create client I/O thread"));
             return -1;
         }
+        client->ioThreadRunning = true;
+    }
 
-        VIR_DEBUG("Going to sleep %p %p", client->waitDispatch, thiscall);
-        /* Go to sleep while other thread is working... */
-        if (virCondWait(&thiscall->cond, &client->lock) < 0) {
-            if (client->waitDispatch == thiscall) {
-                client->waitDispatch = thiscall->next;
-            } else {
-                tmp = client->waitDispatch;
-                while (tmp && tmp->next &&
-                       tmp->next != thiscall) {
-                    tmp = tmp->next;
-                }
-                if (tmp && tmp->next == thiscall)
-                    tmp->next = thiscall->next;
-            }
-            virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
-                        _("failed to wait on condition"));
+    /* Waiting for a stream packet, nothing to send */
+    if (thecall->mode == VIR_NET_CLIENT_MODE_WAIT_RX) {
+        virNetClientReplyAdd(client, thecall);
+        return 0;
+    }
+
+    /* If nothing is queued ahead of us, try to write the call
+     * straight away, saving a trip through the I/O thread */
+    if (!client->txHead) {
+        if (virNetClientIOWriteMessage(client, thecall) < 0) {
+            virNetClientMarkFailed(client);
             return -1;
         }
 
-        VIR_DEBUG("Wokeup from sleep %p %p", client->waitDispatch, thiscall);
-        /* Two reasons we can be woken up
-         *  1. Other thread has got our reply ready for us
-         *  2. Other thread is all done, and it is our turn to
-         *     be the dispatcher to finish waiting for
-         *     our reply
-         */
-        if (thiscall->mode == VIR_NET_CLIENT_MODE_COMPLETE) {
-            rv = 0;
-            /*
-             * We avoided catching the buck and our reply is ready !
-             * We've already had 'thiscall' removed from the list
-             * so just need to (maybe) handle errors & free it
-             */
-            goto cleanup;
+        if (thecall->mode != VIR_NET_CLIENT_MODE_WAIT_TX) {
+            virNetClientCallSent(client, thecall);
+            return 0;
         }
-
-        /* Grr, someone passed the buck onto us ... */
-
-    } else {
-        /* We're first to catch the buck */
-        client->waitDispatch = thiscall;
     }
 
-    VIR_DEBUG("We have the buck %p %p", client->waitDispatch, thiscall);
-    /*
-     * The buck stops here!
-     *
-     * At this point we're about to own the dispatch
-     * process...
-     */
-
-    /*
-     * Avoid needless wake-ups of the event loop in the
-     * case where this call is being made from a different
-     * thread than the event loop. These wake-ups would
-     * cause the event loop thread to be blocked on the
-     * mutex for the duration of the call
-     */
-    virNetSocketUpdateIOCallback(client->sock, 0);
-
-    virResetLastError();
-    rv = virNetClientIOEventLoop(client, thiscall);
-
-    virNetSocketUpdateIOCallback(client->sock, VIR_EVENT_HANDLE_READABLE);
-
-    if (rv == 0 &&
-        virGetLastError())
-        rv = -1;
+    thecall->next = NULL;
+    if (client->txTail)
+        client->txTail->next = thecall;
+    else
+        client->txHead = thecall;
+    client->txTail = thecall;
 
-cleanup:
-    VIR_DEBUG("All done with our call %p %p %d", client->waitDispatch, thiscall, rv);
-    return rv;
+    virNetClientWakeup(client);
+    return 0;
 }
 
 
-void virNetClientIncomingEvent(virNetSocketPtr sock,
-                               int events,
-                               void *opaque)
+/*
+ * Sleep until the I/O thread has completed the call
+ *
+ * NB. You must have the client lock before calling this
+ */
+static int
+virNetClientCallWait(virNetClientPtr client,
+                     virNetClientCallPtr thecall)
 {
-    virNetClientPtr client = opaque;
-
-    virNetClientLock(client);
-
-    if (!client->sock)
-        goto done;
-
-    /* This should be impossible, but it doesn't hurt to check */
-    if (client->waitDispatch)
-        goto done;
-
-    VIR_DEBUG("Event fired %p %d", sock, events);
+    while (thecall->mode != VIR_NET_CLIENT_MODE_COMPLETE) {
+        if (virCondWait(&thecall->cond, &client->lock) < 0) {
+            /* The call may be half written, so the
+             * connection can't be trusted any more */
+            virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("failed to wait on condition"));
+            virNetClientMarkFailed(client);
+            return -1;
+        }
+    }
 
-    if (events & (VIR_EVENT_HANDLE_HANGUP | VIR_EVENT_HANDLE_ERROR)) {
-        VIR_DEBUG("%s : VIR_EVENT_HANDLE_HANGUP or "
-                  "VIR_EVENT_HANDLE_ERROR encountered", __FUNCTION__);
-        virNetSocketRemoveIOCallback(sock);
-        goto done;
+    if (thecall->err) {
+        virSetError(thecall->err);
+        return -1;
     }
 
-    if (virNetClientIOHandleInput(client) < 0) {
-        VIR_WARN("Something went wrong during async message processing");
-        virNetSocketRemoveIOCallback(sock);
+    if (thecall->failed) {
+        if (client->ioError)
+            virSetError(client->ioError);
+        else
+            virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                        _("client socket is closed"));
+        return -1;
     }
 
-done:
-    virNetClientUnlock(client);
+    return 0;
 }
 
 
+/*
+ * This function sends a message to remote server and awaits a reply
+ *
+ * NB. This does not free the args structure (not desirable, since you
+ * often want this allocated on the stack or else it contains strings
+ * which come from the user).  It does however free any intermediate
+ * results, eg. the error structure if there is one.
+ *
+ * NB(2). Make sure to memset (&ret, 0, sizeof ret) before calling,
+ * else Bad Things will happen in the XDR code.
+ *
+ * NB(3). Multiple threads may use the client for RPC at the same
+ * time, their calls are multiplexed over the connection by the
+ * client's I/O thread.
+ */
 int virNetClientSend(virNetClientPtr client,
                      virNetMessagePtr msg,
                      bool expectReply)
@@ -1197,39 +1331,72 @@ int virNetClientSend(virNetClientPtr client,
     virNetClientCallPtr call;
     int ret = -1;
 
-    if (expectReply &&
-        (msg->bufferLength != 0) &&
-        (msg->header.status == VIR_NET_CONTINUE)) {
-        virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
-                    _("Attempt to send an asynchronous message with a synchronous reply"));
+    if (!(call = virNetClientCallNew(msg, expectReply)))
         return -1;
-    }
 
-    if (VIR_ALLOC(call) < 0) {
-        virReportOOMError();
-        return -1;
-    }
+    virNetClientLock(client);
+
+    if (virNetClientCallSubmit(client, call) == 0)
+        ret = virNetClientCallWait(client, call);
+
+    virNetClientUnlock(client);
+
+    virNetClientCallFree(call);
+    return ret;
+}
+
+
+/**
+ * virNetClientSendAsync:
+ * @client: the client
+ * @msg: the encoded call
+ *
+ * Send @msg without waiting for its reply, so that many calls can be
+ * outstanding from a single thread.  @msg must stay valid until it is
+ * passed to virNetClientCallFinish, which fills it with the reply.
+ *
+ * Returns the pending call, or NULL on error
+ */
+virNetClientCallPtr virNetClientSendAsync(virNetClientPtr client,
+                                          virNetMessagePtr msg)
+{
+    virNetClientCallPtr call;
+
+    if (!(call = virNetClientCallNew(msg, true)))
+        return NULL;
 
     virNetClientLock(client);
 
-    if (virCondInit(&call->cond) < 0) {
-        virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
-                    _("cannot initialize condition variable"));
-        goto cleanup;
+    if (virNetClientCallSubmit(client, call) < 0) {
+        virNetClientUnlock(client);
+        virNetClientCallFree(call);
+        return NULL;
     }
 
-    if (msg->bufferLength)
-        call->mode = VIR_NET_CLIENT_MODE_WAIT_TX;
-    else
-        call->mode = VIR_NET_CLIENT_MODE_WAIT_RX;
-    call->msg = msg;
-    call->expectReply = expectReply;
+    virNetClientUnlock(client);
+    return call;
+}
 
-    ret = virNetClientIO(client, call);
 
-cleanup:
-    ignore_value(virCondDestroy(&call->cond));
-    VIR_FREE(call);
+/**
+ * virNetClientCallFinish:
+ * @client: the client
+ * @call: a call returned by virNetClientSendAsync
+ *
+ * Wait for the reply to @call to arrive and release @call.  The
+ * reply is left in the message the call was sent with.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int virNetClientCallFinish(virNetClientPtr client,
+                           virNetClientCallPtr call)
+{
+    int ret;
+
+    virNetClientLock(client);
+    ret = virNetClientCallWait(client, call);
     virNetClientUnlock(client);
+
+    virNetClientCallFree(call);
     return ret;
 }
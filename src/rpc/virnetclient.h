@@ -69,6 +69,11 @@ int virNetClientSend(virNetClientPtr client,
                      virNetMessagePtr msg,
                      bool expectReply);
 
+virNetClientCallPtr virNetClientSendAsync(virNetClientPtr client,
+                                          virNetMessagePtr msg);
+int virNetClientCallFinish(virNetClientPtr client,
+                           virNetClientCallPtr call);
+
 # ifdef HAVE_SASL
 void virNetClientSetSASLSession(virNetClientPtr client,
                                 virNetSASLSessionPtr sasl);
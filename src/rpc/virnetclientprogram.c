@@ -263,34 +263,96 @@ cleanup:
 }
 
 
-int virNetClientProgramCall(virNetClientProgramPtr prog,
-                            virNetClientPtr client,
-                            unsigned serial,
-                            int proc,
-                            xdrproc_t args_filter, void *args,
-                            xdrproc_t ret_filter, void *ret)
-{
+struct _virNetClientProgramPendingCall {
     virNetMessagePtr msg;
+    virNetClientCallPtr call;
+    unsigned serial;
+    int proc;
+};
 
-    if (!(msg = virNetMessageNew(false)))
-        return -1;
 
-    msg->header.prog = prog->program;
-    msg->header.vers = prog->version;
-    msg->header.status = VIR_NET_OK;
-    msg->header.type = VIR_NET_CALL;
-    msg->header.serial = serial;
-    msg->header.proc = proc;
+/**
+ * virNetClientProgramCallAsync:
+ * @prog: the program
+ * @client: the client to send the call over
+ * @serial: the serial number of the call
+ * @proc: the procedure to call
+ * @args_filter: XDR filter for @args
+ * @args: the procedure's arguments
+ *
+ * Start a call, without waiting for its reply.  The result must be
+ * collected with virNetClientProgramCallFinish.
+ *
+ * Returns the pending call, or NULL on error
+ */
+virNetClientProgramPendingCallPtr
+virNetClientProgramCallAsync(virNetClientProgramPtr prog,
+                             virNetClientPtr client,
+                             unsigned serial,
+                             int proc,
+                             xdrproc_t args_filter, void *args)
+{
+    virNetClientProgramPendingCallPtr pending;
+
+    if (VIR_ALLOC(pending) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    if (!(pending->msg = virNetMessageNew(false)))
+        goto error;
+
+    pending->serial = serial;
+    pending->proc = proc;
+
+    pending->msg->header.prog = prog->program;
+    pending->msg->header.vers = prog->version;
+    pending->msg->header.status = VIR_NET_OK;
+    pending->msg->header.type = VIR_NET_CALL;
+    pending->msg->header.serial = serial;
+    pending->msg->header.proc = proc;
 
-    if (virNetMessageEncodeHeader(msg) < 0)
+    if (virNetMessageEncodeHeader(pending->msg) < 0)
         goto error;
 
-    if (virNetMessageEncodePayload(msg, args_filter, args) < 0)
+    if (virNetMessageEncodePayload(pending->msg, args_filter, args) < 0)
         goto error;
 
-    if (virNetClientSend(client, msg, true) < 0)
+    if (!(pending->call = virNetClientSendAsync(client, pending->msg)))
         goto error;
 
+    return pending;
+
+error:
+    virNetMessageFree(pending->msg);
+    VIR_FREE(pending);
+    return NULL;
+}
+
+
+/**
+ * virNetClientProgramCallFinish:
+ * @prog: the program
+ * @client: the client the call was sent over
+ * @pending: the call returned by virNetClientProgramCallAsync
+ * @ret_filter: XDR filter for @ret
+ * @ret: filled with the procedure's result
+ *
+ * Wait for the reply to @pending and decode it, releasing @pending.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int virNetClientProgramCallFinish(virNetClientProgramPtr prog,
+                                  virNetClientPtr client,
+                                  virNetClientProgramPendingCallPtr pending,
+                                  xdrproc_t ret_filter, void *ret)
+{
+    virNetMessagePtr msg = pending->msg;
+    int rv = -1;
+
+    if (virNetClientCallFinish(client, pending->call) < 0)
+        goto cleanup;
+
     /* None of these 3 should ever happen here, because
      * virNetClientSend should have validated the reply,
      * but it doesn't hurt to check again.
@@ -298,42 +360,59 @@ int virNetClientProgramCall(virNetClientProgramPtr prog,
     if (msg->header.type != VIR_NET_REPLY) {
         virNetError(VIR_ERR_INTERNAL_ERROR,
                     _("Unexpected message type %d"), msg->header.type);
-        goto error;
+        goto cleanup;
     }
-    if (msg->header.proc != proc) {
+    if (msg->header.proc != pending->proc) {
         virNetError(VIR_ERR_INTERNAL_ERROR,
                     _("Unexpected message proc %d != %d"),
-                    msg->header.proc, proc);
-        goto error;
+                    msg->header.proc, pending->proc);
+        goto cleanup;
     }
-    if (msg->header.serial != serial) {
+    if (msg->header.serial != pending->serial) {
         virNetError(VIR_ERR_INTERNAL_ERROR,
                     _("Unexpected message serial %d != %d"),
-                    msg->header.serial, serial);
-        goto error;
+                    msg->header.serial, pending->serial);
+        goto cleanup;
     }
 
     switch (msg->header.status) {
     case VIR_NET_OK:
         if (virNetMessageDecodePayload(msg, ret_filter, ret) < 0)
-            goto error;
+            goto cleanup;
         break;
 
     case VIR_NET_ERROR:
         virNetClientProgramDispatchError(prog, msg);
-        goto error;
+        goto cleanup;
 
     default:
         virNetError(VIR_ERR_RPC,
                     _("Unexpected message status %d"), msg->header.status);
-        goto error;
+        goto cleanup;
     }
 
+    rv = 0;
+
+cleanup:
     virNetMessageFree(msg);
+    VIR_FREE(pending);
+    return rv;
+}
 
-    return 0;
 
-error:
-    virNetMessageFree(msg);
-    return -1;
+int virNetClientProgramCall(virNetClientProgramPtr prog,
+                            virNetClientPtr client,
+                            unsigned serial,
+                            int proc,
+                            xdrproc_t args_filter, void *args,
+                            xdrproc_t ret_filter, void *ret)
+{
+    virNetClientProgramPendingCallPtr pending;
+
+    if (!(pending = virNetClientProgramCallAsync(prog, client, serial, proc,
+                                                 args_filter, args)))
+        return -1;
+
+    return virNetClientProgramCallFinish(prog, client, pending,
+                                         ret_filter, ret);
 }
@@ -31,12 +31,18 @@
 typedef struct _virNetClient virNetClient;
 typedef virNetClient *virNetClientPtr;
 
+typedef struct _virNetClientCall virNetClientCall;
+typedef virNetClientCall *virNetClientCallPtr;
+
 typedef struct _virNetClientProgram virNetClientProgram;
 typedef virNetClientProgram *virNetClientProgramPtr;
 
 typedef struct _virNetClientProgramEvent virNetClientProgramEvent;
 typedef virNetClientProgramEvent *virNetClientProgramEventPtr;
 
+typedef struct _virNetClientProgramPendingCall virNetClientProgramPendingCall;
+typedef virNetClientProgramPendingCall *virNetClientProgramPendingCallPtr;
+
 typedef struct _virNetClientProgramErrorHandler virNetClientProgramErrorHander;
 typedef virNetClientProgramErrorHander *virNetClientProgramErrorHanderPtr;
 
@@ -80,6 +86,17 @@ int virNetClientProgramCall(virNetClientProgramPtr prog,
                             xdrproc_t args_filter, void *args,
                             xdrproc_t ret_filter, void *ret);
 
+virNetClientProgramPendingCallPtr
+virNetClientProgramCallAsync(virNetClientProgramPtr prog,
+                             virNetClientPtr client,
+                             unsigned serial,
+                             int proc,
+                             xdrproc_t args_filter, void *args);
+
+int virNetClientProgramCallFinish(virNetClientProgramPtr prog,
+                                  virNetClientPtr client,
+                                  virNetClientProgramPendingCallPtr pending,
+                                  xdrproc_t ret_filter, void *ret);
 
 
 #endif /* __VIR_NET_CLIENT_PROGRAM_H__ */
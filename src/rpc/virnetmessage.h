@@ -29,6 +29,9 @@ typedef struct virNetMessageError *virNetMessageErrorPtr;
 typedef struct _virNetMessage virNetMessage;
 typedef virNetMessage *virNetMessagePtr;
 
+/* Leading bytes of a call's arguments kept for statistics */
+# define VIR_NET_MESSAGE_ARGS_CAPTURE 128
+
 typedef void (*virNetMessageFreeCallback)(virNetMessagePtr msg, void *opaque);
 
 /* Never allocate this (huge) buffer on the stack. Always
@@ -43,6 +46,14 @@ struct _virNetMessage {
 
     virNetMessageHeader header;
 
+    /* Timestamps in microseconds of a call received by a
+     * server, zero when the message is not being timed */
+    unsigned long long rxTime;
+    unsigned long long dispatchTime;
+    unsigned long long replyTime;
+    size_t argsLength;
+    char args[VIR_NET_MESSAGE_ARGS_CAPTURE];
+
     virNetMessageFreeCallback cb;
     void *opaque;
 
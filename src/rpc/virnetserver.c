@@ -28,6 +28,7 @@
 #include <fcntl.h>
 
 #include "virnetserver.h"
+#include "virnetserverstats.h"
 #include "logging.h"
 #include "memory.h"
 #include "virterror_internal.h"
@@ -36,6 +37,7 @@
 #include "util.h"
 #include "virfile.h"
 #include "event.h"
+#include "buf.h"
 #if HAVE_AVAHI
 # include "virnetservermdns.h"
 #endif
@@ -133,6 +135,9 @@ static void virNetServerHandleJob(void *jobOpaque, void *opaque)
     VIR_DEBUG("server=%p client=%p message=%p prog=%p",
               srv, job->client, job->msg, job->prog);
 
+    if (job->msg->rxTime)
+        job->msg->dispatchTime = virNetServerStatsNow();
+
     if (!job->prog) {
         if (virNetServerProgramUnknownError(job->client,
                                             job->msg,
@@ -620,6 +625,98 @@ no_memory:
     return -1;
 }
 
+/* Caller must hold the server lock */
+static const char *
+virNetServerGetProcName(virNetServerPtr srv,
+                        unsigned program,
+                        int proc)
+{
+    size_t i;
+
+    for (i = 0 ; i < srv->nprograms ; i++) {
+        if ((unsigned)virNetServerProgramGetID(srv->programs[i]) == program)
+            return virNetServerProgramGetProcName(srv->programs[i], proc);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * virNetServerGetStats:
+ * @srv: the server
+ * @nslowest: maximum number of slowest calls to list
+ * @reset: whether to zero the statistics once reported
+ *
+ * Format the per procedure and per client call latency
+ * statistics, in microseconds, as XML.
+ *
+ * Returns the XML document, or NULL on error
+ */
+char *virNetServerGetStats(virNetServerPtr srv,
+                           size_t nslowest,
+                           bool reset)
+{
+    virNetServerStatsSnapshotPtr snapshot;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    size_t i, j;
+
+    if (!(snapshot = virNetServerStatsCollect(nslowest, reset)))
+        return NULL;
+
+    virNetServerLock(srv);
+
+    virBufferAddLit(&buf, "<rpcstats>\n");
+
+    for (i = 0 ; i < snapshot->nprocs ; i++) {
+        virNetServerStatsProcPtr proc = &snapshot->procs[i];
+        const char *name = virNetServerGetProcName(srv, proc->program,
+                                                   proc->proc);
+
+        virBufferAsprintf(&buf, "  <procedure program='0x%x' number='%d'",
+                          proc->program, proc->proc);
+        if (name)
+            virBufferAsprintf(&buf, " name='%s'", name);
+        virBufferAsprintf(&buf, " calls='%llu' errors='%llu'>\n",
+                          proc->calls, proc->errors);
+        for (j = 0 ; j < VIR_NET_SERVER_STATS_PHASE_LAST ; j++)
+            virNetServerStatsHistogramFormat(&buf, "phase",
+                                             virNetServerStatsPhaseTypeToString(j),
+                                             &proc->phases[j]);
+        virBufferAddLit(&buf, "  </procedure>\n");
+    }
+
+    for (i = 0 ; i < srv->nclients ; i++)
+        virNetServerClientFormatStats(srv->clients[i], &buf, reset);
+
+    if (snapshot->ncalls) {
+        virBufferAddLit(&buf, "  <slowest>\n");
+        for (i = 0 ; i < snapshot->ncalls ; i++) {
+            virNetServerStatsCallPtr call = &snapshot->calls[i];
+
+            virNetServerStatsCallFormat(&buf,
+                                        virNetServerGetProcName(srv, call->program,
+                                                                call->proc),
+                                        call);
+        }
+        virBufferAddLit(&buf, "  </slowest>\n");
+    }
+
+    virBufferAddLit(&buf, "</rpcstats>\n");
+
+    virNetServerUnlock(srv);
+    virNetServerStatsSnapshotFree(snapshot);
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        virReportOOMError();
+        return NULL;
+    }
+
+    return virBufferContentAndReset(&buf);
+}
+
+
 int virNetServerSetTLSContext(virNetServerPtr srv,
                               virNetTLSContextPtr tls)
 {
@@ -74,6 +74,10 @@ int virNetServerAddService(virNetServerPtr srv,
 int virNetServerAddProgram(virNetServerPtr srv,
                            virNetServerProgramPtr prog);
 
+char *virNetServerGetStats(virNetServerPtr srv,
+                           size_t nslowest,
+                           bool reset);
+
 int virNetServerSetTLSContext(virNetServerPtr srv,
                               virNetTLSContextPtr tls);
 
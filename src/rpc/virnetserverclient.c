@@ -28,6 +28,7 @@
 #endif
 
 #include "virnetserverclient.h"
+#include "virnetserverstats.h"
 
 #include "logging.h"
 #include "virterror_internal.h"
@@ -97,6 +98,9 @@ struct _virNetServerClient
     virNetServerClientDispatchFunc dispatchFunc;
     void *dispatchOpaque;
 
+    /* Replies written for timed calls */
+    virNetServerStatsClient stats;
+
     void *privateData;
     virNetServerClientFreeFunc privateDataFreeFunc;
     virNetServerClientCloseFunc privateDataCloseFunc;
@@ -798,6 +802,9 @@ readmore:
             return;
         }
 
+        if (msg->header.type == VIR_NET_CALL)
+            msg->rxTime = virNetServerStatsNow();
+
         /* Maybe send off for queue against a filter */
         filter = client->filters;
         while (filter) {
@@ -911,6 +918,10 @@ virNetServerClientDispatchWrite(virNetServerClientPtr client)
             /* Get finished msg from head of tx queue */
             msg = virNetMessageQueueServe(&client->tx);
 
+            if (msg->rxTime && msg->replyTime)
+                virNetServerStatsRecordReply(msg, &client->stats,
+                                             virNetServerClientRemoteAddrString(client));
+
             if (msg->tracked) {
                 client->nrequests--;
                 /* See if the recv queue is currently throttled */
@@ -1003,6 +1014,10 @@ int virNetServerClientSendMessage(virNetServerClientPtr client,
     VIR_DEBUG("msg=%p proc=%d len=%zu offset=%zu",
               msg, msg->header.proc,
               msg->bufferLength, msg->bufferOffset);
+    if (msg->rxTime && !msg->replyTime &&
+        msg->header.type == VIR_NET_REPLY)
+        virNetServerStatsRecordDispatch(msg);
+
     virNetServerClientLock(client);
 
     if (client->sock && !client->wantClose) {
@@ -1017,6 +1032,36 @@ int virNetServerClientSendMessage(virNetServerClientPtr client,
 }
 
 
+/*
+ * Format the latency statistics of replies written to the
+ * client, optionally resetting them afterwards
+ */
+void virNetServerClientFormatStats(virNetServerClientPtr client,
+                                   virBufferPtr buf,
+                                   bool reset)
+{
+    virNetServerClientLock(client);
+
+    virBufferAddLit(buf, "  <client");
+    if (client->sock)
+        virBufferEscapeString(buf, " address='%s'",
+                              virNetSocketRemoteAddrString(client->sock));
+    if (client->identity)
+        virBufferEscapeString(buf, " identity='%s'", client->identity);
+    virBufferAsprintf(buf, " readonly='%s' calls='%llu' errors='%llu'>\n",
+                      client->readonly ? "yes" : "no",
+                      client->stats.calls, client->stats.errors);
+    virNetServerStatsHistogramFormat(buf, "latency", NULL,
+                                     &client->stats.total);
+    virBufferAddLit(buf, "  </client>\n");
+
+    if (reset)
+        memset(&client->stats, 0, sizeof(client->stats));
+
+    virNetServerClientUnlock(client);
+}
+
+
 bool virNetServerClientNeedAuth(virNetServerClientPtr client)
 {
     bool need = false;
@@ -26,6 +26,7 @@
 
 # include "virnetsocket.h"
 # include "virnetmessage.h"
+# include "buf.h"
 
 typedef struct _virNetServerClient virNetServerClient;
 typedef virNetServerClient *virNetServerClientPtr;
@@ -107,6 +108,10 @@ int virNetServerClientSendMessage(virNetServerClientPtr client,
 
 bool virNetServerClientNeedAuth(virNetServerClientPtr client);
 
+void virNetServerClientFormatStats(virNetServerClientPtr client,
+                                   virBufferPtr buf,
+                                   bool reset);
+
 void virNetServerClientFree(virNetServerClientPtr client);
 
 
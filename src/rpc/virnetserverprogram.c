@@ -25,6 +25,7 @@
 
 #include "virnetserverprogram.h"
 #include "virnetserverclient.h"
+#include "virnetserverstats.h"
 
 #include "memory.h"
 #include "virterror_internal.h"
@@ -120,6 +121,18 @@ virNetServerProgramGetPriority(virNetServerProgramPtr prog,
     return proc->priority;
 }
 
+const char *
+virNetServerProgramGetProcName(virNetServerProgramPtr prog,
+                               int procedure)
+{
+    virNetServerProgramProcPtr proc = virNetServerProgramGetProc(prog, procedure);
+
+    if (!proc)
+        return NULL;
+
+    return proc->name;
+}
+
 static int
 virNetServerProgramSendError(unsigned program,
                              unsigned version,
@@ -385,6 +398,8 @@ virNetServerProgramDispatchCall(virNetServerProgramPtr prog,
         goto error;
     }
 
+    virNetServerStatsCaptureArgs(msg);
+
     if (virNetMessageDecodePayload(msg, dispatcher->arg_filter, arg) < 0)
         goto error;
 
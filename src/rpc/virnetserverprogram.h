@@ -54,6 +54,7 @@ struct _virNetServerProgramProc {
     xdrproc_t ret_filter;
     bool needAuth;
     unsigned int priority;
+    const char *name;
 };
 
 virNetServerProgramPtr virNetServerProgramNew(unsigned program,
@@ -67,6 +68,9 @@ int virNetServerProgramGetVersion(virNetServerProgramPtr prog);
 unsigned int virNetServerProgramGetPriority(virNetServerProgramPtr prog,
                                             int procedure);
 
+const char *virNetServerProgramGetProcName(virNetServerProgramPtr prog,
+                                           int procedure);
+
 void virNetServerProgramRef(virNetServerProgramPtr prog);
 
 int virNetServerProgramMatches(virNetServerProgramPtr prog,
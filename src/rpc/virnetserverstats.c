@@ -0,0 +1,640 @@
+/*
+ * virnetserverstats.c: RPC server call statistics
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ * Each thread which records statistics gets its own block of
+ * counters, so the workers never contend with each other.  The block
+ * lock is only ever contended by a reader, which merges all blocks
+ * into a snapshot.  When a thread exits, its block is folded into
+ * the 'retired' block so no counts are lost.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "virnetserverstats.h"
+
+#include "memory.h"
+#include "threads.h"
+#include "virterror_internal.h"
+#include "logging.h"
+
+#define VIR_FROM_THIS VIR_FROM_RPC
+#define virNetError(code, ...)                                    \
+    virReportErrorHelper(VIR_FROM_THIS, code, __FILE__,           \
+                         __FUNCTION__, __LINE__, __VA_ARGS__)
+
+/* Bounds on what a client can make us allocate */
+#define VIR_NET_SERVER_STATS_MAX_PROGRAMS 16
+#define VIR_NET_SERVER_STATS_MAX_PROCS 1024
+
+VIR_ENUM_IMPL(virNetServerStatsPhase, VIR_NET_SERVER_STATS_PHASE_LAST,
+              "queue", "dispatch", "reply")
+
+typedef struct _virNetServerStatsProgram virNetServerStatsProgram;
+typedef virNetServerStatsProgram *virNetServerStatsProgramPtr;
+
+struct _virNetServerStatsProgram {
+    unsigned program;
+    size_t nprocs;
+    virNetServerStatsProcPtr procs; /* indexed by procedure number */
+};
+
+typedef struct _virNetServerStatsBlock virNetServerStatsBlock;
+typedef virNetServerStatsBlock *virNetServerStatsBlockPtr;
+
+struct _virNetServerStatsBlock {
+    virMutex lock;
+
+    size_t nprograms;
+    virNetServerStatsProgramPtr programs;
+
+    virNetServerStatsBlockPtr next;
+};
+
+/* Protects the list of blocks, the retired block and the
+ * slowest calls.  Acquired before any block lock */
+static virMutex statsLock;
+static virNetServerStatsBlockPtr statsBlocks;
+static virNetServerStatsBlock statsRetired;
+
+static size_t statsNSlowest;
+static virNetServerStatsCall statsSlowest[VIR_NET_SERVER_STATS_SLOWEST];
+
+static virThreadLocal statsLocal;
+static virOnceControl statsOnce = VIR_ONCE_CONTROL_INITIALIZER;
+static int statsInitialized = -1;
+
+
+/* Timestamps are in microseconds, like the histograms, and come
+ * from the monotonic clock so that intervals never go negative */
+unsigned long long
+virNetServerStatsNow(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+
+static void
+virNetServerStatsHistogramAdd(virNetServerStatsHistogramPtr hist,
+                              unsigned long long us)
+{
+    size_t i = 0;
+
+    while (i < VIR_NET_SERVER_STATS_BUCKETS - 1 && (us >> i) != 0)
+        i++;
+
+    hist->buckets[i]++;
+    hist->count++;
+    hist->sum += us;
+    if (us > hist->max)
+        hist->max = us;
+}
+
+
+static void
+virNetServerStatsHistogramMerge(virNetServerStatsHistogramPtr dst,
+                                virNetServerStatsHistogramPtr src)
+{
+    size_t i;
+
+    for (i = 0 ; i < VIR_NET_SERVER_STATS_BUCKETS ; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+
+static void
+virNetServerStatsBlockClear(virNetServerStatsBlockPtr block)
+{
+    size_t i;
+
+    for (i = 0 ; i < block->nprograms ; i++)
+        VIR_FREE(block->programs[i].procs);
+    VIR_FREE(block->programs);
+    block->nprograms = 0;
+}
+
+
+static void
+virNetServerStatsBlockReset(virNetServerStatsBlockPtr block)
+{
+    size_t i;
+
+    for (i = 0 ; i < block->nprograms ; i++)
+        memset(block->programs[i].procs, 0,
+               sizeof(*block->programs[i].procs) *
+               block->programs[i].nprocs);
+}
+
+
+/* Returns the counters for the procedure, or NULL if it is out of
+ * range or cannot be allocated; statistics are best effort so no
+ * error is reported */
+static virNetServerStatsProcPtr
+virNetServerStatsBlockLookup(virNetServerStatsBlockPtr block,
+                             unsigned program,
+                             int proc)
+{
+    virNetServerStatsProgramPtr prog = NULL;
+    size_t i;
+
+    if (proc < 0 || proc >= VIR_NET_SERVER_STATS_MAX_PROCS)
+        return NULL;
+
+    for (i = 0 ; i < block->nprograms ; i++) {
+        if (block->programs[i].program == program) {
+            prog = &block->programs[i];
+            break;
+        }
+    }
+
+    if (!prog) {
+        if (block->nprograms >= VIR_NET_SERVER_STATS_MAX_PROGRAMS ||
+            VIR_EXPAND_N(block->programs, block->nprograms, 1) < 0)
+            return NULL;
+        prog = &block->programs[block->nprograms - 1];
+        prog->program = program;
+    }
+
+    if (proc >= prog->nprocs) {
+        size_t n = prog->nprocs;
+
+        if (VIR_EXPAND_N(prog->procs, prog->nprocs, proc + 1 - n) < 0)
+            return NULL;
+        for (i = n ; i < prog->nprocs ; i++) {
+            prog->procs[i].program = program;
+            prog->procs[i].proc = i;
+        }
+    }
+
+    return &prog->procs[proc];
+}
+
+
+/* Caller must hold the lock of @src, if any, and own @dst */
+static int
+virNetServerStatsBlockMerge(virNetServerStatsBlockPtr dst,
+                            virNetServerStatsBlockPtr src)
+{
+    size_t i, j, k;
+
+    for (i = 0 ; i < src->nprograms ; i++) {
+        virNetServerStatsProgramPtr prog = &src->programs[i];
+
+        for (j = 0 ; j < prog->nprocs ; j++) {
+            virNetServerStatsProcPtr from = &prog->procs[j];
+            virNetServerStatsProcPtr to;
+
+            if (from->calls == 0 &&
+                from->phases[VIR_NET_SERVER_STATS_PHASE_REPLY].count == 0)
+                continue;
+
+            if (!(to = virNetServerStatsBlockLookup(dst, prog->program, j)))
+                return -1;
+
+            to->calls += from->calls;
+            to->errors += from->errors;
+            for (k = 0 ; k < VIR_NET_SERVER_STATS_PHASE_LAST ; k++)
+                virNetServerStatsHistogramMerge(&to->phases[k],
+                                                &from->phases[k]);
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+virNetServerStatsBlockRetire(void *opaque)
+{
+    virNetServerStatsBlockPtr block = opaque;
+    virNetServerStatsBlockPtr *prev;
+
+    if (!block)
+        return;
+
+    virMutexLock(&statsLock);
+    for (prev = &statsBlocks ; *prev ; prev = &(*prev)->next) {
+        if (*prev == block) {
+            *prev = block->next;
+            break;
+        }
+    }
+    if (virNetServerStatsBlockMerge(&statsRetired, block) < 0)
+        VIR_WARN("Lost RPC statistics of exiting thread");
+    virMutexUnlock(&statsLock);
+
+    virNetServerStatsBlockClear(block);
+    virMutexDestroy(&block->lock);
+    VIR_FREE(block);
+}
+
+
+static void
+virNetServerStatsOnceInit(void)
+{
+    if (virMutexInit(&statsLock) < 0)
+        return;
+
+    statsInitialized = virThreadLocalInit(&statsLocal,
+                                          virNetServerStatsBlockRetire);
+}
+
+
+/* Returns the calling thread's block, with its lock held */
+static virNetServerStatsBlockPtr
+virNetServerStatsBlockAcquire(void)
+{
+    virNetServerStatsBlockPtr block;
+
+    if (virOnce(&statsOnce, virNetServerStatsOnceInit) < 0 ||
+        statsInitialized < 0)
+        return NULL;
+
+    if (!(block = virThreadLocalGet(&statsLocal))) {
+        if (VIR_ALLOC(block) < 0)
+            return NULL;
+        if (virMutexInit(&block->lock) < 0) {
+            VIR_FREE(block);
+            return NULL;
+        }
+
+        virMutexLock(&statsLock);
+        block->next = statsBlocks;
+        statsBlocks = block;
+        virMutexUnlock(&statsLock);
+
+        virThreadLocalSet(&statsLocal, block);
+    }
+
+    virMutexLock(&block->lock);
+    return block;
+}
+
+
+/**
+ * virNetServerStatsCaptureArgs:
+ * @msg: a call whose header has been decoded
+ *
+ * Keep a copy of the leading bytes of the encoded arguments of
+ * @msg, so they can be reported if the call turns out to be slow.
+ */
+void
+virNetServerStatsCaptureArgs(virNetMessagePtr msg)
+{
+    if (!msg->rxTime)
+        return;
+
+    msg->argsLength = msg->bufferLength - msg->bufferOffset;
+    memcpy(msg->args, msg->buffer + msg->bufferOffset,
+           MIN(msg->argsLength, sizeof(msg->args)));
+}
+
+
+/**
+ * virNetServerStatsRecordDispatch:
+ * @msg: the reply to a timed call, about to be queued
+ *
+ * Account the time @msg spent waiting for a worker and being
+ * dispatched.  Called by the worker thread.
+ */
+void
+virNetServerStatsRecordDispatch(virNetMessagePtr msg)
+{
+    virNetServerStatsBlockPtr block;
+    virNetServerStatsProcPtr proc;
+
+    msg->replyTime = virNetServerStatsNow();
+
+    if (!(block = virNetServerStatsBlockAcquire()))
+        return;
+
+    if ((proc = virNetServerStatsBlockLookup(block, msg->header.prog,
+                                             msg->header.proc))) {
+        proc->calls++;
+        if (msg->header.status == VIR_NET_ERROR)
+            proc->errors++;
+
+        /* A message never picked up by a worker has no dispatch time */
+        if (msg->dispatchTime) {
+            virNetServerStatsHistogramAdd(&proc->phases[VIR_NET_SERVER_STATS_PHASE_QUEUE],
+                                          msg->dispatchTime - msg->rxTime);
+            virNetServerStatsHistogramAdd(&proc->phases[VIR_NET_SERVER_STATS_PHASE_DISPATCH],
+                                          msg->replyTime - msg->dispatchTime);
+        }
+    }
+
+    virMutexUnlock(&block->lock);
+}
+
+
+static void
+virNetServerStatsRecordSlowest(virNetMessagePtr msg,
+                               const char *clientName,
+                               unsigned long long now)
+{
+    virNetServerStatsCallPtr call;
+    unsigned long long total = now - msg->rxTime;
+    size_t i;
+
+    virMutexLock(&statsLock);
+
+    if (statsNSlowest == VIR_NET_SERVER_STATS_SLOWEST) {
+        if (total <= statsSlowest[statsNSlowest - 1].total)
+            goto cleanup;
+        VIR_FREE(statsSlowest[statsNSlowest - 1].client);
+        statsNSlowest--;
+    }
+
+    for (i = statsNSlowest ; i > 0 && statsSlowest[i - 1].total < total ; i--)
+        statsSlowest[i] = statsSlowest[i - 1];
+    statsNSlowest++;
+
+    call = &statsSlowest[i];
+    memset(call, 0, sizeof(*call));
+    call->program = msg->header.prog;
+    call->proc = msg->header.proc;
+    call->serial = msg->header.serial;
+    call->failed = msg->header.status == VIR_NET_ERROR;
+    call->client = clientName ? strdup(clientName) : NULL;
+    call->total = total;
+    if (msg->dispatchTime) {
+        call->phases[VIR_NET_SERVER_STATS_PHASE_QUEUE] =
+            msg->dispatchTime - msg->rxTime;
+        call->phases[VIR_NET_SERVER_STATS_PHASE_DISPATCH] =
+            msg->replyTime - msg->dispatchTime;
+    }
+    call->phases[VIR_NET_SERVER_STATS_PHASE_REPLY] = now - msg->replyTime;
+    call->argsLength = msg->argsLength;
+    memcpy(call->args, msg->args, MIN(msg->argsLength, sizeof(call->args)));
+
+cleanup:
+    virMutexUnlock(&statsLock);
+}
+
+
+/**
+ * virNetServerStatsRecordReply:
+ * @msg: the reply to a timed call, fully written to the client
+ * @client: per client counters, locked by the caller
+ * @clientName: name of the client for the slowest calls list
+ *
+ * Account the time spent queued for and writing the reply, and
+ * remember the call if it is one of the slowest seen.
+ */
+void
+virNetServerStatsRecordReply(virNetMessagePtr msg,
+                             virNetServerStatsClientPtr client,
+                             const char *clientName)
+{
+    virNetServerStatsBlockPtr block;
+    virNetServerStatsProcPtr proc;
+    unsigned long long now = virNetServerStatsNow();
+
+    client->calls++;
+    if (msg->header.status == VIR_NET_ERROR)
+        client->errors++;
+    virNetServerStatsHistogramAdd(&client->total, now - msg->rxTime);
+
+    if ((block = virNetServerStatsBlockAcquire())) {
+        if ((proc = virNetServerStatsBlockLookup(block, msg->header.prog,
+                                                 msg->header.proc)))
+            virNetServerStatsHistogramAdd(&proc->phases[VIR_NET_SERVER_STATS_PHASE_REPLY],
+                                          now - msg->replyTime);
+        virMutexUnlock(&block->lock);
+    }
+
+    virNetServerStatsRecordSlowest(msg, clientName, now);
+}
+
+
+void
+virNetServerStatsSnapshotFree(virNetServerStatsSnapshotPtr snapshot)
+{
+    size_t i;
+
+    if (!snapshot)
+        return;
+
+    for (i = 0 ; i < snapshot->ncalls ; i++)
+        VIR_FREE(snapshot->calls[i].client);
+    VIR_FREE(snapshot->calls);
+    VIR_FREE(snapshot->procs);
+    VIR_FREE(snapshot);
+}
+
+
+/**
+ * virNetServerStatsCollect:
+ * @nslowest: maximum number of slowest calls to include
+ * @reset: whether to zero all counters once collected
+ *
+ * Merge the counters of all threads into a snapshot, listing
+ * only the procedures which have been called.
+ *
+ * Returns the snapshot, or NULL on error
+ */
+virNetServerStatsSnapshotPtr
+virNetServerStatsCollect(size_t nslowest,
+                         bool reset)
+{
+    virNetServerStatsSnapshotPtr snapshot = NULL;
+    virNetServerStatsBlock merged;
+    virNetServerStatsBlockPtr block;
+    size_t i, j;
+    bool locked = false;
+
+    memset(&merged, 0, sizeof(merged));
+
+    if (virOnce(&statsOnce, virNetServerStatsOnceInit) < 0 ||
+        statsInitialized < 0) {
+        virNetError(VIR_ERR_INTERNAL_ERROR, "%s",
+                    _("cannot initialize RPC statistics"));
+        return NULL;
+    }
+
+    if (VIR_ALLOC(snapshot) < 0)
+        goto no_memory;
+
+    virMutexLock(&statsLock);
+    locked = true;
+
+    if (virNetServerStatsBlockMerge(&merged, &statsRetired) < 0)
+        goto no_memory;
+    if (reset)
+        virNetServerStatsBlockReset(&statsRetired);
+
+    for (block = statsBlocks ; block ; block = block->next) {
+        int rc;
+
+        virMutexLock(&block->lock);
+        rc = virNetServerStatsBlockMerge(&merged, block);
+        if (rc == 0 && reset)
+            virNetServerStatsBlockReset(block);
+        virMutexUnlock(&block->lock);
+
+        if (rc < 0)
+            goto no_memory;
+    }
+
+    nslowest = MIN(nslowest, statsNSlowest);
+    if (nslowest &&
+        VIR_ALLOC_N(snapshot->calls, nslowest) < 0)
+        goto no_memory;
+    for (i = 0 ; i < nslowest ; i++) {
+        snapshot->calls[i] = statsSlowest[i];
+        snapshot->calls[i].client = NULL;
+        snapshot->ncalls++;
+        if (statsSlowest[i].client &&
+            !(snapshot->calls[i].client = strdup(statsSlowest[i].client)))
+            goto no_memory;
+    }
+
+    if (reset) {
+        for (i = 0 ; i < statsNSlowest ; i++)
+            VIR_FREE(statsSlowest[i].client);
+        statsNSlowest = 0;
+    }
+
+    virMutexUnlock(&statsLock);
+    locked = false;
+
+    for (i = 0 ; i < merged.nprograms ; i++) {
+        virNetServerStatsProgramPtr prog = &merged.programs[i];
+
+        for (j = 0 ; j < prog->nprocs ; j++) {
+            if (prog->procs[j].calls == 0 &&
+                prog->procs[j].phases[VIR_NET_SERVER_STATS_PHASE_REPLY].count == 0)
+                continue;
+            if (VIR_EXPAND_N(snapshot->procs, snapshot->nprocs, 1) < 0)
+                goto no_memory;
+            snapshot->procs[snapshot->nprocs - 1] = prog->procs[j];
+        }
+    }
+
+    virNetServerStatsBlockClear(&merged);
+    return snapshot;
+
+no_memory:
+    virReportOOMError();
+    if (locked)
+        virMutexUnlock(&statsLock);
+    virNetServerStatsBlockClear(&merged);
+    virNetServerStatsSnapshotFree(snapshot);
+    return NULL;
+}
+
+
+/**
+ * virNetServerStatsHistogramFormat:
+ * @buf: buffer to format into, at an indentation of two levels
+ * @element: name of the XML element
+ * @name: value of the 'name' attribute, or NULL
+ * @hist: the histogram
+ *
+ * Format @hist, listing only the buckets which have counts.  Each
+ * bucket is identified by its exclusive upper bound in microseconds,
+ * which is omitted for the last, open ended, bucket.
+ */
+void
+virNetServerStatsHistogramFormat(virBufferPtr buf,
+                                 const char *element,
+                                 const char *name,
+                                 virNetServerStatsHistogramPtr hist)
+{
+    size_t i;
+
+    virBufferAsprintf(buf, "    <%s", element);
+    if (name)
+        virBufferAsprintf(buf, " name='%s'", name);
+    virBufferAsprintf(buf, " count='%llu' sum='%llu' max='%llu'",
+                      hist->count, hist->sum, hist->max);
+
+    if (hist->count == 0) {
+        virBufferAddLit(buf, "/>\n");
+        return;
+    }
+
+    virBufferAddLit(buf, ">\n");
+    for (i = 0 ; i < VIR_NET_SERVER_STATS_BUCKETS ; i++) {
+        if (!hist->buckets[i])
+            continue;
+        if (i < VIR_NET_SERVER_STATS_BUCKETS - 1)
+            virBufferAsprintf(buf, "      <bucket below='%llu' count='%llu'/>\n",
+                              1ull << i, hist->buckets[i]);
+        else
+            virBufferAsprintf(buf, "      <bucket count='%llu'/>\n",
+                              hist->buckets[i]);
+    }
+    virBufferAsprintf(buf, "    </%s>\n", element);
+}
+
+
+/**
+ * virNetServerStatsCallFormat:
+ * @buf: buffer to format into, at an indentation of two levels
+ * @procName: name of the procedure, or NULL if not known
+ * @call: the call
+ *
+ * Format one of the slowest calls, with the leading bytes of its
+ * XDR encoded arguments in hex.
+ */
+void
+virNetServerStatsCallFormat(virBufferPtr buf,
+                            const char *procName,
+                            virNetServerStatsCallPtr call)
+{
+    size_t len = MIN(call->argsLength, sizeof(call->args));
+    size_t i;
+
+    virBufferAsprintf(buf, "    <call program='0x%x' procedure='%d'",
+                      call->program, call->proc);
+    if (procName)
+        virBufferAsprintf(buf, " name='%s'", procName);
+    virBufferAsprintf(buf, " serial='%u' status='%s'",
+                      call->serial, call->failed ? "error" : "ok");
+    if (call->client)
+        virBufferEscapeString(buf, " client='%s'", call->client);
+    virBufferAsprintf(buf, " time='%llu'>\n", call->total);
+
+    for (i = 0 ; i < VIR_NET_SERVER_STATS_PHASE_LAST ; i++)
+        virBufferAsprintf(buf, "      <phase name='%s' time='%llu'/>\n",
+                          virNetServerStatsPhaseTypeToString(i),
+                          call->phases[i]);
+
+    virBufferAsprintf(buf, "      <args length='%zu'>", call->argsLength);
+    for (i = 0 ; i < len ; i++) {
+        if (i && (i % 4) == 0)
+            virBufferAddChar(buf, ' ');
+        virBufferAsprintf(buf, "%02x", (unsigned char)call->args[i]);
+    }
+    virBufferAddLit(buf, "</args>\n");
+
+    virBufferAddLit(buf, "    </call>\n");
+}
@@ -0,0 +1,126 @@
+/*
+ * virnetserverstats.h: RPC server call statistics
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef __VIR_NET_SERVER_STATS_H__
+# define __VIR_NET_SERVER_STATS_H__
+
+# include "internal.h"
+# include "buf.h"
+# include "util.h"
+# include "virnetmessage.h"
+
+/* Bucket i counts calls which took less than 2^i microseconds,
+ * the last bucket holds everything slower */
+# define VIR_NET_SERVER_STATS_BUCKETS 28
+
+/* Upper bound on the number of slowest calls remembered */
+# define VIR_NET_SERVER_STATS_SLOWEST 32
+
+enum {
+    VIR_NET_SERVER_STATS_PHASE_QUEUE,    /* read complete -> worker picks it up */
+    VIR_NET_SERVER_STATS_PHASE_DISPATCH, /* worker -> reply queued */
+    VIR_NET_SERVER_STATS_PHASE_REPLY,    /* reply queued -> reply written */
+
+    VIR_NET_SERVER_STATS_PHASE_LAST
+};
+
+VIR_ENUM_DECL(virNetServerStatsPhase)
+
+typedef struct _virNetServerStatsHistogram virNetServerStatsHistogram;
+typedef virNetServerStatsHistogram *virNetServerStatsHistogramPtr;
+
+struct _virNetServerStatsHistogram {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[VIR_NET_SERVER_STATS_BUCKETS];
+};
+
+typedef struct _virNetServerStatsProc virNetServerStatsProc;
+typedef virNetServerStatsProc *virNetServerStatsProcPtr;
+
+struct _virNetServerStatsProc {
+    unsigned program;
+    int proc;
+    unsigned long long calls;
+    unsigned long long errors;
+    virNetServerStatsHistogram phases[VIR_NET_SERVER_STATS_PHASE_LAST];
+};
+
+typedef struct _virNetServerStatsClient virNetServerStatsClient;
+typedef virNetServerStatsClient *virNetServerStatsClientPtr;
+
+struct _virNetServerStatsClient {
+    unsigned long long calls;
+    unsigned long long errors;
+    virNetServerStatsHistogram total;
+};
+
+typedef struct _virNetServerStatsCall virNetServerStatsCall;
+typedef virNetServerStatsCall *virNetServerStatsCallPtr;
+
+struct _virNetServerStatsCall {
+    unsigned program;
+    int proc;
+    unsigned serial;
+    bool failed;
+    char *client;
+
+    unsigned long long total;
+    unsigned long long phases[VIR_NET_SERVER_STATS_PHASE_LAST];
+
+    size_t argsLength;
+    char args[VIR_NET_MESSAGE_ARGS_CAPTURE];
+};
+
+typedef struct _virNetServerStatsSnapshot virNetServerStatsSnapshot;
+typedef virNetServerStatsSnapshot *virNetServerStatsSnapshotPtr;
+
+struct _virNetServerStatsSnapshot {
+    size_t nprocs;
+    virNetServerStatsProcPtr procs;
+
+    /* Slowest first */
+    size_t ncalls;
+    virNetServerStatsCallPtr calls;
+};
+
+unsigned long long virNetServerStatsNow(void);
+
+void virNetServerStatsCaptureArgs(virNetMessagePtr msg);
+
+void virNetServerStatsRecordDispatch(virNetMessagePtr msg);
+void virNetServerStatsRecordReply(virNetMessagePtr msg,
+                                  virNetServerStatsClientPtr client,
+                                  const char *clientName);
+
+virNetServerStatsSnapshotPtr virNetServerStatsCollect(size_t nslowest,
+                                                      bool reset);
+void virNetServerStatsSnapshotFree(virNetServerStatsSnapshotPtr snapshot);
+
+void virNetServerStatsHistogramFormat(virBufferPtr buf,
+                                      const char *element,
+                                      const char *name,
+                                      virNetServerStatsHistogramPtr hist);
+void virNetServerStatsCallFormat(virBufferPtr buf,
+                                 const char *procName,
+                                 virNetServerStatsCallPtr call);
+
+#endif /* __VIR_NET_SERVER_STATS_H__ */
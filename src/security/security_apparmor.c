@@ -28,6 +28,7 @@
 #include "internal.h"
 
 #include "security_apparmor.h"
+#include "security_apparmor_state.h"
 #include "util.h"
 #include "memory.h"
 #include "virterror_internal.h"
@@ -38,6 +39,9 @@
 #include "virfile.h"
 #include "configmake.h"
 #include "command.h"
+#include "hash.h"
+#include "threads.h"
+#include "logging.h"
 
 #define VIR_FROM_THIS VIR_FROM_SECURITY
 #define SECURITY_APPARMOR_VOID_DOI      "0"
@@ -48,8 +52,30 @@
 struct SDPDOP {
     virSecurityManagerPtr mgr;
     virDomainObjPtr vm;
+    /* files collected for a single profile update */
+    size_t nfiles;
+    char **files;
 };
 
+typedef struct _AppArmorData AppArmorData;
+typedef AppArmorData *AppArmorDataPtr;
+
+struct _AppArmorData {
+    virMutex lock;
+    virHashTablePtr profiles;   /* see security_apparmor_state.c */
+};
+
+static void
+AppArmorProfileStateForget(virSecurityManagerPtr mgr,
+                           const char *profile)
+{
+    AppArmorDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    virMutexLock(&priv->lock);
+    virHashRemoveEntry(priv->profiles, profile);
+    virMutexUnlock(&priv->lock);
+}
+
 /*
  * profile_status returns '-1' on error, '0' if loaded
  *
@@ -154,21 +180,30 @@ profile_status_file(const char *str)
 }
 
 /*
- * load (add) a profile. Will create one if necessary
+ * load (add) a profile. Will create one if necessary. All of @files
+ * are passed to a single virt-aa-helper run, so that the profile is
+ * only compiled and reloaded once. Nothing is run at all if the
+ * profile would not change.
  */
 static int
 load_profile(virSecurityManagerPtr mgr,
              const char *profile,
              virDomainObjPtr vm,
-             const char *fn,
+             const char **files,
+             size_t nfiles,
              bool append)
 {
+    AppArmorDataPtr priv = virSecurityManagerGetPrivateData(mgr);
     int rc = -1;
+    int n;
     bool create = true;
     char *xml = NULL;
-    virCommandPtr cmd;
+    virCommandPtr cmd = NULL;
     const char *probe = virSecurityManagerGetAllowDiskFormatProbing(mgr)
         ? "1" : "0";
+    const char **todo = NULL;
+    unsigned long long start = 0, end = 0;
+    size_t i;
 
     xml = virDomainDefFormat(vm->def, VIR_DOMAIN_XML_SECURE);
     if (!xml)
@@ -177,34 +212,74 @@ load_profile(virSecurityManagerPtr mgr,
     if (profile_status_file(profile) >= 0)
         create = false;
 
+    if (!create) {
+        if (nfiles && VIR_ALLOC_N(todo, nfiles) < 0) {
+            virReportOOMError();
+            goto clean;
+        }
+
+        virMutexLock(&priv->lock);
+        n = virSecurityAppArmorProfilesFilter(priv->profiles, profile, xml,
+                                              files, nfiles, append, todo);
+        virMutexUnlock(&priv->lock);
+
+        if (n == 0) {
+            VIR_DEBUG("AppArmor profile '%s' is up to date", profile);
+            rc = 0;
+            goto clean;
+        }
+        if (n > 0) {
+            files = todo;
+            nfiles = n;
+        }
+    }
+
     cmd = virCommandNewArgList(VIRT_AA_HELPER, "-p", probe,
                                create ? "-c" : "-r",
                                "-u", profile, NULL);
-    if (!create && fn) {
-        if (append) {
-            virCommandAddArgList(cmd, "-F", fn, NULL);
-        } else {
-            virCommandAddArgList(cmd, "-f", fn, NULL);
-        }
+    if (!create) {
+        /* only the first file is used when not appending */
+        for (i = 0 ; i < nfiles && (append || i == 0) ; i++)
+            virCommandAddArgList(cmd, append ? "-F" : "-f", files[i], NULL);
     }
 
     virCommandSetInputBuffer(cmd, xml);
+
+    ignore_value(virTimeMs(&start));
     rc = virCommandRun(cmd, NULL);
+    ignore_value(virTimeMs(&end));
+
+    VIR_DEBUG("virt-aa-helper %s profile '%s' with %zu files in %llu ms",
+              create ? "created" : "updated", profile,
+              create ? 0 : nfiles, end - start);
+
+    virMutexLock(&priv->lock);
+    if (rc == 0)
+        virSecurityAppArmorProfilesUpdate(priv->profiles, profile, xml,
+                                          files, create ? 0 : nfiles,
+                                          !create && append);
+    else
+        virHashRemoveEntry(priv->profiles, profile);
+    virMutexUnlock(&priv->lock);
 
   clean:
+    virCommandFree(cmd);
+    VIR_FREE(todo);
     VIR_FREE(xml);
 
     return rc;
 }
 
 static int
-remove_profile(const char *profile)
+remove_profile(virSecurityManagerPtr mgr, const char *profile)
 {
     int rc = -1;
     const char * const argv[] = {
         VIRT_AA_HELPER, "-R", "-u", profile, NULL
     };
 
+    AppArmorProfileStateForget(mgr, profile);
+
     if (virRun(argv, NULL) == 0)
         rc = 0;
 
@@ -252,14 +327,14 @@ cleanup:
     return rc;
 }
 
-/* reload the profile, adding read/write file specified by fn if it is not
- * NULL.
+/* reload the profile, adding read/write access to the @nfiles @files
  */
 static int
-reload_profile(virSecurityManagerPtr mgr,
-               virDomainObjPtr vm,
-               const char *fn,
-               bool append)
+reload_profile_files(virSecurityManagerPtr mgr,
+                     virDomainObjPtr vm,
+                     const char **files,
+                     size_t nfiles,
+                     bool append)
 {
     const virSecurityLabelDefPtr secdef = &vm->def->seclabel;
     int rc = -1;
@@ -273,7 +348,8 @@ reload_profile(virSecurityManagerPtr mgr,
 
     /* Update the profile only if it is loaded */
     if (profile_loaded(secdef->imagelabel) >= 0) {
-        if (load_profile(mgr, secdef->imagelabel, vm, fn, append) < 0) {
+        if (load_profile(mgr, secdef->imagelabel, vm,
+                         files, nfiles, append) < 0) {
             virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
                                    _("cannot update AppArmor profile "
                                      "\'%s\'"),
@@ -289,40 +365,42 @@ reload_profile(virSecurityManagerPtr mgr,
     return rc;
 }
 
+/* reload the profile, adding read/write file specified by fn if it is not
+ * NULL.
+ */
 static int
-AppArmorSetSecurityUSBLabel(usbDevice *dev ATTRIBUTE_UNUSED,
-                           const char *file, void *opaque)
+reload_profile(virSecurityManagerPtr mgr,
+               virDomainObjPtr vm,
+               const char *fn,
+               bool append)
 {
-    struct SDPDOP *ptr = opaque;
-    virDomainObjPtr vm = ptr->vm;
+    return reload_profile_files(mgr, vm, &fn, fn ? 1 : 0, append);
+}
 
-    if (reload_profile(ptr->mgr, vm, file, true) < 0) {
-        const virSecurityLabelDefPtr secdef = &vm->def->seclabel;
-        virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
-                               _("cannot update AppArmor profile "
-                                 "\'%s\'"),
-                               secdef->imagelabel);
+/* Collect device files, so the profile is updated once per device */
+static int
+AppArmorCollectFile(struct SDPDOP *ptr, const char *file)
+{
+    if (VIR_EXPAND_N(ptr->files, ptr->nfiles, 1) < 0 ||
+        !(ptr->files[ptr->nfiles - 1] = strdup(file))) {
+        virReportOOMError();
         return -1;
     }
     return 0;
 }
 
 static int
-AppArmorSetSecurityPCILabel(pciDevice *dev ATTRIBUTE_UNUSED,
+AppArmorSetSecurityUSBLabel(usbDevice *dev ATTRIBUTE_UNUSED,
                            const char *file, void *opaque)
 {
-    struct SDPDOP *ptr = opaque;
-    virDomainObjPtr vm = ptr->vm;
+    return AppArmorCollectFile(opaque, file);
+}
 
-    if (reload_profile(ptr->mgr, vm, file, true) < 0) {
-        const virSecurityLabelDefPtr secdef = &vm->def->seclabel;
-        virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
-                               _("cannot update AppArmor profile "
-                                 "\'%s\'"),
-                               secdef->imagelabel);
-        return -1;
-    }
-    return 0;
+static int
+AppArmorSetSecurityPCILabel(pciDevice *dev ATTRIBUTE_UNUSED,
+                           const char *file, void *opaque)
+{
+    return AppArmorCollectFile(opaque, file);
 }
 
 /* Called on libvirtd startup to see if AppArmor is available */
@@ -359,14 +437,31 @@ AppArmorSecurityManagerProbe(void)
  * currently not used.
  */
 static int
-AppArmorSecurityManagerOpen(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
+AppArmorSecurityManagerOpen(virSecurityManagerPtr mgr)
 {
+    AppArmorDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    if (virMutexInit(&priv->lock) < 0) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("unable to initialize mutex"));
+        return -1;
+    }
+
+    if (!(priv->profiles = virSecurityAppArmorProfilesNew())) {
+        virMutexDestroy(&priv->lock);
+        return -1;
+    }
+
     return 0;
 }
 
 static int
-AppArmorSecurityManagerClose(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED)
+AppArmorSecurityManagerClose(virSecurityManagerPtr mgr)
 {
+    AppArmorDataPtr priv = virSecurityManagerGetPrivateData(mgr);
+
+    virHashFree(priv->profiles);
+    virMutexDestroy(&priv->lock);
     return 0;
 }
 
@@ -436,7 +531,7 @@ AppArmorGenSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
     }
 
     /* Now that we have a label, load the profile into the kernel. */
-    if (load_profile(mgr, vm->def->seclabel.label, vm, NULL, false) < 0) {
+    if (load_profile(mgr, vm->def->seclabel.label, vm, NULL, 0, false) < 0) {
         virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
                                _("cannot load AppArmor profile "
                                "\'%s\'"), vm->def->seclabel.label);
@@ -524,7 +619,7 @@ AppArmorReleaseSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
 
 
 static int
-AppArmorRestoreSecurityAllLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
+AppArmorRestoreSecurityAllLabel(virSecurityManagerPtr mgr,
                                 virDomainObjPtr vm,
                                 int migrated ATTRIBUTE_UNUSED)
 {
@@ -532,7 +627,7 @@ AppArmorRestoreSecurityAllLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
     int rc = 0;
 
     if (secdef->type == VIR_DOMAIN_SECLABEL_DYNAMIC) {
-        if ((rc = remove_profile(secdef->label)) != 0) {
+        if ((rc = remove_profile(mgr, secdef->label)) != 0) {
             virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
                                    _("could not remove profile for \'%s\'"),
                                    secdef->label);
@@ -636,8 +731,8 @@ AppArmorSetSecurityImageLabel(virSecurityManagerPtr mgr,
 
         /* update the profile only if it is loaded */
         if (profile_loaded(secdef->imagelabel) >= 0) {
-            if (load_profile(mgr, secdef->imagelabel, vm, disk->src,
-                             false) < 0) {
+            if (load_profile(mgr, secdef->imagelabel, vm,
+                             (const char **) &disk->src, 1, false) < 0) {
                 virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
                                      _("cannot update AppArmor profile "
                                      "\'%s\'"),
@@ -688,6 +783,7 @@ AppArmorSetSecurityHostdevLabel(virSecurityManagerPtr mgr,
     const virSecurityLabelDefPtr secdef = &vm->def->seclabel;
     struct SDPDOP *ptr;
     int ret = -1;
+    size_t i;
 
     if (secdef->norelabel)
         return 0;
@@ -735,7 +831,20 @@ AppArmorSetSecurityHostdevLabel(virSecurityManagerPtr mgr,
         break;
     }
 
+    if (ret == 0 && ptr->nfiles &&
+        reload_profile_files(mgr, vm, (const char **) ptr->files,
+                             ptr->nfiles, true) < 0) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
+                               _("cannot update AppArmor profile "
+                                 "\'%s\'"),
+                               secdef->imagelabel);
+        ret = -1;
+    }
+
 done:
+    for (i = 0 ; i < ptr->nfiles ; i++)
+        VIR_FREE(ptr->files[i]);
+    VIR_FREE(ptr->files);
     VIR_FREE(ptr);
     return ret;
 }
@@ -800,7 +909,7 @@ AppArmorSetImageFDLabel(virSecurityManagerPtr mgr,
 }
 
 virSecurityDriver virAppArmorSecurityDriver = {
-    0,
+    sizeof(AppArmorData),
     SECURITY_APPARMOR_NAME,
     AppArmorSecurityManagerProbe,
     AppArmorSecurityManagerOpen,
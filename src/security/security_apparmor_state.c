@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ * What the AppArmor profiles of running domains were generated from
+ *
+ * The AppArmor driver remembers, for each profile it loaded, the domain
+ * XML and extra file virt-aa-helper last regenerated its include file
+ * from, and the files appended to it since.  Requests which would give
+ * the same include file then skip running the helper.  Appended rules
+ * are only dropped by a regeneration, so a profile with any appended
+ * files is never considered up to date for one.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "security_apparmor_state.h"
+
+#include "virterror_internal.h"
+#include "memory.h"
+#include "util.h"
+
+#define VIR_FROM_THIS VIR_FROM_SECURITY
+
+typedef struct _virSecurityAppArmorProfileState virSecurityAppArmorProfileState;
+typedef virSecurityAppArmorProfileState *virSecurityAppArmorProfileStatePtr;
+
+struct _virSecurityAppArmorProfileState {
+    char *xml;                  /* domain XML given to virt-aa-helper */
+    char *fn;                   /* extra file given with -f, or NULL */
+    virHashTablePtr appended;   /* files appended with -F since then */
+};
+
+static void
+virSecurityAppArmorProfileStateFree(void *payload,
+                                    const void *name ATTRIBUTE_UNUSED)
+{
+    virSecurityAppArmorProfileStatePtr state = payload;
+
+    if (!state)
+        return;
+
+    VIR_FREE(state->xml);
+    VIR_FREE(state->fn);
+    virHashFree(state->appended);
+    VIR_FREE(state);
+}
+
+
+/**
+ * virSecurityAppArmorProfilesNew:
+ *
+ * Returns an empty table of profile states, keyed by profile name,
+ * or NULL on error
+ */
+virHashTablePtr
+virSecurityAppArmorProfilesNew(void)
+{
+    return virHashCreate(32, virSecurityAppArmorProfileStateFree);
+}
+
+
+/**
+ * virSecurityAppArmorProfilesFilter:
+ * @profiles: table from virSecurityAppArmorProfilesNew
+ * @profile: name of the profile to update
+ * @xml: domain XML the update would be generated from
+ * @files: extra files of the update
+ * @nfiles: number of @files
+ * @append: true if @files are appended with -F
+ * @todo: array of @nfiles entries filled with the files to give
+ *        virt-aa-helper
+ *
+ * Work out which of @files still need to be given to virt-aa-helper.
+ * A regeneration (@append false) is only skipped if it would use the
+ * same @xml and extra file as the last one and nothing was appended
+ * since, as the appended rules, e.g. those of a detached host device,
+ * have to be dropped.
+ *
+ * Returns the number of files copied to @todo, 0 if the profile is up
+ * to date, or -1 if the helper has to run regardless
+ */
+int
+virSecurityAppArmorProfilesFilter(virHashTablePtr profiles,
+                                  const char *profile,
+                                  const char *xml,
+                                  const char **files,
+                                  size_t nfiles,
+                                  bool append,
+                                  const char **todo)
+{
+    virSecurityAppArmorProfileStatePtr state;
+    size_t i;
+    int n = 0;
+
+    if (!(state = virHashLookup(profiles, profile)))
+        return -1;
+
+    if (!append) {
+        const char *fn = nfiles ? files[0] : NULL;
+
+        if (virHashSize(state->appended) == 0 &&
+            STREQ(state->xml, xml) &&
+            STREQ_NULLABLE(state->fn, fn))
+            return 0;
+        return -1;
+    }
+
+    for (i = 0 ; i < nfiles ; i++) {
+        if (!virHashLookup(state->appended, files[i]))
+            todo[n++] = files[i];
+    }
+
+    return n;
+}
+
+
+/**
+ * virSecurityAppArmorProfilesUpdate:
+ * @profiles: table from virSecurityAppArmorProfilesNew
+ * @profile: name of the profile which was updated
+ * @xml: domain XML the update was generated from
+ * @files: extra files of the update
+ * @nfiles: number of @files
+ * @append: true if @files were appended with -F
+ *
+ * Record that virt-aa-helper successfully updated @profile.  On
+ * failure the state of @profile is dropped instead, so the next
+ * update runs the helper again.
+ */
+void
+virSecurityAppArmorProfilesUpdate(virHashTablePtr profiles,
+                                  const char *profile,
+                                  const char *xml,
+                                  const char **files,
+                                  size_t nfiles,
+                                  bool append)
+{
+    virSecurityAppArmorProfileStatePtr state = NULL;
+    size_t i;
+
+    if (append)
+        state = virHashLookup(profiles, profile);
+
+    if (!state) {
+        if (VIR_ALLOC(state) < 0 ||
+            !(state->xml = strdup(xml)) ||
+            (nfiles && !append && !(state->fn = strdup(files[0]))) ||
+            !(state->appended = virHashCreate(8, NULL))) {
+            virSecurityAppArmorProfileStateFree(state, NULL);
+            goto error;
+        }
+        if (virHashUpdateEntry(profiles, profile, state) < 0) {
+            virSecurityAppArmorProfileStateFree(state, NULL);
+            goto error;
+        }
+        if (!append)
+            return;
+    }
+
+    for (i = 0 ; i < nfiles ; i++) {
+        if (virHashUpdateEntry(state->appended, files[i], (void *) 1) < 0)
+            goto error;
+    }
+
+    return;
+
+error:
+    /* Not fatal, the next update just runs the helper again */
+    virHashRemoveEntry(profiles, profile);
+    virResetLastError();
+}
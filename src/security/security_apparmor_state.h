@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ * What the AppArmor profiles of running domains were generated from
+ */
+
+#ifndef __VIR_SECURITY_APPARMOR_STATE_H__
+# define __VIR_SECURITY_APPARMOR_STATE_H__
+
+# include "internal.h"
+# include "hash.h"
+
+virHashTablePtr virSecurityAppArmorProfilesNew(void);
+
+int virSecurityAppArmorProfilesFilter(virHashTablePtr profiles,
+                                      const char *profile,
+                                      const char *xml,
+                                      const char **files,
+                                      size_t nfiles,
+                                      bool append,
+                                      const char **todo)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+
+void virSecurityAppArmorProfilesUpdate(virHashTablePtr profiles,
+                                       const char *profile,
+                                       const char *xml,
+                                       const char **files,
+                                       size_t nfiles,
+                                       bool append)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+
+#endif /* __VIR_SECURITY_APPARMOR_STATE_H__ */
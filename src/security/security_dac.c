@@ -24,6 +24,7 @@
 #include <fcntl.h>
 
 #include "security_dac.h"
+#include "security_plan.h"
 #include "virterror_internal.h"
 #include "util.h"
 #include "memory.h"
@@ -31,6 +32,7 @@
 #include "pci.h"
 #include "hostusb.h"
 #include "storage_file.h"
+#include "intprops.h"
 
 #define VIR_FROM_THIS VIR_FROM_SECURITY
 
@@ -147,6 +149,11 @@ virSecurityDACRestoreSecurityFileLabel(const char *path)
     if (stat(newpath, &buf) != 0)
         goto err;
 
+    if (buf.st_uid == 0 && buf.st_gid == 0) {
+        rc = 1;
+        goto err;
+    }
+
     /* XXX record previous ownership */
     rc = virSecurityDACSetOwnership(newpath, 0, 0);
 
@@ -155,6 +162,53 @@ err:
     return rc;
 }
 
+static int
+virSecurityDACApplyLabel(const char *path,
+                         const char *label,
+                         unsigned int flags ATTRIBUTE_UNUSED)
+{
+    unsigned int uid, gid;
+    char *end;
+    struct stat sb;
+
+    if (!label)
+        return virSecurityDACRestoreSecurityFileLabel(path);
+
+    if (virStrToLong_ui(label, &end, 10, &uid) < 0 ||
+        *end != ':' ||
+        virStrToLong_ui(end + 1, NULL, 10, &gid) < 0) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
+                               _("malformed DAC label '%s'"), label);
+        return -1;
+    }
+
+    if (stat(path, &sb) == 0 &&
+        sb.st_uid == uid &&
+        sb.st_gid == gid)
+        return 1;
+
+    return virSecurityDACSetOwnership(path, uid, gid);
+}
+
+static int
+virSecurityDACQueueOwnership(const char *path, int uid, int gid)
+{
+    char label[INT_BUFSIZE_BOUND(uid) + INT_BUFSIZE_BOUND(gid) + 1];
+
+    snprintf(label, sizeof(label), "%u:%u",
+             (unsigned int) uid, (unsigned int) gid);
+
+    return virSecurityLabelPlanAdd("dac", virSecurityDACApplyLabel,
+                                   path, label, 0);
+}
+
+static int
+virSecurityDACQueueRestore(const char *path)
+{
+    return virSecurityLabelPlanAdd("dac", virSecurityDACApplyLabel,
+                                   path, NULL, 0);
+}
+
 
 static int
 virSecurityDACSetSecurityFileLabel(virDomainDiskDefPtr disk ATTRIBUTE_UNUSED,
@@ -165,7 +219,7 @@ virSecurityDACSetSecurityFileLabel(virDomainDiskDefPtr disk ATTRIBUTE_UNUSED,
     virSecurityManagerPtr mgr = opaque;
     virSecurityDACDataPtr priv = virSecurityManagerGetPrivateData(mgr);
 
-    return virSecurityDACSetOwnership(path, priv->user, priv->group);
+    return virSecurityDACQueueOwnership(path, priv->user, priv->group);
 }
 
 
@@ -229,7 +283,7 @@ virSecurityDACRestoreSecurityImageLabelInt(virSecurityManagerPtr mgr,
         }
     }
 
-    return virSecurityDACRestoreSecurityFileLabel(disk->src);
+    return virSecurityDACQueueRestore(disk->src);
 }
 
 
@@ -250,7 +304,7 @@ virSecurityDACSetSecurityPCILabel(pciDevice *dev ATTRIBUTE_UNUSED,
     virSecurityManagerPtr mgr = opaque;
     virSecurityDACDataPtr priv = virSecurityManagerGetPrivateData(mgr);
 
-    return virSecurityDACSetOwnership(file, priv->user, priv->group);
+    return virSecurityDACQueueOwnership(file, priv->user, priv->group);
 }
 
 
@@ -262,7 +316,7 @@ virSecurityDACSetSecurityUSBLabel(usbDevice *dev ATTRIBUTE_UNUSED,
     virSecurityManagerPtr mgr = opaque;
     virSecurityDACDataPtr priv = virSecurityManagerGetPrivateData(mgr);
 
-    return virSecurityDACSetOwnership(file, priv->user, priv->group);
+    return virSecurityDACQueueOwnership(file, priv->user, priv->group);
 }
 
 
@@ -323,7 +377,7 @@ virSecurityDACRestoreSecurityPCILabel(pciDevice *dev ATTRIBUTE_UNUSED,
                                       const char *file,
                                       void *opaque ATTRIBUTE_UNUSED)
 {
-    return virSecurityDACRestoreSecurityFileLabel(file);
+    return virSecurityDACQueueRestore(file);
 }
 
 
@@ -332,7 +386,7 @@ virSecurityDACRestoreSecurityUSBLabel(usbDevice *dev ATTRIBUTE_UNUSED,
                                        const char *file,
                                        void *opaque ATTRIBUTE_UNUSED)
 {
-    return virSecurityDACRestoreSecurityFileLabel(file);
+    return virSecurityDACQueueRestore(file);
 }
 
 
@@ -402,7 +456,7 @@ virSecurityDACSetChardevLabel(virSecurityManagerPtr mgr,
     switch (dev->type) {
     case VIR_DOMAIN_CHR_TYPE_DEV:
     case VIR_DOMAIN_CHR_TYPE_FILE:
-        ret = virSecurityDACSetOwnership(dev->data.file.path, priv->user, priv->group);
+        ret = virSecurityDACQueueOwnership(dev->data.file.path, priv->user, priv->group);
         break;
 
     case VIR_DOMAIN_CHR_TYPE_PIPE:
@@ -412,12 +466,12 @@ virSecurityDACSetChardevLabel(virSecurityManagerPtr mgr,
             goto done;
         }
         if (virFileExists(in) && virFileExists(out)) {
-            if ((virSecurityDACSetOwnership(in, priv->user, priv->group) < 0) ||
-                (virSecurityDACSetOwnership(out, priv->user, priv->group) < 0)) {
+            if ((virSecurityDACQueueOwnership(in, priv->user, priv->group) < 0) ||
+                (virSecurityDACQueueOwnership(out, priv->user, priv->group) < 0)) {
                 goto done;
             }
-        } else if (virSecurityDACSetOwnership(dev->data.file.path,
-                                              priv->user, priv->group) < 0) {
+        } else if (virSecurityDACQueueOwnership(dev->data.file.path,
+                                                priv->user, priv->group) < 0) {
             goto done;
         }
         ret = 0;
@@ -444,7 +498,7 @@ virSecurityDACRestoreChardevLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
     switch (dev->type) {
     case VIR_DOMAIN_CHR_TYPE_DEV:
     case VIR_DOMAIN_CHR_TYPE_FILE:
-        ret = virSecurityDACRestoreSecurityFileLabel(dev->data.file.path);
+        ret = virSecurityDACQueueRestore(dev->data.file.path);
         break;
 
     case VIR_DOMAIN_CHR_TYPE_PIPE:
@@ -454,11 +508,11 @@ virSecurityDACRestoreChardevLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
             goto done;
         }
         if (virFileExists(in) && virFileExists(out)) {
-            if ((virSecurityDACRestoreSecurityFileLabel(out) < 0) ||
-                (virSecurityDACRestoreSecurityFileLabel(in) < 0)) {
+            if ((virSecurityDACQueueRestore(out) < 0) ||
+                (virSecurityDACQueueRestore(in) < 0)) {
             goto done;
             }
-        } else if (virSecurityDACRestoreSecurityFileLabel(dev->data.file.path) < 0) {
+        } else if (virSecurityDACQueueRestore(dev->data.file.path) < 0) {
             goto done;
         }
         ret = 0;
@@ -524,11 +578,11 @@ virSecurityDACRestoreSecurityAllLabel(virSecurityManagerPtr mgr,
         rc = -1;
 
     if (vm->def->os.kernel &&
-        virSecurityDACRestoreSecurityFileLabel(vm->def->os.kernel) < 0)
+        virSecurityDACQueueRestore(vm->def->os.kernel) < 0)
         rc = -1;
 
     if (vm->def->os.initrd &&
-        virSecurityDACRestoreSecurityFileLabel(vm->def->os.initrd) < 0)
+        virSecurityDACQueueRestore(vm->def->os.initrd) < 0)
         rc = -1;
 
     return rc;
@@ -580,15 +634,15 @@ virSecurityDACSetSecurityAllLabel(virSecurityManagerPtr mgr,
         return -1;
 
     if (vm->def->os.kernel &&
-        virSecurityDACSetOwnership(vm->def->os.kernel,
-                                    priv->user,
-                                    priv->group) < 0)
+        virSecurityDACQueueOwnership(vm->def->os.kernel,
+                                     priv->user,
+                                     priv->group) < 0)
         return -1;
 
     if (vm->def->os.initrd &&
-        virSecurityDACSetOwnership(vm->def->os.initrd,
-                                    priv->user,
-                                    priv->group) < 0)
+        virSecurityDACQueueOwnership(vm->def->os.initrd,
+                                     priv->user,
+                                     priv->group) < 0)
         return -1;
 
     return 0;
@@ -602,7 +656,7 @@ virSecurityDACSetSavedStateLabel(virSecurityManagerPtr mgr,
 {
     virSecurityDACDataPtr priv = virSecurityManagerGetPrivateData(mgr);
 
-    return virSecurityDACSetOwnership(savefile, priv->user, priv->group);
+    return virSecurityDACQueueOwnership(savefile, priv->user, priv->group);
 }
 
 
@@ -616,7 +670,7 @@ virSecurityDACRestoreSavedStateLabel(virSecurityManagerPtr mgr,
     if (!priv->dynamicOwnership)
         return 0;
 
-    return virSecurityDACRestoreSecurityFileLabel(savefile);
+    return virSecurityDACQueueRestore(savefile);
 }
 
 
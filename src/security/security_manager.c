@@ -26,6 +26,7 @@
 #include "security_driver.h"
 #include "security_stack.h"
 #include "security_dac.h"
+#include "security_plan.h"
 #include "virterror_internal.h"
 #include "memory.h"
 #include "logging.h"
@@ -275,12 +276,30 @@ int virSecurityManagerReleaseLabel(virSecurityManagerPtr mgr,
     return -1;
 }
 
+/*
+ * Labelling all of a domain's files is done as a single plan, shared
+ * by any stacked drivers, so that each file is only touched once per
+ * driver and the files are relabelled in parallel.
+ */
 int virSecurityManagerSetAllLabel(virSecurityManagerPtr mgr,
                                   virDomainObjPtr vm,
                                   const char *stdin_path)
 {
-    if (mgr->drv->domainSetSecurityAllLabel)
-        return mgr->drv->domainSetSecurityAllLabel(mgr, vm, stdin_path);
+    int ret;
+
+    if (mgr->drv->domainSetSecurityAllLabel) {
+        if (virSecurityLabelPlanBegin() < 0)
+            return -1;
+
+        ret = mgr->drv->domainSetSecurityAllLabel(mgr, vm, stdin_path);
+
+        /* The caller restores all labels if this fails, so there is
+         * no point in applying a partial plan */
+        if (virSecurityLabelPlanEnd(vm->def->name, ret == 0) < 0)
+            ret = -1;
+
+        return ret;
+    }
 
     virSecurityReportError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
     return -1;
@@ -290,8 +309,20 @@ int virSecurityManagerRestoreAllLabel(virSecurityManagerPtr mgr,
                                       virDomainObjPtr vm,
                                       int migrated)
 {
-    if (mgr->drv->domainRestoreSecurityAllLabel)
-        return mgr->drv->domainRestoreSecurityAllLabel(mgr, vm, migrated);
+    int ret;
+
+    if (mgr->drv->domainRestoreSecurityAllLabel) {
+        if (virSecurityLabelPlanBegin() < 0)
+            return -1;
+
+        ret = mgr->drv->domainRestoreSecurityAllLabel(mgr, vm, migrated);
+
+        /* Restoring is best effort, so apply whatever was queued */
+        if (virSecurityLabelPlanEnd(vm->def->name, true) < 0)
+            ret = -1;
+
+        return ret;
+    }
 
     virSecurityReportError(VIR_ERR_NO_SUPPORT, __FUNCTION__);
     return -1;
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ * MCS category pair allocator
+ *
+ * Every dynamically labelled guest gets a "s0:cX,cY" range with X < Y.
+ * The set of such pairs is the upper triangle of an NxN matrix, which
+ * is flattened row by row into a bitmap so that reserving and releasing
+ * a pair is a single bit operation, and picking a free pair is a word
+ * at a time scan from a random starting point.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "security_mcs.h"
+#include "security_driver.h"
+
+#include "virterror_internal.h"
+#include "bitmap.h"
+#include "threads.h"
+#include "memory.h"
+#include "util.h"
+#include "ignore-value.h"
+
+#define VIR_FROM_THIS VIR_FROM_SECURITY
+
+struct _virSecurityMCSAllocator {
+    virMutex lock;
+
+    unsigned int ncategories;
+    size_t npairs;
+    size_t nused;
+    virBitmapPtr used;
+};
+
+
+/* Index of the first pair (c1, c1 + 1) in row @c1 */
+static size_t
+virSecurityMCSRowStart(unsigned int n, unsigned int c1)
+{
+    return (size_t)c1 * (2 * (size_t)n - c1 - 1) / 2;
+}
+
+static int
+virSecurityMCSPairToIndex(virSecurityMCSAllocatorPtr mcs,
+                          unsigned int c1,
+                          unsigned int c2,
+                          size_t *idx)
+{
+    if (c1 >= c2 || c2 >= mcs->ncategories)
+        return -1;
+
+    *idx = virSecurityMCSRowStart(mcs->ncategories, c1) + (c2 - c1 - 1);
+    return 0;
+}
+
+static void
+virSecurityMCSIndexToPair(virSecurityMCSAllocatorPtr mcs,
+                          size_t idx,
+                          unsigned int *c1,
+                          unsigned int *c2)
+{
+    unsigned int lo = 0;
+    unsigned int hi = mcs->ncategories - 1;
+
+    /* Find the last row whose start is <= idx */
+    while (lo + 1 < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (virSecurityMCSRowStart(mcs->ncategories, mid) <= idx)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (virSecurityMCSRowStart(mcs->ncategories, hi) <= idx)
+        lo = hi;
+
+    *c1 = lo;
+    *c2 = lo + 1 + (idx - virSecurityMCSRowStart(mcs->ncategories, lo));
+}
+
+
+/**
+ * virSecurityMCSAllocatorNew:
+ * @ncategories: number of categories, c0 .. c(ncategories - 1)
+ *
+ * Create an allocator for category pairs drawn from @ncategories
+ * categories.  The allocator has its own lock and can be shared by
+ * any number of security managers.
+ *
+ * Returns the new allocator, or NULL on error
+ */
+virSecurityMCSAllocatorPtr
+virSecurityMCSAllocatorNew(unsigned int ncategories)
+{
+    virSecurityMCSAllocatorPtr mcs;
+
+    if (ncategories < 2) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
+                               _("need at least 2 MCS categories, got %u"),
+                               ncategories);
+        return NULL;
+    }
+
+    if (VIR_ALLOC(mcs) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    if (virMutexInit(&mcs->lock) < 0) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("unable to initialize mutex"));
+        VIR_FREE(mcs);
+        return NULL;
+    }
+
+    mcs->ncategories = ncategories;
+    mcs->npairs = virSecurityMCSRowStart(ncategories, ncategories - 1);
+
+    if (!(mcs->used = virBitmapAlloc(mcs->npairs))) {
+        virReportOOMError();
+        virSecurityMCSAllocatorFree(mcs);
+        return NULL;
+    }
+
+    return mcs;
+}
+
+
+void
+virSecurityMCSAllocatorFree(virSecurityMCSAllocatorPtr mcs)
+{
+    if (!mcs)
+        return;
+
+    virBitmapFree(mcs->used);
+    virMutexDestroy(&mcs->lock);
+    VIR_FREE(mcs);
+}
+
+
+/**
+ * virSecurityMCSAcquire:
+ * @mcs: the allocator
+ * @c1: filled with the lower category
+ * @c2: filled with the upper category
+ *
+ * Pick a random free category pair and mark it as used.
+ *
+ * Returns 0 on success, -1 if every pair is in use
+ */
+int
+virSecurityMCSAcquire(virSecurityMCSAllocatorPtr mcs,
+                      unsigned int *c1,
+                      unsigned int *c2)
+{
+    ssize_t idx;
+    size_t start;
+    int ret = -1;
+
+    virMutexLock(&mcs->lock);
+
+    if (mcs->nused == mcs->npairs)
+        goto exhausted;
+
+    /* virRandom() may return its upper bound */
+    start = (size_t)virRandom(mcs->npairs) % mcs->npairs;
+
+    idx = virBitmapNextClearBit(mcs->used, (ssize_t)start - 1);
+    if (idx < 0)
+        idx = virBitmapNextClearBit(mcs->used, -1);
+    if (idx < 0)
+        goto exhausted;
+
+    ignore_value(virBitmapSetBit(mcs->used, idx));
+    mcs->nused++;
+    virSecurityMCSIndexToPair(mcs, idx, c1, c2);
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&mcs->lock);
+    return ret;
+
+exhausted:
+    virSecurityReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("all %zu MCS category pairs are in use"),
+                           mcs->npairs);
+    goto cleanup;
+}
+
+
+/**
+ * virSecurityMCSReserve:
+ * @mcs: the allocator
+ * @c1: the lower category
+ * @c2: the upper category
+ *
+ * Mark the pair @c1, @c2 as used, typically because a guest which
+ * is already running holds it.
+ *
+ * Returns 0 if the pair was reserved, 1 if it was already in use,
+ * -1 if the pair is not one this allocator hands out
+ */
+int
+virSecurityMCSReserve(virSecurityMCSAllocatorPtr mcs,
+                      unsigned int c1,
+                      unsigned int c2)
+{
+    size_t idx;
+    bool used;
+    int ret = -1;
+
+    virMutexLock(&mcs->lock);
+
+    if (virSecurityMCSPairToIndex(mcs, c1, c2, &idx) < 0 ||
+        virBitmapGetBit(mcs->used, idx, &used) < 0)
+        goto cleanup;
+
+    if (used) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    ignore_value(virBitmapSetBit(mcs->used, idx));
+    mcs->nused++;
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&mcs->lock);
+    return ret;
+}
+
+
+/**
+ * virSecurityMCSRelease:
+ * @mcs: the allocator
+ * @c1: the lower category
+ * @c2: the upper category
+ *
+ * Return the pair @c1, @c2 to the free pool.
+ *
+ * Returns 0 on success, -1 if the pair was not in use
+ */
+int
+virSecurityMCSRelease(virSecurityMCSAllocatorPtr mcs,
+                      unsigned int c1,
+                      unsigned int c2)
+{
+    size_t idx;
+    bool used;
+    int ret = -1;
+
+    virMutexLock(&mcs->lock);
+
+    if (virSecurityMCSPairToIndex(mcs, c1, c2, &idx) < 0 ||
+        virBitmapGetBit(mcs->used, idx, &used) < 0 ||
+        !used)
+        goto cleanup;
+
+    ignore_value(virBitmapClearBit(mcs->used, idx));
+    mcs->nused--;
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&mcs->lock);
+    return ret;
+}
+
+
+size_t
+virSecurityMCSCount(virSecurityMCSAllocatorPtr mcs)
+{
+    size_t ret;
+
+    virMutexLock(&mcs->lock);
+    ret = mcs->nused;
+    virMutexUnlock(&mcs->lock);
+
+    return ret;
+}
+
+
+/**
+ * virSecurityMCSParse:
+ * @range: an MCS range such as "s0:c12,c345"
+ * @c1: filled with the lower category
+ * @c2: filled with the upper category
+ *
+ * Extract the category pair from a range as produced by
+ * virSecurityMCSFormat.  Ranges of any other shape, such as
+ * "s0-s0:c0.c1023" or single categories, are not handed out by
+ * the allocator and are rejected.
+ *
+ * Returns 0 on success, -1 if @range is not a category pair
+ */
+int
+virSecurityMCSParse(const char *range,
+                    unsigned int *c1,
+                    unsigned int *c2)
+{
+    char *end;
+
+    if (!(range = STRSKIP(range, "s0:c")))
+        return -1;
+
+    if (virStrToLong_ui(range, &end, 10, c1) < 0 ||
+        !STRPREFIX(end, ",c"))
+        return -1;
+
+    if (virStrToLong_ui(end + 2, &end, 10, c2) < 0 ||
+        *end != '\0')
+        return -1;
+
+    if (*c1 >= *c2)
+        return -1;
+
+    return 0;
+}
+
+
+char *
+virSecurityMCSFormat(unsigned int c1,
+                     unsigned int c2)
+{
+    char *ret;
+
+    if (virAsprintf(&ret, "s0:c%u,c%u", c1, c2) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    return ret;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ * MCS category pair allocator
+ */
+
+#ifndef __VIR_SECURITY_MCS_H__
+# define __VIR_SECURITY_MCS_H__
+
+# include "internal.h"
+
+/* Number of MCS categories handed out to dynamically labelled guests */
+# define VIR_SECURITY_MCS_CATEGORIES 1024
+
+typedef struct _virSecurityMCSAllocator virSecurityMCSAllocator;
+typedef virSecurityMCSAllocator *virSecurityMCSAllocatorPtr;
+
+virSecurityMCSAllocatorPtr virSecurityMCSAllocatorNew(unsigned int ncategories);
+void virSecurityMCSAllocatorFree(virSecurityMCSAllocatorPtr mcs);
+
+int virSecurityMCSAcquire(virSecurityMCSAllocatorPtr mcs,
+                          unsigned int *c1,
+                          unsigned int *c2)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3)
+    ATTRIBUTE_RETURN_CHECK;
+int virSecurityMCSReserve(virSecurityMCSAllocatorPtr mcs,
+                          unsigned int c1,
+                          unsigned int c2)
+    ATTRIBUTE_NONNULL(1);
+int virSecurityMCSRelease(virSecurityMCSAllocatorPtr mcs,
+                          unsigned int c1,
+                          unsigned int c2)
+    ATTRIBUTE_NONNULL(1);
+size_t virSecurityMCSCount(virSecurityMCSAllocatorPtr mcs)
+    ATTRIBUTE_NONNULL(1);
+
+int virSecurityMCSParse(const char *range,
+                        unsigned int *c1,
+                        unsigned int *c2)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+char *virSecurityMCSFormat(unsigned int c1,
+                           unsigned int c2);
+
+#endif /* __VIR_SECURITY_MCS_H__ */
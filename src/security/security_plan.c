@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ * Deferred, deduplicated file relabelling
+ *
+ * Between virSecurityLabelPlanBegin and virSecurityLabelPlanEnd, the
+ * security drivers queue the files they want to relabel instead of
+ * relabelling them straight away.  The plan is kept per thread, so the
+ * stack driver's nested calls into its primary and secondary managers
+ * all add to the same plan.  Each (driver, path) pair is kept once,
+ * with the last requested label winning, exactly as when the labels
+ * were applied serially.  When the outermost caller ends the plan,
+ * the queued labels are applied by a bounded pool of threads, since
+ * the time is dominated by syscall round trips, notably on NFS.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "security_plan.h"
+#include "security_driver.h"
+
+#include "virterror_internal.h"
+#include "threads.h"
+#include "threadpool.h"
+#include "hash.h"
+#include "memory.h"
+#include "util.h"
+#include "logging.h"
+#include "ignore-value.h"
+
+#define VIR_FROM_THIS VIR_FROM_SECURITY
+
+typedef struct _virSecurityLabelPlanEntry virSecurityLabelPlanEntry;
+typedef virSecurityLabelPlanEntry *virSecurityLabelPlanEntryPtr;
+
+struct _virSecurityLabelPlanEntry {
+    virSecurityLabelPlanFunc func;
+    char *path;
+    char *label;
+    unsigned int flags;
+
+    int result;
+    virErrorPtr err;
+};
+
+typedef struct _virSecurityLabelPlan virSecurityLabelPlan;
+typedef virSecurityLabelPlan *virSecurityLabelPlanPtr;
+
+struct _virSecurityLabelPlan {
+    int depth;
+
+    /* "driver:path" -> entry, entries owned by the array */
+    virHashTablePtr index;
+    size_t nentries;
+    virSecurityLabelPlanEntryPtr *entries;
+
+    virMutex lock;
+    virCond done;
+    size_t pending;
+};
+
+static virThreadLocal planLocal;
+static virOnceControl planOnce = VIR_ONCE_CONTROL_INITIALIZER;
+static int planInitialized = -1;
+
+static void
+virSecurityLabelPlanOnceInit(void)
+{
+    planInitialized = virThreadLocalInit(&planLocal, NULL);
+}
+
+
+static void
+virSecurityLabelPlanEntryFree(virSecurityLabelPlanEntryPtr entry)
+{
+    if (!entry)
+        return;
+
+    VIR_FREE(entry->path);
+    VIR_FREE(entry->label);
+    virFreeError(entry->err);
+    VIR_FREE(entry);
+}
+
+
+static void
+virSecurityLabelPlanFree(virSecurityLabelPlanPtr plan)
+{
+    size_t i;
+
+    if (!plan)
+        return;
+
+    for (i = 0 ; i < plan->nentries ; i++)
+        virSecurityLabelPlanEntryFree(plan->entries[i]);
+    VIR_FREE(plan->entries);
+    virHashFree(plan->index);
+    ignore_value(virCondDestroy(&plan->done));
+    virMutexDestroy(&plan->lock);
+    VIR_FREE(plan);
+}
+
+
+static virSecurityLabelPlanPtr
+virSecurityLabelPlanNew(void)
+{
+    virSecurityLabelPlanPtr plan;
+
+    if (VIR_ALLOC(plan) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    if (virMutexInit(&plan->lock) < 0) {
+        VIR_FREE(plan);
+        goto error;
+    }
+    if (virCondInit(&plan->done) < 0) {
+        virMutexDestroy(&plan->lock);
+        VIR_FREE(plan);
+        goto error;
+    }
+
+    if (!(plan->index = virHashCreate(32, NULL))) {
+        virSecurityLabelPlanFree(plan);
+        return NULL;
+    }
+
+    return plan;
+
+error:
+    virSecurityReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                           _("cannot initialize label plan lock"));
+    return NULL;
+}
+
+
+/**
+ * virSecurityLabelPlanBegin:
+ *
+ * Start queueing relabel requests made from this thread.  Calls may
+ * be nested, in which case the plan is only applied once the
+ * outermost virSecurityLabelPlanEnd is reached.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+virSecurityLabelPlanBegin(void)
+{
+    virSecurityLabelPlanPtr plan;
+
+    if (virOnce(&planOnce, virSecurityLabelPlanOnceInit) < 0 ||
+        planInitialized < 0) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("cannot initialize label plan"));
+        return -1;
+    }
+
+    if ((plan = virThreadLocalGet(&planLocal))) {
+        plan->depth++;
+        return 0;
+    }
+
+    if (!(plan = virSecurityLabelPlanNew()))
+        return -1;
+
+    plan->depth = 1;
+    virThreadLocalSet(&planLocal, plan);
+    return 0;
+}
+
+
+static void
+virSecurityLabelPlanRunEntry(virSecurityLabelPlanEntryPtr entry)
+{
+    entry->result = (entry->func)(entry->path, entry->label, entry->flags);
+
+    /* Errors are thread local, so keep a copy for the caller.  Some
+     * restore callbacks deliberately fail without raising one */
+    if (entry->result < 0 && virGetLastError()) {
+        entry->err = virSaveLastError();
+        virResetLastError();
+    }
+}
+
+
+static void
+virSecurityLabelPlanWorker(void *jobdata, void *opaque)
+{
+    virSecurityLabelPlanEntryPtr entry = jobdata;
+    virSecurityLabelPlanPtr plan = opaque;
+
+    virSecurityLabelPlanRunEntry(entry);
+
+    virMutexLock(&plan->lock);
+    if (--plan->pending == 0)
+        virCondSignal(&plan->done);
+    virMutexUnlock(&plan->lock);
+}
+
+
+static int
+virSecurityLabelPlanApply(virSecurityLabelPlanPtr plan,
+                          const char *name)
+{
+    virThreadPoolPtr pool = NULL;
+    unsigned long long start = 0, end = 0;
+    size_t nworkers;
+    size_t nskipped = 0, nfailed = 0;
+    size_t i;
+    int ret = 0;
+
+    if (plan->nentries == 0)
+        return 0;
+
+    ignore_value(virTimeMs(&start));
+
+    nworkers = MIN(plan->nentries, VIR_SECURITY_LABEL_PLAN_WORKERS);
+    if (nworkers > 1)
+        pool = virThreadPoolNew(nworkers, nworkers, 0,
+                                virSecurityLabelPlanWorker, plan);
+
+    if (pool) {
+        virMutexLock(&plan->lock);
+        for (i = 0 ; i < plan->nentries ; i++) {
+            if (virThreadPoolSendJob(pool, 0, plan->entries[i]) < 0) {
+                /* Run it ourselves instead */
+                virMutexUnlock(&plan->lock);
+                virSecurityLabelPlanRunEntry(plan->entries[i]);
+                virMutexLock(&plan->lock);
+                continue;
+            }
+            plan->pending++;
+        }
+        while (plan->pending > 0) {
+            if (virCondWait(&plan->done, &plan->lock) < 0) {
+                virMutexUnlock(&plan->lock);
+                virReportSystemError(errno, "%s",
+                                     _("cannot wait for relabelling to finish"));
+                /* Workers still reference the plan, so let the pool
+                 * drain before anything is freed */
+                virThreadPoolFree(pool);
+                return -1;
+            }
+        }
+        virMutexUnlock(&plan->lock);
+        virThreadPoolFree(pool);
+    } else {
+        for (i = 0 ; i < plan->nentries ; i++)
+            virSecurityLabelPlanRunEntry(plan->entries[i]);
+    }
+
+    for (i = 0 ; i < plan->nentries ; i++) {
+        virSecurityLabelPlanEntryPtr entry = plan->entries[i];
+
+        if (entry->result == 1) {
+            nskipped++;
+        } else if (entry->result < 0) {
+            if (nfailed++ == 0 && entry->err)
+                virSetError(entry->err);
+            ret = -1;
+        }
+    }
+
+    ignore_value(virTimeMs(&end));
+
+    VIR_INFO("Relabelled %zu of %zu paths for '%s' in %llu ms "
+             "(%zu already labelled, %zu failed, %zu threads)",
+             plan->nentries - nskipped - nfailed, plan->nentries,
+             NULLSTR(name), end - start, nskipped, nfailed,
+             pool ? nworkers : 1);
+
+    return ret;
+}
+
+
+/**
+ * virSecurityLabelPlanEnd:
+ * @name: name of the domain being labelled, for reporting
+ * @apply: whether to apply the queued labels or discard them
+ *
+ * Close one level of plan nesting.  When the outermost level is
+ * closed, the queued labels are applied if @apply is true, or
+ * discarded otherwise.
+ *
+ * Returns 0 on success, -1 if any label could not be applied
+ */
+int
+virSecurityLabelPlanEnd(const char *name, bool apply)
+{
+    virSecurityLabelPlanPtr plan;
+    int ret = 0;
+
+    if (planInitialized < 0 ||
+        !(plan = virThreadLocalGet(&planLocal))) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("no label plan in progress"));
+        return -1;
+    }
+
+    if (--plan->depth > 0)
+        return 0;
+
+    virThreadLocalSet(&planLocal, NULL);
+
+    if (apply)
+        ret = virSecurityLabelPlanApply(plan, name);
+    else
+        VIR_DEBUG("Discarding %zu queued labels for '%s'",
+                  plan->nentries, NULLSTR(name));
+
+    virSecurityLabelPlanFree(plan);
+    return ret;
+}
+
+
+/**
+ * virSecurityLabelPlanAdd:
+ * @driver: name of the security driver doing the labelling
+ * @func: callback to apply the label
+ * @path: the file to label
+ * @label: driver specific label, or NULL to restore the default
+ * @flags: driver specific flags, passed back to @func
+ *
+ * Queue @label for @path in the current thread's plan, replacing any
+ * label @driver previously queued for @path.  If no plan is in
+ * progress the label is applied immediately.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+virSecurityLabelPlanAdd(const char *driver,
+                        virSecurityLabelPlanFunc func,
+                        const char *path,
+                        const char *label,
+                        unsigned int flags)
+{
+    virSecurityLabelPlanPtr plan = NULL;
+    virSecurityLabelPlanEntryPtr entry;
+    char *key = NULL;
+    char *newlabel = NULL;
+    int ret = -1;
+
+    if (planInitialized == 0)
+        plan = virThreadLocalGet(&planLocal);
+
+    if (!plan)
+        return (func)(path, label, flags) < 0 ? -1 : 0;
+
+    if (virAsprintf(&key, "%s:%s", driver, path) < 0 ||
+        (label && !(newlabel = strdup(label)))) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if ((entry = virHashLookup(plan->index, key))) {
+        VIR_FREE(entry->label);
+        entry->label = newlabel;
+        entry->func = func;
+        entry->flags = flags;
+        newlabel = NULL;
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (VIR_ALLOC(entry) < 0 ||
+        !(entry->path = strdup(path))) {
+        virReportOOMError();
+        VIR_FREE(entry);
+        goto cleanup;
+    }
+    entry->func = func;
+    entry->label = newlabel;
+    entry->flags = flags;
+    newlabel = NULL;
+
+    if (VIR_EXPAND_N(plan->entries, plan->nentries, 1) < 0) {
+        virReportOOMError();
+        virSecurityLabelPlanEntryFree(entry);
+        goto cleanup;
+    }
+    plan->entries[plan->nentries - 1] = entry;
+
+    if (virHashAddEntry(plan->index, key, entry) < 0) {
+        plan->nentries--;
+        virSecurityLabelPlanEntryFree(entry);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(key);
+    VIR_FREE(newlabel);
+    return ret;
+}
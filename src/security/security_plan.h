@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ *
+ * Deferred, deduplicated file relabelling
+ */
+
+#ifndef __VIR_SECURITY_PLAN_H__
+# define __VIR_SECURITY_PLAN_H__
+
+# include "internal.h"
+
+/* Upper bound on threads used to apply a single plan */
+# define VIR_SECURITY_LABEL_PLAN_WORKERS 8
+
+/*
+ * virSecurityLabelPlanFunc:
+ * @path: the file to label
+ * @label: driver specific label, or NULL to restore the default
+ * @flags: driver specific flags passed to virSecurityLabelPlanAdd
+ *
+ * Apply @label to @path.  Called from a worker thread, so it
+ * must not touch driver or domain state which is not thread safe.
+ *
+ * Returns 0 if the label was changed, 1 if @path was already
+ * labelled correctly, -1 on error
+ */
+typedef int (*virSecurityLabelPlanFunc)(const char *path,
+                                        const char *label,
+                                        unsigned int flags);
+
+int virSecurityLabelPlanBegin(void);
+int virSecurityLabelPlanEnd(const char *name, bool apply);
+
+int virSecurityLabelPlanAdd(const char *driver,
+                            virSecurityLabelPlanFunc func,
+                            const char *path,
+                            const char *label,
+                            unsigned int flags)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+
+#endif /* __VIR_SECURITY_PLAN_H__ */
@@ -32,6 +32,8 @@
 #include "hostusb.h"
 #include "storage_file.h"
 #include "virfile.h"
+#include "security_mcs.h"
+#include "security_plan.h"
 
 #define VIR_FROM_THIS VIR_FROM_SECURITY
 
@@ -41,53 +43,47 @@ static char default_image_context[1024];
 #define SECURITY_SELINUX_VOID_DOI       "0"
 #define SECURITY_SELINUX_NAME "selinux"
 
-/* TODO
-   The data struct of used mcs should be replaced with a better data structure in the future
-*/
-
-struct MCS {
-    char *mcs;
-    struct MCS *next;
+/* Flags for SELinuxApplyLabel */
+enum {
+    /* Failure to label a file on NFS is not an error */
+    SELINUX_LABEL_IGNORE_NFS = (1 << 0),
 };
-static struct MCS *mcsList = NULL;
 
-static int
-mcsAdd(const char *mcs)
+/* Category pairs of running guests with dynamic labels */
+static virSecurityMCSAllocatorPtr mcsAllocator = NULL;
+static virOnceControl mcsAllocatorOnce = VIR_ONCE_CONTROL_INITIALIZER;
+
+static void
+mcsAllocatorInit(void)
 {
-    struct MCS *ptr;
+    mcsAllocator = virSecurityMCSAllocatorNew(VIR_SECURITY_MCS_CATEGORIES);
+}
 
-    for (ptr = mcsList; ptr; ptr = ptr->next) {
-        if (STREQ(ptr->mcs, mcs))
-            return -1;
+/* Record the categories of @mcs as used, if it is a range we hand out */
+static void
+mcsReserve(const char *mcs)
+{
+    unsigned int c1, c2;
+
+    if (virSecurityMCSParse(mcs, &c1, &c2) < 0) {
+        VIR_DEBUG("Not tracking MCS range '%s'", mcs);
+        return;
     }
-    if (VIR_ALLOC(ptr) < 0)
-        return -1;
-    ptr->mcs = strdup(mcs);
-    ptr->next = mcsList;
-    mcsList = ptr;
-    return 0;
+
+    if (virSecurityMCSReserve(mcsAllocator, c1, c2) == 1)
+        VIR_WARN("MCS range '%s' is used by more than one domain", mcs);
 }
 
-static int
-mcsRemove(const char *mcs)
+static void
+mcsRelease(const char *mcs)
 {
-    struct MCS *prevptr = NULL;
-    struct MCS *ptr = NULL;
-
-    for (ptr = mcsList; ptr; ptr = ptr->next) {
-        if (STREQ(ptr->mcs, mcs)) {
-            if (prevptr)
-                prevptr->next = ptr->next;
-            else {
-                mcsList = ptr->next;
-            }
-            VIR_FREE(ptr->mcs);
-            VIR_FREE(ptr);
-            return 0;
-        }
-        prevptr = ptr;
-    }
-    return -1;
+    unsigned int c1, c2;
+
+    if (virSecurityMCSParse(mcs, &c1, &c2) < 0)
+        return;
+
+    if (virSecurityMCSRelease(mcsAllocator, c1, c2) < 0)
+        VIR_DEBUG("MCS range '%s' was not reserved", mcs);
 }
 
 static char *
@@ -113,6 +109,13 @@ SELinuxInitialize(void)
     char *ptr = NULL;
     int fd = 0;
 
+    if (virOnce(&mcsAllocatorOnce, mcsAllocatorInit) < 0 ||
+        !mcsAllocator) {
+        virSecurityReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                               _("unable to initialize MCS category allocator"));
+        return -1;
+    }
+
     fd = open(selinux_virtual_domain_context_path(), O_RDONLY);
     if (fd < 0) {
         virReportSystemError(errno,
@@ -167,8 +170,9 @@ SELinuxGenSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
     int rc = -1;
     char *mcs = NULL;
     char *scontext = NULL;
-    int c1 = 0;
-    int c2 = 0;
+    unsigned int c1 = 0;
+    unsigned int c2 = 0;
+    bool mcsAcquired = false;
     context_t ctx = NULL;
 
     if ((vm->def->seclabel.type == VIR_DOMAIN_SECLABEL_DYNAMIC) &&
@@ -215,27 +219,12 @@ SELinuxGenSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
             goto cleanup;
         }
     } else {
-        do {
-            c1 = virRandom(1024);
-            c2 = virRandom(1024);
-
-            if ( c1 == c2 ) {
-                if (virAsprintf(&mcs, "s0:c%d", c1) < 0) {
-                    virReportOOMError();
-                    goto cleanup;
-                }
-            } else {
-                if (c1 > c2) {
-                    c1 ^= c2;
-                    c2 ^= c1;
-                    c1 ^= c2;
-                }
-                if (virAsprintf(&mcs, "s0:c%d,c%d", c1, c2) < 0) {
-                    virReportOOMError();
-                    goto cleanup;
-                }
-            }
-        } while (mcsAdd(mcs) == -1);
+        if (virSecurityMCSAcquire(mcsAllocator, &c1, &c2) < 0)
+            goto cleanup;
+        mcsAcquired = true;
+
+        if (!(mcs = virSecurityMCSFormat(c1, c2)))
+            goto cleanup;
 
         vm->def->seclabel.label =
             SELinuxGenNewContext(vm->def->seclabel.baselabel ?
@@ -264,6 +253,8 @@ SELinuxGenSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
 
 cleanup:
     if (rc != 0) {
+        if (mcsAcquired)
+            ignore_value(virSecurityMCSRelease(mcsAllocator, c1, c2));
         if (vm->def->seclabel.type == VIR_DOMAIN_SECLABEL_DYNAMIC)
             VIR_FREE(vm->def->seclabel.label);
         VIR_FREE(vm->def->seclabel.imagelabel);
@@ -312,7 +303,7 @@ SELinuxReserveSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
     if (!mcs)
         goto err;
 
-    mcsAdd(mcs);
+    mcsReserve(mcs);
 
     context_free(ctx);
 
@@ -511,6 +502,7 @@ SELinuxRestoreSecurityFileLabel(const char *path)
 {
     struct stat buf;
     security_context_t fcon = NULL;
+    security_context_t econ = NULL;
     int rc = -1;
     char *newpath = NULL;
     char ebuf[1024];
@@ -531,16 +523,70 @@ SELinuxRestoreSecurityFileLabel(const char *path)
 
     if (getContext(newpath, buf.st_mode, &fcon) < 0) {
         VIR_WARN("cannot lookup default selinux label for %s", newpath);
+    } else if (getfilecon(newpath, &econ) >= 0 && STREQ(fcon, econ)) {
+        rc = 1;
     } else {
         rc = SELinuxSetFilecon(newpath, fcon);
     }
 
 err:
+    freecon(econ);
     freecon(fcon);
     VIR_FREE(newpath);
     return rc;
 }
 
+static int
+SELinuxApplyLabel(const char *path,
+                  const char *label,
+                  unsigned int flags)
+{
+    security_context_t econ = NULL;
+    int ret;
+
+    if (!label)
+        return SELinuxRestoreSecurityFileLabel(path);
+
+    if (getfilecon(path, &econ) >= 0 && STREQ(label, econ)) {
+        freecon(econ);
+        return 1;
+    }
+    freecon(econ);
+
+    ret = SELinuxSetFilecon(path, (char *) label);
+
+    if (ret < 0 &&
+        (flags & SELINUX_LABEL_IGNORE_NFS) &&
+        virStorageFileIsSharedFSType(path,
+                                     VIR_STORAGE_FILE_SHFS_NFS) == 1)
+        ret = 0;
+
+    return ret;
+}
+
+static int
+SELinuxQueueFileconFlags(const char *path,
+                         const char *tcon,
+                         unsigned int flags)
+{
+    return virSecurityLabelPlanAdd(SECURITY_SELINUX_NAME, SELinuxApplyLabel,
+                                   path, tcon, flags);
+}
+
+static int
+SELinuxQueueFilecon(const char *path, const char *tcon)
+{
+    return SELinuxQueueFileconFlags(path, tcon, 0);
+}
+
+/* Like SELinuxRestoreSecurityFileLabel, this does not raise errors */
+static int
+SELinuxQueueRestore(const char *path)
+{
+    return virSecurityLabelPlanAdd(SECURITY_SELINUX_NAME, SELinuxApplyLabel,
+                                   path, NULL, 0);
+}
+
 static int
 SELinuxRestoreSecurityImageLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
                                     virDomainObjPtr vm,
@@ -582,7 +628,7 @@ SELinuxRestoreSecurityImageLabelInt(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
         }
     }
 
-    return SELinuxRestoreSecurityFileLabel(disk->src);
+    return SELinuxQueueRestore(disk->src);
 }
 
 
@@ -602,26 +648,22 @@ SELinuxSetSecurityFileLabel(virDomainDiskDefPtr disk,
                             void *opaque)
 {
     const virSecurityLabelDefPtr secdef = opaque;
-    int ret;
+    const char *tcon;
 
     if (depth == 0) {
-        if (disk->shared) {
-            ret = SELinuxSetFilecon(path, default_image_context);
-        } else if (disk->readonly) {
-            ret = SELinuxSetFilecon(path, default_content_context);
-        } else if (secdef->imagelabel) {
-            ret = SELinuxSetFilecon(path, secdef->imagelabel);
-        } else {
-            ret = 0;
-        }
+        if (disk->shared)
+            tcon = default_image_context;
+        else if (disk->readonly)
+            tcon = default_content_context;
+        else if (secdef->imagelabel)
+            tcon = secdef->imagelabel;
+        else
+            return 0;
     } else {
-        ret = SELinuxSetFilecon(path, default_content_context);
+        tcon = default_content_context;
     }
-    if (ret < 0 &&
-        virStorageFileIsSharedFSType(path,
-                                     VIR_STORAGE_FILE_SHFS_NFS) == 1)
-       ret = 0;
-    return ret;
+
+    return SELinuxQueueFileconFlags(path, tcon, SELINUX_LABEL_IGNORE_NFS);
 }
 
 static int
@@ -651,7 +693,7 @@ SELinuxSetSecurityPCILabel(pciDevice *dev ATTRIBUTE_UNUSED,
     virDomainObjPtr vm = opaque;
     const virSecurityLabelDefPtr secdef = &vm->def->seclabel;
 
-    return SELinuxSetFilecon(file, secdef->imagelabel);
+    return SELinuxQueueFilecon(file, secdef->imagelabel);
 }
 
 static int
@@ -661,7 +703,7 @@ SELinuxSetSecurityUSBLabel(usbDevice *dev ATTRIBUTE_UNUSED,
     virDomainObjPtr vm = opaque;
     const virSecurityLabelDefPtr secdef = &vm->def->seclabel;
 
-    return SELinuxSetFilecon(file, secdef->imagelabel);
+    return SELinuxQueueFilecon(file, secdef->imagelabel);
 }
 
 static int
@@ -722,7 +764,7 @@ SELinuxRestoreSecurityPCILabel(pciDevice *dev ATTRIBUTE_UNUSED,
                                const char *file,
                                void *opaque ATTRIBUTE_UNUSED)
 {
-    return SELinuxRestoreSecurityFileLabel(file);
+    return SELinuxQueueRestore(file);
 }
 
 static int
@@ -730,7 +772,7 @@ SELinuxRestoreSecurityUSBLabel(usbDevice *dev ATTRIBUTE_UNUSED,
                                const char *file,
                                void *opaque ATTRIBUTE_UNUSED)
 {
-    return SELinuxRestoreSecurityFileLabel(file);
+    return SELinuxQueueRestore(file);
 }
 
 static int
@@ -802,7 +844,7 @@ SELinuxSetSecurityChardevLabel(virDomainObjPtr vm,
     switch (dev->type) {
     case VIR_DOMAIN_CHR_TYPE_DEV:
     case VIR_DOMAIN_CHR_TYPE_FILE:
-        ret = SELinuxSetFilecon(dev->data.file.path, secdef->imagelabel);
+        ret = SELinuxQueueFilecon(dev->data.file.path, secdef->imagelabel);
         break;
 
     case VIR_DOMAIN_CHR_TYPE_PIPE:
@@ -812,11 +854,11 @@ SELinuxSetSecurityChardevLabel(virDomainObjPtr vm,
             goto done;
         }
         if (virFileExists(in) && virFileExists(out)) {
-            if ((SELinuxSetFilecon(in, secdef->imagelabel) < 0) ||
-                (SELinuxSetFilecon(out, secdef->imagelabel) < 0)) {
+            if ((SELinuxQueueFilecon(in, secdef->imagelabel) < 0) ||
+                (SELinuxQueueFilecon(out, secdef->imagelabel) < 0)) {
                 goto done;
             }
-        } else if (SELinuxSetFilecon(dev->data.file.path, secdef->imagelabel) < 0) {
+        } else if (SELinuxQueueFilecon(dev->data.file.path, secdef->imagelabel) < 0) {
             goto done;
         }
         ret = 0;
@@ -848,7 +890,7 @@ SELinuxRestoreSecurityChardevLabel(virDomainObjPtr vm,
     switch (dev->type) {
     case VIR_DOMAIN_CHR_TYPE_DEV:
     case VIR_DOMAIN_CHR_TYPE_FILE:
-        if (SELinuxRestoreSecurityFileLabel(dev->data.file.path) < 0)
+        if (SELinuxQueueRestore(dev->data.file.path) < 0)
             goto done;
         ret = 0;
         break;
@@ -859,11 +901,11 @@ SELinuxRestoreSecurityChardevLabel(virDomainObjPtr vm,
             goto done;
         }
         if (virFileExists(in) && virFileExists(out)) {
-            if ((SELinuxRestoreSecurityFileLabel(out) < 0) ||
-                (SELinuxRestoreSecurityFileLabel(in) < 0)) {
+            if ((SELinuxQueueRestore(out) < 0) ||
+                (SELinuxQueueRestore(in) < 0)) {
                 goto done;
             }
-        } else if (SELinuxRestoreSecurityFileLabel(dev->data.file.path) < 0) {
+        } else if (SELinuxQueueRestore(dev->data.file.path) < 0) {
             goto done;
         }
         ret = 0;
@@ -908,7 +950,7 @@ SELinuxRestoreSecuritySmartcardCallback(virDomainDefPtr def ATTRIBUTE_UNUSED,
         database = dev->data.cert.database;
         if (!database)
             database = VIR_DOMAIN_SMARTCARD_DEFAULT_DATABASE;
-        return SELinuxRestoreSecurityFileLabel(database);
+        return SELinuxQueueRestore(database);
 
     case VIR_DOMAIN_SMARTCARD_TYPE_PASSTHROUGH:
         return SELinuxRestoreSecurityChardevLabel(vm, &dev->data.passthru);
@@ -965,11 +1007,11 @@ SELinuxRestoreSecurityAllLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
         rc = -1;
 
     if (vm->def->os.kernel &&
-        SELinuxRestoreSecurityFileLabel(vm->def->os.kernel) < 0)
+        SELinuxQueueRestore(vm->def->os.kernel) < 0)
         rc = -1;
 
     if (vm->def->os.initrd &&
-        SELinuxRestoreSecurityFileLabel(vm->def->os.initrd) < 0)
+        SELinuxQueueRestore(vm->def->os.initrd) < 0)
         rc = -1;
 
     return rc;
@@ -985,7 +1027,7 @@ SELinuxReleaseSecurityLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
         if (secdef->label != NULL) {
             context_t con = context_new(secdef->label);
             if (con) {
-                mcsRemove(context_range_get(con));
+                mcsRelease(context_range_get(con));
                 context_free(con);
             }
         }
@@ -1009,7 +1051,7 @@ SELinuxSetSavedStateLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
     if (secdef->norelabel)
         return 0;
 
-    return SELinuxSetFilecon(savefile, secdef->imagelabel);
+    return SELinuxQueueFilecon(savefile, secdef->imagelabel);
 }
 
 
@@ -1023,7 +1065,7 @@ SELinuxRestoreSavedStateLabel(virSecurityManagerPtr mgr ATTRIBUTE_UNUSED,
     if (secdef->norelabel)
         return 0;
 
-    return SELinuxRestoreSecurityFileLabel(savefile);
+    return SELinuxQueueRestore(savefile);
 }
 
 
@@ -1248,7 +1290,7 @@ SELinuxSetSecuritySmartcardCallback(virDomainDefPtr def ATTRIBUTE_UNUSED,
         database = dev->data.cert.database;
         if (!database)
             database = VIR_DOMAIN_SMARTCARD_DEFAULT_DATABASE;
-        return SELinuxSetFilecon(database, default_content_context);
+        return SELinuxQueueFilecon(database, default_content_context);
 
     case VIR_DOMAIN_SMARTCARD_TYPE_PASSTHROUGH:
         return SELinuxSetSecurityChardevLabel(vm, &dev->data.passthru);
@@ -1308,19 +1350,17 @@ SELinuxSetSecurityAllLabel(virSecurityManagerPtr mgr,
         return -1;
 
     if (vm->def->os.kernel &&
-        SELinuxSetFilecon(vm->def->os.kernel, default_content_context) < 0)
+        SELinuxQueueFilecon(vm->def->os.kernel, default_content_context) < 0)
         return -1;
 
     if (vm->def->os.initrd &&
-        SELinuxSetFilecon(vm->def->os.initrd, default_content_context) < 0)
+        SELinuxQueueFilecon(vm->def->os.initrd, default_content_context) < 0)
         return -1;
 
-    if (stdin_path) {
-        if (SELinuxSetFilecon(stdin_path, default_content_context) < 0 &&
-            virStorageFileIsSharedFSType(stdin_path,
-                                         VIR_STORAGE_FILE_SHFS_NFS) != 1)
-            return -1;
-    }
+    if (stdin_path &&
+        SELinuxQueueFileconFlags(stdin_path, default_content_context,
+                                 SELINUX_LABEL_IGNORE_NFS) < 0)
+        return -1;
 
     return 0;
 }
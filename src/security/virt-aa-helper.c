@@ -61,13 +61,16 @@ typedef struct {
     char *hvm;                  /* type of hypervisor (eg hvm, xen) */
     char *arch;                 /* machine architecture */
     int bits;                   /* bits in the guest */
-    char *newfile;              /* newly added file */
+    char **newfiles;            /* newly added files */
+    size_t nnewfiles;
     bool append;                /* append to .files instead of rewrite */
 } vahControl;
 
 static int
 vahDeinit(vahControl * ctl)
 {
+    size_t i;
+
     if (ctl == NULL)
         return -1;
 
@@ -76,7 +79,9 @@ vahDeinit(vahControl * ctl)
     VIR_FREE(ctl->files);
     VIR_FREE(ctl->hvm);
     VIR_FREE(ctl->arch);
-    VIR_FREE(ctl->newfile);
+    for (i = 0; i < ctl->nnewfiles; i++)
+        VIR_FREE(ctl->newfiles[i]);
+    VIR_FREE(ctl->newfiles);
 
     return 0;
 }
@@ -92,8 +97,8 @@ vah_usage(void)
             "    -a | --add                     load profile\n"
             "    -c | --create                  create profile from template\n"
             "    -D | --delete                  unload and delete profile\n"
-            "    -f | --add-file <file>         add file to profile\n"
-            "    -F | --append-file <file>      append file to profile\n"
+            "    -f | --add-file <file>         add file to profile (repeatable)\n"
+            "    -F | --append-file <file>      append file to profile (repeatable)\n"
             "    -r | --replace                 reload profile\n"
             "    -R | --remove                  unload profile\n"
             "    -h | --help                    this help\n"
@@ -240,8 +245,32 @@ cleanup:
     return result;
 }
 
+/*
+ * Check whether @content has a line which is exactly the @len bytes
+ * at @line, so that a rule is not mistaken for a longer one it is a
+ * prefix or substring of
+ */
+static bool
+has_line(const char *content, const char *line, size_t len)
+{
+    const char *p = content;
+
+    while (*p) {
+        const char *eol = strchrnul(p, '\n');
+
+        if ((size_t)(eol - p) == len && STREQLEN(p, line, len))
+            return true;
+        p = *eol ? eol + 1 : eol;
+    }
+
+    return false;
+}
+
 /*
  * Update the dynamic files
+ *
+ * Returns 0 if the file was written, 1 if it already had the wanted
+ * content, -1 on error
  */
 static int
 update_include_file(const char *include_file, const char *included_files,
@@ -261,11 +290,29 @@ update_include_file(const char *include_file, const char *included_files,
             return rc;
     }
 
-    if (append && virFileExists(include_file)) {
-        if (virAsprintf(&pcontent, "%s%s", existing, included_files) == -1) {
+    if (append && existing) {
+        virBuffer buf = VIR_BUFFER_INITIALIZER;
+        const char *line = included_files;
+
+        /* Only append rules which are not there yet, so that repeating
+         * an append leaves the profile untouched */
+        virBufferAdd(&buf, existing, -1);
+        if (flen > 0 && existing[flen - 1] != '\n')
+            virBufferAddChar(&buf, '\n');
+        while (*line) {
+            const char *eol = strchrnul(line, '\n');
+
+            if (!has_line(existing, line, eol - line))
+                virBufferAdd(&buf, line, eol - line + (*eol ? 1 : 0));
+            line = *eol ? eol + 1 : eol;
+        }
+
+        if (virBufferError(&buf)) {
+            virBufferFreeAndReset(&buf);
             vah_error(NULL, 0, _("could not allocate memory for profile"));
             goto clean;
         }
+        pcontent = virBufferContentAndReset(&buf);
     } else {
         if (virAsprintf(&pcontent, "%s%s", warning, included_files) == -1) {
             vah_error(NULL, 0, _("could not allocate memory for profile"));
@@ -281,7 +328,7 @@ update_include_file(const char *include_file, const char *included_files,
 
     /* only update the disk profile if it is different */
     if (flen > 0 && flen == plen && STREQLEN(existing, pcontent, plen)) {
-        rc = 0;
+        rc = 1;
         goto clean;
     }
 
@@ -967,8 +1014,8 @@ get_files(vahControl * ctl)
             } /* switch */
         }
 
-    if (ctl->newfile)
-        if (vah_add_file(&buf, ctl->newfile, "rw") != 0)
+    for (i = 0; i < ctl->nnewfiles; i++)
+        if (vah_add_file(&buf, ctl->newfiles[i], "rw") != 0)
             goto clean;
 
     if (virBufferError(&buf)) {
@@ -1021,7 +1068,8 @@ vahParseArgv(vahControl * ctl, int argc, char **argv)
                 break;
             case 'f':
             case 'F':
-                if ((ctl->newfile = strdup(optarg)) == NULL)
+                if (VIR_EXPAND_N(ctl->newfiles, ctl->nnewfiles, 1) < 0 ||
+                    (ctl->newfiles[ctl->nnewfiles - 1] = strdup(optarg)) == NULL)
                     vah_error(ctl, 1, _("could not allocate memory for disk"));
                 ctl->append = arg == 'F';
                 break;
@@ -1148,9 +1196,11 @@ main(int argc, char **argv)
             vah_error(ctl, 1, _("profile exists"));
         }
 
-        if (ctl->append && ctl->newfile) {
-            if (vah_add_file(&buf, ctl->newfile, "rw") != 0)
-                goto clean;
+        if (ctl->append && ctl->nnewfiles) {
+            size_t i;
+            for (i = 0; i < ctl->nnewfiles; i++)
+                if (vah_add_file(&buf, ctl->newfiles[i], "rw") != 0)
+                    goto clean;
         } else {
             virBufferAsprintf(&buf, "  \"%s/log/libvirt/**/%s.log\" w,\n",
                               LOCALSTATEDIR, ctl->def->name);
@@ -1178,8 +1228,16 @@ main(int argc, char **argv)
             rc = 0;
         } else if ((rc = update_include_file(include_file,
                                              included_files,
-                                             ctl->append)) != 0)
+                                             ctl->append)) < 0) {
             goto clean;
+        } else if (rc == 1) {
+            /* A loaded profile with unchanged rules needs no reload */
+            if (ctl->cmd == 'r') {
+                rc = 0;
+                goto clean;
+            }
+            rc = 0;
+        }
 
 
         /* create the profile from TEMPLATE */
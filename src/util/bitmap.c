@@ -180,3 +180,52 @@ char *virBitmapString(virBitmapPtr bitmap)
 
     return virBufferContentAndReset(&buf);
 }
+
+/**
+ * virBitmapNextClearBit:
+ * @bitmap: Pointer to bitmap
+ * @pos: the position after which to search for a clear bit
+ *
+ * Search for the first clear bit after position @pos in @bitmap.
+ * Pass -1 as @pos to search from the start of the bitmap.  Whole
+ * units are skipped at a time while they are completely set, so the
+ * search does not degrade as the bitmap fills up.
+ *
+ * Returns the position of the found bit, or -1 if no clear bit
+ * remains after @pos.
+ */
+ssize_t virBitmapNextClearBit(virBitmapPtr bitmap, ssize_t pos)
+{
+    size_t nb;
+    size_t nl;
+    size_t sz;
+    unsigned long bits;
+
+    if (pos < 0)
+        pos = -1;
+
+    pos++;
+
+    if ((size_t)pos >= bitmap->size)
+        return -1;
+
+    sz = (bitmap->size + VIR_BITMAP_BITS_PER_UNIT - 1) /
+          VIR_BITMAP_BITS_PER_UNIT;
+    nl = VIR_BITMAP_UNIT_OFFSET(pos);
+    nb = VIR_BITMAP_BIT_OFFSET(pos);
+
+    /* Treat bits before @pos in the first unit as set */
+    bits = ~bitmap->map[nl] & (ULONG_MAX << nb);
+
+    while (bits == 0 && ++nl < sz)
+        bits = ~bitmap->map[nl];
+
+    if (bits == 0)
+        return -1;
+
+    pos = ffsl(bits) - 1 + nl * VIR_BITMAP_BITS_PER_UNIT;
+    if ((size_t)pos >= bitmap->size)
+        return -1;
+
+    return pos;
+}
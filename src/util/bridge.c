@@ -51,12 +51,26 @@
 # include "util.h"
 # include "logging.h"
 # include "network.h"
+# include "netlink.h"
+# include "threads.h"
+# include "ignore-value.h"
+# include "virterror_internal.h"
 
 # define JIFFIES_TO_MS(j) (((j)*1000)/HZ)
 # define MS_TO_JIFFIES(ms) (((ms)*HZ)/1000)
 
 struct _brControl {
     int fd;
+
+    /* Long-lived netlink channel for setting up links, or NULL if
+     * only the ioctl interface can be used */
+    virNetlinkHandlePtr nl;
+
+    /* Tap device setup latency */
+    virMutex lock;
+    unsigned long long ntaps;
+    unsigned long long tapTime;
+    unsigned long long tapTimeMax;
 };
 
 /**
@@ -84,8 +98,19 @@ brInit(brControl **ctlp)
         return errno;
     }
 
+    if (virMutexInit(&(*ctlp)->lock) < 0) {
+        VIR_FORCE_CLOSE(fd);
+        VIR_FREE(*ctlp);
+        return EINVAL;
+    }
+
     (*ctlp)->fd = fd;
 
+    if (!((*ctlp)->nl = virNetlinkHandleNew())) {
+        VIR_DEBUG("Cannot open netlink channel, using ioctls");
+        virResetLastError();
+    }
+
     return 0;
 }
 
@@ -101,6 +126,12 @@ brShutdown(brControl *ctl)
     if (!ctl)
         return;
 
+    if (ctl->ntaps)
+        VIR_DEBUG("Set up %llu tap devices, average %llums, slowest %llums",
+                  ctl->ntaps, ctl->tapTime / ctl->ntaps, ctl->tapTimeMax);
+
+    virNetlinkHandleFree(ctl->nl);
+    virMutexDestroy(&ctl->lock);
     VIR_FORCE_CLOSE(ctl->fd);
 
     VIR_FREE(ctl);
@@ -450,6 +481,93 @@ brProbeVnetHdr(int tapfd)
 }
 # endif
 
+/* Whether @ifname is enslaved to a bridge */
+static bool
+brIsPort(const char *ifname)
+{
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "/sys/class/net/%s/brport",
+                 ifname) >= sizeof(path))
+        return false;
+
+    return virFileExists(path);
+}
+
+/**
+ * brSetupTap:
+ * @ctl: bridge control pointer
+ * @bridge: the bridge name
+ * @ifname: the new tap device
+ * @macaddr: desired MAC address (VIR_MAC_BUFLEN long)
+ * @up: whether to bring the device up
+ *
+ * Do what brAddTap does with a new tap device over the netlink channel:
+ * the MAC address and MTU are set before it is added to the bridge and
+ * brought up, all with a single batch of requests. Kernels which can't
+ * enslave a device with netlink get the ioctl instead.
+ *
+ * Returns 0 in case of success or an errno code in case of failure.
+ */
+static int
+brSetupTap(brControl *ctl,
+           const char *bridge,
+           const char *ifname,
+           const unsigned char *macaddr,
+           bool up)
+{
+    virNetlinkLinkConfig link;
+    struct ifreq ifr;
+    int mtu;
+    int rc;
+
+    if ((mtu = ifGetMtu(ctl, bridge)) < 0)
+        return errno;
+
+    memset(&ifr, 0, sizeof(struct ifreq));
+    if (virStrcpyStatic(ifr.ifr_name, bridge) == NULL)
+        return EINVAL;
+    if (ioctl(ctl->fd, SIOCGIFINDEX, &ifr) < 0)
+        return errno;
+
+    memset(&link, 0, sizeof(link));
+    link.ifname = ifname;
+    link.mac = macaddr;
+    link.mtu = mtu;
+    link.master = ifr.ifr_ifindex;
+    link.up = up ? 1 : -1;
+
+    if ((rc = virNetlinkLinkConfigure(ctl->nl, &link, 1)))
+        return rc;
+
+    if (link.errors[VIR_NETLINK_LINK_SETTINGS])
+        return link.errors[VIR_NETLINK_LINK_SETTINGS];
+
+    if (link.errors[VIR_NETLINK_LINK_MASTER] || !brIsPort(ifname)) {
+        VIR_DEBUG("Cannot enslave %s to %s with netlink: %d",
+                  ifname, bridge, link.errors[VIR_NETLINK_LINK_MASTER]);
+        if ((rc = brAddInterface(ctl, bridge, ifname)))
+            return rc;
+    }
+
+    return link.errors[VIR_NETLINK_LINK_FLAGS];
+}
+
+static void
+brRecordTapSetup(brControl *ctl,
+                 const char *ifname,
+                 unsigned long long elapsed)
+{
+    virMutexLock(&ctl->lock);
+    ctl->ntaps++;
+    ctl->tapTime += elapsed;
+    if (elapsed > ctl->tapTimeMax)
+        ctl->tapTimeMax = elapsed;
+    virMutexUnlock(&ctl->lock);
+
+    VIR_DEBUG("Set up tap device %s in %llums", ifname, elapsed);
+}
+
 /**
  * brAddTap:
  * @ctl: bridge control pointer
@@ -480,10 +598,14 @@ brAddTap(brControl *ctl,
 {
     int fd;
     struct ifreq ifr;
+    unsigned long long start = 0;
+    unsigned long long end;
 
     if (!ctl || !ctl->fd || !bridge || !ifname)
         return EINVAL;
 
+    ignore_value(virTimeMs(&start));
+
     if ((fd = open("/dev/net/tun", O_RDWR)) < 0)
       return errno;
 
@@ -506,6 +628,12 @@ brAddTap(brControl *ctl,
     if (ioctl(fd, TUNSETIFF, &ifr) < 0)
         goto error;
 
+    if (ctl->nl) {
+        if ((errno = brSetupTap(ctl, bridge, ifr.ifr_name, macaddr, up)))
+            goto error;
+        goto configured;
+    }
+
     /* We need to set the interface MAC before adding it
      * to the bridge, because the bridge assumes the lowest
      * MAC of all enslaved interfaces & we don't want it
@@ -524,6 +652,8 @@ brAddTap(brControl *ctl,
         goto error;
     if (up && ((errno = brSetInterfaceUp(ctl, ifr.ifr_name, 1))))
         goto error;
+
+ configured:
     if (!tapfd &&
         (errno = ioctl(fd, TUNSETPERSIST, 1)))
         goto error;
@@ -534,6 +664,10 @@ brAddTap(brControl *ctl,
         *tapfd = fd;
     else
         VIR_FORCE_CLOSE(fd);
+
+    if (start && virTimeMs(&end) == 0)
+        brRecordTapSetup(ctl, *ifname, end - start);
+
     return 0;
 
  error:
@@ -595,6 +729,19 @@ brSetInterfaceUp(brControl *ctl,
     if (!ctl || !ifname)
         return EINVAL;
 
+    if (ctl->nl) {
+        virNetlinkLinkConfig link;
+        int rc;
+
+        memset(&link, 0, sizeof(link));
+        link.ifname = ifname;
+        link.up = up ? 1 : 0;
+
+        if ((rc = virNetlinkLinkConfigure(ctl->nl, &link, 1)))
+            return rc;
+        return link.errors[VIR_NETLINK_LINK_FLAGS];
+    }
+
     memset(&ifr, 0, sizeof(struct ifreq));
 
     if (virStrcpyStatic(ifr.ifr_name, ifname) == NULL)
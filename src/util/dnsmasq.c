@@ -45,15 +45,25 @@
 #include "virterror_internal.h"
 #include "logging.h"
 #include "virfile.h"
+#include "buf.h"
+#include "hash.h"
 
 #define VIR_FROM_THIS VIR_FROM_NETWORK
 #define DNSMASQ_HOSTSFILE_SUFFIX "hostsfile"
 #define DNSMASQ_ADDNHOSTSFILE_SUFFIX "addnhosts"
 
+/* Upper bound on the size of a hosts file we are willing to diff */
+#define DNSMASQ_FILE_MAX (16 * 1024 * 1024)
+
 static void
 dhcphostFree(dnsmasqDhcpHost *host)
 {
+    if (!host)
+        return;
+
     VIR_FREE(host->host);
+    VIR_FREE(host->mac);
+    VIR_FREE(host);
 }
 
 static void
@@ -61,10 +71,198 @@ addnhostFree(dnsmasqAddnHost *host)
 {
     int i;
 
+    if (!host)
+        return;
+
     for (i = 0; i < host->nhostnames; i++)
         VIR_FREE(host->hostnames[i]);
     VIR_FREE(host->hostnames);
     VIR_FREE(host->ip);
+    VIR_FREE(host);
+}
+
+/*
+ * Write @data to @path, going through a temporary file so that dnsmasq
+ * never sees a partially written file, unless the temporary file
+ * cannot be created.
+ *
+ * Returns 0 on success, -errno on failure
+ */
+static int
+genericFileWrite(const char *path,
+                 const char *data)
+{
+    char *tmp;
+    int fd;
+    bool istmp = true;
+    int rc = 0;
+
+    if (virAsprintf(&tmp, "%s.new", path) < 0)
+        return -ENOMEM;
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        istmp = false;
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+            rc = -errno;
+            goto cleanup;
+        }
+    }
+
+    if (safewrite(fd, data, strlen(data)) < 0) {
+        rc = -errno;
+        VIR_FORCE_CLOSE(fd);
+        if (istmp)
+            unlink(tmp);
+        goto cleanup;
+    }
+
+    if (VIR_CLOSE(fd) < 0) {
+        rc = -errno;
+        if (istmp)
+            unlink(tmp);
+        goto cleanup;
+    }
+
+    if (istmp && rename(tmp, path) < 0) {
+        rc = -errno;
+        unlink(tmp);
+        goto cleanup;
+    }
+
+ cleanup:
+    VIR_FREE(tmp);
+
+    return rc;
+}
+
+/*
+ * Bring the file at @path in line with @lines, touching it as little
+ * as possible.  The current contents are compared with @lines: if they
+ * match, nothing is written; if all the current lines are still wanted,
+ * the missing ones are appended; only otherwise is the whole file
+ * rewritten.  With thousands of hosts this avoids rewriting the file
+ * for every change.  An empty set of lines leaves an empty file, since
+ * a running dnsmasq re-reads the file it was started with on SIGHUP.
+ *
+ * Returns 1 if the file was modified, 0 if it was already up to date,
+ * -errno on failure
+ */
+static int
+genericFileUpdate(const char *path,
+                  char *const*lines,
+                  size_t nlines)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    virHashTablePtr ondisk = NULL;
+    char *content = NULL;
+    char *data = NULL;
+    char *cur, *eol;
+    bool *present = NULL;
+    size_t npresent = 0;
+    bool rewrite = false;
+    int len = 0;
+    int fd;
+    size_t i;
+    int rc = 0;
+
+    if (nlines == 0) {
+        struct stat sb;
+
+        if (stat(path, &sb) == 0 && sb.st_size == 0)
+            return 0;
+        if ((rc = genericFileWrite(path, "")) < 0)
+            return rc;
+        return 1;
+    }
+
+    if (VIR_ALLOC_N(present, nlines) < 0 ||
+        !(ondisk = virHashCreate(nlines, NULL))) {
+        rc = -ENOMEM;
+        goto cleanup;
+    }
+
+    /* Anything preventing us from knowing the current contents
+     * just means the file gets rewritten */
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        rewrite = true;
+    } else {
+        len = virFileReadLimFD(fd, DNSMASQ_FILE_MAX, &content);
+        VIR_FORCE_CLOSE(fd);
+        if (len < 0)
+            rewrite = true;
+    }
+
+    for (cur = content; !rewrite && cur && *cur; cur = eol) {
+        if ((eol = strchr(cur, '\n')))
+            *eol++ = '\0';
+        else
+            eol = cur + strlen(cur);
+
+        if (*cur == '\0' || virHashLookup(ondisk, cur))
+            continue;
+        if (virHashAddEntry(ondisk, cur, cur) < 0) {
+            rc = -ENOMEM;
+            goto cleanup;
+        }
+    }
+
+    if (!rewrite) {
+        for (i = 0; i < nlines; i++) {
+            if (virHashLookup(ondisk, lines[i])) {
+                present[i] = true;
+                npresent++;
+            }
+        }
+
+        /* Some line has to go away */
+        if (npresent != virHashSize(ondisk))
+            rewrite = true;
+        else if (npresent == nlines)
+            goto cleanup;
+    }
+
+    if (!rewrite && len > 0 && content[len - 1] != '\0')
+        virBufferAddChar(&buf, '\n'); /* file lacked a final newline */
+
+    for (i = 0; i < nlines; i++) {
+        if (rewrite || !present[i])
+            virBufferAsprintf(&buf, "%s\n", lines[i]);
+    }
+
+    if (virBufferError(&buf)) {
+        rc = -ENOMEM;
+        goto cleanup;
+    }
+    data = virBufferContentAndReset(&buf);
+
+    if (rewrite) {
+        VIR_DEBUG("Rewriting %s with %zu lines", path, nlines);
+        if ((rc = genericFileWrite(path, data)) < 0)
+            goto cleanup;
+    } else {
+        VIR_DEBUG("Appending %zu lines to %s", nlines - npresent, path);
+        if ((fd = open(path, O_WRONLY | O_APPEND)) < 0 ||
+            safewrite(fd, data, strlen(data)) < 0) {
+            rc = -errno;
+            VIR_FORCE_CLOSE(fd);
+            goto cleanup;
+        }
+        if (VIR_CLOSE(fd) < 0) {
+            rc = -errno;
+            goto cleanup;
+        }
+    }
+
+    rc = 1;
+
+ cleanup:
+    virBufferFreeAndReset(&buf);
+    virHashFree(ondisk);
+    VIR_FREE(content);
+    VIR_FREE(present);
+    VIR_FREE(data);
+
+    return rc;
 }
 
 static void
@@ -74,13 +272,14 @@ addnhostsFree(dnsmasqAddnHostsfile *addnhostsfile)
 
     if (addnhostsfile->hosts) {
         for (i = 0; i < addnhostsfile->nhosts; i++)
-            addnhostFree(&addnhostsfile->hosts[i]);
+            addnhostFree(addnhostsfile->hosts[i]);
 
         VIR_FREE(addnhostsfile->hosts);
 
         addnhostsfile->nhosts = 0;
     }
 
+    virHashFree(addnhostsfile->index);
     VIR_FREE(addnhostsfile->path);
 
     VIR_FREE(addnhostsfile);
@@ -92,44 +291,41 @@ addnhostsAdd(dnsmasqAddnHostsfile *addnhostsfile,
              const char *name)
 {
     char *ipstr = NULL;
-    int idx = -1;
+    dnsmasqAddnHost *host;
     int i;
 
     if (!(ipstr = virSocketFormatAddr(ip)))
         return -1;
 
-    for (i = 0; i < addnhostsfile->nhosts; i++) {
-        if (STREQ((const char *)addnhostsfile->hosts[i].ip, (const char *)ipstr)) {
-            idx = i;
-            break;
-        }
-    }
-
-    if (idx < 0) {
-        if (VIR_REALLOC_N(addnhostsfile->hosts, addnhostsfile->nhosts + 1) < 0)
-            goto alloc_error;
-
-        idx = addnhostsfile->nhosts;
-        if (VIR_ALLOC(addnhostsfile->hosts[idx].hostnames) < 0)
+    if (!(host = virHashLookup(addnhostsfile->index, ipstr))) {
+        if (VIR_ALLOC(host) < 0)
             goto alloc_error;
+        host->ip = ipstr;
+        ipstr = NULL;
 
-        if (virAsprintf(&addnhostsfile->hosts[idx].ip, "%s", ipstr) < 0)
+        if (VIR_REALLOC_N(addnhostsfile->hosts, addnhostsfile->nhosts + 1) < 0 ||
+            virHashAddEntry(addnhostsfile->index, host->ip, host) < 0) {
+            addnhostFree(host);
             goto alloc_error;
+        }
+        addnhostsfile->hosts[addnhostsfile->nhosts++] = host;
+    }
 
-        addnhostsfile->hosts[idx].nhostnames = 0;
-        addnhostsfile->nhosts++;
+    for (i = 0; i < host->nhostnames; i++) {
+        if (STREQ(host->hostnames[i], name))
+            goto cleanup;
     }
 
-    if (VIR_REALLOC_N(addnhostsfile->hosts[idx].hostnames, addnhostsfile->hosts[idx].nhostnames + 1) < 0)
+    if (VIR_REALLOC_N(host->hostnames, host->nhostnames + 1) < 0)
         goto alloc_error;
 
-    if (virAsprintf(&addnhostsfile->hosts[idx].hostnames[addnhostsfile->hosts[idx].nhostnames], "%s", name) < 0)
+    if (!(host->hostnames[host->nhostnames] = strdup(name)))
         goto alloc_error;
 
-    VIR_FREE(ipstr);
-
-    addnhostsfile->hosts[idx].nhostnames++;
+    host->nhostnames++;
 
+ cleanup:
+    VIR_FREE(ipstr);
     return 0;
 
  alloc_error:
@@ -152,6 +348,9 @@ addnhostsNew(const char *name,
     addnhostsfile->hosts = NULL;
     addnhostsfile->nhosts = 0;
 
+    if (!(addnhostsfile->index = virHashCreate(32, NULL)))
+        goto error;
+
     if (virAsprintf(&addnhostsfile->path, "%s/%s.%s", config_dir, name,
                     DNSMASQ_ADDNHOSTSFILE_SUFFIX) < 0) {
         virReportOOMError();
@@ -166,86 +365,38 @@ addnhostsNew(const char *name,
 }
 
 static int
-addnhostsWrite(const char *path,
-               dnsmasqAddnHost *hosts,
-               unsigned int nhosts)
+addnhostsSave(dnsmasqAddnHostsfile *addnhostsfile)
 {
-    char *tmp;
-    FILE *f;
-    bool istmp = true;
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char **lines = NULL;
     unsigned int i, ii;
-    int rc = 0;
-
-    if (nhosts == 0)
-        return rc;
-
-    if (virAsprintf(&tmp, "%s.new", path) < 0)
-        return -ENOMEM;
-
-    if (!(f = fopen(tmp, "w"))) {
-        istmp = false;
-        if (!(f = fopen(path, "w"))) {
-            rc = -errno;
-            goto cleanup;
-        }
-    }
+    int err = -ENOMEM;
 
-    for (i = 0; i < nhosts; i++) {
-        if (fputs(hosts[i].ip, f) == EOF || fputc('\t', f) == EOF) {
-            rc = -errno;
-            VIR_FORCE_FCLOSE(f);
-
-            if (istmp)
-                unlink(tmp);
-
-            goto cleanup;
-        }
-
-        for (ii = 0; ii < hosts[i].nhostnames; ii++) {
-            if (fputs(hosts[i].hostnames[ii], f) == EOF || fputc('\t', f) == EOF) {
-                rc = -errno;
-                VIR_FORCE_FCLOSE(f);
-
-                if (istmp)
-                    unlink(tmp);
-
-                goto cleanup;
-            }
-        }
+    if (VIR_ALLOC_N(lines, addnhostsfile->nhosts) < 0)
+        goto cleanup;
 
-        if (fputc('\n', f) == EOF) {
-            rc = -errno;
-            VIR_FORCE_FCLOSE(f);
+    for (i = 0; i < addnhostsfile->nhosts; i++) {
+        dnsmasqAddnHost *host = addnhostsfile->hosts[i];
 
-            if (istmp)
-                unlink(tmp);
+        virBufferAsprintf(&buf, "%s\t", host->ip);
+        for (ii = 0; ii < host->nhostnames; ii++)
+            virBufferAsprintf(&buf, "%s\t", host->hostnames[ii]);
 
+        if (virBufferError(&buf))
             goto cleanup;
-        }
+        lines[i] = virBufferContentAndReset(&buf);
     }
 
-    if (VIR_FCLOSE(f) == EOF) {
-        rc = -errno;
-        goto cleanup;
-    }
-
-    if (istmp && rename(tmp, path) < 0) {
-        rc = -errno;
-        unlink(tmp);
-        goto cleanup;
-    }
+    err = genericFileUpdate(addnhostsfile->path, lines,
+                            addnhostsfile->nhosts);
 
  cleanup:
-    VIR_FREE(tmp);
-
-    return rc;
-}
-
-static int
-addnhostsSave(dnsmasqAddnHostsfile *addnhostsfile)
-{
-    int err = addnhostsWrite(addnhostsfile->path, addnhostsfile->hosts,
-                             addnhostsfile->nhosts);
+    virBufferFreeAndReset(&buf);
+    if (lines) {
+        for (i = 0; i < addnhostsfile->nhosts; i++)
+            VIR_FREE(lines[i]);
+        VIR_FREE(lines);
+    }
 
     if (err < 0) {
         virReportSystemError(-err, _("cannot write config file '%s'"),
@@ -253,7 +404,7 @@ addnhostsSave(dnsmasqAddnHostsfile *addnhostsfile)
         return -1;
     }
 
-    return 0;
+    return err;
 }
 
 static int
@@ -278,51 +429,72 @@ hostsfileFree(dnsmasqHostsfile *hostsfile)
 
     if (hostsfile->hosts) {
         for (i = 0; i < hostsfile->nhosts; i++)
-            dhcphostFree(&hostsfile->hosts[i]);
+            dhcphostFree(hostsfile->hosts[i]);
 
         VIR_FREE(hostsfile->hosts);
 
         hostsfile->nhosts = 0;
     }
 
+    virHashFree(hostsfile->index);
     VIR_FREE(hostsfile->path);
 
     VIR_FREE(hostsfile);
 }
 
+/*
+ * Add a host, replacing any previous entry for the same MAC
+ * address, as dnsmasq would only honour one of them anyway
+ */
 static int
 hostsfileAdd(dnsmasqHostsfile *hostsfile,
              const char *mac,
              virSocketAddr *ip,
              const char *name)
 {
+    dnsmasqDhcpHost *host;
     char *ipstr = NULL;
-    if (VIR_REALLOC_N(hostsfile->hosts, hostsfile->nhosts + 1) < 0)
-        goto alloc_error;
+    char *line = NULL;
 
     if (!(ipstr = virSocketFormatAddr(ip)))
         return -1;
 
     if (name) {
-        if (virAsprintf(&hostsfile->hosts[hostsfile->nhosts].host, "%s,%s,%s",
-                        mac, ipstr, name) < 0) {
+        if (virAsprintf(&line, "%s,%s,%s", mac, ipstr, name) < 0)
             goto alloc_error;
-        }
     } else {
-        if (virAsprintf(&hostsfile->hosts[hostsfile->nhosts].host, "%s,%s",
-                        mac, ipstr) < 0) {
+        if (virAsprintf(&line, "%s,%s", mac, ipstr) < 0)
             goto alloc_error;
-        }
     }
     VIR_FREE(ipstr);
 
-    hostsfile->nhosts++;
+    if ((host = virHashLookup(hostsfile->index, mac))) {
+        VIR_FREE(host->host);
+        host->host = line;
+        return 0;
+    }
+
+    if (VIR_ALLOC(host) < 0 ||
+        !(host->mac = strdup(mac))) {
+        dhcphostFree(host);
+        goto alloc_error;
+    }
+    host->host = line;
+    line = NULL;
+
+    if (VIR_REALLOC_N(hostsfile->hosts, hostsfile->nhosts + 1) < 0 ||
+        virHashAddEntry(hostsfile->index, host->mac, host) < 0) {
+        dhcphostFree(host);
+        goto alloc_error;
+    }
+    hostsfile->hosts[hostsfile->nhosts++] = host;
 
     return 0;
 
  alloc_error:
     virReportOOMError();
     VIR_FREE(ipstr);
+    VIR_FREE(line);
     return -1;
 }
 
@@ -340,6 +512,9 @@ hostsfileNew(const char *name,
     hostsfile->hosts = NULL;
     hostsfile->nhosts = 0;
 
+    if (!(hostsfile->index = virHashCreate(32, NULL)))
+        goto error;
+
     if (virAsprintf(&hostsfile->path, "%s/%s.%s", config_dir, name,
                     DNSMASQ_HOSTSFILE_SUFFIX) < 0) {
         virReportOOMError();
@@ -354,64 +529,22 @@ hostsfileNew(const char *name,
 }
 
 static int
-hostsfileWrite(const char *path,
-               dnsmasqDhcpHost *hosts,
-               unsigned int nhosts)
+hostsfileSave(dnsmasqHostsfile *hostsfile)
 {
-    char *tmp;
-    FILE *f;
-    bool istmp = true;
+    char **lines = NULL;
     unsigned int i;
-    int rc = 0;
-
-    if (nhosts == 0)
-        return rc;
-
-    if (virAsprintf(&tmp, "%s.new", path) < 0)
-        return -ENOMEM;
-
-    if (!(f = fopen(tmp, "w"))) {
-        istmp = false;
-        if (!(f = fopen(path, "w"))) {
-            rc = -errno;
-            goto cleanup;
-        }
-    }
-
-    for (i = 0; i < nhosts; i++) {
-        if (fputs(hosts[i].host, f) == EOF || fputc('\n', f) == EOF) {
-            rc = -errno;
-            VIR_FORCE_FCLOSE(f);
-
-            if (istmp)
-                unlink(tmp);
+    int err = -ENOMEM;
 
-            goto cleanup;
-        }
-    }
-
-    if (VIR_FCLOSE(f) == EOF) {
-        rc = -errno;
+    if (VIR_ALLOC_N(lines, hostsfile->nhosts) < 0)
         goto cleanup;
-    }
 
-    if (istmp && rename(tmp, path) < 0) {
-        rc = -errno;
-        unlink(tmp);
-        goto cleanup;
-    }
-
- cleanup:
-    VIR_FREE(tmp);
+    for (i = 0; i < hostsfile->nhosts; i++)
+        lines[i] = hostsfile->hosts[i]->host;
 
-    return rc;
-}
+    err = genericFileUpdate(hostsfile->path, lines, hostsfile->nhosts);
 
-static int
-hostsfileSave(dnsmasqHostsfile *hostsfile)
-{
-    int err = hostsfileWrite(hostsfile->path, hostsfile->hosts,
-                             hostsfile->nhosts);
+ cleanup:
+    VIR_FREE(lines);
 
     if (err < 0) {
         virReportSystemError(-err, _("cannot write config file '%s'"),
@@ -419,7 +552,7 @@ hostsfileSave(dnsmasqHostsfile *hostsfile)
         return -1;
     }
 
-    return 0;
+    return err;
 }
 
 /**
@@ -519,11 +652,19 @@ dnsmasqAddHost(dnsmasqContext *ctx,
  * @ctx: pointer to the dnsmasq context for each network
  *
  * Saves all the configurations associated with a context to disk.
+ * Files already holding the right entries are left alone, and new
+ * entries are appended when no existing entry has to go.  A context
+ * built from scratch with the wanted hosts thus turns into only the
+ * writes needed to get rid of those no longer wanted.
+ *
+ * Returns 1 if any file was modified, 0 if they were all up to
+ * date, -1 on error
  */
 int
 dnsmasqSave(const dnsmasqContext *ctx)
 {
-    int ret = 0;
+    int changed = 0;
+    int rc;
 
     if (virFileMakePath(ctx->config_dir) < 0) {
         virReportSystemError(errno, _("cannot create config directory '%s'"),
@@ -531,14 +672,18 @@ dnsmasqSave(const dnsmasqContext *ctx)
         return -1;
     }
 
-    if (ctx->hostsfile)
-        ret = hostsfileSave(ctx->hostsfile);
-    if (ret == 0) {
-        if (ctx->addnhostsfile)
-            ret = addnhostsSave(ctx->addnhostsfile);
+    if (ctx->hostsfile) {
+        if ((rc = hostsfileSave(ctx->hostsfile)) < 0)
+            return -1;
+        changed |= rc;
+    }
+    if (ctx->addnhostsfile) {
+        if ((rc = addnhostsSave(ctx->addnhostsfile)) < 0)
+            return -1;
+        changed |= rc;
     }
 
-    return ret;
+    return changed;
 }
 
 
@@ -23,6 +23,7 @@
 # define __DNSMASQ_H__
 
 # include "network.h"
+# include "hash.h"
 
 typedef struct
 {
@@ -31,15 +32,17 @@ typedef struct
      * "01:23:45:67:89:0a,foo,10.0.0.3".
      */
     char *host;
+    char *mac;
 
 } dnsmasqDhcpHost;
 
 typedef struct
 {
-    unsigned int     nhosts;
-    dnsmasqDhcpHost *hosts;
+    unsigned int      nhosts;
+    dnsmasqDhcpHost **hosts;
+    virHashTablePtr   index; /* MAC address -> dnsmasqDhcpHost */
 
-    char            *path;  /* Absolute path of dnsmasq's hostsfile. */
+    char             *path;  /* Absolute path of dnsmasq's hostsfile. */
 } dnsmasqHostsfile;
 
 typedef struct
@@ -52,10 +55,11 @@ typedef struct
 
 typedef struct
 {
-    unsigned int     nhosts;
-    dnsmasqAddnHost *hosts;
+    unsigned int      nhosts;
+    dnsmasqAddnHost **hosts;
+    virHashTablePtr   index; /* IP address -> dnsmasqAddnHost */
 
-    char            *path;  /* Absolute path of dnsmasq's hostsfile. */
+    char             *path;  /* Absolute path of dnsmasq's hostsfile. */
 } dnsmasqAddnHostsfile;
 
 typedef struct
@@ -29,6 +29,7 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <netinet/in.h>
 
 #ifdef __linux__
@@ -189,6 +190,19 @@ cleanup:
 int
 ifaceCtrl(const char *name, bool up)
 {
+    virNetlinkLinkConfig link;
+    int rc;
+
+    memset(&link, 0, sizeof(link));
+    link.ifname = name;
+    link.up = up ? 1 : 0;
+
+    /* Prefer the shared netlink channel over a socket per call */
+    if ((rc = virNetlinkLinkConfigure(NULL, &link, 1)) == 0)
+        return -link.errors[VIR_NETLINK_LINK_FLAGS];
+
+    VIR_DEBUG("Cannot change flags of %s with netlink: %d", name, rc);
+
     return chgIfaceFlags(name,
                          (up) ? 0      : IFF_UP,
                          (up) ? IFF_UP : 0);
@@ -1769,3 +1783,419 @@ ifaceGetPhysicalFunction(const char *ifname, char **pfname)
     return -1;
 }
 #endif /* __linux__ */
+
+/*
+ * The settings of SR-IOV virtual functions and Solarflare local_addrs
+ * entries for a set of interfaces, grouped by physical function so
+ * that they can be applied with one request per PF.
+ */
+typedef struct _ifaceVfBatchVf ifaceVfBatchVf;
+struct _ifaceVfBatchVf {
+    char *pci_addr;
+    unsigned char mac[VIR_MAC_BUFLEN];
+    int vlan;
+};
+
+typedef struct _ifaceVfBatchPf ifaceVfBatchPf;
+struct _ifaceVfBatchPf {
+    char *pfname;
+
+    size_t npeers;
+    unsigned char (*peers)[VIR_MAC_BUFLEN];
+
+    size_t nvfs;
+    ifaceVfBatchVf *vfs;
+};
+
+struct _ifaceVfBatch {
+    size_t npfs;
+    ifaceVfBatchPf *pfs;
+};
+
+ifaceVfBatchPtr
+ifaceVfBatchNew(void)
+{
+    ifaceVfBatchPtr batch;
+
+    if (VIR_ALLOC(batch) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    return batch;
+}
+
+void
+ifaceVfBatchFree(ifaceVfBatchPtr batch)
+{
+    size_t i, j;
+
+    if (!batch)
+        return;
+
+    for (i = 0 ; i < batch->npfs ; i++) {
+        ifaceVfBatchPf *pf = &batch->pfs[i];
+
+        for (j = 0 ; j < pf->nvfs ; j++)
+            VIR_FREE(pf->vfs[j].pci_addr);
+        VIR_FREE(pf->vfs);
+        VIR_FREE(pf->peers);
+        VIR_FREE(pf->pfname);
+    }
+    VIR_FREE(batch->pfs);
+    VIR_FREE(batch);
+}
+
+/*
+ * ifaceVfBatchAdd:
+ *
+ * @batch: the batch to add to
+ * @linkdev: the interface the guest NIC is attached to, or a VLAN on it
+ * @mac: the MAC address of the guest NIC
+ * @vf_pci_addr: BDF of the VF passed to the guest, or NULL if none
+ * @vlan: the VLAN to put the VF on
+ *
+ * Queue the local_addrs entry for @mac on the physical function behind
+ * @linkdev and, if a VF is given, its MAC address and VLAN. Entries
+ * already queued are not repeated.
+ *
+ * Returns 0 on success and -1 on failure
+ */
+int
+ifaceVfBatchAdd(ifaceVfBatchPtr batch,
+                const char *linkdev,
+                const unsigned char *mac,
+                const char *vf_pci_addr,
+                int vlan)
+{
+    ifaceVfBatchPf *pf = NULL;
+    ifaceVfBatchVf *vf = NULL;
+    char *pfname = NULL;
+    size_t i;
+
+    if (ifaceGetVlanDevice(linkdev, &pfname) != 0) {
+        VIR_FREE(pfname);
+        if (!(pfname = strdup(linkdev)))
+            goto no_memory;
+    } else if (!pfname) {
+        goto no_memory;
+    }
+
+    for (i = 0 ; i < batch->npfs ; i++) {
+        if (STREQ(batch->pfs[i].pfname, pfname)) {
+            pf = &batch->pfs[i];
+            VIR_FREE(pfname);
+            break;
+        }
+    }
+
+    if (!pf) {
+        if (VIR_EXPAND_N(batch->pfs, batch->npfs, 1) < 0)
+            goto no_memory;
+        pf = &batch->pfs[batch->npfs - 1];
+        pf->pfname = pfname;
+        pfname = NULL;
+    }
+
+    for (i = 0 ; i < pf->npeers ; i++) {
+        if (!memcmp(pf->peers[i], mac, VIR_MAC_BUFLEN))
+            break;
+    }
+    if (i == pf->npeers) {
+        if (VIR_EXPAND_N(pf->peers, pf->npeers, 1) < 0)
+            goto no_memory;
+        memcpy(pf->peers[i], mac, VIR_MAC_BUFLEN);
+    }
+
+    if (!vf_pci_addr)
+        return 0;
+
+    for (i = 0 ; i < pf->nvfs ; i++) {
+        if (STREQ(pf->vfs[i].pci_addr, vf_pci_addr)) {
+            vf = &pf->vfs[i];
+            break;
+        }
+    }
+    if (!vf) {
+        if (VIR_EXPAND_N(pf->vfs, pf->nvfs, 1) < 0)
+            goto no_memory;
+        vf = &pf->vfs[pf->nvfs - 1];
+        if (!(vf->pci_addr = strdup(vf_pci_addr))) {
+            pf->nvfs--;
+            goto no_memory;
+        }
+    }
+    memcpy(vf->mac, mac, VIR_MAC_BUFLEN);
+    vf->vlan = vlan;
+
+    return 0;
+
+no_memory:
+    VIR_FREE(pfname);
+    virReportOOMError();
+    return -1;
+}
+
+#ifdef __linux__
+/* Write all the local_addrs entries of @pf through a single open file */
+static void
+ifaceVfBatchWritePeers(ifaceVfBatchPf *pf, bool add)
+{
+    char *path = NULL;
+    char line[VIR_MAC_STRING_BUFLEN + 1];
+    int fd = -1;
+    size_t i;
+
+    if (!pf->npeers ||
+        ifaceSysfsDeviceFile(&path, pf->pfname, "local_addrs") < 0)
+        return;
+
+    if ((fd = open(path, O_WRONLY)) < 0) {
+        if (errno != ENOENT)
+            VIR_WARN("Failed to open '%s': %s", path, strerror(errno));
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < pf->npeers ; i++) {
+        line[0] = add ? '+' : '-';
+        virFormatMacAddr(pf->peers[i], line + 1);
+
+        if (lseek(fd, 0, SEEK_SET) < 0 ||
+            safewrite(fd, line, strlen(line)) < 0)
+            VIR_WARN("Failed to write '%s' to '%s': %s",
+                     line, path, strerror(errno));
+    }
+
+cleanup:
+    VIR_FORCE_CLOSE(fd);
+    VIR_FREE(path);
+}
+
+/* Find the index of each VF of @pfname from the virtfn<index> links of
+ * the PF device: @addrs[index] is the BDF of the VF, or NULL. The order
+ * of the directory entries says nothing about the indexes. */
+static int
+ifaceVfBatchGetIndexes(const char *pfname,
+                       char ***addrs,
+                       size_t *naddrs)
+{
+    char *dirpath = NULL;
+    char *link = NULL;
+    char target[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir = NULL;
+    unsigned int idx;
+    const char *bdf;
+    ssize_t len;
+    int ret = -1;
+
+    *addrs = NULL;
+    *naddrs = 0;
+
+    if (ifaceSysfsFile(&dirpath, pfname, "device") < 0)
+        return -1;
+
+    if (!(dir = opendir(dirpath)))
+        goto cleanup;
+
+    while ((entry = readdir(dir))) {
+        if (!STRPREFIX(entry->d_name, "virtfn") ||
+            virStrToLong_ui(entry->d_name + strlen("virtfn"),
+                            NULL, 10, &idx) < 0)
+            continue;
+
+        if (virBuildPath(&link, dirpath, entry->d_name) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        len = readlink(link, target, sizeof(target) - 1);
+        VIR_FREE(link);
+        if (len < 0)
+            continue;
+        target[len] = '\0';
+
+        bdf = strrchr(target, '/');
+        bdf = bdf ? bdf + 1 : target;
+
+        if (idx >= *naddrs &&
+            VIR_EXPAND_N(*addrs, *naddrs, idx + 1 - *naddrs) < 0) {
+            virReportOOMError();
+            goto cleanup;
+        }
+        if (!((*addrs)[idx] = strdup(bdf))) {
+            virReportOOMError();
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    if (ret < 0) {
+        while (*naddrs)
+            VIR_FREE((*addrs)[--(*naddrs)]);
+        VIR_FREE(*addrs);
+    }
+    if (dir)
+        closedir(dir);
+    VIR_FREE(dirpath);
+    return ret;
+}
+
+/* Set the VFs of @pf one at a time through their sysfs files */
+static int
+ifaceVfBatchWriteVfs(ifaceVfBatchPf *pf, bool add)
+{
+    size_t i;
+    int ret = 0;
+
+    for (i = 0 ; i < pf->nvfs ; i++) {
+        ifaceVfBatchVf *vf = &pf->vfs[i];
+
+        if (add) {
+            if (ifaceReplaceVfMacAddress(vf->mac, vf->pci_addr) < 0 ||
+                ifaceReplaceVfVlan(vf->vlan, vf->pci_addr) < 0) {
+                virReportSystemError(errno,
+                                     _("Failed to configure virtual function %s"),
+                                     vf->pci_addr);
+                return -1;
+            }
+        } else {
+            if (ifaceRestoreVfMacAddress(vf->pci_addr) < 0 ||
+                ifaceRestoreVfVlan(vf->vlan, vf->pci_addr) < 0) {
+                VIR_WARN("Failed to reset virtual function %s: %s",
+                         vf->pci_addr, strerror(errno));
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * ifaceVfBatchApply:
+ *
+ * @batch: the batch to apply
+ * @add: true to set up the VFs and local_addrs entries, false to undo it
+ *
+ * When adding, the local_addrs entries are written first, then the MAC
+ * address and VLAN of the VFs of all the PFs are set with one netlink
+ * request per PF. When removing, the VFs are reset to a zero MAC address
+ * and no VLAN before the local_addrs entries are removed. PFs whose
+ * driver does not take the VF settings over netlink get them through
+ * the sysfs files of each VF instead.
+ *
+ * Failing to update local_addrs only logs a warning, and so does any
+ * failure when removing.
+ *
+ * Returns 0 on success and -1 on failure
+ */
+int
+ifaceVfBatchApply(ifaceVfBatchPtr batch, bool add)
+{
+    static const unsigned char zero[VIR_MAC_BUFLEN];
+    virNetlinkPfConfigPtr pfs = NULL;
+    virNetlinkVfConfigPtr vfs = NULL;
+    char **addrs = NULL;
+    size_t naddrs = 0;
+    size_t nvfs = 0;
+    size_t i, j, k;
+    int rc;
+    int ret = -1;
+
+    if (add) {
+        for (i = 0 ; i < batch->npfs ; i++)
+            ifaceVfBatchWritePeers(&batch->pfs[i], true);
+    }
+
+    for (i = 0 ; i < batch->npfs ; i++)
+        nvfs += batch->pfs[i].nvfs;
+
+    if (nvfs &&
+        (VIR_ALLOC_N(pfs, batch->npfs) < 0 ||
+         VIR_ALLOC_N(vfs, nvfs) < 0)) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    nvfs = 0;
+    for (i = 0 ; pfs && i < batch->npfs ; i++) {
+        ifaceVfBatchPf *pf = &batch->pfs[i];
+
+        pfs[i].ifname = pf->pfname;
+        pfs[i].vfs = &vfs[nvfs];
+
+        if (!pf->nvfs ||
+            ifaceVfBatchGetIndexes(pf->pfname, &addrs, &naddrs) < 0)
+            continue;
+
+        for (j = 0 ; j < pf->nvfs ; j++) {
+            for (k = 0 ; k < naddrs ; k++) {
+                if (addrs[k] && STREQ(addrs[k], pf->vfs[j].pci_addr))
+                    break;
+            }
+            if (k == naddrs)
+                break;
+
+            vfs[nvfs + j].vf = k;
+            vfs[nvfs + j].mac = add ? pf->vfs[j].mac : zero;
+            vfs[nvfs + j].vlan = add ? pf->vfs[j].vlan : 0;
+        }
+
+        /* All the VFs of the PF go in its request, or none does */
+        if (j == pf->nvfs) {
+            pfs[i].nvfs = pf->nvfs;
+            nvfs += pf->nvfs;
+        } else {
+            VIR_DEBUG("Cannot find the index of virtual function %s on %s",
+                      pf->vfs[j].pci_addr, pf->pfname);
+        }
+
+        while (naddrs)
+            VIR_FREE(addrs[--naddrs]);
+        VIR_FREE(addrs);
+    }
+
+    rc = pfs ? virNetlinkVfConfigure(NULL, pfs, batch->npfs) : 0;
+    if (rc)
+        VIR_DEBUG("Cannot configure virtual functions with netlink: %d", rc);
+
+    ret = 0;
+    for (i = 0 ; pfs && i < batch->npfs ; i++) {
+        ifaceVfBatchPf *pf = &batch->pfs[i];
+
+        if (!pf->nvfs ||
+            (!rc && pfs[i].nvfs && !pfs[i].error))
+            continue;
+
+        VIR_DEBUG("Configuring the virtual functions of %s through sysfs: %d",
+                  pf->pfname, rc ? rc : pfs[i].error);
+        if (ifaceVfBatchWriteVfs(pf, add) < 0) {
+            ret = -1;
+            if (add)
+                goto cleanup;
+        }
+    }
+
+    if (!add) {
+        for (i = 0 ; i < batch->npfs ; i++)
+            ifaceVfBatchWritePeers(&batch->pfs[i], false);
+    }
+
+cleanup:
+    VIR_FREE(pfs);
+    VIR_FREE(vfs);
+    return ret;
+}
+#else
+int
+ifaceVfBatchApply(ifaceVfBatchPtr batch ATTRIBUTE_UNUSED,
+                  bool add ATTRIBUTE_UNUSED)
+{
+    ifaceError(VIR_ERR_INTERNAL_ERROR, "%s",
+               _("ifaceVfBatchApply is not supported on non-linux "
+               "platforms"));
+    return -1;
+}
+#endif /* __linux__ */
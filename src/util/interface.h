@@ -121,4 +121,20 @@ int ifaceAddRemoveSfcPeerDevice(const char *pfname,
 int ifaceGetVfMacAddress(unsigned char *macaddress,
                          const char *vf_pci_addr);
 
+typedef struct _ifaceVfBatch ifaceVfBatch;
+typedef ifaceVfBatch *ifaceVfBatchPtr;
+
+ifaceVfBatchPtr ifaceVfBatchNew(void);
+void ifaceVfBatchFree(ifaceVfBatchPtr batch);
+
+int ifaceVfBatchAdd(ifaceVfBatchPtr batch,
+                    const char *linkdev,
+                    const unsigned char *mac,
+                    const char *vf_pci_addr,
+                    int vlan)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_NONNULL(3);
+
+int ifaceVfBatchApply(ifaceVfBatchPtr batch, bool add)
+    ATTRIBUTE_NONNULL(1);
+
 #endif /* __VIR_INTERFACE_H__ */
@@ -43,6 +43,7 @@
 #include "memory.h"
 #include "virterror_internal.h"
 #include "logging.h"
+#include "buf.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
 #define iptablesError(code, ...)                                        \
@@ -58,16 +59,47 @@ typedef struct
 {
     char  *table;
     char  *chain;
+    bool   optional;
 } iptRules;
 
+/* A rule queued by an open transaction */
+typedef struct
+{
+    int       family;
+    iptRules *rules;
+    size_t    owner;    /* index into iptablesContext.owners */
+    char     *args;     /* match and target arguments, space separated */
+} iptPendingRule;
+
 struct _iptablesContext
 {
     iptRules *input_filter;
     iptRules *forward_filter;
     iptRules *nat_postrouting;
     iptRules *mangle_postrouting;
+
+    /* State of the transaction opened by iptablesContextBegin */
+    bool            transaction;
+    unsigned int    flags;
+    size_t          nowners;
+    char          **owners;
+    size_t          npending;
+    iptPendingRule *pending;
+};
+
+/* Every (family, table) pair the rules of this file can end up in */
+static const struct {
+    int family;
+    const char *table;
+} iptTables[] = {
+    { AF_INET, "filter" },
+    { AF_INET, "nat" },
+    { AF_INET, "mangle" },
+    { AF_INET6, "filter" },
 };
 
+#define IPTABLES_TAG_PREFIX "libvirt-"
+
 static void
 iptRulesFree(iptRules *rules)
 {
@@ -78,7 +110,8 @@ iptRulesFree(iptRules *rules)
 
 static iptRules *
 iptRulesNew(const char *table,
-            const char *chain)
+            const char *chain,
+            bool optional)
 {
     iptRules *rules;
 
@@ -91,6 +124,8 @@ iptRulesNew(const char *table,
     if (!(rules->chain = strdup(chain)))
         goto error;
 
+    rules->optional = optional;
+
     return rules;
 
  error:
@@ -98,8 +133,81 @@ iptRulesNew(const char *table,
     return NULL;
 }
 
+static void
+iptablesTransactionReset(iptablesContext *ctx)
+{
+    size_t i;
+
+    for (i = 0 ; i < ctx->npending ; i++)
+        VIR_FREE(ctx->pending[i].args);
+    VIR_FREE(ctx->pending);
+    ctx->npending = 0;
+
+    for (i = 0 ; i < ctx->nowners ; i++)
+        VIR_FREE(ctx->owners[i]);
+    VIR_FREE(ctx->owners);
+    ctx->nowners = 0;
+
+    ctx->flags = 0;
+    ctx->transaction = false;
+}
+
+/* Queue a rule for the current owner, or drop the last identical one
+ * already queued, which lets callers unwind a partially built rule
+ * set the same way they would undo rules that were applied directly */
+static int
+iptablesTransactionQueue(iptablesContext *ctx,
+                         iptRules *rules,
+                         int family,
+                         int action,
+                         char *args)
+{
+    iptPendingRule *rule;
+    size_t i;
+
+    if (ctx->nowners == 0) {
+        iptablesError(VIR_ERR_INTERNAL_ERROR, "%s",
+                      _("no owner set for iptables transaction"));
+        VIR_FREE(args);
+        return -1;
+    }
+
+    if (action == REMOVE) {
+        for (i = ctx->npending ; i > 0 ; i--) {
+            rule = &ctx->pending[i - 1];
+            if (rule->family == family &&
+                rule->rules == rules &&
+                rule->owner == ctx->nowners - 1 &&
+                STREQ(rule->args, args)) {
+                VIR_FREE(rule->args);
+                memmove(rule, rule + 1,
+                        sizeof(*rule) * (ctx->npending - i));
+                ctx->npending--;
+                break;
+            }
+        }
+        VIR_FREE(args);
+        return 0;
+    }
+
+    if (VIR_REALLOC_N(ctx->pending, ctx->npending + 1) < 0) {
+        virReportOOMError();
+        VIR_FREE(args);
+        return -1;
+    }
+
+    rule = &ctx->pending[ctx->npending++];
+    rule->family = family;
+    rule->rules = rules;
+    rule->owner = ctx->nowners - 1;
+    rule->args = args;
+
+    return 0;
+}
+
 static int ATTRIBUTE_SENTINEL
-iptablesAddRemoveRule(iptRules *rules, int family, int action,
+iptablesAddRemoveRule(iptablesContext *ctx, iptRules *rules,
+                      int family, int action,
                       const char *arg, ...)
 {
     va_list args;
@@ -107,6 +215,25 @@ iptablesAddRemoveRule(iptRules *rules, int family, int action,
     virCommandPtr cmd;
     const char *s;
 
+    if (ctx->transaction) {
+        virBuffer buf = VIR_BUFFER_INITIALIZER;
+
+        virBufferAdd(&buf, arg, -1);
+        va_start(args, arg);
+        while ((s = va_arg(args, const char *)))
+            virBufferAsprintf(&buf, " %s", s);
+        va_end(args);
+
+        if (virBufferError(&buf)) {
+            virBufferFreeAndReset(&buf);
+            virReportOOMError();
+            return -1;
+        }
+
+        return iptablesTransactionQueue(ctx, rules, family, action,
+                                        virBufferContentAndReset(&buf));
+    }
+
     cmd = virCommandNew((family == AF_INET6)
                         ? IP6TABLES_PATH : IPTABLES_PATH);
 
@@ -139,16 +266,17 @@ iptablesContextNew(void)
     if (VIR_ALLOC(ctx) < 0)
         return NULL;
 
-    if (!(ctx->input_filter = iptRulesNew("filter", "INPUT")))
+    if (!(ctx->input_filter = iptRulesNew("filter", "INPUT", false)))
         goto error;
 
-    if (!(ctx->forward_filter = iptRulesNew("filter", "FORWARD")))
+    if (!(ctx->forward_filter = iptRulesNew("filter", "FORWARD", false)))
         goto error;
 
-    if (!(ctx->nat_postrouting = iptRulesNew("nat", "POSTROUTING")))
+    if (!(ctx->nat_postrouting = iptRulesNew("nat", "POSTROUTING", false)))
         goto error;
 
-    if (!(ctx->mangle_postrouting = iptRulesNew("mangle", "POSTROUTING")))
+    /* Only holds the CHECKSUM fixup, which not every kernel supports */
+    if (!(ctx->mangle_postrouting = iptRulesNew("mangle", "POSTROUTING", true)))
         goto error;
 
     return ctx;
@@ -167,6 +295,7 @@ iptablesContextNew(void)
 void
 iptablesContextFree(iptablesContext *ctx)
 {
+    iptablesTransactionReset(ctx);
     if (ctx->input_filter)
         iptRulesFree(ctx->input_filter);
     if (ctx->forward_filter)
@@ -178,6 +307,546 @@ iptablesContextFree(iptablesContext *ctx)
     VIR_FREE(ctx);
 }
 
+/**
+ * iptablesContextBegin:
+ * @ctx: pointer to the IP table context
+ * @flags: bitwise-OR of iptablesTransactionFlags
+ *
+ * Open a transaction on @ctx. Until iptablesContextCommit or
+ * iptablesContextAbort is called, the iptablesAdd* functions only
+ * queue their rule for the owner selected with iptablesContextSetOwner
+ * and the iptablesRemove* functions drop a rule queued earlier.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+iptablesContextBegin(iptablesContext *ctx,
+                     unsigned int flags)
+{
+    if (ctx->transaction) {
+        iptablesError(VIR_ERR_INTERNAL_ERROR, "%s",
+                      _("an iptables transaction is already open"));
+        return -1;
+    }
+
+    ctx->transaction = true;
+    ctx->flags = flags;
+    return 0;
+}
+
+/**
+ * iptablesContextSetOwner:
+ * @ctx: pointer to the IP table context
+ * @owner: name identifying a set of rules, e.g. a bridge
+ *
+ * Make @owner part of the open transaction and direct the rules
+ * queued from now on to it. On commit, whatever rules @owner had
+ * installed are replaced with the ones queued for it, so an owner
+ * without queued rules has its rules removed.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+iptablesContextSetOwner(iptablesContext *ctx,
+                        const char *owner)
+{
+    char *tmp;
+
+    if (!ctx->transaction) {
+        iptablesError(VIR_ERR_INTERNAL_ERROR, "%s",
+                      _("no iptables transaction is open"));
+        return -1;
+    }
+
+    if (!(tmp = strdup(owner)) ||
+        VIR_REALLOC_N(ctx->owners, ctx->nowners + 1) < 0) {
+        VIR_FREE(tmp);
+        virReportOOMError();
+        return -1;
+    }
+
+    ctx->owners[ctx->nowners++] = tmp;
+    return 0;
+}
+
+/**
+ * iptablesContextDropOwner:
+ * @ctx: pointer to the IP table context
+ *
+ * Take the owner selected last with iptablesContextSetOwner out of
+ * the open transaction again, discarding the rules queued for it, so
+ * that the rules it has installed are left as they are on commit.
+ * This is for an owner whose rule set could not be built completely.
+ */
+void
+iptablesContextDropOwner(iptablesContext *ctx)
+{
+    size_t owner;
+    size_t i, j;
+
+    if (!ctx->transaction || ctx->nowners == 0)
+        return;
+
+    owner = ctx->nowners - 1;
+    for (i = 0, j = 0 ; i < ctx->npending ; i++) {
+        if (ctx->pending[i].owner == owner)
+            VIR_FREE(ctx->pending[i].args);
+        else
+            ctx->pending[j++] = ctx->pending[i];
+    }
+    ctx->npending = j;
+
+    VIR_FREE(ctx->owners[owner]);
+    ctx->nowners--;
+}
+
+/**
+ * iptablesContextAbort:
+ * @ctx: pointer to the IP table context
+ *
+ * Close the open transaction, if any, discarding the queued rules
+ */
+void
+iptablesContextAbort(iptablesContext *ctx)
+{
+    iptablesTransactionReset(ctx);
+}
+
+/* FNV-1a over the queued rules of @owner in a table, so that the rules
+ * already installed can be recognised as up to date */
+static unsigned int
+iptablesTransactionHash(iptablesContext *ctx,
+                        int family,
+                        const char *table,
+                        size_t owner,
+                        size_t *nrules)
+{
+    unsigned int hash = 2166136261U;
+    const char *p;
+    size_t i;
+
+    *nrules = 0;
+    for (i = 0 ; i < ctx->npending ; i++) {
+        iptPendingRule *rule = &ctx->pending[i];
+
+        if (rule->family != family ||
+            rule->owner != owner ||
+            STRNEQ(rule->rules->table, table))
+            continue;
+
+        for (p = rule->rules->chain ; *p ; p++)
+            hash = (hash ^ (unsigned char)*p) * 16777619U;
+        hash = (hash ^ ' ') * 16777619U;
+        for (p = rule->args ; *p ; p++)
+            hash = (hash ^ (unsigned char)*p) * 16777619U;
+        hash = (hash ^ '\n') * 16777619U;
+        (*nrules)++;
+    }
+
+    return hash;
+}
+
+/* Find the owner a line of iptables-save output was tagged for.
+ * Returns the index of the owner, or -1 if it is not part of the
+ * transaction; @hash is set to the rule set hash from the tag */
+static int
+iptablesTransactionFindOwner(iptablesContext *ctx,
+                             const char *line,
+                             unsigned int *hash)
+{
+    const char *tag;
+    const char *end;
+    size_t len;
+    size_t i;
+
+    if (!STRPREFIX(line, "-A ") ||
+        !(tag = strstr(line, " --comment ")))
+        return -1;
+
+    tag += strlen(" --comment ");
+    if (*tag == '"') {
+        tag++;
+        end = strchr(tag, '"');
+    } else {
+        end = strchr(tag, ' ');
+    }
+    if (!end)
+        end = tag + strlen(tag);
+
+    if (!STRPREFIX(tag, IPTABLES_TAG_PREFIX))
+        return -1;
+    tag += strlen(IPTABLES_TAG_PREFIX);
+
+    for (i = 0 ; i < ctx->nowners ; i++) {
+        len = strlen(ctx->owners[i]);
+        if ((size_t)(end - tag) == len + 9 &&
+            STREQLEN(tag, ctx->owners[i], len) &&
+            tag[len] == '-' &&
+            strspn(tag + len + 1, "0123456789abcdef") >= 8) {
+            *hash = strtoul(tag + len + 1, NULL, 16);
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int
+iptablesTransactionRestore(int family,
+                           const char *table,
+                           const char *input,
+                           char **errbuf)
+{
+    virCommandPtr cmd;
+    int status;
+    int ret = -1;
+
+    cmd = virCommandNewArgList((family == AF_INET6)
+                               ? IP6TABLES_RESTORE_PATH : IPTABLES_RESTORE_PATH,
+                               "--noflush", NULL);
+    virCommandSetInputBuffer(cmd, input);
+    virCommandSetErrorBuffer(cmd, errbuf);
+
+    VIR_DEBUG("Applying to table '%s':\n%s", table, input);
+
+    if (virCommandRun(cmd, &status) < 0)
+        goto cleanup;
+
+    ret = status == 0 ? 0 : 1;
+
+cleanup:
+    virCommandFree(cmd);
+    return ret;
+}
+
+/* Try to remove the untagged rules an older libvirtd may have left
+ * for @owner. The whole set goes in one transaction, which is refused
+ * unless every rule is there, so nothing but exact copies is removed */
+static void
+iptablesTransactionRemoveLegacy(iptablesContext *ctx,
+                                int family,
+                                const char *table,
+                                size_t owner)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *input = NULL;
+    char *errbuf = NULL;
+    size_t i;
+
+    virBufferAsprintf(&buf, "*%s\n", table);
+    for (i = 0 ; i < ctx->npending ; i++) {
+        iptPendingRule *rule = &ctx->pending[i];
+
+        if (rule->family == family &&
+            rule->owner == owner &&
+            STREQ(rule->rules->table, table))
+            virBufferAsprintf(&buf, "--delete %s %s\n",
+                              rule->rules->chain, rule->args);
+    }
+    virBufferAddLit(&buf, "COMMIT\n");
+
+    if (virBufferError(&buf)) {
+        virBufferFreeAndReset(&buf);
+        return;
+    }
+    input = virBufferContentAndReset(&buf);
+
+    if (iptablesTransactionRestore(family, table, input, &errbuf) == 0)
+        VIR_INFO("Removed untagged %s rules of '%s' from table '%s'",
+                 family == AF_INET6 ? "IPv6" : "IPv4",
+                 ctx->owners[owner], table);
+    else
+        VIR_DEBUG("No untagged rules of '%s' in table '%s': %s",
+                  ctx->owners[owner], table, NULLSTR(errbuf));
+
+    VIR_FREE(errbuf);
+    VIR_FREE(input);
+}
+
+/* Split @saved into lines in place, returning the end of the last one */
+static char *
+iptablesTransactionSplit(char *saved)
+{
+    char *line, *eol;
+
+    eol = saved;
+    for (line = saved ; *line ; line = eol) {
+        if ((eol = strchr(line, '\n')))
+            *eol++ = '\0';
+        else
+            eol = line + strlen(line);
+    }
+
+    return eol;
+}
+
+/**
+ * iptablesContextFormatRestore:
+ * @ctx: pointer to the IP table context, with an open transaction
+ * @family: address family of the table
+ * @table: name of the table
+ * @saved: the table as printed by iptables-save
+ * @input: set to the iptables-restore input for the table
+ *
+ * Compare the tagged rules in @saved with the rules queued for each
+ * owner of the transaction, and format the changes which give every
+ * owner whose rules are missing or out of date exactly its queued
+ * rules, leaving the rules of everybody else alone.  @input is set to
+ * NULL if the table is already up to date.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+iptablesContextFormatRestore(iptablesContext *ctx,
+                             int family,
+                             const char *table,
+                             const char *saved,
+                             char **input)
+{
+    virBuffer buf = VIR_BUFFER_INITIALIZER;
+    char *lines = NULL;
+    char *line, *end;
+    unsigned int *hashes = NULL;
+    size_t *nrules = NULL;
+    size_t *nfound = NULL;
+    bool *stale = NULL;
+    bool changed = false;
+    unsigned int hash;
+    size_t i;
+    int owner;
+    int ret = -1;
+
+    *input = NULL;
+
+    if (VIR_ALLOC_N(hashes, ctx->nowners) < 0 ||
+        VIR_ALLOC_N(nrules, ctx->nowners) < 0 ||
+        VIR_ALLOC_N(nfound, ctx->nowners) < 0 ||
+        VIR_ALLOC_N(stale, ctx->nowners) < 0 ||
+        !(lines = strdup(saved))) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < ctx->nowners ; i++)
+        hashes[i] = iptablesTransactionHash(ctx, family, table, i, &nrules[i]);
+
+    /* Check which owners are missing rules or still have the ones
+     * of an older rule set */
+    end = iptablesTransactionSplit(lines);
+    for (line = lines ; line < end ; line += strlen(line) + 1) {
+        if ((owner = iptablesTransactionFindOwner(ctx, line, &hash)) < 0)
+            continue;
+        nfound[owner]++;
+        if (hash != hashes[owner])
+            stale[owner] = true;
+    }
+
+    for (i = 0 ; i < ctx->nowners ; i++) {
+        if (nfound[i] != nrules[i])
+            stale[i] = true;
+        if (stale[i])
+            changed = true;
+    }
+
+    if (!changed) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    virBufferAsprintf(&buf, "*%s\n", table);
+
+    /* Drop what the owners being replaced have installed ... */
+    for (line = lines ; line < end ; line += strlen(line) + 1) {
+        if ((owner = iptablesTransactionFindOwner(ctx, line, &hash)) >= 0 &&
+            stale[owner])
+            virBufferAsprintf(&buf, "-D%s\n", line + 2);
+    }
+
+    /* ... and insert their new rules, in the order they were queued
+     * so the resulting chain matches that of individual inserts */
+    for (i = 0 ; i < ctx->npending ; i++) {
+        iptPendingRule *rule = &ctx->pending[i];
+
+        if (rule->family != family ||
+            STRNEQ(rule->rules->table, table) ||
+            !stale[rule->owner])
+            continue;
+
+        virBufferAsprintf(&buf,
+                          "--insert %s --match comment --comment "
+                          IPTABLES_TAG_PREFIX "%s-%08x %s\n",
+                          rule->rules->chain,
+                          ctx->owners[rule->owner],
+                          hashes[rule->owner],
+                          rule->args);
+    }
+    virBufferAddLit(&buf, "COMMIT\n");
+
+    if (virBufferError(&buf)) {
+        virReportOOMError();
+        goto cleanup;
+    }
+    *input = virBufferContentAndReset(&buf);
+
+    ret = 0;
+
+cleanup:
+    virBufferFreeAndReset(&buf);
+    VIR_FREE(lines);
+    VIR_FREE(hashes);
+    VIR_FREE(nrules);
+    VIR_FREE(nfound);
+    VIR_FREE(stale);
+    return ret;
+}
+
+/* Remove the untagged rules of every owner which has rules queued in
+ * the table but none tagged for it in @saved yet */
+static void
+iptablesTransactionRemoveAllLegacy(iptablesContext *ctx,
+                                   int family,
+                                   const char *table,
+                                   const char *saved)
+{
+    char *lines = NULL;
+    char *line, *end;
+    bool *found = NULL;
+    unsigned int hash;
+    size_t nrules;
+    size_t i;
+    int owner;
+
+    if (VIR_ALLOC_N(found, ctx->nowners) < 0 ||
+        !(lines = strdup(saved)))
+        goto cleanup;
+
+    end = iptablesTransactionSplit(lines);
+    for (line = lines ; line < end ; line += strlen(line) + 1) {
+        if ((owner = iptablesTransactionFindOwner(ctx, line, &hash)) >= 0)
+            found[owner] = true;
+    }
+
+    for (i = 0 ; i < ctx->nowners ; i++) {
+        iptablesTransactionHash(ctx, family, table, i, &nrules);
+        if (!found[i] && nrules > 0)
+            iptablesTransactionRemoveLegacy(ctx, family, table, i);
+    }
+
+cleanup:
+    VIR_FREE(lines);
+    VIR_FREE(found);
+}
+
+static int
+iptablesTransactionCommitTable(iptablesContext *ctx,
+                               int family,
+                               const char *table)
+{
+    virCommandPtr cmd = NULL;
+    char *saved = NULL;
+    char *input = NULL;
+    char *errbuf = NULL;
+    bool optional = true;
+    bool queued = false;
+    size_t i;
+    int rc;
+    int ret = -1;
+
+    for (i = 0 ; i < ctx->npending ; i++) {
+        if (ctx->pending[i].family == family &&
+            STREQ(ctx->pending[i].rules->table, table)) {
+            queued = true;
+            if (!ctx->pending[i].rules->optional)
+                optional = false;
+        }
+    }
+    if (!queued)
+        optional = false;
+
+    cmd = virCommandNewArgList((family == AF_INET6)
+                               ? IP6TABLES_SAVE_PATH : IPTABLES_SAVE_PATH,
+                               "--table", table, NULL);
+    virCommandSetOutputBuffer(cmd, &saved);
+    virCommandSetErrorBuffer(cmd, &errbuf);
+    if (virCommandRun(cmd, NULL) < 0)
+        goto cleanup;
+
+    if (ctx->flags & IPTABLES_TRANSACTION_LEGACY)
+        iptablesTransactionRemoveAllLegacy(ctx, family, table, saved);
+
+    if (iptablesContextFormatRestore(ctx, family, table, saved, &input) < 0)
+        goto cleanup;
+
+    if (!input) {
+        ret = 0;
+        goto cleanup;
+    }
+
+    VIR_FREE(errbuf);
+    if ((rc = iptablesTransactionRestore(family, table, input, &errbuf)) < 0)
+        goto cleanup;
+
+    if (rc > 0) {
+        if (optional) {
+            VIR_WARN("Could not apply %s rules to table '%s': %s",
+                     family == AF_INET6 ? "IPv6" : "IPv4", table,
+                     NULLSTR(errbuf));
+        } else {
+            iptablesError(VIR_ERR_SYSTEM_ERROR,
+                          _("failed to apply %s rules to table '%s': %s"),
+                          family == AF_INET6 ? "IPv6" : "IPv4", table,
+                          NULLSTR(errbuf));
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    virCommandFree(cmd);
+    VIR_FREE(saved);
+    VIR_FREE(input);
+    VIR_FREE(errbuf);
+    return ret;
+}
+
+/**
+ * iptablesContextCommit:
+ * @ctx: pointer to the IP table context
+ *
+ * Apply the open transaction and close it. Every owner that is part of
+ * it ends up with exactly the rules queued for it. Each table of each
+ * address family is updated with a single atomic iptables-restore run,
+ * and left alone when the owners' rules there are already up to date.
+ * Rules are tagged with their owner and a hash of its rule set, which
+ * is how they are found again later, also by another libvirtd.
+ *
+ * Returns 0 on success, -1 if the rules of any table could not be
+ * applied
+ */
+int
+iptablesContextCommit(iptablesContext *ctx)
+{
+    size_t i;
+    int ret = 0;
+
+    if (!ctx->transaction) {
+        iptablesError(VIR_ERR_INTERNAL_ERROR, "%s",
+                      _("no iptables transaction is open"));
+        return -1;
+    }
+
+    for (i = 0 ; i < ARRAY_CARDINALITY(iptTables) ; i++) {
+        if (iptablesTransactionCommitTable(ctx,
+                                           iptTables[i].family,
+                                           iptTables[i].table) < 0)
+            ret = -1;
+    }
+
+    iptablesTransactionReset(ctx);
+    return ret;
+}
+
 static int
 iptablesInput(iptablesContext *ctx,
               int family,
@@ -191,7 +860,7 @@ iptablesInput(iptablesContext *ctx,
     snprintf(portstr, sizeof(portstr), "%d", port);
     portstr[sizeof(portstr) - 1] = '\0';
 
-    return iptablesAddRemoveRule(ctx->input_filter,
+    return iptablesAddRemoveRule(ctx, ctx->input_filter,
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -335,7 +1004,7 @@ iptablesForwardAllowOut(iptablesContext *ctx,
         return -1;
 
     if (physdev && physdev[0]) {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_FAMILY(netaddr),
                                     action,
                                     "--source", networkstr,
@@ -344,7 +1013,7 @@ iptablesForwardAllowOut(iptablesContext *ctx,
                                     "--jump", "ACCEPT",
                                     NULL);
     } else {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_FAMILY(netaddr),
                                     action,
                                     "--source", networkstr,
@@ -421,7 +1090,7 @@ iptablesForwardAllowRelatedIn(iptablesContext *ctx,
         return -1;
 
     if (physdev && physdev[0]) {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -432,7 +1101,7 @@ iptablesForwardAllowRelatedIn(iptablesContext *ctx,
                                     "--jump", "ACCEPT",
                                     NULL);
     } else {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -509,7 +1178,7 @@ iptablesForwardAllowIn(iptablesContext *ctx,
         return -1;
 
     if (physdev && physdev[0]) {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -518,7 +1187,7 @@ iptablesForwardAllowIn(iptablesContext *ctx,
                                     "--jump", "ACCEPT",
                                     NULL);
     } else {
-        ret = iptablesAddRemoveRule(ctx->forward_filter,
+        ret = iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                     VIR_SOCKET_FAMILY(netaddr),
                                     action,
                                     "--destination", networkstr,
@@ -586,7 +1255,7 @@ iptablesForwardAllowCross(iptablesContext *ctx,
                           const char *iface,
                           int action)
 {
-    return iptablesAddRemoveRule(ctx->forward_filter,
+    return iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -643,7 +1312,7 @@ iptablesForwardRejectOut(iptablesContext *ctx,
                          const char *iface,
                          int action)
 {
-    return iptablesAddRemoveRule(ctx->forward_filter,
+    return iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                  family,
                                  action,
                                  "--in-interface", iface,
@@ -699,7 +1368,7 @@ iptablesForwardRejectIn(iptablesContext *ctx,
                         const char *iface,
                         int action)
 {
-    return iptablesAddRemoveRule(ctx->forward_filter,
+    return iptablesAddRemoveRule(ctx, ctx->forward_filter,
                                  family,
                                  action,
                                  "--out-interface", iface,
@@ -772,7 +1441,7 @@ iptablesForwardMasquerade(iptablesContext *ctx,
 
     if (protocol && protocol[0]) {
         if (physdev && physdev[0]) {
-            ret = iptablesAddRemoveRule(ctx->nat_postrouting,
+            ret = iptablesAddRemoveRule(ctx, ctx->nat_postrouting,
                                         AF_INET,
                                         action,
                                         "--source", networkstr,
@@ -783,7 +1452,7 @@ iptablesForwardMasquerade(iptablesContext *ctx,
                                         "--to-ports", "1024-65535",
                                         NULL);
         } else {
-            ret = iptablesAddRemoveRule(ctx->nat_postrouting,
+            ret = iptablesAddRemoveRule(ctx, ctx->nat_postrouting,
                                         AF_INET,
                                         action,
                                         "--source", networkstr,
@@ -795,7 +1464,7 @@ iptablesForwardMasquerade(iptablesContext *ctx,
         }
     } else {
         if (physdev && physdev[0]) {
-            ret = iptablesAddRemoveRule(ctx->nat_postrouting,
+            ret = iptablesAddRemoveRule(ctx, ctx->nat_postrouting,
                                         AF_INET,
                                         action,
                                         "--source", networkstr,
@@ -804,7 +1473,7 @@ iptablesForwardMasquerade(iptablesContext *ctx,
                                         "--jump", "MASQUERADE",
                                         NULL);
         } else {
-            ret = iptablesAddRemoveRule(ctx->nat_postrouting,
+            ret = iptablesAddRemoveRule(ctx, ctx->nat_postrouting,
                                         AF_INET,
                                         action,
                                         "--source", networkstr,
@@ -875,7 +1544,7 @@ iptablesOutputFixUdpChecksum(iptablesContext *ctx,
     snprintf(portstr, sizeof(portstr), "%d", port);
     portstr[sizeof(portstr) - 1] = '\0';
 
-    return iptablesAddRemoveRule(ctx->mangle_postrouting,
+    return iptablesAddRemoveRule(ctx, ctx->mangle_postrouting,
                                  AF_INET,
                                  action,
                                  "--out-interface", iface,
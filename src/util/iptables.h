@@ -29,6 +29,24 @@ typedef struct _iptablesContext iptablesContext;
 iptablesContext *iptablesContextNew              (void);
 void             iptablesContextFree             (iptablesContext *ctx);
 
+typedef enum {
+    /* Also remove untagged copies of the rules left by older releases */
+    IPTABLES_TRANSACTION_LEGACY = (1 << 0),
+} iptablesTransactionFlags;
+
+int              iptablesContextBegin            (iptablesContext *ctx,
+                                                  unsigned int flags);
+int              iptablesContextSetOwner         (iptablesContext *ctx,
+                                                  const char *owner);
+void             iptablesContextDropOwner        (iptablesContext *ctx);
+int              iptablesContextCommit           (iptablesContext *ctx);
+int              iptablesContextFormatRestore    (iptablesContext *ctx,
+                                                  int family,
+                                                  const char *table,
+                                                  const char *saved,
+                                                  char **input);
+void             iptablesContextAbort            (iptablesContext *ctx);
+
 int              iptablesAddTcpInput             (iptablesContext *ctx,
                                                   int family,
                                                   const char *iface,
@@ -68,6 +68,7 @@ VIR_ENUM_IMPL(virMacvtapMode, VIR_MACVTAP_MODE_LAST,
 # include "uuid.h"
 # include "virfile.h"
 # include "netlink.h"
+# include "ignore-value.h"
 
 # define VIR_FROM_THIS VIR_FROM_NET
 
@@ -264,8 +265,6 @@ openMacvtapTap(const char *tgifname,
                const unsigned char *macaddress,
                const char *linkdev,
                enum virMacvtapMode mode,
-               const char *vf_pci_addr,
-               int vlan,
                int vnet_hdr,
                const unsigned char *vmuuid,
                virVirtualPortProfileParamsPtr virtPortProfile,
@@ -281,6 +280,10 @@ openMacvtapTap(const char *tgifname,
     uint32_t macvtapMode;
     const char *cr_ifname;
     int ifindex;
+    unsigned long long start = 0;
+    unsigned long long end;
+
+    ignore_value(virTimeMs(&start));
 
     macvtapMode = modeMap[mode];
 
@@ -301,14 +304,8 @@ openMacvtapTap(const char *tgifname,
         }
     }
 
-    if (mode == VIR_MACVTAP_MODE_PCI_PASSTHRU_HYBRID) {
-        if (ifaceReplaceVfMacAddress(macaddress, vf_pci_addr) != 0) {
-            return -1;
-        }
-        if (ifaceReplaceVfVlan(vlan, vf_pci_addr) != 0) {
-            return -1;
-        }
-    }
+    /* The VF of a PCI_PASSTHRU_HYBRID interface is set up along with
+     * those of the other interfaces of the domain, see ifaceVfBatchApply */
 
     if (tgifname) {
         if(ifaceGetIndex(false, tgifname, &ifindex) == 0) {
@@ -385,6 +382,9 @@ openMacvtapTap(const char *tgifname,
         goto disassociate_exit;
     }
 
+    if (start && virTimeMs(&end) == 0)
+        VIR_DEBUG("Set up macvtap device %s in %llums",
+                  cr_ifname, end - start);
 
     return rc;
 
@@ -416,8 +416,6 @@ void
 delMacvtap(const char *ifname,
            const unsigned char *macaddr,
            const char *linkdev,
-           const char *vf_pci_addr,
-           int vlan,
            int mode,
            virVirtualPortProfileParamsPtr virtPortProfile,
            char *stateDir)
@@ -426,11 +424,6 @@ delMacvtap(const char *ifname,
         ifaceRestoreMacAddress(linkdev, stateDir);
     }
     
-    if (mode == VIR_MACVTAP_MODE_PCI_PASSTHRU_HYBRID) {
-        ifaceRestoreVfMacAddress(vf_pci_addr);
-        ifaceRestoreVfVlan(vlan, vf_pci_addr);
-    }
-
     if (ifname) {
         vpDisassociatePortProfileId(ifname, macaddr,
                                     linkdev,
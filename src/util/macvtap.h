@@ -58,8 +58,6 @@ int openMacvtapTap(const char *ifname,
                    const unsigned char *macaddress,
                    const char *linkdev,
                    enum virMacvtapMode mode,
-                   const char *vf_pci_addr,
-                   int vlan,
                    int vnet_hdr,
                    const unsigned char *vmuuid,
                    virVirtualPortProfileParamsPtr virtPortProfile,
@@ -71,8 +69,6 @@ int openMacvtapTap(const char *ifname,
 void delMacvtap(const char *ifname,
                 const unsigned char *macaddress,
                 const char *linkdev,
-                const char *vf_pci_addr,
-                int vlan,
                 int mode,
                 virVirtualPortProfileParamsPtr virtPortProfile,
                 char *stateDir);
@@ -30,9 +30,21 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <limits.h>
+
+#ifdef __linux__
+# include <sys/socket.h>
+# include <poll.h>
+# include <net/if.h>
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
 
 #include "netlink.h"
 #include "memory.h"
+#include "threads.h"
+#include "util.h"
+#include "virfile.h"
 #include "virterror_internal.h"
 
 #define VIR_FROM_THIS VIR_FROM_NET
@@ -43,6 +55,639 @@
 
 #define NETLINK_ACK_TIMEOUT_S  2
 
+struct _virNetlinkHandle {
+    virMutex lock;
+    int fd;
+    unsigned int seq;
+};
+
+#ifdef __linux__
+
+static virNetlinkHandlePtr virNetlinkDefault;
+static virOnceControl virNetlinkDefaultOnce = VIR_ONCE_CONTROL_INITIALIZER;
+
+/**
+ * virNetlinkHandleNew:
+ *
+ * Open a routing netlink channel to the kernel. It is meant to be kept
+ * for the lifetime of its user and may be shared between threads, each
+ * exchange holding the channel for its duration.
+ *
+ * Returns the new handle, or NULL with an error reported
+ */
+virNetlinkHandlePtr
+virNetlinkHandleNew(void)
+{
+    virNetlinkHandlePtr nlh;
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+    };
+
+    if (VIR_ALLOC(nlh) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+    nlh->fd = -1;
+
+    if (virMutexInit(&nlh->lock) < 0) {
+        netlinkError(VIR_ERR_INTERNAL_ERROR, "%s",
+                     _("cannot initialize netlink handle mutex"));
+        VIR_FREE(nlh);
+        return NULL;
+    }
+
+    if ((nlh->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) < 0 ||
+        virSetCloseExec(nlh->fd) < 0 ||
+        bind(nlh->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        virReportSystemError(errno, "%s",
+                             _("cannot connect to netlink socket"));
+        virNetlinkHandleFree(nlh);
+        return NULL;
+    }
+
+    nlh->seq = time(NULL);
+
+    return nlh;
+}
+
+/**
+ * virNetlinkHandleFree:
+ * @nlh: the netlink handle
+ *
+ * Close a channel opened with virNetlinkHandleNew
+ */
+void
+virNetlinkHandleFree(virNetlinkHandlePtr nlh)
+{
+    if (!nlh)
+        return;
+
+    VIR_FORCE_CLOSE(nlh->fd);
+    virMutexDestroy(&nlh->lock);
+    VIR_FREE(nlh);
+}
+
+static void
+virNetlinkDefaultInit(void)
+{
+    virNetlinkDefault = virNetlinkHandleNew();
+}
+
+/* The channel shared by the users which don't have one of their own */
+static virNetlinkHandlePtr
+virNetlinkGetDefault(void)
+{
+    if (virOnce(&virNetlinkDefaultOnce, virNetlinkDefaultInit) < 0 ||
+        !virNetlinkDefault) {
+        errno = ENOTCONN;
+        return NULL;
+    }
+
+    return virNetlinkDefault;
+}
+
+/* Receive the next datagram the kernel sent to @nlh, which must be
+ * locked, waiting until @deadline at most. Returns the length of the
+ * datagram stored in @buf, or -1 with errno set */
+static ssize_t
+virNetlinkHandleRecv(virNetlinkHandlePtr nlh,
+                     unsigned char **buf,
+                     unsigned long long deadline)
+{
+    struct pollfd pfd = { .fd = nlh->fd, .events = POLLIN };
+    struct sockaddr_nl addr;
+    socklen_t addrlen;
+    unsigned long long now;
+    ssize_t len;
+    int rc;
+
+    for (;;) {
+        if (virTimeMs(&now) < 0)
+            return -1;
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        if ((rc = poll(&pfd, 1, deadline - now)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        /* Size the buffer to the datagram waiting */
+        if ((len = recv(nlh->fd, NULL, 0, MSG_PEEK | MSG_TRUNC)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+
+        if (VIR_ALLOC_N(*buf, len + 1) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        addrlen = sizeof(addr);
+        if ((len = recvfrom(nlh->fd, *buf, len, 0,
+                            (struct sockaddr *)&addr, &addrlen)) < 0) {
+            VIR_FREE(*buf);
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+
+        if (addr.nl_pid == 0)
+            return len;
+
+        /* Not from the kernel */
+        VIR_FREE(*buf);
+    }
+}
+
+# ifdef HAVE_LIBNL
+/* Send a single request and return the first datagram answering it */
+static int
+virNetlinkHandleCommand(virNetlinkHandlePtr nlh,
+                        struct nlmsghdr *msg,
+                        unsigned char **respbuf,
+                        unsigned int *respbuflen)
+{
+    struct sockaddr_nl kernel = {
+        .nl_family = AF_NETLINK,
+    };
+    struct nlmsghdr *resp;
+    unsigned long long deadline;
+    ssize_t len;
+    int ret = -1;
+    int save_errno;
+
+    virMutexLock(&nlh->lock);
+
+    msg->nlmsg_seq = ++nlh->seq;
+    msg->nlmsg_pid = 0;
+
+    if (sendto(nlh->fd, msg, msg->nlmsg_len, 0,
+               (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+        goto cleanup;
+
+    if (virTimeMs(&deadline) < 0)
+        goto cleanup;
+    deadline += NETLINK_ACK_TIMEOUT_S * 1000;
+
+    for (;;) {
+        if ((len = virNetlinkHandleRecv(nlh, respbuf, deadline)) < 0)
+            goto cleanup;
+
+        resp = (struct nlmsghdr *)*respbuf;
+        if (NLMSG_OK(resp, len) && resp->nlmsg_seq == msg->nlmsg_seq)
+            break;
+
+        /* A late answer to an exchange that timed out */
+        VIR_FREE(*respbuf);
+    }
+
+    *respbuflen = len;
+    ret = 0;
+
+cleanup:
+    save_errno = errno;
+    virMutexUnlock(&nlh->lock);
+    errno = save_errno;
+    return ret;
+}
+# endif /* HAVE_LIBNL */
+
+/* Send all @nmsgs requests in a single datagram, which the kernel
+ * processes in order, and collect their acknowledgements. @errors
+ * receives 0 or the errno the kernel answered each request with.
+ * Returns 0 once every request was answered, or -1 with errno set */
+static int
+virNetlinkHandleExchange(virNetlinkHandlePtr nlh,
+                         struct nlmsghdr **msgs,
+                         size_t nmsgs,
+                         int *errors)
+{
+    struct sockaddr_nl kernel = {
+        .nl_family = AF_NETLINK,
+    };
+    struct msghdr hdr;
+    struct iovec *iov = NULL;
+    struct nlmsghdr *resp;
+    struct nlmsgerr *err;
+    unsigned char *buf = NULL;
+    unsigned long long deadline;
+    unsigned int first;
+    unsigned int idx;
+    size_t pending = nmsgs;
+    size_t i;
+    ssize_t len;
+    int remaining;
+    int ret = -1;
+    int save_errno;
+
+    if (VIR_ALLOC_N(iov, nmsgs) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    virMutexLock(&nlh->lock);
+
+    first = nlh->seq + 1;
+    for (i = 0 ; i < nmsgs ; i++) {
+        msgs[i]->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+        msgs[i]->nlmsg_seq = ++nlh->seq;
+        msgs[i]->nlmsg_pid = 0;
+        iov[i].iov_base = msgs[i];
+        iov[i].iov_len = NLMSG_ALIGN(msgs[i]->nlmsg_len);
+        errors[i] = -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &kernel;
+    hdr.msg_namelen = sizeof(kernel);
+    hdr.msg_iov = iov;
+    hdr.msg_iovlen = nmsgs;
+
+    if (sendmsg(nlh->fd, &hdr, 0) < 0)
+        goto cleanup;
+
+    if (virTimeMs(&deadline) < 0)
+        goto cleanup;
+    deadline += NETLINK_ACK_TIMEOUT_S * 1000;
+
+    while (pending > 0) {
+        if ((len = virNetlinkHandleRecv(nlh, &buf, deadline)) < 0)
+            goto cleanup;
+
+        remaining = len;
+        for (resp = (struct nlmsghdr *)buf;
+             NLMSG_OK(resp, remaining);
+             resp = NLMSG_NEXT(resp, remaining)) {
+            idx = resp->nlmsg_seq - first;
+
+            /* Skip answers to exchanges that timed out */
+            if (idx >= nmsgs || errors[idx] != -1 ||
+                resp->nlmsg_type != NLMSG_ERROR)
+                continue;
+
+            if (resp->nlmsg_len < NLMSG_LENGTH(sizeof(*err))) {
+                errors[idx] = EBADMSG;
+            } else {
+                err = NLMSG_DATA(resp);
+                errors[idx] = -err->error;
+            }
+            pending--;
+        }
+
+        VIR_FREE(buf);
+    }
+
+    ret = 0;
+
+cleanup:
+    save_errno = errno;
+    virMutexUnlock(&nlh->lock);
+    VIR_FREE(buf);
+    VIR_FREE(iov);
+    errno = save_errno;
+    return ret;
+}
+
+typedef struct {
+    struct nlmsghdr hdr;
+    struct ifinfomsg ifinfo;
+    char attrs[RTA_SPACE(IFNAMSIZ) +
+               RTA_SPACE(VIR_MAC_BUFLEN) +
+               RTA_SPACE(sizeof(unsigned int)) +
+               RTA_SPACE(sizeof(int))];
+} virNetlinkLinkRequest;
+
+static void
+virNetlinkAddAttr(struct nlmsghdr *hdr,
+                  unsigned short type,
+                  const void *data,
+                  size_t len)
+{
+    struct rtattr *rta;
+
+    rta = (struct rtattr *)((char *)hdr + NLMSG_ALIGN(hdr->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    if (len)
+        memcpy(RTA_DATA(rta), data, len);
+    hdr->nlmsg_len = NLMSG_ALIGN(hdr->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static struct nlmsghdr *
+virNetlinkLinkRequestInit(virNetlinkLinkRequest *req,
+                          const char *ifname)
+{
+    memset(req, 0, sizeof(*req));
+    req->hdr.nlmsg_len = NLMSG_LENGTH(sizeof(req->ifinfo));
+    req->hdr.nlmsg_type = RTM_SETLINK;
+    req->ifinfo.ifi_family = AF_UNSPEC;
+    virNetlinkAddAttr(&req->hdr, IFLA_IFNAME, ifname, strlen(ifname) + 1);
+
+    return &req->hdr;
+}
+
+/**
+ * virNetlinkLinkConfigure:
+ * @nlh: the netlink handle, or NULL to use the shared one
+ * @links: the links to configure
+ * @nlinks: number of links
+ *
+ * Apply the settings of all @links with a single batch of RTM_SETLINK
+ * requests. For each link the MAC address and MTU are set first, then
+ * the link is enslaved to its bridge and finally brought up or down,
+ * the order in which a new tap device must be set up. The outcome of
+ * each step is stored in the errors array of the link.
+ *
+ * Like the bridge helpers, this does not report errors.
+ *
+ * Returns 0 if the requests were all answered, an errno code otherwise
+ */
+int
+virNetlinkLinkConfigure(virNetlinkHandlePtr nlh,
+                        virNetlinkLinkConfigPtr links,
+                        size_t nlinks)
+{
+    virNetlinkLinkRequest *reqs = NULL;
+    struct nlmsghdr **msgs = NULL;
+    int *errors = NULL;
+    size_t *owners = NULL;
+    size_t nmsgs = 0;
+    size_t i, j;
+    int ret = ENOMEM;
+
+    if (!nlh && !(nlh = virNetlinkGetDefault()))
+        return errno;
+
+    if (VIR_ALLOC_N(reqs, nlinks * VIR_NETLINK_LINK_LAST) < 0 ||
+        VIR_ALLOC_N(msgs, nlinks * VIR_NETLINK_LINK_LAST) < 0 ||
+        VIR_ALLOC_N(errors, nlinks * VIR_NETLINK_LINK_LAST) < 0 ||
+        VIR_ALLOC_N(owners, nlinks * VIR_NETLINK_LINK_LAST) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < nlinks ; i++) {
+        virNetlinkLinkConfigPtr link = &links[i];
+        struct nlmsghdr *hdr;
+        unsigned int mtu = link->mtu;
+        int master = link->master;
+
+        memset(link->errors, 0, sizeof(link->errors));
+
+        if (strlen(link->ifname) >= IFNAMSIZ) {
+            for (j = 0 ; j < VIR_NETLINK_LINK_LAST ; j++)
+                link->errors[j] = EINVAL;
+            continue;
+        }
+
+        if (link->mac || link->mtu) {
+            hdr = virNetlinkLinkRequestInit(&reqs[nmsgs], link->ifname);
+            if (link->mac)
+                virNetlinkAddAttr(hdr, IFLA_ADDRESS,
+                                  link->mac, VIR_MAC_BUFLEN);
+            if (link->mtu)
+                virNetlinkAddAttr(hdr, IFLA_MTU, &mtu, sizeof(mtu));
+            owners[nmsgs] = i * VIR_NETLINK_LINK_LAST + VIR_NETLINK_LINK_SETTINGS;
+            msgs[nmsgs++] = hdr;
+        }
+
+        if (link->master > 0) {
+            hdr = virNetlinkLinkRequestInit(&reqs[nmsgs], link->ifname);
+            virNetlinkAddAttr(hdr, IFLA_MASTER, &master, sizeof(master));
+            owners[nmsgs] = i * VIR_NETLINK_LINK_LAST + VIR_NETLINK_LINK_MASTER;
+            msgs[nmsgs++] = hdr;
+        }
+
+        if (link->up >= 0) {
+            hdr = virNetlinkLinkRequestInit(&reqs[nmsgs], link->ifname);
+            reqs[nmsgs].ifinfo.ifi_change = IFF_UP;
+            reqs[nmsgs].ifinfo.ifi_flags = link->up ? IFF_UP : 0;
+            owners[nmsgs] = i * VIR_NETLINK_LINK_LAST + VIR_NETLINK_LINK_FLAGS;
+            msgs[nmsgs++] = hdr;
+        }
+    }
+
+    if (nmsgs &&
+        virNetlinkHandleExchange(nlh, msgs, nmsgs, errors) < 0) {
+        ret = errno;
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < nmsgs ; i++)
+        links[owners[i] / VIR_NETLINK_LINK_LAST].errors[owners[i] % VIR_NETLINK_LINK_LAST] = errors[i];
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(reqs);
+    VIR_FREE(msgs);
+    VIR_FREE(errors);
+    VIR_FREE(owners);
+    return ret;
+}
+
+# ifdef IFLA_VF_MAX
+static struct rtattr *
+virNetlinkNestStart(struct nlmsghdr *hdr,
+                    unsigned short type)
+{
+    struct rtattr *nest;
+
+    nest = (struct rtattr *)((char *)hdr + NLMSG_ALIGN(hdr->nlmsg_len));
+    virNetlinkAddAttr(hdr, type, NULL, 0);
+
+    return nest;
+}
+
+static void
+virNetlinkNestEnd(struct nlmsghdr *hdr,
+                  struct rtattr *nest)
+{
+    nest->rta_len = (char *)hdr + hdr->nlmsg_len - (char *)nest;
+}
+
+/* Build the RTM_SETLINK request carrying the settings of all the VFs
+ * of @pf in its IFLA_VFINFO_LIST */
+static struct nlmsghdr *
+virNetlinkVfRequestNew(virNetlinkPfConfigPtr pf)
+{
+    struct nlmsghdr *hdr;
+    struct ifinfomsg *ifinfo;
+    struct rtattr *list;
+    struct rtattr *info;
+    size_t len;
+    size_t i;
+
+    len = NLMSG_SPACE(sizeof(*ifinfo)) +
+          RTA_SPACE(IFNAMSIZ) +
+          RTA_SPACE(0) +
+          pf->nvfs * (RTA_SPACE(0) +
+                      RTA_SPACE(sizeof(struct ifla_vf_mac)) +
+                      RTA_SPACE(sizeof(struct ifla_vf_vlan)));
+
+    /* The list is a single attribute, whose length must fit */
+    if (len - NLMSG_SPACE(sizeof(*ifinfo)) - RTA_SPACE(IFNAMSIZ) > USHRT_MAX) {
+        errno = E2BIG;
+        return NULL;
+    }
+
+    if (VIR_ALLOC_N(hdr, len) < 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    hdr->nlmsg_len = NLMSG_LENGTH(sizeof(*ifinfo));
+    hdr->nlmsg_type = RTM_SETLINK;
+    ifinfo = NLMSG_DATA(hdr);
+    ifinfo->ifi_family = AF_UNSPEC;
+    virNetlinkAddAttr(hdr, IFLA_IFNAME, pf->ifname, strlen(pf->ifname) + 1);
+
+    list = virNetlinkNestStart(hdr, IFLA_VFINFO_LIST);
+    for (i = 0 ; i < pf->nvfs ; i++) {
+        virNetlinkVfConfigPtr vf = &pf->vfs[i];
+
+        info = virNetlinkNestStart(hdr, IFLA_VF_INFO);
+
+        if (vf->mac) {
+            struct ifla_vf_mac mac = { .vf = vf->vf };
+
+            memcpy(mac.mac, vf->mac, VIR_MAC_BUFLEN);
+            virNetlinkAddAttr(hdr, IFLA_VF_MAC, &mac, sizeof(mac));
+        }
+
+        if (vf->vlan >= 0) {
+            struct ifla_vf_vlan vlan = { .vf = vf->vf, .vlan = vf->vlan };
+
+            virNetlinkAddAttr(hdr, IFLA_VF_VLAN, &vlan, sizeof(vlan));
+        }
+
+        virNetlinkNestEnd(hdr, info);
+    }
+    virNetlinkNestEnd(hdr, list);
+
+    return hdr;
+}
+
+/**
+ * virNetlinkVfConfigure:
+ * @nlh: the netlink handle, or NULL to use the shared one
+ * @pfs: the physical functions whose VFs to configure
+ * @npfs: number of physical functions
+ *
+ * Set the MAC address and VLAN of SR-IOV virtual functions. The
+ * settings of all the VFs of a PF go in the IFLA_VFINFO_LIST of a
+ * single RTM_SETLINK request, and the requests for all @pfs are sent
+ * as one batch. The outcome for each PF is stored in its error field.
+ *
+ * Returns 0 if the requests were all answered, an errno code otherwise
+ */
+int
+virNetlinkVfConfigure(virNetlinkHandlePtr nlh,
+                      virNetlinkPfConfigPtr pfs,
+                      size_t npfs)
+{
+    struct nlmsghdr **msgs = NULL;
+    int *errors = NULL;
+    size_t *owners = NULL;
+    size_t nmsgs = 0;
+    size_t i;
+    int ret = ENOMEM;
+
+    if (!nlh && !(nlh = virNetlinkGetDefault()))
+        return errno;
+
+    if (VIR_ALLOC_N(msgs, npfs) < 0 ||
+        VIR_ALLOC_N(errors, npfs) < 0 ||
+        VIR_ALLOC_N(owners, npfs) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < npfs ; i++) {
+        pfs[i].error = 0;
+
+        if (!pfs[i].nvfs)
+            continue;
+
+        if (strlen(pfs[i].ifname) >= IFNAMSIZ) {
+            pfs[i].error = EINVAL;
+            continue;
+        }
+
+        if (!(msgs[nmsgs] = virNetlinkVfRequestNew(&pfs[i]))) {
+            pfs[i].error = errno;
+            continue;
+        }
+        owners[nmsgs++] = i;
+    }
+
+    if (nmsgs &&
+        virNetlinkHandleExchange(nlh, msgs, nmsgs, errors) < 0) {
+        ret = errno;
+        goto cleanup;
+    }
+
+    for (i = 0 ; i < nmsgs ; i++)
+        pfs[owners[i]].error = errors[i];
+
+    ret = 0;
+
+cleanup:
+    for (i = 0 ; i < nmsgs ; i++)
+        VIR_FREE(msgs[i]);
+    VIR_FREE(msgs);
+    VIR_FREE(errors);
+    VIR_FREE(owners);
+    return ret;
+}
+# else /* !IFLA_VF_MAX */
+int
+virNetlinkVfConfigure(virNetlinkHandlePtr nlh ATTRIBUTE_UNUSED,
+                      virNetlinkPfConfigPtr pfs ATTRIBUTE_UNUSED,
+                      size_t npfs ATTRIBUTE_UNUSED)
+{
+    return ENOSYS;
+}
+# endif /* IFLA_VF_MAX */
+
+#else /* !__linux__ */
+
+virNetlinkHandlePtr
+virNetlinkHandleNew(void)
+{
+    netlinkError(VIR_ERR_INTERNAL_ERROR, "%s",
+                 _("netlink is not supported on non-linux platforms"));
+    return NULL;
+}
+
+void
+virNetlinkHandleFree(virNetlinkHandlePtr nlh ATTRIBUTE_UNUSED)
+{
+}
+
+int
+virNetlinkLinkConfigure(virNetlinkHandlePtr nlh ATTRIBUTE_UNUSED,
+                        virNetlinkLinkConfigPtr links ATTRIBUTE_UNUSED,
+                        size_t nlinks ATTRIBUTE_UNUSED)
+{
+    return ENOSYS;
+}
+
+int
+virNetlinkVfConfigure(virNetlinkHandlePtr nlh ATTRIBUTE_UNUSED,
+                      virNetlinkPfConfigPtr pfs ATTRIBUTE_UNUSED,
+                      size_t npfs ATTRIBUTE_UNUSED)
+{
+    return ENOSYS;
+}
+
+#endif /* __linux__ */
+
 /**
  * nlComm:
  * @nlmsg: pointer to netlink message
@@ -74,9 +719,31 @@ int nlComm(struct nl_msg *nl_msg,
     int fd;
     int n;
     struct nlmsghdr *nlmsg = nlmsg_hdr(nl_msg);
-    struct nl_handle *nlhandle = nl_handle_alloc();
+    struct nl_handle *nlhandle;
+    virNetlinkHandlePtr nlh;
+
+    /* Requests to the kernel go through the shared channel */
+    if (nl_pid == 0) {
+        if (!(nlh = virNetlinkGetDefault())) {
+            virReportSystemError(errno, "%s",
+                                 _("cannot connect to netlink socket"));
+            return -1;
+        }
+
+        *respbuf = NULL;
+        *respbuflen = 0;
+        if (virNetlinkHandleCommand(nlh, nlmsg, respbuf, respbuflen) < 0) {
+            virReportSystemError(errno, "%s",
+                                 errno == ETIMEDOUT ?
+                                 _("no valid netlink response was received") :
+                                 _("cannot communicate over netlink socket"));
+            VIR_FREE(*respbuf);
+            return -1;
+        }
+        return 0;
+    }
 
-    if (!nlhandle) {
+    if (!(nlhandle = nl_handle_alloc())) {
         virReportSystemError(errno,
                              "%s", _("cannot allocate nlhandle for netlink"));
         return -1;
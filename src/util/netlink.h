@@ -21,6 +21,7 @@
 # define __VIR_NETLINK_H__
 
 # include "config.h"
+# include "internal.h"
 
 # if defined(__linux__) && defined(HAVE_LIBNL)
 
@@ -36,4 +37,61 @@ int nlComm(struct nl_msg *nl_msg,
            unsigned char **respbuf, unsigned int *respbuflen,
            int nl_pid);
 
+typedef struct _virNetlinkHandle virNetlinkHandle;
+typedef virNetlinkHandle *virNetlinkHandlePtr;
+
+virNetlinkHandlePtr virNetlinkHandleNew(void);
+void virNetlinkHandleFree(virNetlinkHandlePtr nlh);
+
+enum {
+    VIR_NETLINK_LINK_SETTINGS,  /* MAC address and MTU */
+    VIR_NETLINK_LINK_MASTER,    /* bridge to enslave to */
+    VIR_NETLINK_LINK_FLAGS,     /* up or down */
+
+    VIR_NETLINK_LINK_LAST
+};
+
+typedef struct _virNetlinkLinkConfig virNetlinkLinkConfig;
+typedef virNetlinkLinkConfig *virNetlinkLinkConfigPtr;
+
+struct _virNetlinkLinkConfig {
+    const char *ifname;
+    const unsigned char *mac;   /* VIR_MAC_BUFLEN bytes, or NULL to keep */
+    unsigned int mtu;           /* 0 to keep */
+    int master;                 /* ifindex of the bridge, or 0 */
+    int up;                     /* 1 for up, 0 for down, -1 to keep */
+
+    /* Set to 0 or the errno of each step */
+    int errors[VIR_NETLINK_LINK_LAST];
+};
+
+int virNetlinkLinkConfigure(virNetlinkHandlePtr nlh,
+                            virNetlinkLinkConfigPtr links,
+                            size_t nlinks);
+
+typedef struct _virNetlinkVfConfig virNetlinkVfConfig;
+typedef virNetlinkVfConfig *virNetlinkVfConfigPtr;
+
+struct _virNetlinkVfConfig {
+    int vf;                     /* index of the VF on its PF */
+    const unsigned char *mac;   /* VIR_MAC_BUFLEN bytes, or NULL to keep */
+    int vlan;                   /* VLAN id, 0 to clear, -1 to keep */
+};
+
+typedef struct _virNetlinkPfConfig virNetlinkPfConfig;
+typedef virNetlinkPfConfig *virNetlinkPfConfigPtr;
+
+struct _virNetlinkPfConfig {
+    const char *ifname;
+    virNetlinkVfConfigPtr vfs;
+    size_t nvfs;
+
+    /* Set to 0 or the errno the request for this PF failed with */
+    int error;
+};
+
+int virNetlinkVfConfigure(virNetlinkHandlePtr nlh,
+                          virNetlinkPfConfigPtr pfs,
+                          size_t npfs);
+
 #endif /* __VIR_NETLINK_H__ */
@@ -37,6 +37,8 @@
 #include "logging.h"
 #include "memory.h"
 #include "command.h"
+#include "threads.h"
+#include "util.h"
 #include "virterror_internal.h"
 #include "virfile.h"
 
@@ -71,6 +73,7 @@ struct _pciDevice {
     unsigned      has_flr : 1;
     unsigned      has_pm_reset : 1;
     unsigned      managed : 1;
+    unsigned long long reset_time;    /* How long the last reset took, in ms */
 
     /* used by reattach function */
     unsigned      unbind_from_stub : 1;
@@ -104,6 +107,7 @@ struct _pciDeviceList {
 #define PCI_CONF_HEADER_LEN     0x40
 
 /* PCI30 6.2.1 */
+#define PCI_VENDOR_ID           0x00    /* Vendor ID */
 #define PCI_HEADER_TYPE         0x0e    /* Header type */
 #define PCI_HEADER_TYPE_BRIDGE 0x1
 #define PCI_HEADER_TYPE_MASK   0x7f
@@ -162,6 +166,27 @@ struct _pciDeviceList {
 #define PCI_EXT_CAP_OFFSET_SHIFT  20
 #define PCI_EXT_CAP_OFFSET_MASK   0x00000ffc
 
+/* Vendor ID read while a device does not respond yet (all ones), or
+ * while it asks for the configuration request to be retried;
+ * PCIe20 2.3.2 Completion Handling Rules */
+#define PCI_VENDOR_ID_NONE      0xffff
+#define PCI_VENDOR_ID_CRS       0x0001
+
+/* BR12 3.2.5.18  Secondary bus reset must be held for at least 1ms */
+#define PCI_BUS_RESET_HOLD      2       /* ms */
+/* PCIe20 6.6.1  No configuration requests may be sent for 100ms after
+ * a reset, and CRS is only visible to software that enabled it */
+#define PCI_BUS_RESET_SETTLE    100     /* ms */
+/* PM12 5.6.1  D3hot entry and D3hot to D0 recovery take 10ms, during
+ * which PM_CTRL may already read back the state written */
+#define PCI_PM_TRANSITION       10      /* ms */
+/* How long devices may take to come back after a reset, in ms */
+#define PCI_BUS_RESET_TIMEOUT   1000
+#define PCI_PM_RESET_TIMEOUT    100
+/* Bounds for the interval of polling them meanwhile, in ms */
+#define PCI_RESET_POLL_MIN      1
+#define PCI_RESET_POLL_MAX      20
+
 #define PCI_EXT_CAP_ID_ACS      0x000d
 #define PCI_EXT_ACS_CTRL        0x06
 
@@ -602,6 +627,72 @@ pciGetParentDevice(pciDevice *dev, pciDevice **parent)
     return ret;
 }
 
+typedef bool (*pciResetPredicate)(pciDevice *dev);
+
+/* Does @dev answer configuration requests again? */
+static bool
+pciDeviceResponds(pciDevice *dev)
+{
+    uint16_t vendor = pciRead16(dev, PCI_VENDOR_ID);
+
+    return vendor != PCI_VENDOR_ID_NONE && vendor != PCI_VENDOR_ID_CRS;
+}
+
+static bool
+pciDeviceInD3hot(pciDevice *dev)
+{
+    uint32_t ctl = pciRead32(dev, dev->pci_pm_cap_pos + PCI_PM_CTRL);
+
+    return (ctl & PCI_PM_CTRL_STATE_MASK) == PCI_PM_CTRL_STATE_D3hot;
+}
+
+static bool
+pciDeviceInD0(pciDevice *dev)
+{
+    uint32_t ctl = pciRead32(dev, dev->pci_pm_cap_pos + PCI_PM_CTRL);
+
+    return pciDeviceResponds(dev) &&
+        (ctl & PCI_PM_CTRL_STATE_MASK) == PCI_PM_CTRL_STATE_D0;
+}
+
+/* Polls config space of @dev until @ready says it is done with a
+ * reset step, backing off from PCI_RESET_POLL_MIN to PCI_RESET_POLL_MAX
+ * between reads.  Gives up after @timeout ms.
+ */
+static int
+pciWaitForReset(pciDevice *dev,
+                pciResetPredicate ready,
+                const char *what,
+                unsigned long long timeout)
+{
+    unsigned long long start;
+    unsigned long long now;
+    unsigned int interval = PCI_RESET_POLL_MIN;
+
+    if (virTimeMs(&start) < 0)
+        return -1;
+    now = start;
+
+    while (!ready(dev)) {
+        if (now - start >= timeout) {
+            pciReportError(VIR_ERR_INTERNAL_ERROR,
+                           _("PCI device %s did not %s within %llums"),
+                           dev->name, what, timeout);
+            return -1;
+        }
+
+        usleep(interval * 1000);
+        if (interval < PCI_RESET_POLL_MAX)
+            interval = MIN(interval * 2, PCI_RESET_POLL_MAX);
+
+        if (virTimeMs(&now) < 0)
+            return -1;
+    }
+
+    VIR_DEBUG("%s %s: %s after %llums", dev->id, dev->name, what, now - start);
+    return 0;
+}
+
 /* Secondary Bus Reset is our sledgehammer - it resets all
  * devices behind a bus.
  */
@@ -649,18 +740,24 @@ pciTrySecondaryBusReset(pciDevice *dev,
         goto out;
     }
 
-    /* Read the control register, set the reset flag, wait 200ms,
-     * unset the reset flag and wait 200ms.
+    /* Read the control register, set the reset flag, hold it for
+     * the minimum time, unset the reset flag, leave the bus alone for
+     * as long as the spec demands and wait for the device to respond
+     * again.
      */
     ctl = pciRead16(dev, PCI_BRIDGE_CONTROL);
 
     pciWrite16(parent, PCI_BRIDGE_CONTROL, ctl | PCI_BRIDGE_CTL_RESET);
 
-    usleep(200 * 1000); /* sleep 200ms */
+    usleep(PCI_BUS_RESET_HOLD * 1000);
 
     pciWrite16(parent, PCI_BRIDGE_CONTROL, ctl);
 
-    usleep(200 * 1000); /* sleep 200ms */
+    usleep(PCI_BUS_RESET_SETTLE * 1000);
+
+    if (pciWaitForReset(dev, pciDeviceResponds, "come out of bus reset",
+                        PCI_BUS_RESET_TIMEOUT) < 0)
+        goto out;
 
     if (pciWrite(dev, 0, config_space, PCI_CONF_LEN) < 0) {
         pciReportError(VIR_ERR_INTERNAL_ERROR,
@@ -702,11 +799,19 @@ pciTryPowerManagementReset(pciDevice *dev)
 
     pciWrite32(dev, dev->pci_pm_cap_pos + PCI_PM_CTRL, ctl|PCI_PM_CTRL_STATE_D3hot);
 
-    usleep(10 * 1000); /* sleep 10ms */
+    usleep(PCI_PM_TRANSITION * 1000);
+
+    if (pciWaitForReset(dev, pciDeviceInD3hot, "enter D3hot",
+                        PCI_PM_RESET_TIMEOUT) < 0)
+        return -1;
 
     pciWrite32(dev, dev->pci_pm_cap_pos + PCI_PM_CTRL, ctl|PCI_PM_CTRL_STATE_D0);
 
-    usleep(10 * 1000); /* sleep 10ms */
+    usleep(PCI_PM_TRANSITION * 1000);
+
+    if (pciWaitForReset(dev, pciDeviceInD0, "return to D0",
+                        PCI_PM_RESET_TIMEOUT) < 0)
+        return -1;
 
     if (pciWrite(dev, 0, &config_space[0], PCI_CONF_LEN) < 0) {
         pciReportError(VIR_ERR_INTERNAL_ERROR,
@@ -747,6 +852,8 @@ pciResetDevice(pciDevice *dev,
                pciDeviceList *inactiveDevs)
 {
     int ret = -1;
+    unsigned long long start = 0;
+    unsigned long long end;
 
     if (activeDevs && pciDeviceListFind(activeDevs, dev)) {
         pciReportError(VIR_ERR_INTERNAL_ERROR,
@@ -757,12 +864,16 @@ pciResetDevice(pciDevice *dev,
     if (!dev->initted && pciInitDevice(dev) < 0)
         return -1;
 
+    dev->reset_time = 0;
+
     /* KVM will perform FLR when starting and stopping
      * a guest, so there is no need for us to do it here.
      */
     if (dev->has_flr)
         return 0;
 
+    ignore_value(virTimeMs(&start));
+
     /* If the device supports PCI power management reset,
      * that's the next best thing because it only resets
      * the function, not the whole device.
@@ -782,6 +893,12 @@ pciResetDevice(pciDevice *dev,
                        err ? err->message : _("no FLR, PM reset or bus reset available"));
     }
 
+    if (start && virTimeMs(&end) == 0) {
+        dev->reset_time = end - start;
+        VIR_DEBUG("%s %s: reset took %llums",
+                  dev->id, dev->name, dev->reset_time);
+    }
+
     return ret;
 }
 
@@ -951,6 +1068,147 @@ cleanup:
     return result;
 }
 
+/* Dynamic IDs added to the stub drivers' tables while binding devices.
+ * Devices sharing an ID may be bound concurrently, so only the first of
+ * them adds the ID and only the last one removes it again.
+ */
+struct pciStubId {
+    const char *driver;
+    char id[PCI_ID_LEN];
+    unsigned int refs;
+};
+
+static virOnceControl pciStubIdOnce = VIR_ONCE_CONTROL_INITIALIZER;
+static virMutex pciStubIdLock;
+static bool pciStubIdLockReady;
+static struct pciStubId *pciStubIds;
+static size_t pciNStubIds;
+
+static void
+pciStubIdOnceInit(void)
+{
+    if (virMutexInit(&pciStubIdLock) == 0)
+        pciStubIdLockReady = true;
+}
+
+static int
+pciStubIdsLock(void)
+{
+    if (virOnce(&pciStubIdOnce, pciStubIdOnceInit) < 0 ||
+        !pciStubIdLockReady) {
+        pciReportError(VIR_ERR_INTERNAL_ERROR, "%s",
+                       _("unable to initialize PCI stub ID table"));
+        return -1;
+    }
+
+    virMutexLock(&pciStubIdLock);
+    return 0;
+}
+
+static struct pciStubId *
+pciStubIdFind(pciDevice *dev, const char *driver)
+{
+    size_t i;
+
+    for (i = 0; i < pciNStubIds; i++) {
+        if (STREQ(pciStubIds[i].driver, driver) &&
+            STREQ(pciStubIds[i].id, dev->id))
+            return &pciStubIds[i];
+    }
+    return NULL;
+}
+
+/* Add the ID of @dev to the dynamic ID table of @driver */
+static int
+pciStubIdAdd(pciDevice *dev, const char *driver)
+{
+    struct pciStubId *stubid;
+    char *path = NULL;
+    int ret = -1;
+
+    if (pciStubIdsLock() < 0)
+        return -1;
+
+    if ((stubid = pciStubIdFind(dev, driver))) {
+        stubid->refs++;
+        ret = 0;
+        goto cleanup;
+    }
+
+    if (pciDriverFile(&path, driver, "new_id") < 0)
+        goto cleanup;
+
+    if (VIR_EXPAND_N(pciStubIds, pciNStubIds, 1) < 0) {
+        virReportOOMError();
+        goto cleanup;
+    }
+
+    if (virFileWriteStr(path, dev->id, 0) < 0) {
+        virReportSystemError(errno,
+                             _("Failed to add PCI device ID '%s' to %s"),
+                             dev->id, driver);
+        VIR_SHRINK_N(pciStubIds, pciNStubIds, 1);
+        goto cleanup;
+    }
+
+    stubid = &pciStubIds[pciNStubIds - 1];
+    stubid->driver = driver;
+    ignore_value(virStrcpyStatic(stubid->id, dev->id));
+    stubid->refs = 1;
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&pciStubIdLock);
+    VIR_FREE(path);
+    return ret;
+}
+
+/* Drop the reference of @dev to its ID in the dynamic ID table of
+ * @driver, removing the ID if 'remove_id' exists and nobody else
+ * needs it any more.
+ */
+static int
+pciStubIdRemove(pciDevice *dev, const char *driver)
+{
+    struct pciStubId *stubid;
+    char *path = NULL;
+    int ret = -1;
+
+    if (pciStubIdsLock() < 0)
+        return -1;
+
+    if ((stubid = pciStubIdFind(dev, driver))) {
+        size_t i = stubid - pciStubIds;
+
+        if (--stubid->refs > 0) {
+            ret = 0;
+            goto cleanup;
+        }
+
+        if (i != pciNStubIds - 1)
+            memmove(&pciStubIds[i], &pciStubIds[i + 1],
+                    sizeof(*pciStubIds) * (pciNStubIds - i - 1));
+        VIR_SHRINK_N(pciStubIds, pciNStubIds, 1);
+    }
+
+    if (pciDriverFile(&path, driver, "remove_id") < 0)
+        goto cleanup;
+
+    if (virFileExists(path) && virFileWriteStr(path, dev->id, 0) < 0) {
+        virReportSystemError(errno,
+                             _("Failed to remove PCI ID '%s' from %s"),
+                             dev->id, driver);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virMutexUnlock(&pciStubIdLock);
+    VIR_FREE(path);
+    return ret;
+}
+
 
 static int
 pciBindDeviceToStub(pciDevice *dev, const char *driver)
@@ -959,6 +1217,7 @@ pciBindDeviceToStub(pciDevice *dev, const char *driver)
     char *drvdir = NULL;
     char *path = NULL;
     int reprobe = 0;
+    bool stubid = false;
 
     /* check whether the device is already bound to a driver */
     if (pciDriverDir(&drvdir, driver) < 0 ||
@@ -983,16 +1242,9 @@ pciBindDeviceToStub(pciDevice *dev, const char *driver)
      * is triggered for such a device, it will also be immediately
      * bound by the stub.
      */
-    if (pciDriverFile(&path, driver, "new_id") < 0) {
+    if (pciStubIdAdd(dev, driver) < 0)
         goto cleanup;
-    }
-
-    if (virFileWriteStr(path, dev->id, 0) < 0) {
-        virReportSystemError(errno,
-                             _("Failed to add PCI device ID '%s' to %s"),
-                             dev->id, driver);
-        goto cleanup;
-    }
+    stubid = true;
 
     /* check whether the device is bound to pci-stub when we write dev->id to
      * new_id.
@@ -1065,21 +1317,8 @@ remove_id:
     /* If 'remove_id' exists, remove the device id from pci-stub's dynamic
      * ID table so that 'drivers_probe' works below.
      */
-    if (pciDriverFile(&path, driver, "remove_id") < 0) {
-        /* We do not remove PCI ID from pci-stub, and we cannot reprobe it */
-        if (dev->reprobe) {
-            VIR_WARN("Could not remove PCI ID '%s' from %s, and the device "
-                     "cannot be probed again.", dev->id, driver);
-        }
-        dev->reprobe = 0;
-        goto cleanup;
-    }
-
-    if (virFileExists(path) && virFileWriteStr(path, dev->id, 0) < 0) {
-        virReportSystemError(errno,
-                             _("Failed to remove PCI ID '%s' from %s"),
-                             dev->id, driver);
-
+    stubid = false;
+    if (pciStubIdRemove(dev, driver) < 0) {
         /* remove PCI ID from pci-stub failed, and we cannot reprobe it */
         if (dev->reprobe) {
             VIR_WARN("Failed to remove PCI ID '%s' from %s, and the device "
@@ -1096,6 +1335,10 @@ cleanup:
     VIR_FREE(path);
 
     if (result < 0) {
+        /* Drop our reference to the ID first, or the stub would grab
+         * the device again when it is reprobed */
+        if (stubid)
+            ignore_value(pciStubIdRemove(dev, driver));
         pciUnbindDeviceFromStub(dev, driver);
     }
 
@@ -1424,6 +1667,12 @@ void pciDeviceReAttachInit(pciDevice *pci)
     pci->reprobe = 1;
 }
 
+unsigned long long
+pciDeviceGetResetTime(pciDevice *dev)
+{
+    return dev->reset_time;
+}
+
 
 pciDeviceList *
 pciDeviceListNew(void)
@@ -1548,6 +1797,136 @@ pciDeviceListFind(pciDeviceList *list, pciDevice *dev)
 }
 
 
+/* Devices sharing a bus, handled one after another by one thread */
+struct pciBusWorker {
+    unsigned domain;
+    unsigned bus;
+    pciDevice **devs;
+    size_t ndevs;
+
+    const pciDeviceListActor *actors;
+    size_t nactors;
+    void *opaque;
+
+    virThread thread;
+    bool running;
+    int ret;
+    virErrorPtr err;
+};
+
+static void
+pciBusWorkerRun(void *opaque)
+{
+    struct pciBusWorker *worker = opaque;
+    size_t i, j;
+
+    for (i = 0; i < worker->nactors; i++) {
+        for (j = 0; j < worker->ndevs; j++) {
+            if ((worker->actors[i])(worker->devs[j], worker->opaque) < 0) {
+                worker->ret = -1;
+                worker->err = virSaveLastError();
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Passes each device in @list through the @nactors stages in @actors.
+ * Devices on different buses are handled concurrently, one thread per
+ * bus, since resetting one of them cannot disturb the others.  Devices
+ * sharing a bus are handled one after another, in the order of @list,
+ * and all of them complete a stage before any enters the next one.  On
+ * each bus, the first failure stops processing further devices.
+ *
+ * Returns 0 on success, -1 if an actor failed for any device, in which
+ * case the error it reported first is kept.
+ */
+int
+pciDeviceListForEachBus(pciDeviceList *list,
+                        const pciDeviceListActor *actors,
+                        size_t nactors,
+                        void *opaque)
+{
+    struct pciBusWorker *workers = NULL;
+    size_t nworkers = 0;
+    size_t i, j;
+    int ret = 0;
+
+    for (i = 0; i < list->count; i++) {
+        pciDevice *dev = list->devs[i];
+
+        for (j = 0; j < nworkers; j++) {
+            if (workers[j].domain == dev->domain && workers[j].bus == dev->bus)
+                break;
+        }
+
+        if (j == nworkers) {
+            if (VIR_EXPAND_N(workers, nworkers, 1) < 0) {
+                virReportOOMError();
+                ret = -1;
+                goto cleanup;
+            }
+            workers[j].domain = dev->domain;
+            workers[j].bus = dev->bus;
+            workers[j].actors = actors;
+            workers[j].nactors = nactors;
+            workers[j].opaque = opaque;
+        }
+
+        if (VIR_EXPAND_N(workers[j].devs, workers[j].ndevs, 1) < 0) {
+            virReportOOMError();
+            ret = -1;
+            goto cleanup;
+        }
+        workers[j].devs[workers[j].ndevs - 1] = dev;
+    }
+
+    if (nworkers == 1) {
+        /* Nothing to run concurrently */
+        pciBusWorkerRun(&workers[0]);
+        if (workers[0].ret < 0) {
+            if (workers[0].err)
+                virSetError(workers[0].err);
+            ret = -1;
+        }
+        goto cleanup;
+    }
+
+    VIR_DEBUG("Processing %u PCI devices on %zu buses",
+              list->count, nworkers);
+
+    for (i = 0; i < nworkers; i++) {
+        if (virThreadCreate(&workers[i].thread, true,
+                            pciBusWorkerRun, &workers[i]) == 0)
+            workers[i].running = true;
+        else
+            pciBusWorkerRun(&workers[i]);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].running)
+            virThreadJoin(&workers[i].thread);
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].ret < 0) {
+            if (ret == 0 && workers[i].err)
+                virSetError(workers[i].err);
+            ret = -1;
+        }
+    }
+
+cleanup:
+    for (i = 0; i < nworkers; i++) {
+        VIR_FREE(workers[i].devs);
+        virFreeError(workers[i].err);
+    }
+    VIR_FREE(workers);
+    return ret;
+}
+
+
 int pciDeviceFileIterate(pciDevice *dev,
                          pciDeviceFileActor actor,
                          void *opaque)
@@ -52,6 +52,7 @@ void      pciDeviceSetUsedBy(pciDevice     *dev,
                              const char *used_by);
 const char *pciDeviceGetUsedBy(pciDevice   *dev);
 void      pciDeviceReAttachInit(pciDevice   *dev);
+unsigned long long pciDeviceGetResetTime(pciDevice *dev);
 
 pciDeviceList *pciDeviceListNew  (void);
 void           pciDeviceListFree (pciDeviceList *list);
@@ -67,6 +68,20 @@ void           pciDeviceListDel  (pciDeviceList *list,
 pciDevice *    pciDeviceListFind (pciDeviceList *list,
                                   pciDevice *dev);
 
+/*
+ * Callback invoked by pciDeviceListForEachBus() for each device,
+ * once per stage.
+ *
+ * Should return 0 if successfully processed, or -1 to indicate
+ * error and skip the remaining devices and stages on the same bus.
+ */
+typedef int (*pciDeviceListActor)(pciDevice *dev, void *opaque);
+
+int            pciDeviceListForEachBus(pciDeviceList *list,
+                                       const pciDeviceListActor *actors,
+                                       size_t nactors,
+                                       void *opaque);
+
 /*
  * Callback that will be invoked once for each file
  * associated with / used for PCI host device access.
@@ -28,12 +28,21 @@
 #include "virfile.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#if HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
 
 #include "command.h"
 #include "configmake.h"
+#include "dirname.h"
 #include "memory.h"
+#include "logging.h"
 #include "virterror_internal.h"
 
 #define VIR_FROM_THIS VIR_FROM_NONE
@@ -253,6 +262,181 @@ virFileDirectFdFree(virFileDirectFdPtr dfd)
 }
 
 
+/* How often to look again when changes cannot be watched for, in ms */
+#define VIR_FILE_WATCH_POLL 100
+
+struct _virFileWatch {
+    int inotify;    /* Watches for file changes, or -1 */
+    int pidfd;      /* Becomes readable when the process exits, or -1 */
+    bool polling;   /* Some change cannot be watched for */
+};
+
+/**
+ * virFileWatchNew:
+ * @pid: process creating or writing the files, or 0
+ *
+ * Creates an object for waiting until files are created or written
+ * by another process.  When @pid is given the wait also ends as soon
+ * as that process exits, where the kernel can tell us.
+ *
+ * Returns the new object to be freed with virFileWatchFree(), or NULL
+ * on failure, with an error reported.
+ */
+virFileWatchPtr
+virFileWatchNew(pid_t pid)
+{
+    virFileWatchPtr watch;
+
+    if (VIR_ALLOC(watch) < 0) {
+        virReportOOMError();
+        return NULL;
+    }
+
+    watch->pidfd = -1;
+#if HAVE_SYS_INOTIFY_H
+    if ((watch->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        char ebuf[1024];
+        VIR_DEBUG("Unable to initialize inotify: %s",
+                  virStrerror(errno, ebuf, sizeof ebuf));
+        watch->polling = true;
+    }
+#else
+    watch->inotify = -1;
+    watch->polling = true;
+#endif
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    if (pid > 0 &&
+        (watch->pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0)
+        VIR_DEBUG("Unable to watch process %lld for exit", (long long) pid);
+#else
+    (void) pid;
+#endif
+
+    return watch;
+}
+
+/**
+ * virFileWatchAddPath:
+ * @watch: watch object
+ * @path: file to watch
+ * @create: whether to wait for @path being created rather than written
+ *
+ * Starts watching @path.  Changes which happened before this call are
+ * not noticed, so the caller should look at the file only afterwards.
+ * Where the change cannot be watched for, virFileWatchWait() falls back
+ * to returning periodically.
+ *
+ * Returns 0 on success, -1 on failure with an error reported.
+ */
+int
+virFileWatchAddPath(virFileWatchPtr watch,
+                    const char *path,
+                    bool create)
+{
+#if HAVE_SYS_INOTIFY_H
+    char *dir = NULL;
+    int wd;
+
+    if (watch->inotify < 0)
+        return 0;
+
+    if (create) {
+        if (!(dir = mdir_name(path))) {
+            virReportOOMError();
+            return -1;
+        }
+        wd = inotify_add_watch(watch->inotify, dir, IN_CREATE | IN_MOVED_TO);
+    } else {
+        wd = inotify_add_watch(watch->inotify, path,
+                               IN_MODIFY | IN_CLOSE_WRITE);
+    }
+
+    if (wd < 0) {
+        char ebuf[1024];
+        VIR_DEBUG("Unable to watch %s: %s",
+                  dir ? dir : path, virStrerror(errno, ebuf, sizeof ebuf));
+        watch->polling = true;
+    }
+
+    VIR_FREE(dir);
+#else
+    (void) watch;
+    (void) path;
+    (void) create;
+#endif
+    return 0;
+}
+
+/**
+ * virFileWatchWait:
+ * @watch: watch object
+ * @timeout: longest time to wait, in ms, or -1 to wait forever
+ *
+ * Waits until any of the watched files changes, the watched process
+ * exits or @timeout expires, whichever comes first.  May also return
+ * early when changes cannot be watched for, so callers must check the
+ * state of things they are waiting for each time this returns.
+ *
+ * Returns 1 if something happened, 0 on timeout, -1 on error.
+ */
+int
+virFileWatchWait(virFileWatchPtr watch, int timeout)
+{
+    struct pollfd fds[2];
+    int nfds = 0;
+    int ret;
+
+    if (watch->polling &&
+        (timeout < 0 || timeout > VIR_FILE_WATCH_POLL))
+        timeout = VIR_FILE_WATCH_POLL;
+
+    if (watch->inotify >= 0) {
+        fds[nfds].fd = watch->inotify;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+    if (watch->pidfd >= 0) {
+        fds[nfds].fd = watch->pidfd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+    }
+
+    while ((ret = poll(fds, nfds, timeout)) < 0 && errno == EINTR)
+        ;
+    if (ret < 0) {
+        virReportSystemError(errno, "%s",
+                             _("failed to wait for file changes"));
+        return -1;
+    }
+
+    if (watch->inotify >= 0 && (fds[0].revents & POLLIN)) {
+        char buf[4096];
+
+        /* Only the fact that something happened is interesting */
+        while (read(watch->inotify, buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    return ret > 0;
+}
+
+/**
+ * virFileWatchFree:
+ * @watch: watch object, or NULL
+ */
+void
+virFileWatchFree(virFileWatchPtr watch)
+{
+    if (!watch)
+        return;
+
+    VIR_FORCE_CLOSE(watch->inotify);
+    VIR_FORCE_CLOSE(watch->pidfd);
+    VIR_FREE(watch);
+}
+
+
 #ifndef WIN32
 /**
  * virFileLock:
@@ -65,6 +65,22 @@ int virFileDirectFdClose(virFileDirectFdPtr dfd);
 
 void virFileDirectFdFree(virFileDirectFdPtr dfd);
 
+/* Opaque type for waiting on files written by another process.  */
+struct _virFileWatch;
+
+typedef struct _virFileWatch virFileWatch;
+typedef virFileWatch *virFileWatchPtr;
+
+virFileWatchPtr virFileWatchNew(pid_t pid) ATTRIBUTE_RETURN_CHECK;
+
+int virFileWatchAddPath(virFileWatchPtr watch, const char *path, bool create)
+    ATTRIBUTE_NONNULL(1) ATTRIBUTE_NONNULL(2) ATTRIBUTE_RETURN_CHECK;
+
+int virFileWatchWait(virFileWatchPtr watch, int timeout)
+    ATTRIBUTE_NONNULL(1);
+
+void virFileWatchFree(virFileWatchPtr watch);
+
 int virFileLock(int fd, bool shared, off_t start, off_t len);
 int virFileUnlock(int fd, off_t start, off_t len);
 
@@ -0,0 +1,275 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "testutils.h"
+#include "dnsmasq.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+
+static char statedir[] = "/tmp/dnsmasqtest-XXXXXX";
+
+
+static int
+testAddHost(dnsmasqContext *ctx,
+            const char *mac,
+            const char *ip,
+            const char *name)
+{
+    virSocketAddr addr;
+
+    if (virSocketParseAddr(ip, &addr, AF_INET) < 0)
+        return -1;
+
+    if (mac)
+        return dnsmasqAddDhcpHost(ctx, mac, &addr, name);
+    return dnsmasqAddHost(ctx, &addr, name);
+}
+
+
+/* Check the hosts file holds exactly the @nlines of @lines, in any order */
+static int
+testCheckFile(const char *path,
+              const char **lines,
+              size_t nlines)
+{
+    char *content = NULL;
+    char *cur, *eol;
+    size_t nfound = 0;
+    size_t i;
+    int ret = -1;
+
+    if (virFileReadAll(path, 1024 * 1024, &content) < 0) {
+        if (nlines == 0 && !virFileExists(path))
+            return 0;
+        testError("Cannot read %s\n", path);
+        return -1;
+    }
+
+    for (cur = content; *cur; cur = eol) {
+        if (!(eol = strchr(cur, '\n'))) {
+            testError("Missing newline at the end of %s\n", path);
+            goto cleanup;
+        }
+        *eol++ = '\0';
+
+        for (i = 0; i < nlines; i++) {
+            if (STREQ(cur, lines[i]))
+                break;
+        }
+        if (i == nlines) {
+            testError("Unexpected line '%s' in %s\n", cur, path);
+            goto cleanup;
+        }
+        nfound++;
+    }
+
+    if (nfound != nlines) {
+        testError("Expected %zu lines in %s, found %zu\n",
+                  nlines, path, nfound);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(content);
+    return ret;
+}
+
+
+static int
+testSave(dnsmasqContext *ctx, int expect)
+{
+    int rc = dnsmasqSave(ctx);
+
+    if (rc != expect) {
+        testError("Expected save to return %d, got %d\n", expect, rc);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+testDhcpHosts(const void *data ATTRIBUTE_UNUSED)
+{
+    dnsmasqContext *ctx = NULL;
+    struct stat sb;
+    ino_t ino;
+    int ret = -1;
+    const char *first[] = {
+        "52:54:00:00:00:01,10.0.0.1,one",
+        "52:54:00:00:00:02,10.0.0.2,two",
+    };
+    const char *appended[] = {
+        "52:54:00:00:00:01,10.0.0.1,one",
+        "52:54:00:00:00:02,10.0.0.2,two",
+        "52:54:00:00:00:03,10.0.0.3",
+    };
+    const char *replaced[] = {
+        "52:54:00:00:00:01,10.0.0.1,one",
+        "52:54:00:00:00:02,10.0.0.20,two",
+    };
+
+    if (!(ctx = dnsmasqContextNew("dhcp", statedir)))
+        goto cleanup;
+
+    /* Initial write */
+    if (testAddHost(ctx, "52:54:00:00:00:01", "10.0.0.1", "one") < 0 ||
+        testAddHost(ctx, "52:54:00:00:00:02", "10.0.0.2", "two") < 0 ||
+        testSave(ctx, 1) < 0 ||
+        testCheckFile(ctx->hostsfile->path, first, ARRAY_CARDINALITY(first)) < 0)
+        goto cleanup;
+
+    /* Nothing changed, so nothing is written */
+    if (stat(ctx->hostsfile->path, &sb) < 0)
+        goto cleanup;
+    ino = sb.st_ino;
+    if (testSave(ctx, 0) < 0)
+        goto cleanup;
+
+    /* A new host is appended in place */
+    if (testAddHost(ctx, "52:54:00:00:00:03", "10.0.0.3", NULL) < 0 ||
+        testSave(ctx, 1) < 0 ||
+        testCheckFile(ctx->hostsfile->path, appended, ARRAY_CARDINALITY(appended)) < 0)
+        goto cleanup;
+    if (stat(ctx->hostsfile->path, &sb) < 0)
+        goto cleanup;
+    if (sb.st_ino != ino) {
+        testError("Hosts file was replaced rather than appended to\n");
+        goto cleanup;
+    }
+
+    /* Changing a MAC's address replaces its entry, and a host missing
+     * from the rebuilt list requires the file to be rewritten */
+    dnsmasqContextFree(ctx);
+    if (!(ctx = dnsmasqContextNew("dhcp", statedir)) ||
+        testAddHost(ctx, "52:54:00:00:00:01", "10.0.0.1", "one") < 0 ||
+        testAddHost(ctx, "52:54:00:00:00:02", "10.0.0.2", "two") < 0 ||
+        testAddHost(ctx, "52:54:00:00:00:02", "10.0.0.20", "two") < 0 ||
+        testSave(ctx, 1) < 0 ||
+        testCheckFile(ctx->hostsfile->path, replaced, ARRAY_CARDINALITY(replaced)) < 0)
+        goto cleanup;
+
+    /* A fresh context with the same hosts finds nothing to do */
+    dnsmasqContextFree(ctx);
+    if (!(ctx = dnsmasqContextNew("dhcp", statedir)) ||
+        testAddHost(ctx, "52:54:00:00:00:02", "10.0.0.20", "two") < 0 ||
+        testAddHost(ctx, "52:54:00:00:00:01", "10.0.0.1", "one") < 0 ||
+        testSave(ctx, 0) < 0)
+        goto cleanup;
+
+    /* No hosts at all leaves an empty file for dnsmasq to re-read */
+    dnsmasqContextFree(ctx);
+    if (!(ctx = dnsmasqContextNew("dhcp", statedir)) ||
+        testSave(ctx, 1) < 0)
+        goto cleanup;
+    if (!virFileExists(ctx->hostsfile->path)) {
+        testError("Empty hosts file was removed\n");
+        goto cleanup;
+    }
+    if (testCheckFile(ctx->hostsfile->path, NULL, 0) < 0 ||
+        testSave(ctx, 0) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (ctx)
+        dnsmasqDelete(ctx);
+    dnsmasqContextFree(ctx);
+    return ret;
+}
+
+
+static int
+testAddnHosts(const void *data ATTRIBUTE_UNUSED)
+{
+    dnsmasqContext *ctx = NULL;
+    int ret = -1;
+    const char *first[] = {
+        "10.0.0.1\tone\tuno\t",
+    };
+    const char *appended[] = {
+        "10.0.0.1\tone\tuno\t",
+        "10.0.0.2\ttwo\t",
+    };
+    const char *removed[] = {
+        "10.0.0.1\tuno\t",
+        "10.0.0.2\ttwo\t",
+    };
+
+    if (!(ctx = dnsmasqContextNew("addn", statedir)))
+        goto cleanup;
+
+    /* Duplicate names are only listed once */
+    if (testAddHost(ctx, NULL, "10.0.0.1", "one") < 0 ||
+        testAddHost(ctx, NULL, "10.0.0.1", "uno") < 0 ||
+        testAddHost(ctx, NULL, "10.0.0.1", "one") < 0 ||
+        testSave(ctx, 1) < 0 ||
+        testCheckFile(ctx->addnhostsfile->path, first, ARRAY_CARDINALITY(first)) < 0)
+        goto cleanup;
+
+    if (testAddHost(ctx, NULL, "10.0.0.2", "two") < 0 ||
+        testSave(ctx, 1) < 0 ||
+        testCheckFile(ctx->addnhostsfile->path, appended, ARRAY_CARDINALITY(appended)) < 0)
+        goto cleanup;
+
+    if (testAddHost(ctx, NULL, "10.0.0.1", "uno") < 0 ||
+        testSave(ctx, 0) < 0)
+        goto cleanup;
+
+    /* A name missing from the rebuilt list goes away */
+    dnsmasqContextFree(ctx);
+    if (!(ctx = dnsmasqContextNew("addn", statedir)) ||
+        testAddHost(ctx, NULL, "10.0.0.1", "uno") < 0 ||
+        testAddHost(ctx, NULL, "10.0.0.2", "two") < 0 ||
+        testSave(ctx, 1) < 0 ||
+        testCheckFile(ctx->addnhostsfile->path, removed, ARRAY_CARDINALITY(removed)) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (ctx)
+        dnsmasqDelete(ctx);
+    dnsmasqContextFree(ctx);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (!mkdtemp(statedir)) {
+        fprintf(stderr, "Cannot create state directory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (virtTestRun("DHCP hosts", 1, testDhcpHosts, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Additional hosts", 1, testAddnHosts, NULL) < 0)
+        ret = -1;
+
+    rmdir(statedir);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,282 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "domain_conf.h"
+#include "memory.h"
+#include "util.h"
+
+#define NSNAPSHOTS 5000
+
+/* Snapshot i of a chain has snapshot i - 1 as parent, in a wide tree
+ * all snapshots but the first are children of the first one */
+static int
+testAddSnapshot(virDomainSnapshotObjListPtr snapshots, int i, int parent)
+{
+    virDomainSnapshotDefPtr def;
+
+    if (VIR_ALLOC(def) < 0 ||
+        virAsprintf(&def->name, "snap%d", i) < 0 ||
+        (parent >= 0 && virAsprintf(&def->parent, "snap%d", parent) < 0) ||
+        !virDomainSnapshotAssignDef(snapshots, def)) {
+        virDomainSnapshotDefFree(def);
+        return -1;
+    }
+
+    return 0;
+}
+
+static virDomainSnapshotObjPtr
+testFindSnapshot(virDomainSnapshotObjListPtr snapshots, int i)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "snap%d", i);
+    return virDomainSnapshotFindByName(snapshots, name);
+}
+
+static void
+testCount(void *payload ATTRIBUTE_UNUSED,
+          const void *name ATTRIBUTE_UNUSED,
+          void *data)
+{
+    int *count = data;
+
+    (*count)++;
+}
+
+struct testRemoveData {
+    virDomainSnapshotObjListPtr snapshots;
+    bool early;
+};
+
+/* Removes snapshots like deleting them with their children does */
+static void
+testRemove(void *payload,
+           const void *name ATTRIBUTE_UNUSED,
+           void *data)
+{
+    virDomainSnapshotObjPtr snap = payload;
+    struct testRemoveData *rem = data;
+
+    if (snap->nchildren != 0)
+        rem->early = true;
+    virDomainSnapshotObjListRemove(rem->snapshots, snap);
+}
+
+/* Moves children to the parent of the snapshot being deleted */
+static void
+testReparent(void *payload,
+             const void *name ATTRIBUTE_UNUSED,
+             void *data)
+{
+    virDomainSnapshotObjPtr snap = payload;
+    virDomainSnapshotObjPtr parent = data;
+
+    VIR_FREE(snap->def->parent);
+    if (parent && !(snap->def->parent = strdup(parent->def->name)))
+        return;
+    virDomainSnapshotSetParent(snap, parent);
+}
+
+/*
+ * Loads a chain of snapshots in the order readdir might return them,
+ * deletes one in the middle and then everything below another one.
+ */
+static int
+testChain(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainSnapshotObjList snapshots;
+    virDomainSnapshotObjPtr snap;
+    struct testRemoveData rem = { &snapshots, false };
+    int count;
+    int ret = -1;
+    int i;
+
+    if (virDomainSnapshotObjListInit(&snapshots) < 0)
+        return -1;
+
+    for (i = NSNAPSHOTS - 1; i >= 0; i--) {
+        if (testAddSnapshot(&snapshots, i, i - 1) < 0)
+            goto cleanup;
+    }
+    if (virDomainSnapshotUpdateRelations(&snapshots) < 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "chain is inconsistent\n");
+        goto cleanup;
+    }
+
+    count = 0;
+    snap = testFindSnapshot(&snapshots, 0);
+    if (!snap || snap->parent ||
+        virDomainSnapshotForEachDescendant(snap, testCount,
+                                           &count) != NSNAPSHOTS - 1 ||
+        count != NSNAPSHOTS - 1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "wrong number of descendants of root\n");
+        goto cleanup;
+    }
+
+    /* Delete snap1000, keeping its children */
+    snap = testFindSnapshot(&snapshots, 1000);
+    if (!snap || virDomainSnapshotHasChildren(snap) != 1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "snap1000 not found\n");
+        goto cleanup;
+    }
+    virDomainSnapshotForEachChild(snap, testReparent, snap->parent);
+    virDomainSnapshotObjListRemove(&snapshots, snap);
+
+    snap = testFindSnapshot(&snapshots, 1001);
+    if (!snap || !snap->parent ||
+        snap->parent != testFindSnapshot(&snapshots, 999) ||
+        STRNEQ_NULLABLE(snap->def->parent, "snap999")) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "snap1001 not reparented\n");
+        goto cleanup;
+    }
+
+    /* Delete everything below snap100 */
+    snap = testFindSnapshot(&snapshots, 100);
+    if (virDomainSnapshotForEachDescendant(snap, testRemove,
+                                           &rem) != NSNAPSHOTS - 102 ||
+        rem.early) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "wrong number of descendants removed\n");
+        goto cleanup;
+    }
+    if (virDomainSnapshotObjListNum(&snapshots, 0) != 101 ||
+        virDomainSnapshotHasChildren(snap)) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "descendants left behind\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virHashFree(snapshots.objs);
+    return ret;
+}
+
+/*
+ * One snapshot with all others as its children, deleted with its
+ * children.
+ */
+static int
+testWide(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainSnapshotObjList snapshots;
+    virDomainSnapshotObjPtr snap;
+    struct testRemoveData rem = { &snapshots, false };
+    int count = 0;
+    int ret = -1;
+    int i;
+
+    if (virDomainSnapshotObjListInit(&snapshots) < 0)
+        return -1;
+
+    for (i = 0; i < NSNAPSHOTS; i++) {
+        if (testAddSnapshot(&snapshots, i, i ? 0 : -1) < 0)
+            goto cleanup;
+    }
+
+    snap = testFindSnapshot(&snapshots, 0);
+    if (!snap || virDomainSnapshotHasChildren(snap) != NSNAPSHOTS - 1 ||
+        virDomainSnapshotForEachChild(snap, testCount,
+                                      &count) != NSNAPSHOTS - 1 ||
+        count != NSNAPSHOTS - 1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "wrong number of children\n");
+        goto cleanup;
+    }
+
+    /* Remove a few in the middle of the list of children */
+    for (i = 1; i < NSNAPSHOTS; i += 100)
+        virDomainSnapshotObjListRemove(&snapshots,
+                                       testFindSnapshot(&snapshots, i));
+    if (virDomainSnapshotHasChildren(snap) !=
+        NSNAPSHOTS - 1 - NSNAPSHOTS / 100) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "children not removed\n");
+        goto cleanup;
+    }
+
+    virDomainSnapshotForEachDescendant(snap, testRemove, &rem);
+    if (virDomainSnapshotObjListNum(&snapshots, 0) != 1 ||
+        rem.early ||
+        virDomainSnapshotHasChildren(snap)) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "children left behind\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virHashFree(snapshots.objs);
+    return ret;
+}
+
+/* Broken metadata must not make walking the tree loop forever */
+static int
+testCycle(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainSnapshotObjList snapshots;
+    virDomainSnapshotObjPtr snap;
+    int count = 0;
+    int ret = -1;
+
+    if (virDomainSnapshotObjListInit(&snapshots) < 0)
+        return -1;
+
+    if (testAddSnapshot(&snapshots, 0, 2) < 0 ||
+        testAddSnapshot(&snapshots, 1, 0) < 0 ||
+        testAddSnapshot(&snapshots, 2, 1) < 0 ||
+        testAddSnapshot(&snapshots, 3, 2) < 0)
+        goto cleanup;
+
+    if (virDomainSnapshotUpdateRelations(&snapshots) == 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "cycle not detected\n");
+        goto cleanup;
+    }
+
+    snap = testFindSnapshot(&snapshots, 0);
+    while (snap->parent)
+        snap = snap->parent;
+    if (virDomainSnapshotForEachDescendant(snap, testCount, &count) != 3) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "cycle not broken\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virHashFree(snapshots.objs);
+    return ret;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virtTestRun("Snapshot chain of 5000", virTestGetLoops(),
+                    testChain, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Snapshot tree 5000 wide", virTestGetLoops(),
+                    testWide, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Snapshot cycle", 1, testCycle, NULL) < 0)
+        ret = -1;
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,370 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "testutils.h"
+#include "iptables.h"
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+
+static void
+testQuietError(void *userData ATTRIBUTE_UNUSED,
+               virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nothing */
+}
+
+
+/* Rules of some other tool and of a network not in the transaction */
+#define SAVED_OTHERS                                                    \
+    "# Generated by iptables-save v1.4.12\n"                            \
+    "*filter\n"                                                         \
+    ":INPUT ACCEPT [0:0]\n"                                             \
+    ":FORWARD ACCEPT [0:0]\n"                                           \
+    ":OUTPUT ACCEPT [0:0]\n"                                            \
+    "-A INPUT -i lo -j ACCEPT\n"                                        \
+    "-A INPUT -i virbr1 -p udp -m udp --dport 53 "                      \
+    "-m comment --comment libvirt-virbr1-0badc0de -j ACCEPT\n"
+
+#define SAVED_END                                                       \
+    "COMMIT\n"                                                          \
+    "# Completed\n"
+
+
+/* Open a transaction queueing the rules of a network on virbr0,
+ * with the DNS port given, next to an owner whose name is a prefix */
+static iptablesContext *
+testContext(int dnsport)
+{
+    iptablesContext *ctx;
+
+    if (!(ctx = iptablesContextNew()))
+        return NULL;
+
+    if (iptablesContextBegin(ctx, 0) < 0 ||
+        iptablesContextSetOwner(ctx, "virbr") < 0 ||
+        iptablesContextSetOwner(ctx, "virbr0") < 0 ||
+        iptablesAddUdpInput(ctx, AF_INET, "virbr0", dnsport) < 0 ||
+        iptablesAddUdpInput(ctx, AF_INET, "virbr0", 67) < 0 ||
+        iptablesAddForwardRejectOut(ctx, AF_INET, "virbr0") < 0) {
+        iptablesContextFree(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+
+/* Extract the owner tag of the first rule inserted by @input */
+static char *
+testGetTag(const char *input)
+{
+    const char *tag;
+
+    if (!input ||
+        !(tag = strstr(input, "--comment libvirt-virbr0-")))
+        return NULL;
+    tag += strlen("--comment ");
+
+    return strndup(tag, strlen("libvirt-virbr0-") + 8);
+}
+
+
+static int
+testCompare(const char *input, const char *expect)
+{
+    if (STREQ_NULLABLE(input, expect))
+        return 0;
+
+    if (virTestGetVerbose())
+        testError("\nExpected:\n%s\nGot:\n%s\n",
+                  NULLSTR(expect), NULLSTR(input));
+    return -1;
+}
+
+
+/*
+ * Commits the rules of virbr0 to a table without any, then once they
+ * are all there, in iptables-save's own format, finds nothing to do
+ * for them nor for any other table.
+ */
+static int
+testInstall(const void *data ATTRIBUTE_UNUSED)
+{
+    iptablesContext *ctx;
+    char *input = NULL;
+    char *tag = NULL;
+    char *expect = NULL;
+    char *saved = NULL;
+    int ret = -1;
+
+    if (!(ctx = testContext(53)))
+        return -1;
+
+    if (iptablesContextFormatRestore(ctx, AF_INET, "filter",
+                                     SAVED_OTHERS SAVED_END, &input) < 0 ||
+        !(tag = testGetTag(input)))
+        goto cleanup;
+
+    if (virAsprintf(&expect,
+                    "*filter\n"
+                    "--insert INPUT --match comment --comment %s "
+                    "--in-interface virbr0 --protocol udp "
+                    "--destination-port 53 --jump ACCEPT\n"
+                    "--insert INPUT --match comment --comment %s "
+                    "--in-interface virbr0 --protocol udp "
+                    "--destination-port 67 --jump ACCEPT\n"
+                    "--insert FORWARD --match comment --comment %s "
+                    "--in-interface virbr0 --jump REJECT\n"
+                    "COMMIT\n", tag, tag, tag) < 0 ||
+        testCompare(input, expect) < 0)
+        goto cleanup;
+    VIR_FREE(input);
+
+    /* Quoted and unquoted comments are both recognised */
+    if (virAsprintf(&saved,
+                    SAVED_OTHERS
+                    "-A INPUT -i virbr0 -p udp -m udp --dport 67 "
+                    "-m comment --comment \"%s\" -j ACCEPT\n"
+                    "-A INPUT -i virbr0 -p udp -m udp --dport 53 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-A FORWARD -i virbr0 -m comment --comment %s "
+                    "-j REJECT --reject-with icmp-port-unreachable\n"
+                    SAVED_END, tag, tag, tag) < 0)
+        goto cleanup;
+
+    if (iptablesContextFormatRestore(ctx, AF_INET, "filter",
+                                     saved, &input) < 0 ||
+        testCompare(input, NULL) < 0)
+        goto cleanup;
+
+    if (iptablesContextFormatRestore(ctx, AF_INET, "nat",
+                                     "*nat\n" SAVED_END, &input) < 0 ||
+        testCompare(input, NULL) < 0 ||
+        iptablesContextFormatRestore(ctx, AF_INET6, "filter",
+                                     SAVED_OTHERS SAVED_END, &input) < 0 ||
+        testCompare(input, NULL) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    iptablesContextFree(ctx);
+    VIR_FREE(input);
+    VIR_FREE(tag);
+    VIR_FREE(expect);
+    VIR_FREE(saved);
+    return ret;
+}
+
+
+/*
+ * Replaces the rules of virbr0 when its rule set changed or one of
+ * its rules went missing, and removes them when it has none queued.
+ * Rules of other owners and untagged rules are never touched.
+ */
+static int
+testReplace(const void *data ATTRIBUTE_UNUSED)
+{
+    iptablesContext *ctx = NULL;
+    char *input = NULL;
+    char *oldtag = NULL;
+    char *tag = NULL;
+    char *saved = NULL;
+    char *partial = NULL;
+    char *expect = NULL;
+    int ret = -1;
+
+    /* The installed rule set, as committed with DNS on port 53 */
+    if (!(ctx = testContext(53)) ||
+        iptablesContextFormatRestore(ctx, AF_INET, "filter",
+                                     SAVED_OTHERS SAVED_END, &input) < 0 ||
+        !(oldtag = testGetTag(input)))
+        goto cleanup;
+    iptablesContextFree(ctx);
+    ctx = NULL;
+    VIR_FREE(input);
+
+    if (virAsprintf(&saved,
+                    SAVED_OTHERS
+                    "-A INPUT -i virbr0 -p udp -m udp --dport 67 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-A INPUT -i virbr0 -p udp -m udp --dport 53 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-A FORWARD -i virbr0 -m comment --comment %s -j REJECT\n"
+                    SAVED_END, oldtag, oldtag, oldtag) < 0 ||
+        virAsprintf(&partial,
+                    SAVED_OTHERS
+                    "-A INPUT -i virbr0 -p udp -m udp --dport 53 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-A FORWARD -i virbr0 -m comment --comment %s -j REJECT\n"
+                    SAVED_END, oldtag, oldtag) < 0)
+        goto cleanup;
+
+    /* A changed rule set gets a new tag and replaces the old one */
+    if (!(ctx = testContext(5353)) ||
+        iptablesContextFormatRestore(ctx, AF_INET, "filter",
+                                     saved, &input) < 0 ||
+        !input ||
+        !(tag = testGetTag(strstr(input, "--insert"))))
+        goto cleanup;
+
+    if (STREQ(tag, oldtag)) {
+        if (virTestGetVerbose())
+            testError("\nChanged rule set kept tag %s\n", tag);
+        goto cleanup;
+    }
+
+    if (virAsprintf(&expect,
+                    "*filter\n"
+                    "-D INPUT -i virbr0 -p udp -m udp --dport 67 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-D INPUT -i virbr0 -p udp -m udp --dport 53 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-D FORWARD -i virbr0 -m comment --comment %s -j REJECT\n"
+                    "--insert INPUT --match comment --comment %s "
+                    "--in-interface virbr0 --protocol udp "
+                    "--destination-port 5353 --jump ACCEPT\n"
+                    "--insert INPUT --match comment --comment %s "
+                    "--in-interface virbr0 --protocol udp "
+                    "--destination-port 67 --jump ACCEPT\n"
+                    "--insert FORWARD --match comment --comment %s "
+                    "--in-interface virbr0 --jump REJECT\n"
+                    "COMMIT\n",
+                    oldtag, oldtag, oldtag, tag, tag, tag) < 0 ||
+        testCompare(input, expect) < 0)
+        goto cleanup;
+    iptablesContextFree(ctx);
+    ctx = NULL;
+    VIR_FREE(input);
+    VIR_FREE(expect);
+
+    /* A rule deleted behind our back brings back the whole set */
+    if (!(ctx = testContext(53)) ||
+        iptablesContextFormatRestore(ctx, AF_INET, "filter",
+                                     partial, &input) < 0 ||
+        !input ||
+        !strstr(input, "--destination-port 67") ||
+        !strstr(input, "-D FORWARD -i virbr0")) {
+        if (virTestGetVerbose())
+            testError("\nMissing rule not restored:\n%s\n", NULLSTR(input));
+        goto cleanup;
+    }
+    iptablesContextFree(ctx);
+    ctx = NULL;
+    VIR_FREE(input);
+
+    /* Rules queued and then removed again are not installed, and an
+     * owner without rules loses those it had */
+    if (!(ctx = iptablesContextNew()) ||
+        iptablesContextBegin(ctx, 0) < 0 ||
+        iptablesContextSetOwner(ctx, "virbr0") < 0 ||
+        iptablesAddTcpInput(ctx, AF_INET, "virbr0", 53) < 0 ||
+        iptablesRemoveTcpInput(ctx, AF_INET, "virbr0", 53) < 0 ||
+        iptablesContextFormatRestore(ctx, AF_INET, "filter",
+                                     saved, &input) < 0)
+        goto cleanup;
+
+    if (virAsprintf(&expect,
+                    "*filter\n"
+                    "-D INPUT -i virbr0 -p udp -m udp --dport 67 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-D INPUT -i virbr0 -p udp -m udp --dport 53 "
+                    "-m comment --comment %s -j ACCEPT\n"
+                    "-D FORWARD -i virbr0 -m comment --comment %s -j REJECT\n"
+                    "COMMIT\n",
+                    oldtag, oldtag, oldtag) < 0 ||
+        testCompare(input, expect) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    if (ctx)
+        iptablesContextFree(ctx);
+    VIR_FREE(input);
+    VIR_FREE(oldtag);
+    VIR_FREE(tag);
+    VIR_FREE(saved);
+    VIR_FREE(partial);
+    VIR_FREE(expect);
+    return ret;
+}
+
+
+/*
+ * An owner taken out of the transaction again, as done for a network
+ * whose rules could not all be queued, keeps the rules it has
+ */
+static int
+testDropOwner(const void *data ATTRIBUTE_UNUSED)
+{
+    iptablesContext *ctx;
+    char *input = NULL;
+    int ret = -1;
+
+    if (!(ctx = testContext(53)))
+        return -1;
+
+    if (iptablesContextSetOwner(ctx, "virbr1") < 0 ||
+        iptablesAddTcpInput(ctx, AF_INET, "virbr1", 53) < 0)
+        goto cleanup;
+    iptablesContextDropOwner(ctx);
+
+    if (iptablesContextFormatRestore(ctx, AF_INET, "filter",
+                                     SAVED_OTHERS SAVED_END, &input) < 0 ||
+        !input)
+        goto cleanup;
+
+    if (strstr(input, "virbr1")) {
+        if (virTestGetVerbose())
+            testError("\nRules of a dropped owner were touched:\n%s\n",
+                      input);
+        goto cleanup;
+    }
+
+    /* The owner selected before it still gets its rules */
+    if (!strstr(input, "--destination-port 67")) {
+        if (virTestGetVerbose())
+            testError("\nRules of virbr0 missing:\n%s\n", input);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    iptablesContextFree(ctx);
+    VIR_FREE(input);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    virSetErrorFunc(NULL, testQuietError);
+
+    if (virtTestRun("iptables install", 1, testInstall, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("iptables replace", 1, testReplace, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("iptables drop owner", 1, testDropOwner, NULL) < 0)
+        ret = -1;
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,498 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "testutils.h"
+#include "locking/lock_driver.h"
+#include "locking/lock_driver_nop.h"
+
+/* The plugin's driver table, linked in directly */
+extern virLockDriver virLockDriverImpl;
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+
+static char leasedir[] = "/tmp/lockdriverfcntltest-XXXXXX";
+static char *conf;
+
+static void
+testQuietError(void *userData ATTRIBUTE_UNUSED,
+               virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nothing */
+}
+
+
+static int
+testRemoveLeaseDir(void)
+{
+    DIR *dir;
+    struct dirent *ent;
+    char *path;
+    int ret = 0;
+
+    if (!(dir = opendir(leasedir)))
+        return -1;
+
+    while ((ent = readdir(dir))) {
+        if (STREQ(ent->d_name, ".") || STREQ(ent->d_name, ".."))
+            continue;
+        if (virAsprintf(&path, "%s/%s", leasedir, ent->d_name) < 0) {
+            ret = -1;
+            break;
+        }
+        if (unlink(path) < 0)
+            ret = -1;
+        VIR_FREE(path);
+    }
+    closedir(dir);
+
+    if (rmdir(leasedir) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+
+/*
+ * Set up @man for a guest called @name, running as @pid, using
+ * @ndisks of @disks, which are shared if @shared is true
+ */
+static int
+testLockNew(virLockManagerPtr man,
+            virLockDriverPtr drv,
+            const char *name,
+            pid_t pid,
+            const char **disks,
+            size_t ndisks,
+            bool shared)
+{
+    virLockManagerParam params[] = {
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UUID,
+          .key = "uuid",
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_STRING,
+          .key = "name",
+          .value = { .str = (char *)name },
+        },
+        { .type = VIR_LOCK_MANAGER_PARAM_TYPE_UINT,
+          .key = "pid",
+          .value = { .ui = pid },
+        },
+    };
+    size_t i;
+
+    strncpy((char *)params[0].value.uuid, name, VIR_UUID_BUFLEN);
+
+    man->driver = drv;
+    man->privateData = NULL;
+
+    if (drv->drvNew(man, VIR_LOCK_MANAGER_OBJECT_TYPE_DOMAIN,
+                    ARRAY_CARDINALITY(params), params, 0) < 0)
+        return -1;
+
+    for (i = 0 ; i < ndisks ; i++) {
+        if (drv->drvAddResource(man, VIR_LOCK_MANAGER_RESOURCE_TYPE_DISK,
+                                disks[i], 0, NULL,
+                                shared ? VIR_LOCK_MANAGER_RESOURCE_SHARED : 0) < 0) {
+            drv->drvFree(man);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static const char *disks[] = {
+    "/var/lib/libvirt/images/a.img",
+    "/var/lib/libvirt/images/b.img",
+    "/var/lib/libvirt/images/c.img",
+    "/var/lib/libvirt/images/d.img",
+    "/var/lib/libvirt/images/e.img",
+    "/var/lib/libvirt/images/f.img",
+    "/var/lib/libvirt/images/g.img",
+    "/var/lib/libvirt/images/h.img",
+};
+
+
+static int
+testConflict(const void *data ATTRIBUTE_UNUSED)
+{
+    virLockDriverPtr drv = &virLockDriverImpl;
+    virLockManager a, b, c;
+    char *state = NULL;
+    int ret = -1;
+
+    /* Any live process will do, as long as it is not us */
+    if (testLockNew(&a, drv, "guest-a", getppid(), disks, 2, false) < 0)
+        return -1;
+    if (testLockNew(&b, drv, "guest-b", getppid(), disks + 1, 2, false) < 0)
+        goto cleanup_a;
+    if (testLockNew(&c, drv, "guest-c", getppid(), disks + 2, 1, false) < 0)
+        goto cleanup_b;
+
+    if (drv->drvAcquire(&a, NULL, 0, NULL) < 0) {
+        if (virTestGetVerbose())
+            testError("\nfailed to acquire leases of guest-a\n");
+        goto cleanup;
+    }
+
+    /* b.img is taken, so guest-b must get none of its disks */
+    if (drv->drvAcquire(&b, NULL, 0, NULL) == 0) {
+        if (virTestGetVerbose())
+            testError("\nguest-b acquired a lease held by guest-a\n");
+        goto cleanup;
+    }
+    if (drv->drvAcquire(&c, NULL, 0, NULL) < 0) {
+        if (virTestGetVerbose())
+            testError("\nfailed rollback kept c.img locked\n");
+        goto cleanup;
+    }
+    if (drv->drvRelease(&c, NULL, 0) < 0)
+        goto cleanup;
+
+    /* Pausing guest-a gives its leases away, resuming takes them back */
+    if (drv->drvRelease(&a, &state, 0) < 0 ||
+        drv->drvAcquire(&b, NULL, 0, NULL) < 0) {
+        if (virTestGetVerbose())
+            testError("\nleases of paused guest-a were not released\n");
+        goto cleanup;
+    }
+    if (drv->drvAcquire(&a, state, 0, NULL) == 0) {
+        if (virTestGetVerbose())
+            testError("\nguest-a resumed while guest-b holds b.img\n");
+        goto cleanup;
+    }
+    if (drv->drvRelease(&b, NULL, 0) < 0 ||
+        drv->drvAcquire(&a, state, 0, NULL) < 0) {
+        if (virTestGetVerbose())
+            testError("\nfailed to resume guest-a\n");
+        goto cleanup;
+    }
+
+    if (drv->drvRelease(&a, NULL, 0) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(state);
+    drv->drvFree(&c);
+cleanup_b:
+    drv->drvFree(&b);
+cleanup_a:
+    drv->drvFree(&a);
+    return ret;
+}
+
+
+static int
+testShared(const void *data ATTRIBUTE_UNUSED)
+{
+    virLockDriverPtr drv = &virLockDriverImpl;
+    virLockManager a, b, c;
+    int ret = -1;
+
+    if (testLockNew(&a, drv, "guest-a", getppid(), disks, 1, true) < 0)
+        return -1;
+    if (testLockNew(&b, drv, "guest-b", getppid(), disks, 1, true) < 0)
+        goto cleanup_a;
+    if (testLockNew(&c, drv, "guest-c", getppid(), disks, 1, false) < 0)
+        goto cleanup_b;
+
+    if (drv->drvAcquire(&a, NULL, 0, NULL) < 0 ||
+        drv->drvAcquire(&b, NULL, 0, NULL) < 0)
+        goto cleanup;
+
+    if (drv->drvAcquire(&c, NULL, 0, NULL) == 0)
+        goto cleanup;
+
+    if (drv->drvRelease(&a, NULL, 0) < 0 ||
+        drv->drvRelease(&b, NULL, 0) < 0 ||
+        drv->drvAcquire(&c, NULL, 0, NULL) < 0 ||
+        drv->drvRelease(&c, NULL, 0) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    drv->drvFree(&c);
+cleanup_b:
+    drv->drvFree(&b);
+cleanup_a:
+    drv->drvFree(&a);
+    return ret;
+}
+
+
+/*
+ * A forked process stands in for another host: it has its own set
+ * of fcntl() locks, so only the kernel can tell it about ours
+ */
+static int
+testOtherProcess(const void *data ATTRIBUTE_UNUSED)
+{
+    virLockDriverPtr drv = &virLockDriverImpl;
+    virLockManager a;
+    pid_t child;
+    int status;
+    int ret = -1;
+
+    if (testLockNew(&a, drv, "guest-a", getppid(), disks, 1, false) < 0)
+        return -1;
+
+    if (drv->drvAcquire(&a, NULL, 0, NULL) < 0)
+        goto cleanup;
+
+    if ((child = fork()) < 0)
+        goto cleanup;
+
+    if (child == 0) {
+        virLockManager b;
+
+        if (testLockNew(&b, drv, "guest-b", getpid(), disks, 1, false) < 0)
+            _exit(EXIT_FAILURE);
+        /* Must fail, the lease is held by our parent */
+        _exit(drv->drvAcquire(&b, NULL, 0, NULL) < 0 ?
+              EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (waitpid(child, &status, 0) != child ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        if (virTestGetVerbose())
+            testError("\nanother process acquired a held lease\n");
+        goto cleanup;
+    }
+
+    if (drv->drvRelease(&a, NULL, 0) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    drv->drvFree(&a);
+    return ret;
+}
+
+
+/*
+ * The locks go away with the daemon holding them, so after a restart
+ * the leases of running guests are acquired again, as reconnecting
+ * to them does, and keep other hosts off their disks
+ */
+static int
+testRestart(const void *data ATTRIBUTE_UNUSED)
+{
+    virLockDriverPtr drv = &virLockDriverImpl;
+    virLockManager a;
+    pid_t child;
+    int status;
+    int ret = -1;
+
+    if (!(drv->flags & VIR_LOCK_MANAGER_HELD_BY_CALLER))
+        return -1;
+
+    if (testLockNew(&a, drv, "guest-a", getppid(), disks, 1, false) < 0)
+        return -1;
+    if (drv->drvAcquire(&a, NULL, 0, NULL) < 0) {
+        drv->drvFree(&a);
+        return -1;
+    }
+    drv->drvFree(&a);
+
+    if (drv->drvDeinit() < 0 ||
+        drv->drvInit(VIR_LOCK_MANAGER_VERSION, conf, 0) < 0)
+        return -1;
+
+    if (testLockNew(&a, drv, "guest-a", getppid(), disks, 1, false) < 0)
+        return -1;
+    if (drv->drvAcquire(&a, NULL, 0, NULL) < 0) {
+        if (virTestGetVerbose())
+            testError("\nfailed to reacquire leases after restart\n");
+        goto cleanup;
+    }
+
+    if ((child = fork()) < 0)
+        goto cleanup;
+
+    if (child == 0) {
+        virLockManager b;
+
+        if (testLockNew(&b, drv, "guest-b", getpid(), disks, 1, false) < 0)
+            _exit(EXIT_FAILURE);
+        _exit(drv->drvAcquire(&b, NULL, 0, NULL) < 0 ?
+              EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (waitpid(child, &status, 0) != child ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        if (virTestGetVerbose())
+            testError("\nanother process acquired a reacquired lease\n");
+        goto cleanup;
+    }
+
+    if (drv->drvRelease(&a, NULL, 0) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    drv->drvFree(&a);
+    return ret;
+}
+
+
+static int
+testStaleOwner(const void *data ATTRIBUTE_UNUSED)
+{
+    virLockDriverPtr drv = &virLockDriverImpl;
+    virLockManager a, b;
+    pid_t child;
+    int ret = -1;
+
+    /* A guest which went away without releasing its lease */
+    if ((child = fork()) < 0)
+        return -1;
+    if (child == 0)
+        _exit(EXIT_SUCCESS);
+    if (waitpid(child, NULL, 0) != child)
+        return -1;
+
+    if (testLockNew(&a, drv, "guest-a", child, disks, 1, false) < 0)
+        return -1;
+    if (testLockNew(&b, drv, "guest-b", getppid(), disks, 1, false) < 0)
+        goto cleanup_a;
+
+    if (drv->drvAcquire(&a, NULL, 0, NULL) < 0)
+        goto cleanup;
+
+    if (drv->drvAcquire(&b, NULL, 0, NULL) < 0) {
+        if (virTestGetVerbose())
+            testError("\nlease of stopped guest-a was not reclaimed\n");
+        goto cleanup;
+    }
+
+    if (drv->drvRelease(&b, NULL, 0) < 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    drv->drvFree(&b);
+cleanup_a:
+    drv->drvFree(&a);
+    return ret;
+}
+
+
+#define TEST_LOCK_ITERATIONS 1000
+
+/*
+ * Lock latency of a guest with 8 disks across a start, pause and
+ * resume cycle, compared with the nop driver
+ */
+static int
+testBenchmark(const void *data)
+{
+    virLockDriverPtr drv = (virLockDriverPtr)data;
+    unsigned long long start, end;
+    virLockManager man;
+    char *state = NULL;
+    int i;
+
+    if (virTimeMs(&start) < 0)
+        return -1;
+
+    for (i = 0 ; i < TEST_LOCK_ITERATIONS ; i++) {
+        if (testLockNew(&man, drv, "guest-bench", getppid(),
+                        disks, ARRAY_CARDINALITY(disks), false) < 0)
+            return -1;
+
+        if (drv->drvAcquire(&man, NULL, 0, NULL) < 0 ||
+            drv->drvRelease(&man, &state, 0) < 0 ||
+            drv->drvAcquire(&man, state, 0, NULL) < 0 ||
+            drv->drvRelease(&man, NULL, 0) < 0) {
+            VIR_FREE(state);
+            drv->drvFree(&man);
+            return -1;
+        }
+
+        VIR_FREE(state);
+        drv->drvFree(&man);
+    }
+
+    if (virTimeMs(&end) < 0)
+        return -1;
+
+    if (virTestGetVerbose())
+        fprintf(stderr, "\n%d cycles of %zu disks in %llu ms\n%74s",
+                TEST_LOCK_ITERATIONS, ARRAY_CARDINALITY(disks),
+                end - start, "... ");
+
+    return 0;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+    FILE *fp;
+
+    virSetErrorFunc(NULL, testQuietError);
+
+    /* Anything will do, tmpfs included, as long as it has fcntl() locks */
+    if (!mkdtemp(leasedir) ||
+        virAsprintf(&conf, "%s/fcntl.conf", leasedir) < 0 ||
+        !(fp = fopen(conf, "w"))) {
+        fprintf(stderr, "Cannot create lease directory\n");
+        return EXIT_FAILURE;
+    }
+    fprintf(fp, "disk_lease_dir = \"%s\"\n", leasedir);
+    if (fclose(fp) != 0 ||
+        virLockDriverImpl.drvInit(VIR_LOCK_MANAGER_VERSION, conf, 0) < 0 ||
+        virLockDriverNop.drvInit(VIR_LOCK_MANAGER_VERSION, NULL, 0) < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    if (virtTestRun("fcntl conflict", 1, testConflict, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("fcntl shared", 1, testShared, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("fcntl other process", 1, testOtherProcess, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("fcntl stale owner", 1, testStaleOwner, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("fcntl restart", 1, testRestart, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("nop benchmark", 1, testBenchmark, &virLockDriverNop) < 0)
+        ret = -1;
+    if (virtTestRun("fcntl benchmark", 1, testBenchmark, &virLockDriverImpl) < 0)
+        ret = -1;
+
+    virLockDriverImpl.drvDeinit();
+    virLockDriverNop.drvDeinit();
+
+cleanup:
+    if (testRemoveLeaseDir() < 0)
+        ret = -1;
+    VIR_FREE(conf);
+    return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,199 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "testutils.h"
+#include "node_device_conf.h"
+#include "memory.h"
+#include "util.h"
+
+/* Roughly a host with many SR-IOV capable NICs: 50 PFs with 99 VFs
+ * each, every one a PCI device with a net device below it */
+#define NPFS 50
+#define NVFS 99
+#define NDEVS (NPFS * (NVFS + 1) * 2)
+
+static int
+testDeviceNames(int i, char **name, char **path, char **parent)
+{
+    int pci = i / 2;
+    int bus = pci / (NVFS + 1) + 1;
+    int fn = pci % (NVFS + 1);
+
+    if (virAsprintf(path, "/sys/devices/pci0000:00/0000:%02x:%02x.%x",
+                    bus, fn / 8, fn % 8) < 0)
+        return -1;
+
+    if (i % 2 == 0) {
+        if (virAsprintf(name, "pci_0000_%02x_%02x_%x",
+                        bus, fn / 8, fn % 8) < 0 ||
+            !(*parent = strdup("computer")))
+            return -1;
+    } else {
+        char *pcipath = *path;
+        int ret;
+
+        ret = virAsprintf(path, "%s/net/eth%d", pcipath, pci);
+        VIR_FREE(pcipath);
+        if (ret < 0 ||
+            virAsprintf(name, "net_eth%d", pci) < 0 ||
+            virAsprintf(parent, "pci_0000_%02x_%02x_%x",
+                        bus, fn / 8, fn % 8) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static virNodeDeviceDefPtr
+testDeviceDef(int i)
+{
+    virNodeDeviceDefPtr def;
+
+    if (VIR_ALLOC(def) < 0 ||
+        testDeviceNames(i, &def->name, &def->sysfs_path, &def->parent) < 0) {
+        virNodeDeviceDefFree(def);
+        return NULL;
+    }
+
+    return def;
+}
+
+static int
+testLookup(virNodeDeviceObjListPtr devs, int i, bool present)
+{
+    char *name = NULL;
+    char *path = NULL;
+    char *parent = NULL;
+    virNodeDeviceObjPtr byName = NULL;
+    virNodeDeviceObjPtr byPath = NULL;
+    int ret = -1;
+
+    if (testDeviceNames(i, &name, &path, &parent) < 0)
+        goto cleanup;
+
+    if ((byName = virNodeDeviceFindByName(devs, name)))
+        virNodeDeviceObjUnlock(byName);
+    if ((byPath = virNodeDeviceFindBySysfsPath(devs, path)))
+        virNodeDeviceObjUnlock(byPath);
+
+    if (present) {
+        if (!byName || byName != byPath ||
+            STRNEQ(byName->def->name, name) ||
+            STRNEQ(byName->def->parent, parent)) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "device %s not found\n", name);
+            goto cleanup;
+        }
+    } else if (byName || byPath) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "removed device %s found\n", name);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(name);
+    VIR_FREE(path);
+    VIR_FREE(parent);
+    return ret;
+}
+
+/*
+ * Adds all devices as enumeration does at startup, looks up each of
+ * them as udev events do, moves some to a new sysfs path and removes
+ * every other one.
+ */
+static int
+testObjList(const void *data ATTRIBUTE_UNUSED)
+{
+    virNodeDeviceObjList devs;
+    virNodeDeviceDefPtr def = NULL;
+    virNodeDeviceObjPtr dev;
+    char *oldpath = NULL;
+    int ret = -1;
+    int i;
+
+    memset(&devs, 0, sizeof(devs));
+
+    for (i = 0; i < NDEVS; i++) {
+        if (!(def = testDeviceDef(i)) ||
+            !(dev = virNodeDeviceAssignDef(&devs, def)))
+            goto cleanup;
+        def = NULL;
+        virNodeDeviceObjUnlock(dev);
+    }
+
+    if (devs.count != NDEVS)
+        goto cleanup;
+
+    for (i = 0; i < NDEVS; i++) {
+        if (testLookup(&devs, i, true) < 0)
+            goto cleanup;
+    }
+
+    /* A change event replaces the definition, here with a new path */
+    if (!(def = testDeviceDef(1)))
+        goto cleanup;
+    oldpath = def->sysfs_path;
+    if (virAsprintf(&def->sysfs_path, "%s-renamed", oldpath) < 0 ||
+        !(dev = virNodeDeviceAssignDef(&devs, def)))
+        goto cleanup;
+    def = NULL;
+    virNodeDeviceObjUnlock(dev);
+    if (devs.count != NDEVS ||
+        virNodeDeviceFindBySysfsPath(&devs, oldpath) ||
+        !(dev = virNodeDeviceFindBySysfsPath(&devs, dev->def->sysfs_path)))
+        goto cleanup;
+    virNodeDeviceObjUnlock(dev);
+
+    for (i = 2; i < NDEVS; i += 2) {
+        char *name = NULL;
+        char *path = NULL;
+        char *parent = NULL;
+
+        if (testDeviceNames(i, &name, &path, &parent) < 0)
+            goto cleanup;
+        dev = virNodeDeviceFindBySysfsPath(&devs, path);
+        VIR_FREE(name);
+        VIR_FREE(path);
+        VIR_FREE(parent);
+        if (!dev)
+            goto cleanup;
+        virNodeDeviceObjRemove(&devs, dev);
+    }
+
+    if (devs.count != NDEVS / 2 + 1)
+        goto cleanup;
+
+    for (i = 2; i < NDEVS; i++) {
+        if (testLookup(&devs, i, i % 2 == 1) < 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(oldpath);
+    virNodeDeviceDefFree(def);
+    virNodeDeviceObjListFree(&devs);
+    return ret;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virtTestRun("Node device list with 10000 devices",
+                    virTestGetLoops(), testObjList, NULL) < 0)
+        ret = -1;
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,189 @@
+#include <config.h>
+
+#ifdef WITH_QEMU
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+
+# include "testutils.h"
+# include "qemu/qemu_migration.h"
+
+# define MiB (1024ull * 1024)
+
+/* Simulation step and how long a migration may run, in ms */
+# define SIM_STEP 10
+# define SIM_TIMEOUT (3600 * 1000ull)
+
+enum testOutcome {
+    TEST_COMPLETED,
+    TEST_ABORTED,
+    TEST_TIMEOUT,
+};
+
+struct testInfo {
+    const char *name;
+    /* Guest */
+    unsigned long long memory;          /* Bytes */
+    unsigned long long dirtyRate;       /* Bytes/s */
+    unsigned long long workingSet;      /* Bytes the guest keeps dirtying */
+    /* Host */
+    unsigned long long link;            /* Bytes/s the network can carry */
+    unsigned long bandwidth;            /* Initial limit, in MiB/s */
+    /* Policy */
+    unsigned long maxBandwidth;
+    unsigned long long maxDowntime;
+    int stallAction;
+    /* Expectations */
+    enum testOutcome outcome;
+    bool bandwidthRaised;
+    bool downtimeRaised;
+    bool paused;
+};
+
+/*
+ * Models QEMU sending guest memory: each step sends what bandwidth and
+ * the link allow while the guest dirties pages of its working set again.
+ * QEMU stops the guest and completes the migration once the rest can be
+ * sent within the allowed downtime.
+ */
+static int testConverge(const void *data)
+{
+    const struct testInfo *info = data;
+    qemuMigrationConvergePolicy policy = {
+        .enabled = true,
+        .maxDowntime = info->maxDowntime,
+        .maxBandwidth = info->maxBandwidth,
+        .stallTimeout = 30000,
+        .stallAction = info->stallAction,
+    };
+    qemuDomainJobProgress progress;
+    qemuDomainJobConverge state;
+    unsigned long long now = 1;
+    unsigned long long processed = 0;
+    unsigned long long remaining = info->memory;
+    unsigned long long dirtyRate = info->dirtyRate;
+    unsigned long long rate;
+    unsigned long long sent;
+    enum testOutcome outcome = TEST_TIMEOUT;
+    bool paused = false;
+
+    memset(&progress, 0, sizeof(progress));
+    memset(&state, 0, sizeof(state));
+    state.bandwidth = info->bandwidth;
+    state.downtime = 30;
+
+    while (now < SIM_TIMEOUT) {
+        rate = state.bandwidth * MiB;
+        if (rate > info->link)
+            rate = info->link;
+
+        if (remaining * 1000 / rate <= state.downtime) {
+            outcome = TEST_COMPLETED;
+            break;
+        }
+
+        sent = rate * SIM_STEP / 1000;
+        if (sent > remaining)
+            sent = remaining;
+        processed += sent;
+        remaining -= sent;
+        if (remaining < info->workingSet) {
+            remaining += dirtyRate * SIM_STEP / 1000;
+            if (remaining > info->workingSet)
+                remaining = info->workingSet;
+        }
+        now += SIM_STEP;
+
+        qemuMigrationUpdateProgress(&progress, now, processed, remaining);
+
+        switch (qemuMigrationConverge(&policy, &state, &progress)) {
+        case QEMU_MIGRATION_CONVERGE_PAUSE:
+            paused = true;
+            dirtyRate = 0;
+            break;
+        case QEMU_MIGRATION_CONVERGE_ABORT:
+            outcome = TEST_ABORTED;
+            goto done;
+        }
+    }
+
+done:
+    if (outcome != info->outcome) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "outcome %d, expected %d\n",
+                    outcome, info->outcome);
+        return -1;
+    }
+    if (!!state.bandwidthSteps != info->bandwidthRaised ||
+        !!state.downtimeSteps != info->downtimeRaised ||
+        paused != info->paused) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "bandwidth steps %u, downtime steps %u, "
+                    "paused %d\n",
+                    state.bandwidthSteps, state.downtimeSteps, paused);
+        return -1;
+    }
+    if ((policy.maxBandwidth > info->bandwidth &&
+         state.bandwidth > policy.maxBandwidth) ||
+        state.downtime > policy.maxDowntime) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "bandwidth %lu or downtime %llu over limit\n",
+                    state.bandwidth, state.downtime);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+# define DO_TEST(name, memory, dirty, wss, link, bw, maxbw, maxdt,      \
+                 action, outcome, bwRaised, dtRaised, paused)           \
+    do {                                                                \
+        const struct testInfo info = {                                  \
+            name, (memory) * MiB, (dirty) * MiB, (wss) * MiB,           \
+            (link) * MiB, bw, maxbw, maxdt,                             \
+            QEMU_MIGRATION_CONVERGE_ ## action, outcome,                \
+            bwRaised, dtRaised, paused                                  \
+        };                                                              \
+        if (virtTestRun("Converge " name, 1, testConverge, &info) < 0)  \
+            ret = -1;                                                   \
+    } while (0)
+
+    /* Idle guest needs no help */
+    DO_TEST("idle", 1024, 1, 64, 1024, 32, 1024, 2000,
+            NONE, TEST_COMPLETED, false, false, false);
+    /* Limited by the default bandwidth, fast link */
+    DO_TEST("bandwidth", 1024, 48, 512, 1024, 32, 1024, 2000,
+            NONE, TEST_COMPLETED, true, false, false);
+    /* Slow link, small working set fits into longer downtime */
+    DO_TEST("downtime", 1024, 200, 100, 100, 1024, 1024, 2000,
+            NONE, TEST_COMPLETED, false, true, false);
+    /* Large working set dirtied faster than the link carries */
+    DO_TEST("stall-none", 4096, 400, 2048, 100, 1024, 1024, 2000,
+            NONE, TEST_TIMEOUT, false, true, false);
+    DO_TEST("stall-pause", 4096, 400, 2048, 100, 1024, 1024, 2000,
+            PAUSE, TEST_COMPLETED, false, true, true);
+    DO_TEST("stall-abort", 4096, 400, 2048, 100, 1024, 1024, 2000,
+            ABORT, TEST_ABORTED, false, true, false);
+    /* Raising bandwidth up to the cap is not enough */
+    DO_TEST("bandwidth-stall", 4096, 400, 2048, 1024, 32, 256, 2000,
+            ABORT, TEST_ABORTED, true, true, false);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
+
+#else
+
+int main(void)
+{
+    return EXIT_AM_SKIP;
+}
+
+#endif /* WITH_QEMU */
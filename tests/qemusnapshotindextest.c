@@ -0,0 +1,504 @@
+#include <config.h>
+
+#ifdef WITH_QEMU
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <dirent.h>
+# include <sys/stat.h>
+# include <sys/time.h>
+
+# include "internal.h"
+# include "testutils.h"
+# include "qemu/qemu_domain.h"
+# include "memory.h"
+# include "util.h"
+
+# define NSNAPSHOTS 20
+# define CACHE_SIZE 4
+
+static char snapshotdir[] = "/tmp/qemusnapshotindextest-XXXXXX";
+static struct qemud_driver driver;
+
+static void
+testQuietError(void *userData ATTRIBUTE_UNUSED,
+               virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nothing */
+}
+
+static virDomainObjPtr
+testNewVM(void)
+{
+    virDomainObjPtr vm;
+    qemuDomainObjPrivatePtr priv = NULL;
+
+    if (VIR_ALLOC(vm) < 0 ||
+        VIR_ALLOC(vm->def) < 0 ||
+        !(vm->def->name = strdup("dom")) ||
+        VIR_ALLOC(priv) < 0 ||
+        virDomainSnapshotObjListInit(&vm->snapshots) < 0)
+        goto error;
+    vm->privateData = priv;
+    memset(vm->def->uuid, 1, VIR_UUID_BUFLEN);
+
+    return vm;
+
+error:
+    if (vm)
+        virDomainDefFree(vm->def);
+    VIR_FREE(priv);
+    VIR_FREE(vm);
+    return NULL;
+}
+
+static void
+testFreeVM(virDomainObjPtr vm)
+{
+    if (!vm)
+        return;
+    virHashFree(vm->snapshots.objs);
+    virDomainDefFree(vm->def);
+    VIR_FREE(vm->privateData);
+    VIR_FREE(vm);
+}
+
+static virDomainSnapshotObjPtr
+testFindSnapshot(virDomainObjPtr vm, int i)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "snap%d", i);
+    return virDomainSnapshotFindByName(&vm->snapshots, name);
+}
+
+static char *
+testPath(const char *file)
+{
+    char *path;
+
+    if (virAsprintf(&path, "%s/dom/%s", snapshotdir, file) < 0)
+        return NULL;
+    return path;
+}
+
+/* Removes the snapshot directory of the domain, including the
+ * directories standing in for metadata files */
+static int
+testClean(void)
+{
+    DIR *dir;
+    struct dirent *ent;
+    char *path;
+    char *dompath;
+    int ret = 0;
+
+    if (!(dompath = testPath("")))
+        return -1;
+
+    if (!(dir = opendir(dompath))) {
+        VIR_FREE(dompath);
+        return 0;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (STREQ(ent->d_name, ".") || STREQ(ent->d_name, ".."))
+            continue;
+        if (!(path = testPath(ent->d_name))) {
+            ret = -1;
+            break;
+        }
+        if (unlink(path) < 0 && rmdir(path) < 0)
+            ret = -1;
+        VIR_FREE(path);
+    }
+    closedir(dir);
+
+    if (rmdir(dompath) < 0)
+        ret = -1;
+    VIR_FREE(dompath);
+    return ret;
+}
+
+/* Saves a chain of snapshots, the last one current, and their index */
+static virDomainObjPtr
+testCreate(void)
+{
+    virDomainObjPtr vm;
+    virDomainSnapshotDefPtr def = NULL;
+    virDomainSnapshotObjPtr snap;
+    int i;
+
+    if (testClean() < 0 || !(vm = testNewVM()))
+        return NULL;
+
+    for (i = 0; i < NSNAPSHOTS; i++) {
+        if (VIR_ALLOC(def) < 0 ||
+            virAsprintf(&def->name, "snap%d", i) < 0 ||
+            (i && virAsprintf(&def->parent, "snap%d", i - 1) < 0) ||
+            virAsprintf(&def->description, "snapshot %d", i) < 0)
+            goto error;
+        def->state = VIR_DOMAIN_SHUTOFF;
+        def->creationTime = 1000 + i;
+        def->current = i == NSNAPSHOTS - 1;
+
+        if (!(snap = virDomainSnapshotAssignDef(&vm->snapshots, def)))
+            goto error;
+        def = NULL;
+        if (snap->def->current)
+            vm->current_snapshot = snap;
+    }
+
+    if (virDomainSnapshotUpdateRelations(&vm->snapshots) < 0)
+        goto error;
+
+    for (i = 0; i < NSNAPSHOTS; i++) {
+        if (qemuDomainSnapshotWriteMetadata(&driver, vm,
+                                            testFindSnapshot(vm, i)) < 0)
+            goto error;
+    }
+
+    if (qemuDomainSnapshotWriteIndex(&driver, vm) < 0)
+        goto error;
+
+    return vm;
+
+error:
+    virDomainSnapshotDefFree(def);
+    testFreeVM(vm);
+    return NULL;
+}
+
+/* Loads the index into a fresh domain, which is returned even if that
+ * failed, with @ret set to the result */
+static virDomainObjPtr
+testLoad(int *ret)
+{
+    virDomainObjPtr vm;
+
+    if (!(vm = testNewVM()))
+        return NULL;
+    *ret = qemuDomainSnapshotLoadIndex(&driver, vm);
+    return vm;
+}
+
+static int
+testCountFull(virDomainObjPtr vm)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < NSNAPSHOTS; i++) {
+        if (!testFindSnapshot(vm, i)->partial)
+            count++;
+    }
+    return count;
+}
+
+/*
+ * Writes the index and reads it back: every snapshot comes back
+ * partial with its relations and the current one, and gets its full
+ * definition from its metadata file when asked for.
+ */
+static int
+testRoundTrip(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjPtr vm = NULL;
+    virDomainObjPtr loaded = NULL;
+    virDomainSnapshotObjPtr snap;
+    char *path = NULL;
+    struct stat sb;
+    ino_t ino;
+    int rc;
+    int i;
+    int ret = -1;
+
+    if (!(vm = testCreate()) ||
+        !(path = testPath(QEMU_SNAPSHOT_INDEX)))
+        goto cleanup;
+    if (stat(path, &sb) < 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "index not written\n");
+        goto cleanup;
+    }
+    ino = sb.st_ino;
+
+    if (!(loaded = testLoad(&rc)))
+        goto cleanup;
+    if (rc < 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "index not loaded\n");
+        goto cleanup;
+    }
+    if (virDomainSnapshotObjListNum(&loaded->snapshots, 0) != NSNAPSHOTS) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "wrong number of snapshots loaded\n");
+        goto cleanup;
+    }
+    if (loaded->current_snapshot != testFindSnapshot(loaded, NSNAPSHOTS - 1)) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "current snapshot not restored\n");
+        goto cleanup;
+    }
+
+    for (i = 0; i < NSNAPSHOTS; i++) {
+        snap = testFindSnapshot(loaded, i);
+        if (!snap || !snap->partial || snap->def->description ||
+            snap->def->creationTime != 1000 + i ||
+            snap->def->state != VIR_DOMAIN_SHUTOFF) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "snapshot not loaded partial\n");
+            goto cleanup;
+        }
+        if (snap->parent != (i ? testFindSnapshot(loaded, i - 1) : NULL)) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "relations not restored\n");
+            goto cleanup;
+        }
+    }
+
+    snap = testFindSnapshot(loaded, 10);
+    if (qemuDomainSnapshotLoadDef(&driver, loaded, snap) < 0)
+        goto cleanup;
+    if (snap->partial ||
+        STRNEQ_NULLABLE(snap->def->description, "snapshot 10") ||
+        STRNEQ_NULLABLE(snap->def->parent, "snap9")) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "full definition not loaded\n");
+        goto cleanup;
+    }
+
+    /* An up to date index is not written again */
+    if (qemuDomainSnapshotWriteIndex(&driver, loaded) < 0)
+        goto cleanup;
+    if (stat(path, &sb) < 0 || sb.st_ino != ino) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "up to date index rewritten\n");
+        goto cleanup;
+    }
+
+    /* but dropped as soon as a metadata file changes */
+    if (qemuDomainSnapshotWriteMetadata(&driver, loaded, snap) < 0)
+        goto cleanup;
+    if (stat(path, &sb) == 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "stale index left behind\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    testFreeVM(vm);
+    testFreeVM(loaded);
+    VIR_FREE(path);
+    return ret;
+}
+
+/*
+ * An index is only trusted if it names exactly the metadata files
+ * present, none of them newer than the index.  Otherwise nothing is
+ * loaded from it and it is removed.
+ */
+static int
+testReject(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjPtr vm = NULL;
+    virDomainObjPtr loaded = NULL;
+    char *path = NULL;
+    struct timeval times[2];
+    FILE *fp;
+    int rc;
+    int step;
+    int ret = -1;
+
+    for (step = 0; step < 3; step++) {
+        testFreeVM(vm);
+        VIR_FREE(path);
+        if (!(vm = testCreate()))
+            goto cleanup;
+
+        switch (step) {
+        case 0: /* Metadata file the index does not list */
+            if (!(path = testPath("extra.xml")) ||
+                !(fp = fopen(path, "w")) ||
+                fclose(fp) < 0)
+                goto cleanup;
+            break;
+        case 1: /* Snapshot in the index without a metadata file */
+            if (!(path = testPath("snap5.xml")) || unlink(path) < 0)
+                goto cleanup;
+            break;
+        case 2: /* Metadata file changed after the index was written */
+            if (!(path = testPath("snap5.xml")))
+                goto cleanup;
+            gettimeofday(&times[0], NULL);
+            times[0].tv_sec += 10;
+            times[1] = times[0];
+            if (utimes(path, times) < 0)
+                goto cleanup;
+            break;
+        }
+
+        testFreeVM(loaded);
+        if (!(loaded = testLoad(&rc)))
+            goto cleanup;
+        if (rc == 0) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "unusable index accepted\n");
+            goto cleanup;
+        }
+        if (virDomainSnapshotObjListNum(&loaded->snapshots, 0) != 0 ||
+            loaded->current_snapshot) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "snapshots left over from unusable index\n");
+            goto cleanup;
+        }
+
+        VIR_FREE(path);
+        if (!(path = testPath(QEMU_SNAPSHOT_INDEX)))
+            goto cleanup;
+        if (access(path, F_OK) == 0) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "unusable index left behind\n");
+            goto cleanup;
+        }
+    }
+
+    ret = 0;
+
+cleanup:
+    testFreeVM(vm);
+    testFreeVM(loaded);
+    VIR_FREE(path);
+    return ret;
+}
+
+/*
+ * Once more than CACHE_SIZE definitions are full, the least recently
+ * used ones go back to partial, except those whose metadata could not
+ * be saved.
+ */
+static int
+testTrim(const void *data ATTRIBUTE_UNUSED)
+{
+    virDomainObjPtr vm = NULL;
+    virDomainObjPtr loaded = NULL;
+    virDomainSnapshotObjPtr snap;
+    char *path = NULL;
+    int rc;
+    int i;
+    int ret = -1;
+
+    if (!(vm = testCreate()) ||
+        !(loaded = testLoad(&rc)))
+        goto cleanup;
+    if (rc < 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "index not loaded\n");
+        goto cleanup;
+    }
+
+    for (i = 0; i < 10; i++) {
+        if (qemuDomainSnapshotLoadDef(&driver, loaded,
+                                      testFindSnapshot(loaded, i)) < 0)
+            goto cleanup;
+    }
+    qemuDomainSnapshotTrimDefs(&driver, loaded);
+
+    if (testCountFull(loaded) != CACHE_SIZE) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "wrong number of full definitions kept\n");
+        goto cleanup;
+    }
+    for (i = 0; i < 10; i++) {
+        if (testFindSnapshot(loaded, i)->partial != (i < 10 - CACHE_SIZE)) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "wrong definitions dropped\n");
+            goto cleanup;
+        }
+    }
+
+    /* Make saving snap0 fail, then use everything else more recently */
+    snap = testFindSnapshot(loaded, 0);
+    if (qemuDomainSnapshotLoadDef(&driver, loaded, snap) < 0 ||
+        !(path = testPath("snap0.xml")) ||
+        unlink(path) < 0 ||
+        mkdir(path, 0700) < 0)
+        goto cleanup;
+    VIR_FREE(snap->def->description);
+    if (!(snap->def->description = strdup("changed")))
+        goto cleanup;
+    if (qemuDomainSnapshotWriteMetadata(&driver, loaded, snap) == 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "saving metadata did not fail\n");
+        goto cleanup;
+    }
+
+    for (i = 1; i < 10; i++) {
+        if (qemuDomainSnapshotLoadDef(&driver, loaded,
+                                      testFindSnapshot(loaded, i)) < 0)
+            goto cleanup;
+    }
+    qemuDomainSnapshotTrimDefs(&driver, loaded);
+
+    if (snap->partial ||
+        STRNEQ_NULLABLE(snap->def->description, "changed")) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "unsaved definition dropped\n");
+        goto cleanup;
+    }
+    if (testCountFull(loaded) != CACHE_SIZE + 1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "wrong number of full definitions kept\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    testFreeVM(vm);
+    testFreeVM(loaded);
+    VIR_FREE(path);
+    return ret;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (!mkdtemp(snapshotdir)) {
+        fprintf(stderr, "Cannot create snapshot directory\n");
+        return EXIT_FAILURE;
+    }
+    driver.snapshotDir = snapshotdir;
+    driver.snapshotCacheSize = CACHE_SIZE;
+
+    virSetErrorFunc(NULL, testQuietError);
+
+    if (virtTestRun("Snapshot index round trip", 1, testRoundTrip, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Snapshot index reject", 1, testReject, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Snapshot definition trim", 1, testTrim, NULL) < 0)
+        ret = -1;
+
+    if (testClean() < 0 || rmdir(snapshotdir) < 0)
+        ret = -1;
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
+
+#else
+
+int main(void)
+{
+    return EXIT_AM_SKIP;
+}
+
+#endif /* WITH_QEMU */
@@ -239,8 +239,8 @@ mymain(void)
         if (!(info.extraFlags = qemuCapsNew()))                         \
             return EXIT_FAILURE;                                        \
         qemuCapsSetList(info.extraFlags, __VA_ARGS__, QEMU_CAPS_LAST);  \
-        if (virtTestRun("QEMU XML-2-ARGV " name,                        \
-                        1, testCompareXMLToArgvHelper, &info) < 0)      \
+        if (virtTestRun("QEMU XML-2-ARGV " name, virTestGetLoops(),     \
+                        testCompareXMLToArgvHelper, &info) < 0)         \
             ret = -1;                                                   \
         qemuCapsFree(info.extraFlags);                                  \
     } while (0)
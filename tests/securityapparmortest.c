@@ -0,0 +1,188 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "memory.h"
+#include "util.h"
+#include "testutils.h"
+#include "security/security_apparmor_state.h"
+
+#define PROFILE "libvirt-00000000-0000-0000-0000-0123456789ab"
+
+#define DOMAIN_XML                                                      \
+    "<domain type='kvm'>\n"                                             \
+    "  <name>test</name>\n"                                             \
+    "</domain>\n"
+
+#define DOMAIN_HOSTDEV_XML                                              \
+    "<domain type='kvm'>\n"                                             \
+    "  <name>test</name>\n"                                             \
+    "  <devices>\n"                                                     \
+    "    <hostdev mode='subsystem' type='pci'>\n"                       \
+    "      <source><address bus='0x00' slot='0x19' function='0x0'/>"    \
+    "</source>\n"                                                       \
+    "    </hostdev>\n"                                                  \
+    "  </devices>\n"                                                    \
+    "</domain>\n"
+
+/* What the driver appends for the host device above */
+static const char *hostdevFiles[] = {
+    "/sys/bus/pci/devices/0000:00:19.0/config",
+    "/sys/bus/pci/devices/0000:00:19.0/resource0",
+};
+
+
+/*
+ * Loads a profile, leaves it alone when asked to regenerate it from the
+ * same XML, then only appends files it does not already allow.
+ */
+static int
+testUpToDate(const void *data ATTRIBUTE_UNUSED)
+{
+    virHashTablePtr profiles;
+    const char *todo[ARRAY_CARDINALITY(hostdevFiles)];
+    const char *img = "/var/lib/libvirt/images/test.save";
+    int n;
+    int ret = -1;
+
+    if (!(profiles = virSecurityAppArmorProfilesNew()))
+        return -1;
+
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE, DOMAIN_XML,
+                                          NULL, 0, false, todo);
+    if (n != -1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "unknown profile considered up to date\n");
+        goto cleanup;
+    }
+
+    virSecurityAppArmorProfilesUpdate(profiles, PROFILE, DOMAIN_XML,
+                                      NULL, 0, false);
+
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE, DOMAIN_XML,
+                                          NULL, 0, false, todo);
+    if (n != 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "unchanged profile regenerated: %d\n", n);
+        goto cleanup;
+    }
+
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE, DOMAIN_XML,
+                                          &img, 1, false, todo);
+    if (n != -1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "profile with new file not regenerated\n");
+        goto cleanup;
+    }
+
+    virSecurityAppArmorProfilesUpdate(profiles, PROFILE, DOMAIN_HOSTDEV_XML,
+                                      hostdevFiles, 1, true);
+
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE,
+                                          DOMAIN_HOSTDEV_XML, hostdevFiles,
+                                          ARRAY_CARDINALITY(hostdevFiles),
+                                          true, todo);
+    if (n != 1 || STRNEQ(todo[0], hostdevFiles[1])) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "expected to append only %s, got %d files\n",
+                    hostdevFiles[1], n);
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virHashFree(profiles);
+    return ret;
+}
+
+
+/*
+ * Attaches a host device, whose files are appended to the profile, and
+ * detaches it again: the profile must be regenerated even though the
+ * domain XML is back to what it was loaded from, and afterwards the
+ * files of the device are no longer allowed.
+ */
+static int
+testHostdevDetach(const void *data ATTRIBUTE_UNUSED)
+{
+    virHashTablePtr profiles;
+    const char *todo[ARRAY_CARDINALITY(hostdevFiles)];
+    int nfiles = ARRAY_CARDINALITY(hostdevFiles);
+    int n;
+    int ret = -1;
+
+    if (!(profiles = virSecurityAppArmorProfilesNew()))
+        return -1;
+
+    virSecurityAppArmorProfilesUpdate(profiles, PROFILE, DOMAIN_XML,
+                                      NULL, 0, false);
+
+    /* Attach */
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE,
+                                          DOMAIN_HOSTDEV_XML, hostdevFiles,
+                                          nfiles, true, todo);
+    if (n != nfiles) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "attach appended %d files\n", n);
+        goto cleanup;
+    }
+    virSecurityAppArmorProfilesUpdate(profiles, PROFILE, DOMAIN_HOSTDEV_XML,
+                                      todo, n, true);
+
+    /* Detach, the hostdev is already gone from the XML */
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE, DOMAIN_XML,
+                                          NULL, 0, false, todo);
+    if (n != -1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "detach kept the appended hostdev files\n");
+        goto cleanup;
+    }
+    virSecurityAppArmorProfilesUpdate(profiles, PROFILE, DOMAIN_XML,
+                                      NULL, 0, false);
+
+    /* The regenerated profile no longer has the hostdev files */
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE,
+                                          DOMAIN_HOSTDEV_XML, hostdevFiles,
+                                          nfiles, true, todo);
+    if (n != nfiles) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "hostdev files still allowed after detach\n");
+        goto cleanup;
+    }
+
+    n = virSecurityAppArmorProfilesFilter(profiles, PROFILE, DOMAIN_XML,
+                                          NULL, 0, false, todo);
+    if (n != 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "regenerated profile not up to date\n");
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    virHashFree(profiles);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virtTestRun("AppArmor profile up to date", 1,
+                    testUpToDate, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("AppArmor hostdev detach", 1,
+                    testHostdevDetach, NULL) < 0)
+        ret = -1;
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -0,0 +1,180 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "memory.h"
+#include "testutils.h"
+#include "security/security_mcs.h"
+
+
+#define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+
+static void
+testQuietError(void *userData ATTRIBUTE_UNUSED,
+               virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nothing */
+}
+
+
+#define TEST_MCS_LABELS 100000
+
+static int
+testMCSAcquireRelease(const void *data ATTRIBUTE_UNUSED)
+{
+    virSecurityMCSAllocatorPtr mcs;
+    unsigned int *c1 = NULL;
+    unsigned int *c2 = NULL;
+    int i;
+    int ret = -1;
+
+    if (!(mcs = virSecurityMCSAllocatorNew(VIR_SECURITY_MCS_CATEGORIES)))
+        return -1;
+
+    if (VIR_ALLOC_N(c1, TEST_MCS_LABELS) < 0 ||
+        VIR_ALLOC_N(c2, TEST_MCS_LABELS) < 0)
+        goto cleanup;
+
+    for (i = 0; i < TEST_MCS_LABELS; i++) {
+        if (virSecurityMCSAcquire(mcs, &c1[i], &c2[i]) < 0) {
+            if (virTestGetVerbose())
+                testError("\nfailed to acquire label %d\n", i);
+            goto cleanup;
+        }
+
+        if (c1[i] >= c2[i] || c2[i] >= VIR_SECURITY_MCS_CATEGORIES) {
+            if (virTestGetVerbose())
+                testError("\ninvalid pair c%u,c%u\n", c1[i], c2[i]);
+            goto cleanup;
+        }
+    }
+
+    if (virSecurityMCSCount(mcs) != TEST_MCS_LABELS) {
+        if (virTestGetVerbose())
+            testError("\nexpected %d labels in use, got %zu\n",
+                      TEST_MCS_LABELS, virSecurityMCSCount(mcs));
+        goto cleanup;
+    }
+
+    /* Every acquired pair must be marked as in use exactly once, so
+     * releasing each of them must succeed and leave nothing behind */
+    for (i = 0; i < TEST_MCS_LABELS; i++) {
+        if (virSecurityMCSReserve(mcs, c1[i], c2[i]) != 1 ||
+            virSecurityMCSRelease(mcs, c1[i], c2[i]) < 0) {
+            if (virTestGetVerbose())
+                testError("\npair c%u,c%u handed out twice\n", c1[i], c2[i]);
+            goto cleanup;
+        }
+    }
+
+    if (virSecurityMCSCount(mcs) != 0) {
+        if (virTestGetVerbose())
+            testError("\n%zu labels still in use\n", virSecurityMCSCount(mcs));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(c1);
+    VIR_FREE(c2);
+    virSecurityMCSAllocatorFree(mcs);
+    return ret;
+}
+
+
+static int
+testMCSExhaust(const void *data ATTRIBUTE_UNUSED)
+{
+    virSecurityMCSAllocatorPtr mcs;
+    unsigned int c1, c2;
+    int i;
+    int ret = -1;
+
+    /* 5 categories give 10 distinct pairs */
+    if (!(mcs = virSecurityMCSAllocatorNew(5)))
+        return -1;
+
+    for (i = 0; i < 10; i++) {
+        if (virSecurityMCSAcquire(mcs, &c1, &c2) < 0)
+            goto cleanup;
+    }
+
+    if (virSecurityMCSAcquire(mcs, &c1, &c2) == 0)
+        goto cleanup;
+
+    if (virSecurityMCSRelease(mcs, 1, 3) < 0 ||
+        virSecurityMCSAcquire(mcs, &c1, &c2) < 0 ||
+        c1 != 1 || c2 != 3)
+        goto cleanup;
+
+    if (virSecurityMCSRelease(mcs, 3, 3) == 0 ||
+        virSecurityMCSRelease(mcs, 0, 5) == 0)
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    virSecurityMCSAllocatorFree(mcs);
+    return ret;
+}
+
+
+static int
+testMCSParse(const void *data ATTRIBUTE_UNUSED)
+{
+    unsigned int c1, c2;
+    char *str = NULL;
+    int ret = -1;
+
+    if (virSecurityMCSParse("s0:c12,c345", &c1, &c2) < 0 ||
+        c1 != 12 || c2 != 345)
+        goto cleanup;
+
+    if (virSecurityMCSParse("s0:c5", &c1, &c2) == 0 ||
+        virSecurityMCSParse("s0:c7,c7", &c1, &c2) == 0 ||
+        virSecurityMCSParse("s0:c9,c3", &c1, &c2) == 0 ||
+        virSecurityMCSParse("s0-s0:c0.c1023", &c1, &c2) == 0 ||
+        virSecurityMCSParse("s0:c1,c2,c3", &c1, &c2) == 0)
+        goto cleanup;
+
+    if (!(str = virSecurityMCSFormat(12, 345)) ||
+        STRNEQ(str, "s0:c12,c345"))
+        goto cleanup;
+
+    ret = 0;
+
+cleanup:
+    VIR_FREE(str);
+    return ret;
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    virSetErrorFunc(NULL, testQuietError);
+
+    if (virtTestRun("MCS acquire/release", 1,
+                    testMCSAcquireRelease, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("MCS exhaust", 1, testMCSExhaust, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("MCS parse", 1, testMCSParse, NULL) < 0)
+        ret = -1;
+
+    return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
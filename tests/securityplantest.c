@@ -0,0 +1,267 @@
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "memory.h"
+#include "threads.h"
+#include "util.h"
+#include "virterror_internal.h"
+#include "testutils.h"
+#include "security/security_plan.h"
+
+#define VIR_FROM_THIS VIR_FROM_SECURITY
+
+#define NPATHS 1000
+
+/* What the callbacks were asked to do, indexed by path number */
+static virMutex lock;
+static int applied[NPATHS];
+static char *labels[NPATHS];
+
+static void
+testQuietError(void *userData ATTRIBUTE_UNUSED,
+               virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nothing */
+}
+
+static void
+testReset(void)
+{
+    int i;
+
+    for (i = 0; i < NPATHS; i++) {
+        applied[i] = 0;
+        VIR_FREE(labels[i]);
+    }
+}
+
+/* Paths are "/plan/<n>", labels "fail" make the callback fail */
+static int
+testApply(const char *path,
+          const char *label,
+          unsigned int flags ATTRIBUTE_UNUSED)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (virStrToLong_ui(path + strlen("/plan/"), NULL, 10, &i) < 0 ||
+        i >= NPATHS)
+        return -1;
+
+    virMutexLock(&lock);
+    applied[i]++;
+    VIR_FREE(labels[i]);
+    labels[i] = label ? strdup(label) : NULL;
+    virMutexUnlock(&lock);
+
+    if (STREQ_NULLABLE(label, "fail")) {
+        virReportSystemError(EACCES, _("unable to label %s"), path);
+        ret = -1;
+    } else if (STREQ_NULLABLE(label, "same")) {
+        ret = 1;
+    }
+
+    return ret;
+}
+
+static int
+testAdd(const char *driver, int i, const char *label)
+{
+    char path[32];
+
+    snprintf(path, sizeof(path), "/plan/%d", i);
+    return virSecurityLabelPlanAdd(driver, testApply, path, label, 0);
+}
+
+/* Without a plan, labels are applied straight away */
+static int
+testImmediate(const void *data ATTRIBUTE_UNUSED)
+{
+    testReset();
+
+    if (testAdd("dac", 0, "107:107") < 0 ||
+        testAdd("dac", 0, "same") < 0)
+        return -1;
+
+    if (applied[0] != 2 || STRNEQ(labels[0], "same")) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "label not applied immediately\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Queues every path several times from two drivers and nested plans,
+ * as the stack driver does, and checks each (driver, path) pair is
+ * applied once with the last label only when the outermost plan ends.
+ */
+static int
+testQueue(const void *data ATTRIBUTE_UNUSED)
+{
+    int i;
+
+    testReset();
+
+    if (virSecurityLabelPlanBegin() < 0)
+        return -1;
+
+    for (i = 0; i < NPATHS; i++) {
+        if (testAdd("dac", i, "0:0") < 0 ||
+            testAdd("dac", i, i % 2 ? "107:107" : NULL) < 0)
+            goto error;
+    }
+
+    if (virSecurityLabelPlanBegin() < 0)
+        goto error;
+    for (i = 0; i < NPATHS; i += 10) {
+        if (testAdd("selinux", i, "system_u:object_r:svirt_image_t:s0") < 0)
+            goto error;
+    }
+    if (virSecurityLabelPlanEnd("test", true) < 0)
+        goto error;
+
+    for (i = 0; i < NPATHS; i++) {
+        if (applied[i] != 0) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "label applied before plan ended\n");
+            goto error;
+        }
+    }
+
+    if (virSecurityLabelPlanEnd("test", true) < 0)
+        return -1;
+
+    for (i = 0; i < NPATHS; i++) {
+        if (applied[i] != (i % 10 ? 1 : 2)) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "label applied wrong number of times\n");
+            return -1;
+        }
+        if (i % 10 &&
+            STRNEQ_NULLABLE(labels[i], i % 2 ? "107:107" : NULL)) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "last queued label not applied\n");
+            return -1;
+        }
+    }
+
+    return 0;
+
+error:
+    virSecurityLabelPlanEnd("test", false);
+    return -1;
+}
+
+/* A plan ended without applying it does nothing */
+static int
+testDiscard(const void *data ATTRIBUTE_UNUSED)
+{
+    int i;
+
+    testReset();
+
+    if (virSecurityLabelPlanBegin() < 0)
+        return -1;
+    for (i = 0; i < NPATHS; i++) {
+        if (testAdd("dac", i, "107:107") < 0) {
+            virSecurityLabelPlanEnd("test", false);
+            return -1;
+        }
+    }
+    if (virSecurityLabelPlanEnd("test", false) < 0)
+        return -1;
+
+    for (i = 0; i < NPATHS; i++) {
+        if (applied[i] != 0) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "discarded label applied\n");
+            return -1;
+        }
+    }
+
+    /* and does not leave a plan behind */
+    if (testAdd("dac", 0, "107:107") < 0)
+        return -1;
+    if (applied[0] != 1) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "plan left behind\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* An error raised in a worker thread reaches the caller */
+static int
+testError(const void *data ATTRIBUTE_UNUSED)
+{
+    virErrorPtr err;
+    int i;
+
+    testReset();
+    virResetLastError();
+
+    if (virSecurityLabelPlanBegin() < 0)
+        return -1;
+    for (i = 0; i < NPATHS; i++) {
+        if (testAdd("dac", i, i == NPATHS / 2 ? "fail" : "same") < 0) {
+            virSecurityLabelPlanEnd("test", false);
+            return -1;
+        }
+    }
+
+    if (virSecurityLabelPlanEnd("test", true) >= 0) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "failure not reported\n");
+        return -1;
+    }
+
+    err = virGetLastError();
+    if (!err || !err->message || !strstr(err->message, "/plan/500")) {
+        if (virTestGetVerbose())
+            fprintf(stderr, "error from worker lost\n");
+        return -1;
+    }
+
+    for (i = 0; i < NPATHS; i++) {
+        if (applied[i] != 1) {
+            if (virTestGetVerbose())
+                fprintf(stderr, "label not applied after failure\n");
+            return -1;
+        }
+    }
+
+    virResetLastError();
+    return 0;
+}
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    if (virMutexInit(&lock) < 0)
+        return EXIT_FAILURE;
+
+    virSetErrorFunc(NULL, testQuietError);
+
+    if (virtTestRun("Label plan immediate", 1, testImmediate, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Label plan queue", 1, testQueue, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Label plan discard", 1, testDiscard, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Label plan error", 1, testError, NULL) < 0)
+        ret = -1;
+
+    testReset();
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+VIRT_TEST_MAIN(mymain)
@@ -51,6 +51,7 @@
 
 static unsigned int testDebug = -1;
 static unsigned int testVerbose = -1;
+static unsigned int testLoops = -1;
 
 static unsigned int testOOM = 0;
 static unsigned int testCounter = 0;
@@ -536,6 +537,14 @@ virTestGetVerbose(void) {
     return testVerbose || virTestGetDebug();
 }
 
+/* How often tests that support benchmarking should run each case */
+unsigned int
+virTestGetLoops(void) {
+    if (testLoops == -1)
+        testLoops = virTestGetFlag("VIR_TEST_LOOPS");
+    return testLoops ? testLoops : 1;
+}
+
 int virtTestMain(int argc,
                  char **argv,
                  int (*func)(void))
@@ -43,6 +43,7 @@ int virtTestDifferenceBin(FILE *stream,
 
 unsigned int virTestGetDebug(void);
 unsigned int virTestGetVerbose(void);
+unsigned int virTestGetLoops(void);
 
 char *virtTestLogContentAndReset(void);
 
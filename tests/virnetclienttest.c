@@ -0,0 +1,619 @@
+/*
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "testutils.h"
+#include "util.h"
+#include "virterror_internal.h"
+#include "memory.h"
+#include "logging.h"
+#include "threads.h"
+#include "threadpool.h"
+#include "virfile.h"
+
+#include "rpc/virnetsocket.h"
+#include "rpc/virnetclient.h"
+
+#define VIR_FROM_THIS VIR_FROM_RPC
+
+#ifndef WIN32
+
+# define testError(...)                                          \
+    do {                                                        \
+        fprintf(stderr, __VA_ARGS__);                           \
+        /* Pad to line up with test name ... in virTestRun */   \
+        fprintf(stderr, "%74s", "... ");                        \
+    } while (0)
+
+/*
+ * A fake server, with a pool of workers which take a while to answer
+ * each call, like libvirtd does, so replies come back out of order.
+ * The calls mirror virDomainGetInfo, and the reply carries the serial
+ * of the call, so a reply handed to the wrong caller is noticed.
+ */
+# define TEST_PROGRAM 0x20008086
+# define TEST_VERSION 1
+
+enum {
+    TEST_PROC_GET_INFO = 16,
+    TEST_PROC_HANGUP = 1000,
+};
+
+# define TEST_SERVER_WORKERS 20
+
+struct testGetInfoArgs {
+    char *name;
+    char uuid[VIR_UUID_BUFLEN];
+    int id;
+};
+
+struct testGetInfoRet {
+    unsigned char state;
+    uint64_t maxMem;
+    uint64_t memory;
+    unsigned short nrVirtCpu;
+    uint64_t cpuTime;
+};
+
+static bool_t
+xdr_testGetInfoArgs(XDR *xdrs, struct testGetInfoArgs *objp)
+{
+    if (!xdr_string(xdrs, &objp->name, 256) ||
+        !xdr_opaque(xdrs, objp->uuid, VIR_UUID_BUFLEN) ||
+        !xdr_int(xdrs, &objp->id))
+        return FALSE;
+    return TRUE;
+}
+
+static bool_t
+xdr_testGetInfoRet(XDR *xdrs, struct testGetInfoRet *objp)
+{
+    if (!xdr_u_char(xdrs, &objp->state) ||
+        !xdr_uint64_t(xdrs, &objp->maxMem) ||
+        !xdr_uint64_t(xdrs, &objp->memory) ||
+        !xdr_u_short(xdrs, &objp->nrVirtCpu) ||
+        !xdr_uint64_t(xdrs, &objp->cpuTime))
+        return FALSE;
+    return TRUE;
+}
+
+
+typedef struct _testServer testServer;
+typedef testServer *testServerPtr;
+
+struct _testServer {
+    char *path;
+    virNetSocketPtr lsock;
+    virNetSocketPtr sock;
+    int fd;
+
+    virThread reader;
+    virThreadPoolPtr pool;
+
+    /* Serialises replies from the workers */
+    virMutex lock;
+    unsigned int delay;
+
+    virNetClientPtr client;
+    virNetClientProgramPtr prog;
+
+    virMutex serialLock;
+    unsigned int serial;
+};
+
+
+static void
+testServerWorker(void *jobdata, void *opaque)
+{
+    virNetMessagePtr msg = jobdata;
+    testServerPtr srv = opaque;
+    struct testGetInfoRet ret;
+
+    if (srv->delay)
+        usleep(srv->delay);
+
+    memset(&ret, 0, sizeof(ret));
+    ret.state = 1;
+    ret.maxMem = ret.memory = 1024 * 1024;
+    ret.nrVirtCpu = 4;
+    ret.cpuTime = msg->header.serial;
+
+    msg->header.type = VIR_NET_REPLY;
+    msg->header.status = VIR_NET_OK;
+
+    if (virNetMessageEncodeHeader(msg) < 0 ||
+        virNetMessageEncodePayload(msg, (xdrproc_t)xdr_testGetInfoRet, &ret) < 0)
+        goto cleanup;
+
+    virMutexLock(&srv->lock);
+    ignore_value(safewrite(srv->fd, msg->buffer, msg->bufferLength));
+    virMutexUnlock(&srv->lock);
+
+cleanup:
+    virNetMessageFree(msg);
+}
+
+
+static void
+testServerReader(void *opaque)
+{
+    testServerPtr srv = opaque;
+
+    for (;;) {
+        virNetMessagePtr msg;
+
+        if (!(msg = virNetMessageNew(false)))
+            break;
+
+        msg->bufferLength = VIR_NET_MESSAGE_LEN_MAX;
+        if (saferead(srv->fd, msg->buffer, msg->bufferLength) != msg->bufferLength ||
+            virNetMessageDecodeLength(msg) < 0 ||
+            saferead(srv->fd, msg->buffer + msg->bufferOffset,
+                     msg->bufferLength - msg->bufferOffset) !=
+            msg->bufferLength - msg->bufferOffset ||
+            virNetMessageDecodeHeader(msg) < 0) {
+            virNetMessageFree(msg);
+            break;
+        }
+
+        if (msg->header.proc == TEST_PROC_HANGUP) {
+            virNetMessageFree(msg);
+            shutdown(srv->fd, SHUT_RDWR);
+            break;
+        }
+
+        if (virThreadPoolSendJob(srv->pool, 0, msg) < 0) {
+            virNetMessageFree(msg);
+            break;
+        }
+    }
+}
+
+
+static void
+testServerFree(testServerPtr srv)
+{
+    if (!srv)
+        return;
+
+    if (srv->client) {
+        virNetClientClose(srv->client);
+        virNetClientFree(srv->client);
+        /* The reader sees EOF and quits */
+        virThreadJoin(&srv->reader);
+    }
+    virNetClientProgramFree(srv->prog);
+
+    /* Waits for the workers to finish */
+    virThreadPoolFree(srv->pool);
+
+    virNetSocketFree(srv->sock);
+    virNetSocketFree(srv->lsock);
+    if (srv->path)
+        unlink(srv->path);
+    VIR_FREE(srv->path);
+    virMutexDestroy(&srv->lock);
+    virMutexDestroy(&srv->serialLock);
+    VIR_FREE(srv);
+}
+
+
+static testServerPtr
+testServerNew(unsigned int delay)
+{
+    testServerPtr srv;
+    virNetClientPtr client = NULL;
+
+    if (VIR_ALLOC(srv) < 0)
+        return NULL;
+
+    if (virMutexInit(&srv->lock) < 0 ||
+        virMutexInit(&srv->serialLock) < 0) {
+        VIR_FREE(srv);
+        return NULL;
+    }
+    srv->delay = delay;
+
+    if (progname[0] == '/') {
+        if (virAsprintf(&srv->path, "%s-test.sock", progname) < 0)
+            goto error;
+    } else {
+        if (virAsprintf(&srv->path, "%s/%s-test.sock", abs_builddir, progname) < 0)
+            goto error;
+    }
+
+    if (virNetSocketNewListenUNIX(srv->path, 0700, -1, getgid(), &srv->lsock) < 0 ||
+        virNetSocketListen(srv->lsock, 0) < 0)
+        goto error;
+
+    if (!(client = virNetClientNewUNIX(srv->path, false, NULL)))
+        goto error;
+
+    if (virNetSocketAccept(srv->lsock, &srv->sock) < 0 || !srv->sock ||
+        virNetSocketSetBlocking(srv->sock, true) < 0)
+        goto error;
+    srv->fd = virNetSocketGetFD(srv->sock);
+
+    if (!(srv->pool = virThreadPoolNew(TEST_SERVER_WORKERS, TEST_SERVER_WORKERS,
+                                       0, testServerWorker, srv)))
+        goto error;
+
+    if (virThreadCreate(&srv->reader, true, testServerReader, srv) < 0)
+        goto error;
+    srv->client = client;
+    client = NULL;
+
+    if (!(srv->prog = virNetClientProgramNew(TEST_PROGRAM, TEST_VERSION,
+                                             NULL, 0, NULL)))
+        goto error;
+
+    return srv;
+
+error:
+    virNetClientFree(client);
+    testServerFree(srv);
+    return NULL;
+}
+
+
+static unsigned int
+testServerSerial(testServerPtr srv)
+{
+    unsigned int serial;
+
+    virMutexLock(&srv->serialLock);
+    serial = srv->serial++;
+    virMutexUnlock(&srv->serialLock);
+
+    return serial;
+}
+
+
+static int
+testGetInfo(testServerPtr srv)
+{
+    struct testGetInfoArgs args;
+    struct testGetInfoRet ret;
+    unsigned int serial = testServerSerial(srv);
+
+    memset(&args, 0, sizeof(args));
+    memset(&ret, 0, sizeof(ret));
+    args.name = (char *)"guest";
+    args.id = 1;
+
+    if (virNetClientProgramCall(srv->prog, srv->client, serial,
+                                TEST_PROC_GET_INFO,
+                                (xdrproc_t)xdr_testGetInfoArgs, (char *)&args,
+                                (xdrproc_t)xdr_testGetInfoRet, (char *)&ret) < 0)
+        return -1;
+
+    if (ret.cpuTime != serial) {
+        if (virTestGetVerbose())
+            testError("\ncall %u got the reply to call %llu\n",
+                      serial, (unsigned long long)ret.cpuTime);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+struct testThreadData {
+    testServerPtr srv;
+    size_t ncalls;
+    int ret;
+};
+
+static void
+testCallThread(void *opaque)
+{
+    struct testThreadData *data = opaque;
+    size_t i;
+
+    for (i = 0 ; i < data->ncalls ; i++) {
+        if (testGetInfo(data->srv) < 0) {
+            data->ret = -1;
+            return;
+        }
+    }
+}
+
+
+struct testConcurrentData {
+    size_t nthreads;
+    size_t ncalls;
+};
+
+/*
+ * Many threads making calls over one connection at the same time,
+ * which is the virDomainGetInfo polling done by management apps
+ */
+static int
+testConcurrentCalls(const void *opaque)
+{
+    const struct testConcurrentData *data = opaque;
+    testServerPtr srv;
+    virThreadPtr threads = NULL;
+    struct testThreadData *tdata = NULL;
+    unsigned long long start, end;
+    size_t nstarted = 0;
+    size_t i;
+    int ret = -1;
+
+    if (!(srv = testServerNew(200)))
+        return -1;
+
+    if (VIR_ALLOC_N(threads, data->nthreads) < 0 ||
+        VIR_ALLOC_N(tdata, data->nthreads) < 0)
+        goto cleanup;
+
+    if (virTimeMs(&start) < 0)
+        goto cleanup;
+
+    for (i = 0 ; i < data->nthreads ; i++) {
+        tdata[i].srv = srv;
+        tdata[i].ncalls = data->ncalls;
+        if (virThreadCreate(&threads[i], true, testCallThread, &tdata[i]) < 0)
+            goto cleanup;
+        nstarted++;
+    }
+
+    ret = 0;
+
+cleanup:
+    for (i = 0 ; i < nstarted ; i++) {
+        virThreadJoin(&threads[i]);
+        if (tdata[i].ret < 0)
+            ret = -1;
+    }
+
+    if (ret == 0 && virTimeMs(&end) == 0 && virTestGetVerbose()) {
+        size_t ncalls = data->nthreads * data->ncalls;
+        fprintf(stderr, "\n%zu threads, %zu calls in %llu ms (%.0f calls/s) ",
+                data->nthreads, ncalls, end - start,
+                end > start ? ncalls * 1000.0 / (end - start) : 0.0);
+    }
+
+    VIR_FREE(threads);
+    VIR_FREE(tdata);
+    testServerFree(srv);
+    return ret;
+}
+
+
+# define TEST_ASYNC_CALLS 256
+
+/*
+ * A single thread keeping many calls in flight, and collecting
+ * them in the opposite order
+ */
+static int
+testAsyncCalls(const void *opaque ATTRIBUTE_UNUSED)
+{
+    testServerPtr srv;
+    virNetClientProgramPendingCallPtr pending[TEST_ASYNC_CALLS];
+    unsigned int serials[TEST_ASYNC_CALLS];
+    struct testGetInfoArgs args;
+    struct testGetInfoRet ret;
+    size_t nstarted = 0;
+    int i;
+    int rv = 0;
+
+    if (!(srv = testServerNew(500)))
+        return -1;
+
+    memset(&args, 0, sizeof(args));
+    args.name = (char *)"guest";
+
+    for (i = 0 ; i < TEST_ASYNC_CALLS ; i++) {
+        serials[i] = testServerSerial(srv);
+        if (!(pending[i] = virNetClientProgramCallAsync(srv->prog, srv->client,
+                                                         serials[i],
+                                                         TEST_PROC_GET_INFO,
+                                                         (xdrproc_t)xdr_testGetInfoArgs,
+                                                         (char *)&args))) {
+            rv = -1;
+            break;
+        }
+        nstarted++;
+    }
+
+    for (i = nstarted - 1 ; i >= 0 ; i--) {
+        memset(&ret, 0, sizeof(ret));
+        if (virNetClientProgramCallFinish(srv->prog, srv->client, pending[i],
+                                          (xdrproc_t)xdr_testGetInfoRet,
+                                          (char *)&ret) < 0) {
+            rv = -1;
+            continue;
+        }
+        if (ret.cpuTime != serials[i]) {
+            if (virTestGetVerbose())
+                testError("\ncall %u got the reply to call %llu\n",
+                          serials[i], (unsigned long long)ret.cpuTime);
+            rv = -1;
+        }
+    }
+
+    testServerFree(srv);
+    return rv;
+}
+
+
+/*
+ * Calls still waiting when the server goes away must fail,
+ * not hang, and so must any later ones
+ */
+static int
+testHangup(const void *opaque ATTRIBUTE_UNUSED)
+{
+    testServerPtr srv;
+    virNetClientProgramPendingCallPtr pending = NULL;
+    struct testGetInfoArgs args;
+    struct testGetInfoRet ret;
+    int rv = -1;
+
+    /* Long enough for the hangup to overtake the reply */
+    if (!(srv = testServerNew(200 * 1000)))
+        return -1;
+
+    memset(&args, 0, sizeof(args));
+    memset(&ret, 0, sizeof(ret));
+    args.name = (char *)"guest";
+
+    if (!(pending = virNetClientProgramCallAsync(srv->prog, srv->client,
+                                                 testServerSerial(srv),
+                                                 TEST_PROC_GET_INFO,
+                                                 (xdrproc_t)xdr_testGetInfoArgs,
+                                                 (char *)&args)))
+        goto cleanup;
+
+    if (virNetClientProgramCall(srv->prog, srv->client, testServerSerial(srv),
+                                TEST_PROC_HANGUP,
+                                (xdrproc_t)xdr_testGetInfoArgs, (char *)&args,
+                                (xdrproc_t)xdr_testGetInfoRet, (char *)&ret) == 0)
+        goto cleanup;
+
+    if (virNetClientProgramCallFinish(srv->prog, srv->client, pending,
+                                      (xdrproc_t)xdr_testGetInfoRet,
+                                      (char *)&ret) == 0) {
+        pending = NULL;
+        goto cleanup;
+    }
+    pending = NULL;
+
+    if (testGetInfo(srv) == 0)
+        goto cleanup;
+
+    rv = 0;
+
+cleanup:
+    if (pending)
+        ignore_value(virNetClientProgramCallFinish(srv->prog, srv->client,
+                                                   pending,
+                                                   (xdrproc_t)xdr_testGetInfoRet,
+                                                   (char *)&ret));
+    testServerFree(srv);
+    return rv;
+}
+
+
+/*
+ * Closing the client while its I/O thread is waiting for a reply
+ * fails the call, and the socket does get closed once the thread
+ * has let go of it, which the server's reader notices
+ */
+static int
+testClose(const void *opaque ATTRIBUTE_UNUSED)
+{
+    testServerPtr srv;
+    virNetClientProgramPendingCallPtr pending;
+    struct testGetInfoArgs args;
+    struct testGetInfoRet ret;
+    int rv = -1;
+
+    if (!(srv = testServerNew(200 * 1000)))
+        return -1;
+
+    memset(&args, 0, sizeof(args));
+    memset(&ret, 0, sizeof(ret));
+    args.name = (char *)"guest";
+
+    if (!(pending = virNetClientProgramCallAsync(srv->prog, srv->client,
+                                                 testServerSerial(srv),
+                                                 TEST_PROC_GET_INFO,
+                                                 (xdrproc_t)xdr_testGetInfoArgs,
+                                                 (char *)&args)))
+        goto cleanup;
+
+    virNetClientClose(srv->client);
+
+    if (virNetClientProgramCallFinish(srv->prog, srv->client, pending,
+                                      (xdrproc_t)xdr_testGetInfoRet,
+                                      (char *)&ret) == 0) {
+        if (virTestGetVerbose())
+            testError("\ncall in flight completed after close\n");
+        goto cleanup;
+    }
+
+    if (testGetInfo(srv) == 0) {
+        if (virTestGetVerbose())
+            testError("\ncall made after close succeeded\n");
+        goto cleanup;
+    }
+
+    rv = 0;
+
+cleanup:
+    /* Hangs if the socket is never closed */
+    testServerFree(srv);
+    return rv;
+}
+
+
+static void
+testQuietError(void *userData ATTRIBUTE_UNUSED,
+               virErrorPtr error ATTRIBUTE_UNUSED)
+{
+    /* nothing */
+}
+
+
+static int
+mymain(void)
+{
+    int ret = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    virSetErrorFunc(NULL, testQuietError);
+
+# define DO_TEST_CONCURRENT(nthreads, ncalls)                           \
+    do {                                                                \
+        struct testConcurrentData data = { nthreads, ncalls };          \
+        if (virtTestRun("Concurrent calls " # nthreads " threads", 1,   \
+                        testConcurrentCalls, &data) < 0)                \
+            ret = -1;                                                   \
+    } while (0)
+
+    DO_TEST_CONCURRENT(1, 500);
+    DO_TEST_CONCURRENT(8, 250);
+    DO_TEST_CONCURRENT(64, 50);
+
+    if (virtTestRun("Async calls", 1, testAsyncCalls, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Server hangup", 1, testHangup, NULL) < 0)
+        ret = -1;
+    if (virtTestRun("Client close", 1, testClose, NULL) < 0)
+        ret = -1;
+
+    return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#else
+static int
+mymain(void)
+{
+    return EXIT_AM_SKIP;
+}
+#endif
+
+VIRT_TEST_MAIN(mymain)
@@ -1058,22 +1058,65 @@ cleanup:
  */
 static const vshCmdInfo info_domblkstat[] = {
     {"help", N_("get device block stats for a domain")},
-    {"desc", N_("Get device block stats for a running domain.")},
+    {"desc", N_("Get device block stats for a running domain, "
+                "or of all its devices if no device is given.")},
     {NULL,NULL}
 };
 
 static const vshCmdOptDef opts_domblkstat[] = {
     {"domain", VSH_OT_DATA, VSH_OFLAG_REQ, N_("domain name, id or uuid")},
-    {"device", VSH_OT_DATA, VSH_OFLAG_REQ, N_("block device")},
+    {"device", VSH_OT_DATA, VSH_OFLAG_NONE, N_("block device")},
     {NULL, 0, 0, NULL}
 };
 
+static bool
+cmdDomblkstatAll (vshControl *ctl, virDomainPtr dom, const char *name)
+{
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    int i;
+    bool ret = false;
+
+    if (virDomainBlockStatsAll(dom, NULL, &nparams, 0) < 0)
+        goto cleanup;
+
+    if (nparams == 0) {
+        ret = true;
+        goto cleanup;
+    }
+
+    params = vshCalloc(ctl, nparams, sizeof(*params));
+    if (virDomainBlockStatsAll(dom, params, &nparams, 0) < 0)
+        goto cleanup;
+
+    /* Fields are named <device>.<statistic> */
+    for (i = 0; i < nparams; i++) {
+        char *dot = strrchr(params[i].field, '.');
+
+        if (!dot || params[i].type != VIR_TYPED_PARAM_LLONG ||
+            params[i].value.l < 0)
+            continue;
+        *dot = '\0';
+        vshPrint (ctl, "%s %s %lld\n",
+                  params[i].field, dot + 1, params[i].value.l);
+    }
+
+    ret = true;
+
+cleanup:
+    if (!ret)
+        vshError(ctl, _("Failed to get block stats %s"), name);
+    VIR_FREE(params);
+    return ret;
+}
+
 static bool
 cmdDomblkstat (vshControl *ctl, const vshCmd *cmd)
 {
     virDomainPtr dom;
     const char *name = NULL, *device = NULL;
     struct _virDomainBlockStats stats;
+    bool ret;
 
     if (!vshConnectionUsability (ctl, ctl->conn))
         return false;
@@ -1081,11 +1124,17 @@ cmdDomblkstat (vshControl *ctl, const vshCmd *cmd)
     if (!(dom = vshCommandOptDomain (ctl, cmd, &name)))
         return false;
 
-    if (vshCommandOptString (cmd, "device", &device) <= 0) {
+    if (vshCommandOptString (cmd, "device", &device) < 0) {
         virDomainFree(dom);
         return false;
     }
 
+    if (!device) {
+        ret = cmdDomblkstatAll(ctl, dom, name);
+        virDomainFree(dom);
+        return ret;
+    }
+
     if (virDomainBlockStats (dom, device, &stats, sizeof stats) == -1) {
         vshError(ctl, _("Failed to get block stats %s %s"), name, device);
         virDomainFree(dom);
@@ -10418,6 +10467,54 @@ cmdSysinfo (vshControl *ctl, const vshCmd *cmd ATTRIBUTE_UNUSED)
     return true;
 }
 
+/*
+ * "rpcstats" command
+ */
+static const vshCmdInfo info_rpcstats[] = {
+    {"help", N_("print RPC call statistics of the daemon")},
+    {"desc",
+     N_("output an XML string with per procedure and per client RPC latency "
+        "histograms, and optionally the slowest calls seen")},
+    {NULL, NULL}
+};
+
+static const vshCmdOptDef opts_rpcstats[] = {
+    {"slowest", VSH_OT_INT, VSH_OFLAG_NONE,
+     N_("number of slowest calls to list")},
+    {"reset", VSH_OT_BOOL, 0, N_("reset the statistics once printed")},
+    {NULL, 0, 0, NULL}
+};
+
+static bool
+cmdRPCStats(vshControl *ctl, const vshCmd *cmd)
+{
+    char *stats;
+    unsigned int nslowest = 0;
+    unsigned int flags = 0;
+
+    if (!vshConnectionUsability(ctl, ctl->conn))
+        return false;
+
+    if (vshCommandOptUInt(cmd, "slowest", &nslowest) < 0) {
+        vshError(ctl, "%s", _("invalid number of slowest calls"));
+        return false;
+    }
+
+    if (vshCommandOptBool(cmd, "reset"))
+        flags |= VIR_CONNECT_GET_RPC_STATS_RESET;
+
+    stats = virConnectGetRPCStats(ctl->conn, nslowest, flags);
+    if (stats == NULL) {
+        vshError(ctl, "%s", _("failed to get RPC statistics"));
+        return false;
+    }
+
+    vshPrint(ctl, "%s", stats);
+    VIR_FREE(stats);
+
+    return true;
+}
+
 /*
  * "vncdisplay" command
  */
@@ -13475,6 +13572,7 @@ static const vshCmdDef hostAndHypervisorCmds[] = {
     {"qemu-attach", cmdQemuAttach, opts_qemu_attach, info_qemu_attach},
     {"qemu-monitor-command", cmdQemuMonitorCommand, opts_qemu_monitor_command,
      info_qemu_monitor_command, 0},
+    {"rpcstats", cmdRPCStats, opts_rpcstats, info_rpcstats, 0},
     {"sysinfo", cmdSysinfo, NULL, info_sysinfo, 0},
     {"uri", cmdURI, NULL, info_uri, 0},
     {NULL, NULL, NULL, NULL, 0}